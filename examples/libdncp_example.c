@@ -29,6 +29,7 @@ void (*hnetd_log)(int priority, const char *format, ...) = example_log;
 #include "udp46.c"
 #include "hncp_io.c"
 #include "hncp.c"
+#include "hncp_hash.c"
 
 int main (int argc, char **argv)
 {
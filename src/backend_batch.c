@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ *
+ */
+
+#include "backend_batch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "hnetd.h"
+
+/* The co-process acknowledges the frames it has run here */
+#define BACKEND_BATCH_ACK_FD 3
+
+// Fork and execute a single command, optionally with extra environment
+static void _oneshot(char *argv[], char *envp[])
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		for (size_t i = 0; envp && envp[i]; ++i)
+			putenv(envp[i]);
+
+		execv(argv[0], argv);
+		_exit(128);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+static bool _append(struct backend_batch *b, const char *data, size_t len);
+
+// Length of the (complete) frame at buf; *argc is 0 for end of batch
+static size_t _frame_len(const char *buf, const char *end, size_t *argc)
+{
+	const char *p = buf;
+	size_t envc;
+
+	if (sscanf(buf, "%zu %zu", argc, &envc) != 2)
+		return 0;
+
+	for (size_t i = 0; i <= *argc + envc; ++i) {
+		if (!(p = memchr(p, '\n', end - p)))
+			return 0;
+		++p;
+	}
+	return p - buf;
+}
+
+// Run the commands of the frames in buf one-shot
+static unsigned long _replay(const char *cmd, const char *buf, size_t len)
+{
+	const char *end = buf + len;
+	unsigned long count = 0;
+	size_t flen, argc, envc;
+
+	while (buf < end && (flen = _frame_len(buf, end, &argc))) {
+		const char *frame = buf;
+		buf += flen;
+		if (!argc)
+			continue;
+
+		envc = 0;
+		sscanf(frame, "%*u %zu", &envc);
+
+		char *argv[argc + 2], *envp[envc + 1];
+		char *fields[envc + argc];
+		const char *p = memchr(frame, '\n', flen) + 1;
+
+		for (size_t i = 0; i < envc + argc; ++i) {
+			const char *nl = memchr(p, '\n', end - p);
+			fields[i] = strndup(p, nl - p);
+			p = nl + 1;
+		}
+
+		memcpy(envp, fields, envc * sizeof(*envp));
+		envp[envc] = NULL;
+		argv[0] = (char *)cmd;
+		memcpy(&argv[1], &fields[envc], argc * sizeof(*argv));
+		argv[argc + 1] = NULL;
+
+		_oneshot(argv, envp);
+		count++;
+
+		for (size_t i = 0; i < envc + argc; ++i)
+			free(fields[i]);
+	}
+	return count;
+}
+
+static void _stop(struct backend_batch *b)
+{
+	if (b->fd.fd < 0)
+		return;
+
+	uloop_fd_delete(&b->fd);
+	close(b->fd.fd);
+	b->fd.fd = -1;
+
+	// The process is still reaped by uloop, unless terminating
+	if (b->proc.pending)
+		kill(b->proc.pid, SIGTERM);
+}
+
+// Give up on the co-process; whatever it has not acknowledged runs one-shot
+static void _fail(struct backend_batch *b, const char *reason)
+{
+	L_WARN("Backend co-process failed (%s), using one-shot mode", reason);
+	_stop(b);
+
+	unsigned long count = _replay(b->cmd, b->buf, b->len);
+	if (count)
+		L_INFO("Replayed %lu unacknowledged backend commands", count);
+
+	b->replayed += count;
+	b->len = b->sent = b->queued = 0;
+}
+
+// Drop the acknowledged frames; false if the co-process is gone
+static bool _read_acks(struct backend_batch *b)
+{
+	char buf[256];
+
+	for (;;) {
+		ssize_t l = read(b->fd.fd, buf, sizeof(buf));
+		if (l < 0 && errno == EINTR)
+			continue;
+		else if (l < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		else if (!l)
+			return false;
+
+		for (ssize_t i = 0; i < l; ++i) {
+			size_t argc, flen;
+
+			if (buf[i] != '\n' || !b->sent ||
+					!(flen = _frame_len(b->buf, b->buf + b->sent, &argc))) {
+				L_ERR("Unexpected acknowledgement from backend");
+				continue;
+			}
+
+			memmove(b->buf, b->buf + flen, b->len - flen + 1);
+			b->len -= flen;
+			b->sent -= flen;
+			b->acked++;
+		}
+	}
+}
+
+// Wait for events (and acknowledgements); false if the co-process failed
+static bool _wait(struct backend_batch *b, short events)
+{
+	struct pollfd pfd = { .fd = b->fd.fd, .events = events | POLLIN };
+
+	if (poll(&pfd, 1, -1) < 0)
+		return errno == EINTR;
+
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+		if (!_read_acks(b) || (pfd.revents & POLLERR)) {
+			_fail(b, "exited");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void _flush(struct backend_batch *b)
+{
+	if (b->fd.fd < 0 || !b->queued)
+		return;
+
+	if (!_append(b, "0 0\n", 4)) {
+		_fail(b, "out of memory");
+		return;
+	}
+
+	L_DEBUG("Flushing %zu backend commands (%zu bytes)",
+			b->queued, b->len - b->sent);
+
+	while (b->sent < b->len) {
+		ssize_t l = send(b->fd.fd, &b->buf[b->sent],
+				b->len - b->sent, MSG_NOSIGNAL);
+		if (l < 0 && errno == EINTR)
+			continue;
+		else if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (!_wait(b, POLLOUT))
+				return;
+			continue;
+		} else if (l < 0) {
+			_fail(b, strerror(errno));
+			return;
+		}
+		b->sent += l;
+	}
+
+	b->queued = 0;
+	b->batches++;
+}
+
+static void _flush_cb(struct uloop_timeout *t)
+{
+	_flush(container_of(t, struct backend_batch, flush));
+}
+
+static void _ack_cb(struct uloop_fd *fd, __unused unsigned int events)
+{
+	struct backend_batch *b = container_of(fd, struct backend_batch, fd);
+
+	if (!_read_acks(b))
+		_fail(b, "closed");
+}
+
+static void _exited_cb(struct uloop_process *p, int ret)
+{
+	struct backend_batch *b = container_of(p, struct backend_batch, proc);
+
+	L_WARN("Backend exited with status %d", ret);
+	if (b->fd.fd >= 0) {
+		// It may have acknowledged more before exiting
+		_read_acks(b);
+		_fail(b, "exited");
+	}
+}
+
+static bool _append(struct backend_batch *b, const char *data, size_t len)
+{
+	// Keep one byte for NUL termination, for sscanf
+	if (b->len + len + 1 > b->size) {
+		size_t size = b->size ? b->size : 1024;
+		while (size < b->len + len + 1)
+			size *= 2;
+
+		char *buf = realloc(b->buf, size);
+		if (!buf)
+			return false;
+
+		b->buf = buf;
+		b->size = size;
+	}
+
+	memcpy(&b->buf[b->len], data, len);
+	b->len += len;
+	b->buf[b->len] = 0;
+	return true;
+}
+
+static bool _queue(struct backend_batch *b, char *argv[], char *envp[])
+{
+	size_t argc = 0, envc = 0;
+	while (envp && envp[envc])
+		if (strchr(envp[envc++], '\n'))
+			return false;
+
+	// argv[0] is the backend itself and not transmitted
+	while (argv[argc + 1])
+		if (strchr(argv[1 + argc++], '\n'))
+			return false;
+
+	size_t len = b->len;
+	char hdr[32];
+	snprintf(hdr, sizeof(hdr), "%zu %zu\n", argc, envc);
+	bool ok = _append(b, hdr, strlen(hdr));
+
+	for (size_t i = 0; ok && i < envc; ++i)
+		ok = _append(b, envp[i], strlen(envp[i])) && _append(b, "\n", 1);
+
+	for (size_t i = 1; ok && i <= argc; ++i)
+		ok = _append(b, argv[i], strlen(argv[i])) && _append(b, "\n", 1);
+
+	if (!ok) {
+		b->len = len;
+		if (b->buf)
+			b->buf[len] = 0;
+		return false;
+	}
+
+	b->queued++;
+	return true;
+}
+
+void backend_batch_init(struct backend_batch *b, const char *cmd)
+{
+	int sv[2];
+
+	memset(b, 0, sizeof(*b));
+	b->cmd = cmd;
+	b->fd.fd = -1;
+	b->fd.cb = _ack_cb;
+	b->proc.cb = _exited_cb;
+	b->flush.cb = _flush_cb;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		L_WARN("Unable to create backend socket, using one-shot mode: %s",
+				strerror(errno));
+		return;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {(char *)cmd, "batch", NULL};
+		// dup (unlike the socket) is not close-on-exec
+		int fd = dup(sv[1]);
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, BACKEND_BATCH_ACK_FD);
+		if (fd != STDIN_FILENO && fd != BACKEND_BATCH_ACK_FD)
+			close(fd);
+		execv(argv[0], argv);
+		_exit(128);
+	}
+	close(sv[1]);
+
+	if (pid < 0) {
+		L_WARN("Unable to start backend, using one-shot mode: %s",
+				strerror(errno));
+		close(sv[0]);
+		return;
+	}
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	b->fd.fd = sv[0];
+	uloop_fd_add(&b->fd, ULOOP_READ);
+	b->proc.pid = pid;
+	uloop_process_add(&b->proc);
+}
+
+void backend_batch_call(struct backend_batch *b, char *argv[], char *envp[])
+{
+	if (b->fd.fd >= 0 && _queue(b, argv, envp)) {
+		uloop_timeout_set(&b->flush, 0);
+		return;
+	}
+
+	// Not through the co-process, but still in order
+	backend_batch_sync(b);
+	_oneshot(argv, envp);
+}
+
+void backend_batch_sync(struct backend_batch *b)
+{
+	uloop_timeout_cancel(&b->flush);
+	_flush(b);
+
+	while (b->fd.fd >= 0 && b->sent)
+		if (!_wait(b, 0))
+			break;
+}
+
+void backend_batch_term(struct backend_batch *b)
+{
+	uloop_timeout_cancel(&b->flush);
+	_stop(b);
+	if (b->proc.pending)
+		uloop_process_delete(&b->proc);
+	free(b->buf);
+	b->buf = NULL;
+	b->len = b->size = b->sent = b->queued = 0;
+}
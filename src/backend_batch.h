@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ *
+ * Persistent backend co-process ("<backend> batch").
+ *
+ * Commands are framed as "<argc> <envc>\n" followed by envc environment
+ * assignments and argc arguments, one per line. A "0 0\n" frame ends a
+ * batch; the backend defers expensive reloads (e.g. odhcpd) until then.
+ * Commands issued within one uloop iteration are queued and written as
+ * one batch.
+ *
+ * The backend acknowledges every frame it has run (end of batch frames
+ * included) with a "\n" on its file descriptor 3. Frames are kept until
+ * acknowledged; if the co-process dies or cannot be written to, the
+ * unacknowledged commands are run again one-shot (fork/exec per command),
+ * and so are all later ones.
+ */
+
+#ifndef BACKEND_BATCH_H_
+#define BACKEND_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <libubox/uloop.h>
+
+struct backend_batch {
+	const char *cmd;
+	struct uloop_process proc;
+	struct uloop_fd fd;          /* fd.fd < 0 in one-shot mode */
+	struct uloop_timeout flush;
+
+	/* Frames: [0, sent) written but not acknowledged, [sent, len) queued */
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t sent;
+	size_t queued;               /* Commands in [sent, len) */
+
+	/* Statistics */
+	unsigned long batches;
+	unsigned long acked;         /* Frames acknowledged */
+	unsigned long replayed;      /* Commands run one-shot after a failure */
+};
+
+/* Start the co-process cmd ("cmd batch"). If that fails, commands
+ * are run one-shot. */
+void backend_batch_init(struct backend_batch *b, const char *cmd);
+
+/* Run the command argv (argv[0] is the backend itself) with the
+ * optional NULL-terminated environment envp, after all previous ones. */
+void backend_batch_call(struct backend_batch *b, char *argv[], char *envp[]);
+
+/* Wait until all previous commands have been run. */
+void backend_batch_sync(struct backend_batch *b);
+
+/* Stop the co-process (queued commands are dropped). */
+void backend_batch_term(struct backend_batch *b);
+
+#endif /* BACKEND_BATCH_H_ */
@@ -17,15 +17,16 @@
 
 int dncp_node_cmp(dncp_node n1, dncp_node n2)
 {
-  return memcmp(&n1->node_id, &n2->node_id, DNCP_NI_LEN(n1->dncp));
+  return dncp_ni_cmp(n1->dncp, n1->node_id, n2->node_id);
 }
 
+/* The keys are the node identifiers themselves */
 static int
-compare_nodes(const void *a, const void *b, void *ptr __unused)
+compare_nodes(const void *a, const void *b, void *ptr)
 {
-  dncp_node n1 = (dncp_node) a, n2 = (dncp_node) b;
+  dncp o = container_of(ptr, dncp_s, nodes);
 
-  return dncp_node_cmp(n1, n2);
+  return dncp_ni_cmp(o, a, b);
 }
 
 void dncp_schedule(dncp o)
@@ -36,10 +37,70 @@ void dncp_schedule(dncp o)
   o->immediate_scheduled = true;
 }
 
+typedef struct {
+  dncp dncp;
+  struct tlv_attr **index;
+  int type;
+  int idx;
+} dncp_index_ctx_s, *dncp_index_ctx;
+
+/* tlv_validate callback which fills (first half of) the index as a
+ * side effect; the logic is same as in dncp_node_recalculate_index */
+static void _index_tlv(void *ctx, struct tlv_attr *a, bool valid __unused)
+{
+  dncp_index_ctx ic = ctx;
+  dncp o = ic->dncp;
+
+  if ((int)tlv_id(a) != ic->type)
+    {
+      ic->type = tlv_id(a);
+      ic->idx = ic->type < o->tlv_type_to_index_length ?
+        o->tlv_type_to_index[ic->type] : 0;
+      if (ic->idx)
+        ic->index[2 * ic->idx - 2] = a;
+    }
+  if (ic->idx)
+    ic->index[2 * ic->idx - 1] = tlv_next(a);
+}
+
+/* Check the framing (and schema, if any) of new node data, and
+ * produce its TLV index in the same pass. Returns the index (to be
+ * freed by the caller), or NULL if there are no indexes or allocation
+ * fails. */
+static struct tlv_attr **_validate_node_data(dncp_node n,
+                                             struct tlv_attr *a,
+                                             struct tlv_attr **a_valid,
+                                             int *invalid)
+{
+  dncp o = n->dncp;
+  int size = o->num_tlv_indexes * 4 * sizeof(n->tlv_index[0]);
+  dncp_index_ctx_s ic = { .dncp = o, .type = -1 };
+
+  if (size)
+    ic.index = calloc(1, size);
+  *invalid = tlv_validate(o->ext->conf.node_data_schema,
+                          tlv_data(a), tlv_len(a),
+                          ic.index ? _index_tlv : NULL, &ic);
+  if (*invalid < 0)
+    {
+      L_INFO("invalid node data framing from %s", DNCP_NODE_REPR(n));
+      *a_valid = NULL;
+      free(ic.index);
+      return NULL;
+    }
+  if (*invalid)
+    L_DEBUG("%d malformed TLVs from %s", *invalid, DNCP_NODE_REPR(n));
+  *a_valid = o->ext->cb.validate_node_data(n, a);
+  return ic.index;
+}
+
 void dncp_node_set(dncp_node n, uint32_t update_number,
                    hnetd_time_t t, struct tlv_attr *a)
 {
   struct tlv_attr *a_valid = a;
+  struct tlv_attr **index = NULL;
+  int num_indexes = n->dncp->num_tlv_indexes;
+  int invalid = 0;
 
   L_DEBUG("dncp_node_set %s update #%d %p (@%lld (-%lld))",
           DNCP_NODE_REPR(n), (int) update_number, a,
@@ -51,7 +112,7 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       L_DEBUG(" .. spurious (no change, we ignore time delta)");
       if (a && a != n->tlv_container)
-        free(a);
+        tlv_free(a);
       return;
     }
 
@@ -63,14 +124,15 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
         {
           if (n->tlv_container != a)
             {
-              free(a);
+              tlv_free(a);
               a = n->tlv_container;
             }
           a_valid = n->tlv_container_valid;
+          invalid = dncp_node_get_cold(n)->tlv_container_invalid;
         }
       else
         {
-          a_valid = n->dncp->ext->cb.validate_node_data(n, a);
+          index = _validate_node_data(n, a, &a_valid, &invalid);
         }
     }
 
@@ -80,7 +142,7 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
   /* Replace origination time if any */
   if (t)
     {
-      n->origination_time = t;
+      dncp_node_get_cold(n)->origination_time = t;
       n->expiration_time = t + ((1LL << 32) - (1LL << 15));
     }
 
@@ -91,15 +153,30 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
         dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid,
                                              a_valid);
       if (n->tlv_container)
-        free(n->tlv_container);
+        tlv_free(n->tlv_container);
 
       n->tlv_container = a;
       n->tlv_container_valid = a_valid;
+      dncp_node_get_cold(n)->tlv_container_invalid = invalid;
       n->tlv_index_dirty = true;
+      /* Subscribers may have added indexes, making ours stale */
+      if (index && num_indexes == n->dncp->num_tlv_indexes)
+        {
+          int size = num_indexes * 4 * sizeof(n->tlv_index[0]);
+
+          if (a_valid == a)
+            memcpy((void *)index + size / 2, index, size / 2);
+          free(n->tlv_index);
+          n->tlv_index = index;
+          n->tlv_index_dirty = false;
+          index = NULL;
+        }
       n->node_data_hash_dirty = true;
       n->dncp->graph_dirty = true;
     }
 
+  free(index);
+
   /* _anything_ we do here dirties network hash. */
   n->dncp->network_hash_dirty = true;
 
@@ -107,6 +184,55 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
 }
 
 
+/* Nodes are carved out of per-dncp chunks (see dncp_node_chunk_s),
+ * so that they are cache line aligned and packed back to back. */
+static dncp_node _node_alloc(dncp o)
+{
+  dncp_node_chunk c = list_empty(&o->node_chunks) ? NULL :
+    list_first_entry(&o->node_chunks, dncp_node_chunk_s, in_node_chunks);
+  void *slot;
+
+  if (!c || c->used == o->nodes_per_chunk)
+    {
+      if (posix_memalign(&slot, DNCP_NODE_CHUNK_SIZE, DNCP_NODE_CHUNK_SIZE))
+        return NULL;
+      c = slot;
+      memset(c, 0, sizeof(*c));
+      list_add(&c->in_node_chunks, &o->node_chunks);
+      o->num_node_chunks++;
+    }
+  if (c->free)
+    {
+      slot = c->free;
+      c->free = *((void **)slot);
+    }
+  else
+    slot = (void *)c + DNCP_NODE_CHUNK_HEADER + c->touched++ * o->node_size;
+  /* Full chunks go to the back, so that the first one has room */
+  if (++c->used == o->nodes_per_chunk)
+    list_move_tail(&c->in_node_chunks, &o->node_chunks);
+  memset(slot, 0, o->node_size);
+  return slot;
+}
+
+static void _node_free(dncp o, dncp_node n)
+{
+  dncp_node_chunk c =
+    (void *)((uintptr_t)n & ~((uintptr_t)DNCP_NODE_CHUNK_SIZE - 1));
+
+  if (c->used-- == o->nodes_per_chunk)
+    list_move(&c->in_node_chunks, &o->node_chunks);
+  if (!c->used)
+    {
+      list_del(&c->in_node_chunks);
+      o->num_node_chunks--;
+      free(c);
+      return;
+    }
+  *((void **)n) = c->free;
+  c->free = n;
+}
+
 static void update_node(__unused struct vlist_tree *t,
                         struct vlist_node *node_new,
                         struct vlist_node *node_old)
@@ -122,7 +248,7 @@ static void update_node(__unused struct vlist_tree *t,
       dncp_node_set(n_old, 0, 0, NULL);
       if (n_old->tlv_index)
         free(n_old->tlv_index);
-      free(n_old);
+      _node_free(o, n_old);
     }
   if (n_new)
     {
@@ -145,6 +271,141 @@ compare_tlvs(const void *a, const void *b, void *ptr __unused)
   return tlv_attr_cmp(&t1->tlv, &t2->tlv);
 }
 
+/* Make room for len more bytes at the end of local_data. */
+static bool _local_data_reserve(dncp o, int len)
+{
+  struct tlv_attr *a = o->local_data;
+  size_t used = a ? tlv_raw_len(a) : TLV_SIZE;
+  size_t size = a ? tlv_alloc_size(a) : 0;
+
+  if (used + len <= size)
+    return true;
+  size = size * 2 > used + len ? size * 2 : used + len;
+  if (!(a = tlv_realloc(a, size)))
+    return false;
+  if (!o->local_data)
+    tlv_init(a, 0, TLV_SIZE);
+  o->local_data = a;
+  return true;
+}
+
+static void _local_data_drop(dncp o)
+{
+  tlv_free(o->local_data);
+  o->local_data = NULL;
+}
+
+static bool _local_data_rebuild(dncp o)
+{
+  dncp_tlv t;
+
+  if (!_local_data_reserve(o, 0))
+    return false;
+  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    {
+      int plen = tlv_pad_len(&t->tlv);
+
+      if (!_local_data_reserve(o, plen))
+        {
+          _local_data_drop(o);
+          return false;
+        }
+      memcpy(tlv_next(o->local_data), &t->tlv, plen);
+      tlv_init(o->local_data, 0, tlv_raw_len(o->local_data) + plen);
+    }
+  return true;
+}
+
+/* Position of a (or where it would be) within local_data. */
+static struct tlv_attr *_local_data_find(dncp o, struct tlv_attr *a)
+{
+  struct tlv_attr *pos;
+
+  tlv_for_each_attr(pos, o->local_data)
+    if (tlv_attr_cmp(pos, a) >= 0)
+      return pos;
+  return tlv_next(o->local_data);
+}
+
+/* Keep local_data in sync with a single added or removed TLV. If that
+ * is not possible, it is rebuilt the next time it is needed. */
+static void _local_data_patch(dncp o, struct tlv_attr *a, bool add)
+{
+  struct tlv_attr *pos;
+  int plen = tlv_pad_len(a);
+  void *end;
+
+  if (!o->local_data)
+    return;
+  if (add && !_local_data_reserve(o, plen))
+    {
+      _local_data_drop(o);
+      return;
+    }
+  pos = _local_data_find(o, a);
+  end = tlv_next(o->local_data);
+  if (add)
+    {
+      memmove((void *)pos + plen, pos, end - (void *)pos);
+      memcpy(pos, a, plen);
+      tlv_init(o->local_data, 0, tlv_raw_len(o->local_data) + plen);
+      return;
+    }
+  if ((void *)pos == end || tlv_attr_cmp(pos, a))
+    {
+      L_ERR("local data out of sync, %s missing", TLV_REPR(a));
+      _local_data_drop(o);
+      return;
+    }
+  memmove(pos, (void *)pos + plen, end - (void *)pos - plen);
+  tlv_init(o->local_data, 0, tlv_raw_len(o->local_data) - plen);
+}
+
+static int
+compare_peers_sa6(const void *a, const void *b, void *ptr __unused)
+{
+  return memcmp(a, b, sizeof(struct sockaddr_in6));
+}
+
+void dncp_peer_set_sa6(dncp o, dncp_peer n, struct sockaddr_in6 *sa6)
+{
+  if (n->in_peers_by_sa6.key)
+    {
+      if (!memcmp(&n->last_sa6, sa6, sizeof(*sa6)))
+        return;
+      avl_delete(&o->peers_by_sa6, &n->in_peers_by_sa6);
+    }
+  n->last_sa6 = *sa6;
+  n->in_peers_by_sa6.key = &n->last_sa6;
+  avl_insert(&o->peers_by_sa6, &n->in_peers_by_sa6);
+}
+
+/* Keep the local peer indexes up to date as DNCP_T_PEER TLVs come and
+ * go. The extra data is zeroed by dncp_add_tlv. */
+static void _peer_link(dncp o, dncp_tlv t)
+{
+  dncp_t_peer ne = dncp_tlv_peer(o, &t->tlv);
+  dncp_peer n = dncp_tlv_get_extra(t);
+  dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+
+  n->tlv = t;
+  if (ep)
+    list_add_tail(&n->in_ep_peers,
+                  &container_of(ep, dncp_ep_i_s, conf)->peers);
+  else
+    INIT_LIST_HEAD(&n->in_ep_peers);
+}
+
+static void _peer_unlink(dncp o, dncp_tlv t)
+{
+  dncp_peer n = dncp_tlv_get_extra(t);
+
+  if (n->in_peers_by_sa6.key)
+    avl_delete(&o->peers_by_sa6, &n->in_peers_by_sa6);
+  list_del(&n->in_ep_peers);
+  dncp_fetch_peer_gone(o, n);
+}
+
 static void update_tlv(struct vlist_tree *t,
                        struct vlist_node *node_new,
                        struct vlist_node *node_old)
@@ -153,6 +414,13 @@ static void update_tlv(struct vlist_tree *t,
   dncp_tlv t_old = container_of(node_old, dncp_tlv_s, in_tlvs);
   __unused dncp_tlv t_new = container_of(node_new, dncp_tlv_s, in_tlvs);
 
+  /* Replacement by an equal TLV does not change the serialization */
+  if (!t_old != !t_new)
+    _local_data_patch(o, t_old ? &t_old->tlv : &t_new->tlv, !t_old);
+  if (t_old && dncp_tlv_peer(o, &t_old->tlv))
+    _peer_unlink(o, t_old);
+  if (t_new && dncp_tlv_peer(o, &t_new->tlv))
+    _peer_link(o, t_new);
   if (t_old)
     {
       dncp_notify_subscribers_local_tlv_changed(o, &t_old->tlv, false);
@@ -161,6 +429,7 @@ static void update_tlv(struct vlist_tree *t,
   if (t_new)
     dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
 
+  o->num_local_tlv_changes++;
   o->tlvs_dirty = true;
   dncp_schedule(o);
 }
@@ -183,6 +452,11 @@ static void update_ep(struct vlist_tree *t,
 
   if (t_old)
     {
+      dncp_peer n, n2;
+
+      /* Peers are normally gone by now; just forget about them */
+      list_for_each_entry_safe(n, n2, &t_old->peers, in_ep_peers)
+        list_del_init(&n->in_ep_peers);
       free(t_old);
     }
   else
@@ -196,24 +470,20 @@ static void update_ep(struct vlist_tree *t,
 dncp_node
 dncp_find_node_by_node_id(dncp o, void *ni, bool create)
 {
-  /* Unfortunately as DNCP_NI_LEN refers to node -> dncp, we cannot
-   * simply use the dncp_node_id pointer as is anymore.. */
-  dncp_node_s fake_node = { .dncp = o };
-  memcpy(&fake_node.node_id, ni, DNCP_NI_LEN(o));
-
-  dncp_node n = vlist_find(&o->nodes, &fake_node, &fake_node, in_nodes);
+  dncp_node n = vlist_find(&o->nodes, ni, n, in_nodes);
 
   if (n)
     return n;
   if (!create)
     return NULL;
-  n = calloc(1, sizeof(*n) + o->ext->conf.ext_node_data_size);
+  n = _node_alloc(o);
   if (!n)
     return false;
-  memcpy(&n->node_id, ni, DNCP_NI_LEN(o));
   n->dncp = o;
+  memcpy(n->node_id, ni, DNCP_NI_LEN(o));
+  dncp_node_get_cold(n)->node = n;
   n->tlv_index_dirty = true;
-  vlist_add(&o->nodes, &n->in_nodes, n);
+  vlist_add(&o->nodes, &n->in_nodes, n->node_id);
   return n;
 }
 
@@ -227,11 +497,45 @@ bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len)
 
   memset(o, 0, sizeof(*o));
   o->ext = ext;
+#ifdef DNCP_FIXED_NI_LEN
+  if (ext->conf.node_id_length != DNCP_FIXED_NI_LEN)
+    {
+      L_ERR("dncp_init - node identifier length %d, built for %d",
+            (int)ext->conf.node_id_length, DNCP_FIXED_NI_LEN);
+      return false;
+    }
+#endif /* DNCP_FIXED_NI_LEN */
+#ifdef DNCP_FIXED_HASH_LEN
+  if (ext->conf.hash_length != DNCP_FIXED_HASH_LEN)
+    {
+      L_ERR("dncp_init - hash length %d, built for %d",
+            (int)ext->conf.hash_length, DNCP_FIXED_HASH_LEN);
+      return false;
+    }
+#endif /* DNCP_FIXED_HASH_LEN */
+  INIT_LIST_HEAD(&o->node_chunks);
+  o->node_cold_offset = DNCP_ALIGN(offsetof(dncp_node_s, node_id)
+                                   + DNCP_NI_LEN(o) + DNCP_HASH_LEN(o),
+                                   __alignof__(dncp_node_cold_s));
+  o->node_size = DNCP_ALIGN(o->node_cold_offset + sizeof(dncp_node_cold_s)
+                            + ext->conf.ext_node_data_size,
+                            DNCP_CACHE_LINE_SIZE);
+  o->nodes_per_chunk = (DNCP_NODE_CHUNK_SIZE - DNCP_NODE_CHUNK_HEADER)
+    / o->node_size;
+  if (!o->nodes_per_chunk)
+    {
+      L_ERR("dncp_init - too large ext_node_data_size %d",
+            (int)ext->conf.ext_node_data_size);
+      return false;
+    }
   for (i = 0 ; i < NUM_DNCP_CALLBACKS; i++)
     INIT_LIST_HEAD(&o->subscribers[i]);
+  dncp_index_init(o);
+  dncp_fetch_init(o);
   vlist_init(&o->nodes, compare_nodes, update_node);
   o->nodes.keep_old = true;
   vlist_init(&o->tlvs, compare_tlvs, update_tlv);
+  avl_init(&o->peers_by_sa6, compare_peers_sa6, true, NULL);
   vlist_init(&o->eps, compare_eps, update_ep);
   memset(&nih, 0, sizeof(nih));
   ext->cb.hash(node_id, len, &nih.h);
@@ -264,6 +568,30 @@ bool dncp_set_own_node_id(dncp o, void *nibuf)
   return true;
 }
 
+void dncp_get_republish_stats(dncp o, dncp_republish_stats stats)
+{
+  stats->num_local_tlv_changes = o->num_local_tlv_changes;
+  stats->num_republished = o->num_republished;
+  stats->num_deferred = o->num_republish_deferred;
+}
+
+void dncp_get_memory_stats(dncp o, dncp_memory_stats stats)
+{
+  dncp_node n;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->node_size = o->node_size;
+  stats->node_pool = o->num_node_chunks * DNCP_NODE_CHUNK_SIZE;
+  dncp_for_each_node_including_unreachable(o, n)
+    {
+      stats->num_nodes++;
+      stats->node_data += tlv_alloc_size(n->tlv_container);
+      if (n->tlv_index)
+        stats->node_index +=
+          o->num_tlv_indexes * 4 * sizeof(n->tlv_index[0]);
+    }
+}
+
 dncp dncp_create(dncp_ext ext)
 {
   dncp o;
@@ -292,8 +620,13 @@ dncp dncp_create(dncp_ext ext)
 
 void dncp_uninit(dncp o)
 {
+  /* Pending node data fetches refer to peers; drop them first. */
+  dncp_fetch_uninit(o);
+
   /* TLVs should be freed first; they're local phenomenom, but may be
-   * reflected on eps/nodes. */
+   * reflected on eps/nodes. (No point patching local data while at
+   * it.) */
+  _local_data_drop(o);
   vlist_flush_all(&o->tlvs);
 
   /* Link destruction will refer to node -> have to be taken out
@@ -308,9 +641,14 @@ void dncp_uninit(dncp o)
   /* Finally, we can kill own node too. */
   vlist_flush_all(&o->nodes);
 
-  /* Get rid of TLV index. */
+  /* Get rid of TLV indexes. */
   if (o->num_tlv_indexes)
     free(o->tlv_type_to_index);
+  dncp_index_uninit(o);
+  dncp_delta_uninit(o);
+
+  free(o->snapshot_file);
+  dncp_ns_cache_drop(o);
 }
 
 void dncp_destroy(dncp o)
@@ -332,6 +670,26 @@ dncp_node dncp_get_first_node(dncp o)
   return dncp_node_get_next(n);
 }
 
+dncp_tlv dncp_get_first_tlv_with_type(dncp o, uint16_t type)
+{
+  dncp_tlv_s key;
+  dncp_tlv t;
+
+  /* Local TLVs are sorted by their header first, and the type is in
+   * the upper bits of it; the first one of the type is the first one
+   * not less than an empty TLV of the type. */
+  tlv_init(&key.tlv, type, TLV_SIZE);
+  t = avl_find_ge_element(&o->tlvs.avl, &key, t, in_tlvs.avl);
+  return t && tlv_id(&t->tlv) == type ? t : NULL;
+}
+
+dncp_tlv dncp_get_next_tlv_with_type(dncp o, dncp_tlv t)
+{
+  dncp_tlv t2 = dncp_get_next_tlv(o, t);
+
+  return t2 && tlv_id(&t2->tlv) == tlv_id(&t->tlv) ? t2 : NULL;
+}
+
 dncp_tlv dncp_get_first_tlv(dncp o)
 {
   dncp_tlv t;
@@ -379,13 +737,10 @@ int dncp_remove_tlvs_by_type(dncp o, int type)
   dncp_tlv t, t2;
   int c = 0;
 
-  avl_for_each_element_safe(&o->tlvs.avl, t, in_tlvs.avl, t2)
+  dncp_for_each_tlv_with_type_safe(o, t, t2, type)
     {
-      if ((int)tlv_id(&t->tlv) == type)
-        {
-          dncp_remove_tlv(o, t);
-          c++;
-        }
+      dncp_remove_tlv(o, t);
+      c++;
     }
   return c;
 }
@@ -406,6 +761,7 @@ dncp_ep dncp_find_ep_by_name(dncp o, const char *ifname)
   if (!l)
     return NULL;
   l->dncp = o;
+  INIT_LIST_HEAD(&l->peers);
   l->ep_id = o->first_free_ep_id++;
   l->conf = o->ext->conf.per_ep;
   strncpy(l->conf.dnsname, ifname, sizeof(l->conf.ifname));
@@ -469,49 +825,40 @@ dncp_tlv dncp_get_next_tlv(dncp o, dncp_tlv n)
 }
 
 
-static struct tlv_attr *_produce_new_tlvs(dncp_node n)
+/* Does local data differ from what the own node has published? */
+static bool _local_data_changed(dncp_node n)
 {
-  struct tlv_buf tb;
   dncp o = n->dncp;
-  dncp_tlv t;
 
   if (!o->tlvs_dirty)
-    return NULL;
-
-  /* Dump the contents of dncp->tlvs to single tlv_buf. */
-  /* Based on whether or not that would cause change in things, 'do stuff'. */
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    return false;
+  if (!o->local_data && !_local_data_rebuild(o))
     {
-      struct tlv_attr *a = tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
-      if (!a)
-        {
-          L_ERR("dncp_self_flush: tlv_put_raw failed?!?");
-          tlv_buf_free(&tb);
-          return NULL;
-        }
-      tlv_fill_pad(a);
+      L_ERR("dncp_self_flush: local data rebuild failed");
+      return false;
     }
-  tlv_fill_pad(tb.head);
-
-  /* Ok, all puts _did_ succeed. */
-  o->tlvs_dirty = false;
-
-  if (n->tlv_container && tlv_attr_equal(tb.head, n->tlv_container))
+  if (n->tlv_container && tlv_attr_equal(o->local_data, n->tlv_container))
     {
-      tlv_buf_free(&tb);
-      return NULL;
+      o->tlvs_dirty = false;
+      return false;
     }
-  return tb.head;
+  return true;
+}
+
+hnetd_time_t dncp_republish_holddown_end(dncp o)
+{
+  if (!o->tlvs_dirty || o->republish_tlvs
+      || !o->ext->conf.republish_holddown || !o->last_republish)
+    return 0;
+  return o->last_republish + o->ext->conf.republish_holddown;
 }
 
 void dncp_self_flush(dncp_node n)
 {
   dncp o = n->dncp;
-  struct tlv_attr *a, *a2;
+  struct tlv_attr *a = NULL;
 
-  if (!(a = _produce_new_tlvs(n)) && !o->republish_tlvs)
+  if (!_local_data_changed(n) && !o->republish_tlvs)
     {
       L_DEBUG("dncp_self_flush: state did not change -> nothing to flush");
       return;
@@ -520,16 +867,23 @@ void dncp_self_flush(dncp_node n)
   L_DEBUG("dncp_self_flush: notify about to republish tlvs");
   dncp_notify_subscribers_about_to_republish_tlvs(n);
 
-  o->republish_tlvs = false;
-  a2 = _produce_new_tlvs(n);
-  if (a2)
+  /* Subscribers may have changed local data just now; only the end
+   * result is copied. */
+  if (_local_data_changed(n))
     {
-      if (a)
-        free(a);
-      a = a2;
+      if (!(a = tlv_memdup(o->local_data)))
+        {
+          L_ERR("dncp_self_flush: eom");
+          return;
+        }
+      o->tlvs_dirty = false;
     }
+  o->republish_tlvs = false;
+  dncp_delta_remember(o, n);
   dncp_node_set(n, n->update_number + 1, dncp_time(o),
                 a ? a : n->tlv_container);
+  o->last_republish = dncp_time(o);
+  o->num_republished++;
 }
 
 struct tlv_attr *dncp_node_get_tlvs(dncp_node n)
@@ -538,19 +892,67 @@ struct tlv_attr *dncp_node_get_tlvs(dncp_node n)
 }
 
 
+static void _node_data_hash_set(dncp_node n, dncp_hash h)
+{
+  n->node_data_hash_dirty = false;
+  memcpy(dncp_node_hash(n), h, DNCP_HASH_LEN(n->dncp));
+  L_DEBUG("dncp_calculate_node_data_hash %s=%s%s",
+          DNCP_NODE_REPR(n),
+          DNCP_HASH_REPR(n->dncp, dncp_node_hash(n)),
+          n == n->dncp->own_node ? " [self]" : "");
+}
+
 void dncp_calculate_node_data_hash(dncp_node n)
 {
+  dncp_hash_s h;
   int l;
 
   if (!n->node_data_hash_dirty)
     return;
-  n->node_data_hash_dirty = false;
   l = n->tlv_container ? tlv_len(n->tlv_container) : 0;
-  n->dncp->ext->cb.hash(tlv_data(n->tlv_container), l, &n->node_data_hash);
-  L_DEBUG("dncp_calculate_node_data_hash %s=%s%s",
-          DNCP_NODE_REPR(n),
-          DNCP_HASH_REPR(n->dncp, &n->node_data_hash),
-          n == n->dncp->own_node ? " [self]" : "");
+  /* The hash function may write more than DNCP_HASH_LEN bytes */
+  n->dncp->ext->cb.hash(tlv_data(n->tlv_container), l, &h);
+  _node_data_hash_set(n, &h);
+}
+
+/* Calculate the dirty node data hashes of reachable nodes in batches,
+ * if the profile can hash several buffers at once. */
+static void _calculate_node_data_hashes(dncp o)
+{
+  const void *bufs[DNCP_HASH_BATCH];
+  size_t lens[DNCP_HASH_BATCH];
+  dncp_hash_s hashes[DNCP_HASH_BATCH];
+  void *dsts[DNCP_HASH_BATCH];
+  dncp_node nodes[DNCP_HASH_BATCH];
+  dncp_node n;
+  int i, c = 0;
+
+  if (!o->ext->cb.hash_multi)
+    return;
+  for (i = 0 ; i < DNCP_HASH_BATCH ; i++)
+    dsts[i] = &hashes[i];
+  dncp_for_each_node(o, n)
+    {
+      if (!n->node_data_hash_dirty)
+        continue;
+      nodes[c] = n;
+      bufs[c] = tlv_data(n->tlv_container);
+      lens[c] = n->tlv_container ? tlv_len(n->tlv_container) : 0;
+      if (++c < DNCP_HASH_BATCH)
+        continue;
+      o->ext->cb.hash_multi(c, bufs, lens, dsts);
+      for (i = 0 ; i < c ; i++)
+        _node_data_hash_set(nodes[i], &hashes[i]);
+      c = 0;
+    }
+  if (c == 1)
+    dncp_calculate_node_data_hash(nodes[0]);
+  else if (c)
+    {
+      o->ext->cb.hash_multi(c, bufs, lens, dsts);
+      for (i = 0 ; i < c ; i++)
+        _node_data_hash_set(nodes[i], &hashes[i]);
+    }
 }
 
 void dncp_calculate_network_hash(dncp o)
@@ -563,6 +965,8 @@ void dncp_calculate_network_hash(dncp o)
   /* Store original network hash for future study. */
   dncp_hash_s old_hash = o->network_hash;
 
+  _calculate_node_data_hashes(o);
+
   int cnt = 0;
   dncp_for_each_node(o, n)
     cnt++;
@@ -575,10 +979,10 @@ void dncp_calculate_network_hash(dncp o)
     {
       dncp_calculate_node_data_hash(n);
       *((uint32_t *)dst) = cpu_to_be32(n->update_number);
-      memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
+      memcpy(dst + 4, dncp_node_hash(n), DNCP_HASH_LEN(o));
       L_DEBUG(".. %s/%d=%s",
               DNCP_NODE_REPR(n), n->update_number,
-              DNCP_HASH_REPR(n->dncp, &n->node_data_hash));
+              DNCP_HASH_REPR(n->dncp, dncp_node_hash(n)));
       dst += onelen;
     }
   o->ext->cb.hash(buf, cnt * onelen, &o->network_hash);
@@ -651,8 +1055,8 @@ bool dncp_ep_has_highest_id(dncp_ep ep)
         if (nh->ep_id != ep_id)
           continue;
 
-        if (memcmp(dncp_tlv_get_node_id(o, nh),
-                   &o->own_node->node_id, DNCP_NI_LEN(o)) > 0)
+        if (dncp_ni_cmp(o, dncp_tlv_get_node_id(o, nh),
+                        o->own_node->node_id) > 0)
           return false;
       }
   return true;
@@ -737,12 +1141,12 @@ void *dncp_ep_get_ext_data(dncp_ep n)
 
 void *dncp_node_get_ext_data(dncp_node n)
 {
-  return (void*)n+sizeof(*n);
+  return dncp_node_get_cold(n) + 1;
 }
 
 dncp_node dncp_node_from_ext_data(void *ext_data)
 {
-  return ext_data - sizeof(dncp_node_s);
+  return ((dncp_node_cold)ext_data - 1)->node;
 }
 
 dncp_ep dncp_ep_from_ext_data(void *ext_data)
@@ -777,7 +1181,7 @@ dncp_node dncp_get_own_node(dncp o)
 
 void *dncp_node_get_id(dncp_node n)
 {
-  return &n->node_id;
+  return n->node_id;
 }
 
 dncp dncp_node_get_dncp(dncp_node n)
@@ -787,7 +1191,7 @@ dncp dncp_node_get_dncp(dncp_node n)
 
 const char *dncp_node_repr(dncp_node n, char *to_buf)
 {
-  return hex_repr(to_buf, &n->node_id, DNCP_NI_LEN(n->dncp));
+  return hex_repr(to_buf, n->node_id, DNCP_NI_LEN(n->dncp));
 }
 
 dncp dncp_ep_get_dncp(dncp_ep ep)
@@ -816,7 +1220,7 @@ dncp_ext dncp_get_ext(dncp o)
 
 hnetd_time_t dncp_node_get_origination_time(dncp_node n)
 {
-  return n->origination_time;
+  return dncp_node_get_cold(n)->origination_time;
 }
 
 struct tlv_attr *dncp_tlv_get_attr(dncp_tlv tlv)
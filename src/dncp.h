@@ -61,6 +61,9 @@ enum dncp_subscriber_event {
 /* A single, local published TLV.*/
 typedef struct dncp_tlv_struct dncp_tlv_s, *dncp_tlv;
 
+/* A TLV of some node, in the network-wide TLV index. */
+typedef struct dncp_network_tlv_struct dncp_network_tlv_s, *dncp_network_tlv;
+
 /*
  * Flow of DNCP state change notifications (outbound case):
  *
@@ -276,6 +279,11 @@ dncp_ep dncp_get_first_ep(dncp o);
 /**
  * Publish a single TLV.
  *
+ * The change is not flushed to the own node data right away, but only
+ * from the next DNCP timeout (after the republish hold-down), so
+ * several adds and removes done in a row, e.g. by one subscriber
+ * callback, result in a single node data update.
+ *
  * @return The newly allocated TLV, which is valid until
  * dncp_remove_tlv is called for it. Otherwise NULL.
  */
@@ -321,6 +329,57 @@ int dncp_remove_tlvs_by_type(dncp o, int type);
  */
 bool dncp_set_own_node_id(dncp o, void *nibuf);
 
+/**
+ * Set the warm restart snapshot file.
+ *
+ * The nodes stored in the file (if any) are preloaded as unreachable;
+ * they become visible once the network confirms them, and are pruned
+ * normally if it does not. Only nodes whose state differs have to be
+ * fetched from the network. From then on, the node database is
+ * written to the file periodically. NULL filename disables this.
+ *
+ * @return The number of nodes preloaded, or -1 on error.
+ */
+int dncp_set_snapshot_file(dncp o, const char *filename);
+
+/**
+ * Write the node database to the snapshot file now (e.g. on exit).
+ */
+bool dncp_save_snapshot(dncp o);
+
+/**
+ * Enable (or disable) the experimental node data delta extension.
+ *
+ * When enabled, peers that also have it enabled request just the
+ * TLVs that changed in our node data since the version they have,
+ * and we do the same with theirs. Off by default.
+ */
+void dncp_set_node_data_deltas(dncp o, bool enabled);
+
+typedef struct {
+  int num_nodes;
+  size_t node_size; /* bytes per node, including profile's ext data */
+  size_t node_pool; /* bytes allocated for nodes */
+  size_t node_data; /* bytes allocated for node data */
+  size_t node_index; /* bytes allocated for per-node TLV indexes */
+} dncp_memory_stats_s, *dncp_memory_stats;
+
+/**
+ * Get the memory used by the node database.
+ */
+void dncp_get_memory_stats(dncp o, dncp_memory_stats stats);
+
+typedef struct {
+  int num_local_tlv_changes; /* local TLVs added or removed */
+  int num_republished; /* own node data updates (update number bumps) */
+  int num_deferred; /* node data updates postponed by the hold-down */
+} dncp_republish_stats_s, *dncp_republish_stats;
+
+/**
+ * Get statistics about publishing of the local TLVs.
+ */
+void dncp_get_republish_stats(dncp o, dncp_republish_stats stats);
+
 /**
  * Subscribe to DNCP state change events.
  *
@@ -387,6 +446,35 @@ struct tlv_attr *dncp_node_get_tlv_with_type(dncp_node n, uint16_t type,
 #define dncp_node_for_each_tlv_with_type(n, a, t) \
   dncp_node_for_each_tlv_with_t_v(n, a, t, true)
 
+/*************************************************** Network-wide TLV index */
+
+/**
+ * Maintain a network-wide index of TLVs of the given type.
+ *
+ * The index covers the TLVs of all reachable nodes (as seen by the
+ * TLV change subscribers), ordered by node identifier and then TLV
+ * content. It is kept up to date as node data changes, and is updated
+ * before subscribers are notified of the change. Should not be called
+ * from within TLV change callbacks.
+ */
+bool dncp_add_network_tlv_index(dncp o, uint16_t type);
+
+/**
+ * Number of TLVs of the given type in the network, or -1 if the type
+ * is not indexed.
+ */
+int dncp_get_network_tlv_count(dncp o, uint16_t type);
+
+dncp_network_tlv dncp_get_first_network_tlv(dncp o, uint16_t type);
+dncp_network_tlv dncp_network_tlv_get_next(dncp_network_tlv t);
+dncp_node dncp_network_tlv_get_node(dncp_network_tlv t);
+struct tlv_attr *dncp_network_tlv_get_attr(dncp_network_tlv t);
+
+/* Iterate through TLVs of an indexed type in the whole network. */
+#define dncp_for_each_network_tlv(o, t, type)                           \
+  for (t = dncp_get_first_network_tlv(o, type) ; t ;                    \
+       t = dncp_network_tlv_get_next(t))
+
 /******************************************************* Per-(local) tlv API */
 
 /**
@@ -411,6 +499,22 @@ struct tlv_attr *dncp_tlv_get_attr(dncp_tlv tlv);
 
 dncp_tlv dncp_get_first_tlv(dncp o);
 
+/**
+ * Get the first local TLV of the given type (without scanning the
+ * others), and the next one of the same type after tlv.
+ */
+dncp_tlv dncp_get_first_tlv_with_type(dncp o, uint16_t type);
+dncp_tlv dncp_get_next_tlv_with_type(dncp o, dncp_tlv tlv);
+
+#define dncp_for_each_tlv_with_type(o, t, type)                         \
+  for (t = dncp_get_first_tlv_with_type(o, type) ; t ;                  \
+       t = dncp_get_next_tlv_with_type(o, t))
+
+#define dncp_for_each_tlv_with_type_safe(o, t, t2, type)                \
+  for (t = dncp_get_first_tlv_with_type(o, type),                       \
+         t2 = t ? dncp_get_next_tlv_with_type(o, t) : NULL ; t ;        \
+       t = t2, t2 = t ? dncp_get_next_tlv_with_type(o, t) : NULL)
+
 /**************************************************** dncp external bits API */
 
 /*
@@ -451,11 +555,20 @@ struct dncp_ext_configuration_struct {
    * be used to respond to node data requests. */
   hnetd_time_t minimum_prune_interval;
 
+  /* How long after publishing new node data we wait before publishing
+   * further local TLV changes; changes within it are coalesced into
+   * one update. Zero disables the hold-down. */
+  hnetd_time_t republish_holddown;
+
   /* How much memory do we allocate for external code parts per node? */
   size_t ext_node_data_size;
 
   /* How much memory do we allocate for external code parts per ep? */
   size_t ext_ep_data_size;
+
+  /* (Optional) schema node data TLVs are validated against, in the
+   * same pass that checks the node data framing. */
+  const struct tlv_schema *node_data_schema;
 };
 
 /* While the code uses sockaddr_in6 for now, it intentionally does not
@@ -503,6 +616,15 @@ struct dncp_ext_cbs_struct {
    */
   void (*hash)(const void *buf, size_t len, void *dst);
 
+  /**
+   * Callback to hash several independent buffers at once (optional).
+   *
+   * The result must be the same as calling hash for each of
+   * bufs[i][:lens[i]], with dsts[i] as the destination.
+   */
+  void (*hash_multi)(int count, const void **bufs, const size_t *lens,
+                     void **dsts);
+
   /**
    * Validate node data.
    */
@@ -0,0 +1,219 @@
+/*
+ * $Id: dncp_delta.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * Experimental node data deltas: a peer that has an older version of
+ * a node's data may ask the node itself (DNCP_T_REQ_NODE_DELTA) for
+ * just the TLVs that changed since. If the node still has that version
+ * in its history (the last DNCP_DELTA_HISTORY versions of its own node
+ * data are kept), it replies with DNCP_T_NODE_DELTA: the node state,
+ * hash included, followed by records that turn the old node data into
+ * the new one. The receiver checks the result against the hash, and
+ * falls back to requesting the whole node state if it does not match.
+ *
+ * Peers announce support with an empty DNCP_T_DELTA_CAPABLE in their
+ * unicast messages; others never see the new TLVs. Relayed node data
+ * is always sent whole, as only the own node's history is kept.
+ */
+
+#include "dncp_i.h"
+
+static void _forget(dncp_delta_version_s *v)
+{
+  tlv_free(v->data);
+  v->data = NULL;
+}
+
+void dncp_delta_uninit(dncp o)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_DELTA_HISTORY ; i++)
+    _forget(&o->delta_history[i]);
+}
+
+void dncp_set_node_data_deltas(dncp o, bool enabled)
+{
+  L_DEBUG("dncp_set_node_data_deltas %s", enabled ? "on" : "off");
+  o->node_data_deltas = enabled;
+  if (!enabled)
+    dncp_delta_uninit(o);
+}
+
+/* Called with the own node just before its node data is replaced. */
+void dncp_delta_remember(dncp o, dncp_node n)
+{
+  dncp_delta_version_s *v = &o->delta_history[o->delta_history_next];
+
+  if (!o->node_data_deltas || !n->tlv_container)
+    return;
+  _forget(v);
+  if (!(v->data = tlv_memdup(n->tlv_container)))
+    return;
+  v->update_number = n->update_number;
+  o->delta_history_next = (o->delta_history_next + 1) % DNCP_DELTA_HISTORY;
+}
+
+/* Could peer n send the data of node ni as a delta? (That is, is it
+ * the node itself, and does it handle deltas?) */
+bool dncp_delta_from_peer(dncp o, dncp_peer n, const void *ni)
+{
+  dncp_t_peer ne;
+
+  if (!o->node_data_deltas || !n || !n->delta_capable)
+    return false;
+  ne = dncp_tlv_peer(o, &n->tlv->tlv);
+  return ne && !memcmp(dncp_tlv_get_node_id(o, ne), ni, DNCP_NI_LEN(o));
+}
+
+struct tlv_attr *dncp_delta_base(dncp o, uint32_t update_number)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_DELTA_HISTORY ; i++)
+    if (o->delta_history[i].data
+        && o->delta_history[i].update_number == update_number)
+      return o->delta_history[i].data;
+  return NULL;
+}
+
+static void _emit(void *buf, int *len, dncp_t_node_delta_op_s *op,
+                  const void *insert)
+{
+  if (buf)
+    {
+      dncp_t_node_delta_op d = buf + *len;
+
+      d->keep = cpu_to_be16(op->keep);
+      d->drop = cpu_to_be16(op->drop);
+      d->insert_len = cpu_to_be32(op->insert_len);
+      memcpy(d + 1, insert, op->insert_len);
+    }
+  *len += sizeof(*op) + op->insert_len;
+  memset(op, 0, sizeof(*op));
+}
+
+/* Encode the delta from old to new (both sorted, and with valid
+ * framing) to buf, if given. Returns the length of the delta. As both
+ * are walked in step, the result is correct even if they were not
+ * sorted; it is just not minimal then. */
+int dncp_delta_encode(struct tlv_attr *old, struct tlv_attr *new, void *buf)
+{
+  void *oend = tlv_data(old) + tlv_len(old);
+  void *nend = tlv_data(new) + tlv_len(new);
+  struct tlv_attr *a = tlv_data(old), *b = tlv_data(new);
+  dncp_t_node_delta_op_s op = { .keep = 0 };
+  const void *insert = NULL;
+  int len = 0, c;
+
+  while ((void *)a < oend || (void *)b < nend)
+    {
+      c = (void *)a >= oend ? 1 : (void *)b >= nend ? -1 : tlv_attr_cmp(a, b);
+      if (!c)
+        {
+          if (op.drop || op.insert_len || op.keep == UINT16_MAX)
+            _emit(buf, &len, &op, insert);
+          op.keep++;
+          a = tlv_next(a);
+          b = tlv_next(b);
+        }
+      else if (c < 0)
+        {
+          if (op.insert_len || op.drop == UINT16_MAX)
+            _emit(buf, &len, &op, insert);
+          op.drop++;
+          a = tlv_next(a);
+        }
+      else
+        {
+          if (!op.insert_len)
+            insert = b;
+          op.insert_len += tlv_pad_len(b);
+          b = tlv_next(b);
+        }
+    }
+  /* Trailing keeps are implicit */
+  if (op.drop || op.insert_len)
+    _emit(buf, &len, &op, insert);
+  return len;
+}
+
+/* Step over count TLVs of the base at *pos. Returns the number of
+ * bytes stepped over, or -1 if there are not that many. */
+static int _base_skip(void **pos, void *end, int count)
+{
+  void *p = *pos;
+  struct tlv_attr *a;
+  int l;
+
+  while (count--)
+    {
+      a = p;
+      if (p + sizeof(*a) > end || tlv_raw_len(a) < sizeof(*a)
+          || p + tlv_raw_len(a) > end)
+        return -1;
+      p = tlv_next(a);
+      if (p > end)
+        p = end;
+    }
+  l = p - *pos;
+  *pos = p;
+  return l;
+}
+
+/* Apply the delta to old. Returns the new node data (to be released
+ * with tlv_free), or NULL if the delta does not fit old. */
+struct tlv_attr *dncp_delta_apply(struct tlv_attr *old,
+                                  const void *delta, int len)
+{
+  struct tlv_attr *r = NULL;
+  void *out = NULL;
+  int pass, olen = 0;
+
+  for (pass = 0 ; pass < 2 ; pass++)
+    {
+      void *pos = tlv_data(old), *end = pos + tlv_len(old), *start;
+      const void *d = delta, *dend = delta + len;
+      dncp_t_node_delta_op op;
+      uint32_t insert_len;
+      int l;
+
+      olen = 0;
+      while (d < dend)
+        {
+          op = (dncp_t_node_delta_op)d;
+          if (d + sizeof(*op) > dend)
+            goto fail;
+          insert_len = be32_to_cpu(op->insert_len);
+          if (insert_len > (size_t)(dend - d) - sizeof(*op))
+            goto fail;
+          start = pos;
+          if ((l = _base_skip(&pos, end, be16_to_cpu(op->keep))) < 0
+              || _base_skip(&pos, end, be16_to_cpu(op->drop)) < 0)
+            goto fail;
+          if (out)
+            {
+              memcpy(out + olen, start, l);
+              memcpy(out + olen + l, op + 1, insert_len);
+            }
+          olen += l + insert_len;
+          if (olen > DNCP_MAXIMUM_PAYLOAD_SIZE)
+            goto fail;
+          d += sizeof(*op) + insert_len;
+        }
+      if (out)
+        memcpy(out + olen, pos, end - pos);
+      olen += end - pos;
+      if (out)
+        break;
+      if (!(r = tlv_alloc(sizeof(*r) + olen)))
+        return NULL;
+      tlv_init(r, 0, sizeof(*r) + olen);
+      out = tlv_data(r);
+    }
+  return r;
+ fail:
+  tlv_free(r);
+  return NULL;
+}
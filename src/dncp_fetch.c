@@ -0,0 +1,365 @@
+/*
+ * $Id: dncp_fetch.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * Node data fetching: node data that a peer's node states show us to
+ * be missing (or out of date) is not simply requested from that peer,
+ * but recorded in dncp->fetches. dncp_fetch_run then requests it from
+ * the peers that can provide it - the ones that told us about it, and
+ * the ones advertising the same network hash as one of them did -
+ * choosing the one with the least node data outstanding. Requests to
+ * a peer are sent in batches whose replies should fit in
+ * maximum_unicast_size, and at most DNCP_FETCH_WINDOW batches are
+ * outstanding per peer; more are sent as the node data comes in.
+ *
+ * If a peer provides no node data for DNCP_FETCH_TIMEOUT, what was
+ * requested from it is requested again (from some other peer, if there
+ * is one), and given up on after DNCP_FETCH_MAXIMUM_TRIES; the next
+ * network state exchange will bring it up again, if it is still of
+ * interest. (A slow peer is not considered stalled, as long as the
+ * node data keeps coming.)
+ *
+ * With node data deltas (see dncp_delta.c), node data we have an older
+ * version of is preferably requested from the node itself, as a delta;
+ * retries ask for the whole node state.
+ */
+
+#include "dncp_i.h"
+
+static int
+compare_fetches(const void *a, const void *b, void *ptr)
+{
+  dncp o = ptr;
+
+  return dncp_ni_cmp(o, a, b);
+}
+
+static size_t _batch_size(dncp_ep_i l)
+{
+  return l->conf.maximum_unicast_size > 0 ?
+    (size_t)l->conf.maximum_unicast_size : DNCP_MAXIMUM_PAYLOAD_SIZE;
+}
+
+static dncp_ep_i _peer_ep(dncp o, dncp_peer n)
+{
+  dncp_t_peer ne = dncp_tlv_peer(o, &n->tlv->tlv);
+  dncp_ep ep = ne ? dncp_find_ep_by_id(o, ne->ep_id) : NULL;
+
+  return ep ? container_of(ep, dncp_ep_i_s, conf) : NULL;
+}
+
+static void _unrequest(dncp o, dncp_fetch f)
+{
+  if (!f->peer)
+    return;
+  f->peer->fetch_outstanding -= f->estimate;
+  f->peer = NULL;
+  f->requested_at = 0;
+  f->queued = false;
+  o->num_fetches_requested--;
+}
+
+static void _delete(dncp o, dncp_fetch f)
+{
+  _unrequest(o, f);
+  avl_delete(&o->fetches, &f->in_fetches);
+  free(f);
+}
+
+static bool _is_source(dncp_fetch f, dncp_peer n)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_FETCH_SOURCES && f->sources[i] ; i++)
+    if (f->sources[i] == n)
+      return true;
+  return false;
+}
+
+static void _add_source(dncp_fetch f, dncp_peer n)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_FETCH_SOURCES ; i++)
+    if (!f->sources[i] || f->sources[i] == n)
+      {
+        f->sources[i] = n;
+        return;
+      }
+}
+
+static void _remove_source(dncp_fetch f, dncp_peer n)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_FETCH_SOURCES && f->sources[i] ; i++)
+    if (f->sources[i] == n)
+      {
+        memmove(&f->sources[i], &f->sources[i + 1],
+                (DNCP_FETCH_SOURCES - i - 1) * sizeof(f->sources[0]));
+        f->sources[DNCP_FETCH_SOURCES - 1] = NULL;
+        return;
+      }
+}
+
+static bool _can_provide(dncp o, dncp_fetch f, dncp_peer n)
+{
+  return _is_source(f, n)
+    || (f->has_network_hash && n->network_hash_set
+        && !memcmp(&f->network_hash, &n->network_hash, DNCP_HASH_LEN(o)));
+}
+
+void dncp_fetch_want(dncp o, dncp_peer source, void *ni,
+                     uint32_t update_number, dncp_hash network_hash)
+{
+  dncp_fetch f = avl_find_element(&o->fetches, ni, f, in_fetches);
+  int nilen = DNCP_NI_LEN(o);
+  dncp_node n;
+
+  if (f)
+    {
+      if (f->update_number == update_number)
+        {
+          /* Another peer that can provide it */
+          _add_source(f, source);
+          return;
+        }
+      if (!dncp_update_number_gt(f->update_number, update_number))
+        return;
+      /* Even newer; whoever was asked may not have it. */
+      _unrequest(o, f);
+      memset(f->sources, 0, sizeof(f->sources));
+      f->stalled_peer = NULL;
+      f->tries = 0;
+    }
+  else
+    {
+      if (!(f = calloc(1, sizeof(*f) + nilen)))
+        {
+          L_ERR("dncp_fetch_want - eom, %s not fetched",
+                DNCP_NI_REPR(o, ni));
+          return;
+        }
+      memcpy(f->node_id, ni, nilen);
+      f->in_fetches.key = f->node_id;
+      avl_insert(&o->fetches, &f->in_fetches);
+    }
+  f->update_number = update_number;
+  f->sources[0] = source;
+  f->has_network_hash = network_hash != NULL;
+  if (network_hash)
+    memcpy(&f->network_hash, network_hash, DNCP_HASH_LEN(o));
+  n = dncp_find_node_by_node_id(o, ni, false);
+  f->has_base = n && n->tlv_container;
+  f->estimate = sizeof(struct tlv_attr) + nilen + sizeof(dncp_t_node_state_s)
+    + DNCP_HASH_LEN(o) + (n && n->tlv_container ?
+                          (int)tlv_len(n->tlv_container) :
+                          o->fetch_node_data_estimate);
+}
+
+void dncp_fetch_done(dncp o, dncp_peer from, dncp_node n)
+{
+  dncp_fetch f = avl_find_element(&o->fetches, n->node_id, f, in_fetches);
+
+  if (!f || dncp_update_number_gt(n->update_number, f->update_number))
+    return;
+  if (from)
+    from->fetch_progress = dncp_time(o);
+  if (n->tlv_container)
+    o->fetch_node_data_estimate = (3 * o->fetch_node_data_estimate
+                                   + tlv_len(n->tlv_container)) / 4;
+  _delete(o, f);
+}
+
+void dncp_fetch_peer_gone(dncp o, dncp_peer n)
+{
+  dncp_fetch f;
+  bool requeued = false;
+
+  avl_for_each_element(&o->fetches, f, in_fetches)
+    {
+      if (f->peer == n)
+        {
+          _unrequest(o, f);
+          requeued = true;
+        }
+      if (f->stalled_peer == n)
+        f->stalled_peer = NULL;
+      _remove_source(f, n);
+    }
+  if (requeued)
+    dncp_schedule(o);
+}
+
+/* Can f be requested from n as a delta? */
+static bool _can_delta(dncp o, dncp_fetch f, dncp_peer n)
+{
+  return f->has_base && !f->tries && dncp_delta_from_peer(o, n, f->node_id);
+}
+
+/* Is n a better choice for f than best? Peers that did not provide it
+ * last time are avoided, and the node itself is preferred if it can
+ * send a delta; otherwise the least loaded one wins. */
+static bool _better_peer(dncp o, dncp_fetch f, dncp_peer n, dncp_peer best)
+{
+  bool delta;
+
+  if (!best)
+    return true;
+  if ((n == f->stalled_peer) != (best == f->stalled_peer))
+    return best == f->stalled_peer;
+  if ((delta = _can_delta(o, f, n)) != _can_delta(o, f, best))
+    return delta;
+  return n->fetch_outstanding < best->fetch_outstanding;
+}
+
+/* Send the requests queued for n; returns how many there were. */
+static int _send_queued(dncp o, dncp_peer n, hnetd_time_t now)
+{
+  dncp_ep_i l = _peer_ep(o, n);
+  dncp_reply_s reply = { .l = l, .dst = n->last_sa6 };
+  int batch_size = _batch_size(l), batch = 0;
+  dncp_fetch f, f2;
+  dncp_node node;
+  bool ok;
+  int c = 0;
+
+  avl_for_each_element_safe(&o->fetches, f, in_fetches, f2)
+    {
+      if (!f->queued || f->peer != n)
+        continue;
+      c++;
+      if (batch && batch + f->estimate > batch_size)
+        {
+          dncp_reply_send(&reply);
+          memset(&reply.buf, 0, sizeof(reply.buf));
+          batch = 0;
+        }
+      node = _can_delta(o, f, n) ?
+        dncp_find_node_by_node_id(o, f->node_id, false) : NULL;
+      if (node && node->tlv_container)
+        ok = dncp_reply_push_req_node_delta(&reply, f->node_id,
+                                            node->update_number);
+      else
+        ok = dncp_reply_push_req_node_state(&reply, f->node_id);
+      if (!ok)
+        {
+          _unrequest(o, f);
+          continue;
+        }
+      L_DEBUG("requesting node data for %s from " SA6_F,
+              DNCP_NI_REPR(o, f->node_id), SA6_D(&n->last_sa6));
+      f->queued = false;
+      f->requested_at = now;
+      batch += f->estimate;
+    }
+  if (reply.buf.head)
+    dncp_reply_send(&reply);
+  return c;
+}
+
+void dncp_fetch_run(dncp o)
+{
+  bool was_idle = !o->num_fetches_requested;
+  hnetd_time_t now = dncp_time(o);
+  dncp_fetch f, f2;
+  dncp_peer n, best;
+  dncp_ep_i l;
+  bool found;
+  int queued = 0;
+
+  if (avl_is_empty(&o->fetches))
+    return;
+  /* Assign what has not been requested yet to peers (that have room
+   * in their window).. */
+  avl_for_each_element_safe(&o->fetches, f, in_fetches, f2)
+    {
+      if (f->peer)
+        continue;
+      found = false;
+      best = NULL;
+      avl_for_each_element(&o->peers_by_sa6, n, in_peers_by_sa6)
+        {
+          if (!_can_provide(o, f, n) || !(l = _peer_ep(o, n)) || !l->enabled)
+            continue;
+          found = true;
+          if (n->fetch_outstanding
+              && (n->fetch_outstanding + f->estimate
+                  > (int)(DNCP_FETCH_WINDOW * _batch_size(l))))
+            continue;
+          if (_better_peer(o, f, n, best))
+            best = n;
+        }
+      if (!found)
+        {
+          L_DEBUG("nobody to fetch %s from", DNCP_NI_REPR(o, f->node_id));
+          _delete(o, f);
+          continue;
+        }
+      if (!best)
+        continue;
+      f->peer = best;
+      f->queued = true;
+      best->fetch_outstanding += f->estimate;
+      o->num_fetches_requested++;
+      queued++;
+    }
+  /* .. and then send the requests. */
+  avl_for_each_element(&o->peers_by_sa6, n, in_peers_by_sa6)
+    {
+      if (!queued)
+        break;
+      if (n->fetch_outstanding)
+        queued -= _send_queued(o, n, now);
+    }
+  /* Retries are handled in dncp_ext_timeout; make sure it has a look */
+  if (was_idle && o->num_fetches_requested)
+    dncp_schedule(o);
+}
+
+/* When is f considered stalled, if nothing is heard from the peer? */
+static hnetd_time_t _stall_time(dncp_fetch f)
+{
+  hnetd_time_t t = f->requested_at;
+
+  if (f->peer->fetch_progress > t)
+    t = f->peer->fetch_progress;
+  return t + DNCP_FETCH_TIMEOUT;
+}
+
+hnetd_time_t dncp_fetch_timeout(dncp o)
+{
+  hnetd_time_t now = dncp_time(o), next = 0;
+  dncp_fetch f, f2;
+
+  avl_for_each_element_safe(&o->fetches, f, in_fetches, f2)
+    if (f->requested_at && _stall_time(f) <= now)
+      {
+        L_DEBUG("node data for %s not received from " SA6_F,
+                DNCP_NI_REPR(o, f->node_id), SA6_D(&f->peer->last_sa6));
+        f->stalled_peer = f->peer;
+        _unrequest(o, f);
+        if (++f->tries >= DNCP_FETCH_MAXIMUM_TRIES)
+          _delete(o, f);
+      }
+  dncp_fetch_run(o);
+  avl_for_each_element(&o->fetches, f, in_fetches)
+    if (f->requested_at)
+      next = TMIN(next, _stall_time(f));
+  return next;
+}
+
+void dncp_fetch_init(dncp o)
+{
+  avl_init(&o->fetches, compare_fetches, false, o);
+  o->fetch_node_data_estimate = DNCP_FETCH_NODE_DATA_ESTIMATE;
+}
+
+void dncp_fetch_uninit(dncp o)
+{
+  dncp_fetch f, f2;
+
+  avl_for_each_element_safe(&o->fetches, f, in_fetches, f2)
+    _delete(o, f);
+}
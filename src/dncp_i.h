@@ -33,10 +33,38 @@
 /* Rough approximation - should think of real figure. */
 #define DNCP_MAXIMUM_PAYLOAD_SIZE 65536
 
+/* How often the warm restart snapshot is written (if it changed). */
+#define DNCP_SNAPSHOT_INTERVAL (60 * HNETD_TIME_PER_SECOND)
+
+/* Node data fetching (see dncp_fetch.c): requests to a peer are
+ * batched so that the reply should fit in maximum_unicast_size, and at
+ * most DNCP_FETCH_WINDOW batches are outstanding per peer. Node data
+ * is requested again (from some other peer, if possible) if the peer
+ * it was requested from provides nothing for DNCP_FETCH_TIMEOUT, up
+ * to DNCP_FETCH_MAXIMUM_TRIES times. */
+#define DNCP_FETCH_WINDOW 4
+#define DNCP_FETCH_TIMEOUT (HNETD_TIME_PER_SECOND)
+#define DNCP_FETCH_MAXIMUM_TRIES 3
+#define DNCP_FETCH_SOURCES 4
+
+/* Assumed node data size of a node we have not seen before, until
+ * we have received some. */
+#define DNCP_FETCH_NODE_DATA_ESTIMATE 256
+
+/* How many dirty node data hashes are calculated at once (if the
+ * profile supports hashing several buffers at once). */
+#define DNCP_HASH_BATCH 16
+
+/* How many previous versions of the own node data are kept around
+ * for sending node data deltas against (see dncp_delta.c). */
+#define DNCP_DELTA_HISTORY 4
+
 #include <libubox/vlist.h>
 #include <libubox/list.h>
 
 typedef struct dncp_ep_i_struct dncp_ep_i_s, *dncp_ep_i;
+typedef struct dncp_peer_struct dncp_peer_s, *dncp_peer;
+typedef struct dncp_fetch_struct dncp_fetch_s, *dncp_fetch;
 
 
 typedef struct __packed {
@@ -47,6 +75,22 @@ typedef struct __packed {
   unsigned char buf[DNCP_NI_MAX_LEN];
 } dncp_node_id_s, *dncp_node_id;
 
+/* Parameters the cached network state payload was built with */
+typedef struct {
+  dncp_ep_i l;
+  size_t maximum_size;
+  bool unicast;
+  bool always_ep_id;
+  bool graph_dirty;
+  dncp_hash_s network_hash;
+} dncp_ns_cache_key_s;
+
+/* A previous version of the own node data */
+typedef struct {
+  uint32_t update_number;
+  struct tlv_attr *data;
+} dncp_delta_version_s;
+
 struct dncp_struct {
   /* 'external' handling structure */
   dncp_ext ext;
@@ -63,6 +107,15 @@ struct dncp_struct {
   /* local data (TLVs API's clients want published). */
   struct vlist_tree tlvs;
 
+  /* local data serialized the way the own node data will be; patched
+   * in place as tlvs change, with slack at the end of the allocation
+   * for growth. NULL if it has to be rebuilt from tlvs. */
+  struct tlv_attr *local_data;
+
+  /* Local peers (DNCP_T_PEER TLVs' dncp_peer) by last_sa6, for those
+   * we have heard from over unicast. */
+  struct avl_tree peers_by_sa6;
+
   /* local endpoints (endpoints clients have at least referred to once). */
   struct vlist_tree eps;
 
@@ -74,6 +127,17 @@ struct dncp_struct {
    * of what's in local tlvs currently. */
   bool republish_tlvs;
 
+  /* When we last published new node data (for the hold-down), and
+   * republish statistics. */
+  hnetd_time_t last_republish;
+  int num_local_tlv_changes;
+  int num_republished;
+  int num_republish_deferred;
+
+  /* Local changes are waiting for the hold-down to expire (they are
+   * counted in num_republish_deferred once). */
+  bool republish_held;
+
   /* Have we already collided once this boot? If so, let profile deal
    * with it. */
   bool collided;
@@ -118,6 +182,94 @@ struct dncp_struct {
 
   /* Number of times neighbor has been dropped. */
   int num_neighbor_dropped;
+
+  /* Warm restart snapshot file (if any), when to consider writing it
+   * next, and the network hash it was last written with. */
+  char *snapshot_file;
+  hnetd_time_t next_snapshot;
+  dncp_hash_s snapshot_hash;
+
+  /* Network-wide TLV index (see dncp_index.c); for each type,
+   * network_tlv_types has 1 + number of entries, or 0 if the type is
+   * not indexed. */
+  struct avl_tree network_tlvs;
+  int *network_tlv_types;
+  int network_tlv_types_length;
+
+  /* Node pool. Each node takes node_size bytes, a multiple of the
+   * cache line size: dncp_node_s, the identifiers, cold part (at
+   * node_cold_offset) and the ext_node_data. */
+  struct list_head node_chunks;
+  int num_node_chunks;
+  int nodes_per_chunk;
+  size_t node_size;
+  size_t node_cold_offset;
+
+  /* Network state payload built within the current timeout pass; the
+   * time is fixed within it, so it is shared by all destinations
+   * with the same parameters. */
+  struct tlv_buf ns_cache;
+  dncp_ns_cache_key_s ns_cache_key;
+
+  /* Node data we want but do not have yet (dncp_fetch_s, keyed by
+   * node identifier), and how many of them have been requested. */
+  struct avl_tree fetches;
+  int num_fetches_requested;
+
+  /* Running average of the size of fetched node data */
+  int fetch_node_data_estimate;
+
+  /* Are node data deltas enabled, and the previous versions of the
+   * own node data they can be sent against (a ring; the oldest one
+   * at delta_history_next). */
+  bool node_data_deltas;
+  dncp_delta_version_s delta_history[DNCP_DELTA_HISTORY];
+  int delta_history_next;
+};
+
+struct dncp_fetch_struct {
+  /* dncp->fetches entry */
+  struct avl_node in_fetches;
+
+  /* What we want: node data at least this new. */
+  uint32_t update_number;
+
+  /* Peers that have told us about it, and the network hash the first
+   * of them advertised along with it (if has_network_hash); any peer
+   * advertising the same network hash can provide it too. */
+  dncp_peer sources[DNCP_FETCH_SOURCES];
+  dncp_hash_s network_hash;
+  bool has_network_hash;
+
+  /* Who it has been requested from, and when (if it has been). */
+  dncp_peer peer;
+  hnetd_time_t requested_at;
+
+  /* Who did not provide it the last time. */
+  dncp_peer stalled_peer;
+  int tries;
+
+  /* Expected size of the reply (node state with data) */
+  int estimate;
+
+  /* Not sent yet, but assigned to peer within dncp_fetch_run */
+  bool queued;
+
+  /* We have an older version of the node data, so (with deltas) the
+   * node itself could send just what changed. */
+  bool has_base;
+
+  unsigned char node_id[];
+};
+
+struct dncp_network_tlv_struct {
+  /* dncp->network_tlvs entry */
+  struct avl_node in_network_tlvs;
+
+  dncp_node node;
+
+  /* Within node's tlv_container_valid */
+  struct tlv_attr *tlv;
 };
 
 typedef struct dncp_trickle_struct dncp_trickle_s, *dncp_trickle;
@@ -171,43 +323,59 @@ struct dncp_ep_i_struct {
 
   /* The per-ep Trickle state. */
   dncp_trickle_s trickle;
-};
 
-typedef struct dncp_peer_struct dncp_peer_s, *dncp_peer;
+  /* Local peers on this endpoint (dncp_peer.in_ep_peers) */
+  struct list_head peers;
+};
 
 struct dncp_peer_struct {
-  /* Most recent address we heard from this particular neighbor */
+  /* Most recent address we heard from this particular neighbor; set
+   * using dncp_peer_set_sa6. */
   struct sockaddr_in6 last_sa6;
 
+  /* dncp->peers_by_sa6 entry (key is NULL until last_sa6 is set) */
+  struct avl_node in_peers_by_sa6;
+
+  /* dncp_ep_i->peers entry */
+  struct list_head in_ep_peers;
+
+  /* The local TLV this is the extra data of */
+  dncp_tlv tlv;
+
   /* When did we last time receive _consistent_ state from the peer
    * (multicast) or any contact (unicast). */
   hnetd_time_t last_contact;
 
   /* The per-(local)peer Trickle state. */
   dncp_trickle_s trickle;
+
+  /* Network hash the peer last advertised over unicast (if
+   * network_hash_set). */
+  dncp_hash_s network_hash;
+  bool network_hash_set;
+
+  /* Expected size of the node data requested from the peer that has
+   * not arrived yet, and when it last sent us some (or we asked). */
+  int fetch_outstanding;
+  hnetd_time_t fetch_progress;
+
+  /* Did the peer's last unicast message say it handles node data
+   * deltas? */
+  bool delta_capable;
 };
 
 
 struct dncp_node_struct {
-  /* dncp->nodes entry */
+  /* dncp->nodes entry (keyed by node_id) */
   struct vlist_node in_nodes;
 
+  /* The rest up to node_id is what lookups, hashing and pruning
+   * touch. With HNCP lengths, it (and the identifiers) fit in the
+   * cache line following in_nodes. */
+
   /* backpointer to dncp */
   dncp dncp;
 
-  /* These map 1:1 to node data TLV's start */
-  dncp_node_id_s node_id;
-  uint32_t update_number;
-
-  /* When was the last prune during which this node was reachable */
-  hnetd_time_t last_reachable_prune;
-
-  /* Node state stuff */
-  dncp_hash_s node_data_hash;
-  bool node_data_hash_dirty; /* Something related to hash changed */
-  hnetd_time_t origination_time; /* in monotonic time */
-  hnetd_time_t expiration_time; /* in monotonic time */
-
   /* TLV data for the node. All TLV data in one binary blob, as
    * received/created. We could probably also maintain this at end of
    * the structure, but that'd mandate re-inserts whenever content
@@ -215,7 +383,9 @@ struct dncp_node_struct {
   struct tlv_attr *tlv_container;
 
   /* TLV data, that is of correct version # and otherwise looks like
-   * it should be used by us. Either tlv_container, or NULL. */
+   * it should be used by us. Either tlv_container, or NULL. Its
+   * framing has been checked; TLVs within can be walked without
+   * further bounds checks. */
   struct tlv_attr *tlv_container_valid;
 
   /* An index of DNCP TLV indexes (that have been registered and
@@ -225,13 +395,64 @@ struct dncp_node_struct {
    * registered index. */
   struct tlv_attr **tlv_index;
 
+  /* When was the last prune during which this node was reachable */
+  hnetd_time_t last_reachable_prune;
+
+  hnetd_time_t expiration_time; /* in monotonic time */
+
+  uint32_t update_number;
+
+  bool node_data_hash_dirty; /* Something related to hash changed */
+
   /* Flag which indicates whether contents of tlv_idnex are up to date
    * with tlv_container. As a result of this, there's no need for
    * re-alloc when tlv_container changes and we don't immediately want
    * to recalculate tlv_index. */
   bool tlv_index_dirty;
+
+  /* Node identifier (DNCP_NI_LEN bytes), followed by the node data
+   * hash (DNCP_HASH_LEN bytes); see dncp_node_hash. After them (at
+   * dncp->node_cold_offset) is dncp_node_cold_s, and after that the
+   * profile's ext_node_data. */
+  unsigned char node_id[];
 };
 
+/* Node state that is needed only when (re)publishing or dumping it. */
+typedef struct dncp_node_cold_struct {
+  hnetd_time_t origination_time; /* in monotonic time */
+
+  /* Number of TLVs in tlv_container that did not pass the
+   * node_data_schema; if 0, all of them did. */
+  int tlv_container_invalid;
+
+  /* backpointer to the node (for dncp_node_from_ext_data) */
+  dncp_node node;
+} dncp_node_cold_s, *dncp_node_cold;
+
+/* Nodes are allocated from DNCP_NODE_CHUNK_SIZE byte (and aligned)
+ * chunks, each starting with this header, and followed by
+ * dncp->node_size byte slots. Free slots are linked through their
+ * first word. */
+#define DNCP_NODE_CHUNK_SIZE 16384
+#define DNCP_CACHE_LINE_SIZE 64
+#define DNCP_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+typedef struct dncp_node_chunk_struct {
+  /* dncp->node_chunks entry; chunks with free slots are first */
+  struct list_head in_node_chunks;
+
+  /* Previously used slots that have been freed */
+  void *free;
+
+  /* Number of slots in use, and number of slots ever used (from the
+   * start of the chunk) */
+  int used;
+  int touched;
+} dncp_node_chunk_s, *dncp_node_chunk;
+
+#define DNCP_NODE_CHUNK_HEADER \
+  DNCP_ALIGN(sizeof(dncp_node_chunk_s), DNCP_CACHE_LINE_SIZE)
+
 struct dncp_tlv_struct {
   /* dncp->tlvs entry */
   struct vlist_node in_tlvs;
@@ -258,12 +479,25 @@ void dncp_node_recalculate_index(dncp_node n);
 
 bool dncp_add_tlv_index(dncp o, uint16_t type);
 
+/* Network-wide TLV index (dncp_index.c) */
+void dncp_index_init(dncp o);
+void dncp_index_uninit(dncp o);
+void dncp_index_node_tlvs_changed(dncp_node n,
+                                  struct tlv_attr *a_old,
+                                  struct tlv_attr *a_new);
+
 void dncp_schedule(dncp o);
 
-/* Flush own TLV changes to own node. */
+/* Flush own TLV changes to own node. Called only from the DNCP timeout
+ * and node identifier collision handling, never in the middle of a TLV
+ * update; the batching of dncp_add_tlv / dncp_remove_tlv calls into one
+ * node data update depends on that. */
 void dncp_self_flush(dncp_node n);
+void dncp_peer_set_sa6(dncp o, dncp_peer n, struct sockaddr_in6 *sa6);
+hnetd_time_t dncp_republish_holddown_end(dncp o);
 
 /* Various hash calculation utilities. */
+void dncp_calculate_node_data_hash(dncp_node n);
 void dncp_calculate_network_hash(dncp o);
 
 /* Utility functions to send frames. */
@@ -276,18 +510,81 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
 void dncp_ep_i_send_buf(dncp_ep_i l,
                         struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
                         struct tlv_buf *buf);
+void dncp_ns_cache_drop(dncp o);
 void dncp_reply_send(dncp_reply reply);
+bool dncp_reply_push_req_node_state(dncp_reply reply, const void *ni);
+bool dncp_reply_push_req_node_delta(dncp_reply reply, const void *ni,
+                                    uint32_t base_update_number);
+
+/* Node data fetching (dncp_fetch.c) */
+void dncp_fetch_init(dncp o);
+void dncp_fetch_uninit(dncp o);
+void dncp_fetch_want(dncp o, dncp_peer source, void *ni,
+                     uint32_t update_number, dncp_hash network_hash);
+void dncp_fetch_done(dncp o, dncp_peer from, dncp_node n);
+void dncp_fetch_peer_gone(dncp o, dncp_peer n);
+void dncp_fetch_run(dncp o);
+hnetd_time_t dncp_fetch_timeout(dncp o);
+
+/* Node data deltas (dncp_delta.c) */
+void dncp_delta_uninit(dncp o);
+void dncp_delta_remember(dncp o, dncp_node n);
+bool dncp_delta_from_peer(dncp o, dncp_peer n, const void *ni);
+struct tlv_attr *dncp_delta_base(dncp o, uint32_t update_number);
+int dncp_delta_encode(struct tlv_attr *old, struct tlv_attr *new, void *buf);
+struct tlv_attr *dncp_delta_apply(struct tlv_attr *old,
+                                  const void *delta, int len);
 
 /* Miscellaneous utilities that live in dncp_timeout */
 void dncp_trickle_reset(dncp o);
 
-/* Compatibility / convenience macros to access stuff that used to be fixed. */
+/* Compatibility / convenience macros to access stuff that used to be fixed.
+ *
+ * A build for a single profile may fix the node identifier and hash
+ * lengths at compile time (e.g. -DDNCP_FIXED_NI_LEN=4); then the
+ * copies and compares of them are constant-sized, and can be inlined
+ * by the compiler. dncp_init refuses profiles with other lengths. */
+#ifdef DNCP_FIXED_NI_LEN
+#define DNCP_NI_LEN(o) ((void)(o), DNCP_FIXED_NI_LEN)
+#else
 #define DNCP_NI_LEN(o) (o)->ext->conf.node_id_length
+#endif /* DNCP_FIXED_NI_LEN */
+#ifdef DNCP_FIXED_HASH_LEN
+#define DNCP_HASH_LEN(o) ((void)(o), DNCP_FIXED_HASH_LEN)
+#else
 #define DNCP_HASH_LEN(o) (o)->ext->conf.hash_length
+#endif /* DNCP_FIXED_HASH_LEN */
 #define DNCP_KEEPALIVE_INTERVAL(o) (o)->ext->conf.per_ep.keepalive_interval
 #define DNCP_HASH_REPR(o, h) HEX_REPR(h, DNCP_HASH_LEN(o))
 
 /* Inlined utilities. */
+static inline dncp_hash dncp_node_hash(dncp_node n)
+{
+  return (dncp_hash)(n->node_id + DNCP_NI_LEN(n->dncp));
+}
+
+/* Order of node identifiers (same as memcmp) */
+static inline int dncp_ni_cmp(dncp o, const void *a, const void *b)
+{
+#if defined(DNCP_FIXED_NI_LEN) && DNCP_FIXED_NI_LEN == 4
+  uint32_t x, y;
+
+  (void)o;
+  memcpy(&x, a, 4);
+  memcpy(&y, b, 4);
+  x = be32_to_cpu(x);
+  y = be32_to_cpu(y);
+  return x < y ? -1 : x > y;
+#else
+  return memcmp(a, b, DNCP_NI_LEN(o));
+#endif /* DNCP_FIXED_NI_LEN == 4 */
+}
+
+static inline dncp_node_cold dncp_node_get_cold(dncp_node n)
+{
+  return (dncp_node_cold)((char *)n + n->dncp->node_cold_offset);
+}
+
 static inline hnetd_time_t dncp_time(dncp o)
 {
   if (!o->now)
@@ -333,8 +630,7 @@ dncp_tlv_get_node_id2(void *tlv, int nidlen)
 static inline dncp_node_id
 dncp_tlv_get_node_id(dncp o, void *tlv)
 {
-  return dncp_tlv_get_node_id2(tlv,
-                               o->ext->conf.node_id_length);
+  return dncp_tlv_get_node_id2(tlv, DNCP_NI_LEN(o));
 }
 
 static inline dncp_node
@@ -355,7 +651,7 @@ dncp_node_find_neigh_bidir(dncp_node n, dncp_t_peer ne)
         if (ne->ep_id == ne2->peer_ep_id
             && ne->peer_ep_id == ne2->ep_id &&
             !memcmp(dncp_tlv_get_node_id(n->dncp, ne2),
-                    &n->node_id, DNCP_NI_LEN(n->dncp)))
+                    n->node_id, DNCP_NI_LEN(n->dncp)))
           return n2;
       }
 
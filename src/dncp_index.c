@@ -0,0 +1,179 @@
+/*
+ * $Id: dncp_index.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * Network-wide TLV index: for registered TLV types, every (valid) TLV
+ * of every reachable node has an entry in dncp->network_tlvs, sorted
+ * by type, node identifier and TLV content. That is, the entries of a
+ * type are in the same order as dncp_for_each_node +
+ * dncp_node_for_each_tlv_with_type would produce them, but finding
+ * them does not require visiting every node.
+ *
+ * The index is updated from the same old/new node data pairs as the
+ * TLV change notifications, just before the subscribers are called.
+ */
+
+#include "dncp_i.h"
+
+static int
+compare_network_tlvs(const void *a, const void *b, void *ptr)
+{
+  const dncp_network_tlv_s *t1 = a, *t2 = b;
+  dncp o = ptr;
+  int r = (int)tlv_id(t1->tlv) - (int)tlv_id(t2->tlv);
+
+  if (r || t1->node == t2->node)
+    return r ? r : tlv_attr_cmp(t1->tlv, t2->tlv);
+  /* Lookup keys without a node sort first within the type */
+  if (!t1->node || !t2->node)
+    return t1->node ? 1 : -1;
+  r = dncp_ni_cmp(o, t1->node->node_id, t2->node->node_id);
+  return r ? r : tlv_attr_cmp(t1->tlv, t2->tlv);
+}
+
+static inline bool _type_indexed(dncp o, uint16_t type)
+{
+  return type < o->network_tlv_types_length && o->network_tlv_types[type];
+}
+
+static void _add(dncp_node n, struct tlv_attr *a)
+{
+  dncp o = n->dncp;
+  dncp_network_tlv t = malloc(sizeof(*t));
+
+  if (!t)
+    {
+      L_ERR("network TLV index - eom, %s missing", TLV_REPR(a));
+      return;
+    }
+  t->node = n;
+  t->tlv = a;
+  t->in_network_tlvs.key = t;
+  avl_insert(&o->network_tlvs, &t->in_network_tlvs);
+  o->network_tlv_types[tlv_id(a)]++;
+}
+
+static void _remove(dncp_node n, struct tlv_attr *a)
+{
+  dncp o = n->dncp;
+  dncp_network_tlv_s key = { .node = n, .tlv = a };
+  dncp_network_tlv t = avl_find_element(&o->network_tlvs, &key, t,
+                                        in_network_tlvs);
+
+  if (!t)
+    return;
+  avl_delete(&o->network_tlvs, &t->in_network_tlvs);
+  o->network_tlv_types[tlv_id(a)]--;
+  free(t);
+}
+
+void dncp_index_node_tlvs_changed(dncp_node n,
+                                  struct tlv_attr *a_old,
+                                  struct tlv_attr *a_new)
+{
+  dncp o = n->dncp;
+  struct tlv_attr *a;
+
+  if (!o->network_tlv_types_length)
+    return;
+  /* Node data is sorted by type, so we can stop at the first one
+   * beyond the highest indexed type. */
+  if (a_old)
+    tlv_for_each_attr(a, a_old)
+      {
+        if ((int)tlv_id(a) >= o->network_tlv_types_length)
+          break;
+        if (o->network_tlv_types[tlv_id(a)])
+          _remove(n, a);
+      }
+  if (a_new)
+    tlv_for_each_attr(a, a_new)
+      {
+        if ((int)tlv_id(a) >= o->network_tlv_types_length)
+          break;
+        if (o->network_tlv_types[tlv_id(a)])
+          _add(n, a);
+      }
+}
+
+bool dncp_add_network_tlv_index(dncp o, uint16_t type)
+{
+  dncp_node n;
+  struct tlv_attr *a;
+
+  if (_type_indexed(o, type))
+    return true;
+  if (type >= o->network_tlv_types_length)
+    {
+      int old_len = o->network_tlv_types_length;
+      int new_len = type + 1;
+      int *nt = realloc(o->network_tlv_types, new_len * sizeof(*nt));
+
+      if (!nt)
+        return false;
+      memset(nt + old_len, 0, (new_len - old_len) * sizeof(*nt));
+      o->network_tlv_types = nt;
+      o->network_tlv_types_length = new_len;
+    }
+  L_DEBUG("dncp_add_network_tlv_index: type #%d", (int)type);
+  /* Counts are stored +1, so that 0 means not indexed */
+  o->network_tlv_types[type] = 1;
+  dncp_for_each_node(o, n)
+    dncp_node_for_each_tlv_with_type(n, a, type)
+      _add(n, a);
+  return true;
+}
+
+int dncp_get_network_tlv_count(dncp o, uint16_t type)
+{
+  return _type_indexed(o, type) ? o->network_tlv_types[type] - 1 : -1;
+}
+
+dncp_network_tlv dncp_get_first_network_tlv(dncp o, uint16_t type)
+{
+  struct tlv_attr k;
+  dncp_network_tlv_s key = { .node = NULL, .tlv = &k };
+  dncp_network_tlv t;
+
+  if (dncp_get_network_tlv_count(o, type) <= 0)
+    return NULL;
+  tlv_init(&k, type, sizeof(k));
+  t = avl_find_ge_element(&o->network_tlvs, &key, t, in_network_tlvs);
+  return t && tlv_id(t->tlv) == type ? t : NULL;
+}
+
+dncp_network_tlv dncp_network_tlv_get_next(dncp_network_tlv t)
+{
+  dncp o = t->node->dncp;
+  dncp_network_tlv t2;
+
+  if (t == avl_last_element(&o->network_tlvs, t2, in_network_tlvs))
+    return NULL;
+  t2 = avl_next_element(t, in_network_tlvs);
+  return tlv_id(t2->tlv) == tlv_id(t->tlv) ? t2 : NULL;
+}
+
+dncp_node dncp_network_tlv_get_node(dncp_network_tlv t)
+{
+  return t->node;
+}
+
+struct tlv_attr *dncp_network_tlv_get_attr(dncp_network_tlv t)
+{
+  return t->tlv;
+}
+
+void dncp_index_init(dncp o)
+{
+  avl_init(&o->network_tlvs, compare_network_tlvs, true, o);
+}
+
+void dncp_index_uninit(dncp o)
+{
+  /* By now, all nodes are gone and so are the entries */
+  assert(avl_is_empty(&o->network_tlvs));
+  free(o->network_tlv_types);
+  o->network_tlv_types = NULL;
+  o->network_tlv_types_length = 0;
+}
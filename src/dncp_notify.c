@@ -78,15 +78,11 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
 }
 
 /* This can be only used in a loop which makes sure that the p stays
- * valid. It ensures that next TLV won't exceed the end, and if it
- * would, p is invalidated and loop aborts. */
+ * valid. Valid TLV containers have had their framing checked in
+ * dncp_node_set, so all that is left is to stop at the end; p is
+ * then invalidated and the loop aborts. */
 #define ENSURE_VALID(p, end)                    \
-  if ((end - TLV_SIZE) < (void *)p)             \
-    {                                           \
-      p = NULL;                                 \
-      break;                                    \
-    }                                           \
-  if ((end - tlv_pad_len(p)) < (void *)p)       \
+  if ((void *)p >= end)                         \
     {                                           \
       p = NULL;                                 \
       break;                                    \
@@ -101,6 +97,8 @@ void dncp_notify_subscribers_tlvs_changed(dncp_node n,
   void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
   int r;
 
+  dncp_index_node_tlvs_changed(n, a_old, a_new);
+
   /* There are two distinct steps here: First we remove missing, and
    * then we add new ones. Otherwise, there may be confusion if we get
    * first new + then remove, and the underlying TLV has same
@@ -106,15 +106,16 @@ static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
     return false;
 
   void *p = tlv_data(a);
-  memcpy(p, &n->node_id, nilen);
+  memcpy(p, n->node_id, nilen);
   p += nilen;
 
   s = p;
   s->update_number = cpu_to_be32(n->update_number);
-  s->ms_since_origination = cpu_to_be32(now - n->origination_time);
+  s->ms_since_origination =
+    cpu_to_be32(now - dncp_node_get_origination_time(n));
   p += sizeof(*s);
 
-  memcpy(p, &n->node_data_hash, hlen);
+  memcpy(p, dncp_node_hash(n), hlen);
   p += hlen;
 
   if (l)
@@ -125,6 +126,46 @@ static bool _push_node_state_tlv(struct tlv_buf *tb, dncp_node n,
   return true;
 }
 
+/* Push own node n as a delta against base, unless the whole node state
+ * would be smaller. */
+static bool _push_node_delta_tlv(struct tlv_buf *tb, dncp_node n,
+                                 struct tlv_attr *base,
+                                 uint32_t base_update_number)
+{
+  hnetd_time_t now = dncp_time(n->dncp);
+  int nilen = DNCP_NI_LEN(n->dncp);
+  int hlen = DNCP_HASH_LEN(n->dncp);
+  int l = dncp_delta_encode(base, n->tlv_container, NULL);
+  dncp_t_node_delta d;
+  struct tlv_attr *a;
+
+  if (l >= (int)tlv_len(n->tlv_container))
+    return _push_node_state_tlv(tb, n, true);
+  if (!(a = _push_tlv(tb, DNCP_T_NODE_DELTA, nilen + sizeof(*d) + hlen + l)))
+    return false;
+
+  void *p = tlv_data(a);
+  memcpy(p, n->node_id, nilen);
+  p += nilen;
+
+  d = p;
+  d->base_update_number = cpu_to_be32(base_update_number);
+  d->ns.update_number = cpu_to_be32(n->update_number);
+  d->ns.ms_since_origination =
+    cpu_to_be32(now - dncp_node_get_origination_time(n));
+  p += sizeof(*d);
+
+  dncp_calculate_node_data_hash(n);
+  memcpy(p, dncp_node_hash(n), hlen);
+  p += hlen;
+
+  dncp_delta_encode(base, n->tlv_container, p);
+
+  _maybe_pop_tlv(tb, a);
+
+  return true;
+}
+
 static bool _push_network_state_tlv(struct tlv_buf *tb, dncp o)
 {
   struct tlv_attr *a = _push_tlv(tb, DNCP_T_NET_STATE, DNCP_HASH_LEN(o));
@@ -150,9 +191,12 @@ static bool _push_ep_id_tlv(struct tlv_buf *tb, dncp_ep_i l,
 
   if (!a)
     return false;
-  memcpy(tlv_data(a), &l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
+  memcpy(tlv_data(a), l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
   lid = tlv_data(a) + DNCP_NI_LEN(l->dncp);
   lid->ep_id = l->ep_id;
+  if (dst && l->dncp->node_data_deltas
+      && !_push_tlv(tb, DNCP_T_DELTA_CAPABLE, 0))
+    return false;
   return true;
 }
 
@@ -189,18 +233,48 @@ static bool _push_network_state(struct tlv_buf *tb, dncp o,
 
 static bool _push_req_node_data_tlv(struct tlv_buf *tb,
                                     dncp o,
-                                    dncp_t_node_state ns)
+                                    const void *ni)
 {
   struct tlv_attr *a;
 
   if (!(a = _push_tlv(tb, DNCP_T_REQ_NODE_STATE, DNCP_NI_LEN(o))))
     return false;
-  dncp_node_id ni = dncp_tlv_get_node_id(o, ns);
   memcpy(tlv_data(a), ni, DNCP_NI_LEN(o));
   _maybe_pop_tlv(tb, a);
   return true;
 }
 
+static bool _push_req_node_delta_tlv(struct tlv_buf *tb,
+                                     dncp o,
+                                     const void *ni,
+                                     uint32_t base_update_number)
+{
+  int nilen = DNCP_NI_LEN(o);
+  dncp_t_req_node_delta rd;
+  struct tlv_attr *a;
+
+  if (!(a = _push_tlv(tb, DNCP_T_REQ_NODE_DELTA, nilen + sizeof(*rd))))
+    return false;
+  memcpy(tlv_data(a), ni, nilen);
+  rd = tlv_data(a) + nilen;
+  rd->base_update_number = cpu_to_be32(base_update_number);
+  _maybe_pop_tlv(tb, a);
+  return true;
+}
+
+/* Request the node data of ni from peer ne (if known); just what
+ * changed, if ne is the node itself and we have an older version. */
+static bool _push_req_node_tlv(struct tlv_buf *tb, dncp o, dncp_peer ne,
+                               void *ni)
+{
+  dncp_node n;
+
+  if (dncp_delta_from_peer(o, ne, ni)
+      && (n = dncp_find_node_by_node_id(o, ni, false)) && n->tlv_container)
+    return _push_req_node_delta_tlv(tb, o, ni, n->update_number);
+  return _push_req_node_data_tlv(tb, o, ni);
+}
+
 /****************************************** Actual payload sending utilities */
 
 void dncp_ep_i_send_buf(dncp_ep_i l,
@@ -220,6 +294,24 @@ void dncp_reply_send(dncp_reply reply)
   dncp_ep_i_send_buf(reply->l, src, &reply->dst, &reply->buf);
 }
 
+bool dncp_reply_push_req_node_state(dncp_reply reply, const void *ni)
+{
+  return _push_req_node_data_tlv(&reply->buf, reply->l->dncp, ni);
+}
+
+bool dncp_reply_push_req_node_delta(dncp_reply reply, const void *ni,
+                                    uint32_t base_update_number)
+{
+  return _push_req_node_delta_tlv(&reply->buf, reply->l->dncp, ni,
+                                  base_update_number);
+}
+
+
+void dncp_ns_cache_drop(dncp o)
+{
+  tlv_buf_free(&o->ns_cache);
+  memset(&o->ns_cache_key, 0, sizeof(o->ns_cache_key));
+}
 
 void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   struct sockaddr_in6 *src,
@@ -227,21 +319,44 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   size_t maximum_size,
                                   bool always_ep_id)
 {
-  struct tlv_buf tb;
+  struct tlv_buf tb, *b = &tb;
+  dncp_ns_cache_key_s key;
   dncp o = l->dncp;
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (!_push_ep_id_tlv(&tb, l, dst, always_ep_id))
+  /* Within a timeout pass (o->now set), the same payload can be
+   * reused for every destination with the same parameters. */
+  if (o->now)
+    {
+      dncp_calculate_network_hash(o);
+      memset(&key, 0, sizeof(key));
+      key.l = l;
+      key.maximum_size = maximum_size;
+      key.unicast = dst != NULL;
+      key.always_ep_id = always_ep_id;
+      key.graph_dirty = o->graph_dirty;
+      key.network_hash = o->network_hash;
+      b = &o->ns_cache;
+      if (b->buf && !memcmp(&key, &o->ns_cache_key, sizeof(key)))
+        goto send;
+      dncp_ns_cache_drop(o);
+    }
+  memset(b, 0, sizeof(*b));
+  tlv_buf_init(b, 0); /* not passed anywhere */
+  if (!_push_ep_id_tlv(b, l, dst, always_ep_id))
     goto done;
-  if (!_push_network_state(&tb, o, maximum_size))
+  if (!_push_network_state(b, o, maximum_size))
     goto done;
+  if (b == &o->ns_cache)
+    memcpy(&o->ns_cache_key, &key, sizeof(key));
+ send:
   L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F,
           SA6_D(dst), DNCP_LINK_D(l));
-  dncp_ep_i_send_buf(l, src, dst, &tb);
-  return;
+  o->ext->cb.send(o->ext, &l->conf, src, dst,
+                  tlv_data(b->head), tlv_len(b->head));
+  if (b == &o->ns_cache)
+    return;
  done:
-  tlv_buf_free(&tb);
+  tlv_buf_free(b);
 }
 
 /************************************************************ Input handling */
@@ -249,17 +364,10 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
 static dncp_tlv
 _find_local_tlv_by_remote(dncp o, struct sockaddr_in6 *remote)
 {
-  dncp_tlv t;
-  dncp_t_peer ne;
+  dncp_peer n = avl_find_element(&o->peers_by_sa6, remote, n,
+                                 in_peers_by_sa6);
 
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        if (memcmp(&n->last_sa6, remote, sizeof(*remote)) == 0)
-          return t;
-      }
-  return NULL;
+  return n ? n->tlv : NULL;
 }
 
 static dncp_tlv
@@ -293,12 +401,22 @@ _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
     n = dncp_tlv_get_extra(t);
 
   if (!multicast)
-    {
-      n->last_sa6 = *src;
-    }
+    dncp_peer_set_sa6(l->dncp, n, src);
   return t;
 }
 
+/* Node data a (to be owned by n) for n arrived, from peer ne if known */
+static void _node_data_received(dncp o, dncp_peer ne, dncp_node n,
+                                uint32_t update_number,
+                                uint32_t ms_since_origination,
+                                dncp_hash h, struct tlv_attr *a)
+{
+  dncp_node_set(n, update_number, dncp_time(o) - ms_since_origination, a);
+  memcpy(dncp_node_hash(n), h, DNCP_HASH_LEN(o));
+  n->node_data_hash_dirty = false;
+  dncp_fetch_done(o, ne, n);
+}
+
 /* Handle a single received message. */
 static void
 handle_message(dncp_ep_i l,
@@ -316,12 +434,14 @@ handle_message(dncp_ep_i l,
   uint32_t new_update_number;
   bool should_request_network_state = false;
   bool updated_or_requested_state = false;
+  bool delta_capable = false;
   bool multicast = dst == NULL;
   int nilen = DNCP_NI_LEN(l->dncp);
   int hlen = DNCP_HASH_LEN(l->dncp);
   dncp_node_id ni;
   char fake_lid[DNCP_NI_MAX_LEN + sizeof(*lid)];
   bool is_local = false;
+  dncp_hash network_hash = NULL;
   dncp_reply_s reply = { .has_src = !!dst, .dst = *src, .l = l };
 
   if (reply.has_src)
@@ -366,7 +486,7 @@ handle_message(dncp_ep_i l,
           }
         lid = tlv_data(a) + nilen;
         is_local = memcmp(dncp_tlv_get_node_id(l->dncp, lid),
-                          &o->own_node->node_id,
+                          o->own_node->node_id,
                           nilen) == 0;
         if (!is_local)
           {
@@ -394,14 +514,21 @@ handle_message(dncp_ep_i l,
           (void)_push_network_state(&reply.buf, o, 0);
         break;
 
+      case DNCP_T_DELTA_CAPABLE:
+        delta_capable = true;
+        break;
+
       case DNCP_T_REQ_NODE_STATE:
+      case DNCP_T_REQ_NODE_DELTA:
         /* Ignore if in multicast. */
         if (multicast)
           {
             L_INFO("ignoring req-node-data in multicast");
             break;
           }
-        if (tlv_len(a) != DNCP_NI_LEN(o))
+        bool req_delta = tlv_id(a) == DNCP_T_REQ_NODE_DELTA;
+        if (tlv_len(a) != DNCP_NI_LEN(o)
+            + (req_delta ? sizeof(dncp_t_req_node_delta_s) : 0))
           {
             L_DEBUG("got invalid node identifier length in req-node-state:%d",
                     tlv_len(a));
@@ -430,7 +557,22 @@ handle_message(dncp_ep_i l,
           }
         else
           dncp_self_flush(o->own_node);
-        (void)_push_node_state_tlv(&reply.buf, n, true);
+        /* Deltas are sent only of our own node data, if we still have
+         * the version the peer has. */
+        struct tlv_attr *base = NULL;
+        uint32_t base_update_number = 0;
+        if (req_delta && n == o->own_node && o->node_data_deltas
+            && n->tlv_container)
+          {
+            dncp_t_req_node_delta rd = tlv_data(a) + nilen;
+
+            base_update_number = be32_to_cpu(rd->base_update_number);
+            base = dncp_delta_base(o, base_update_number);
+          }
+        if (base)
+          (void)_push_node_delta_tlv(&reply.buf, n, base, base_update_number);
+        else
+          (void)_push_node_state_tlv(&reply.buf, n, true);
         break;
 
       case DNCP_T_NET_STATE:
@@ -445,6 +587,14 @@ handle_message(dncp_ep_i l,
         L_DEBUG("received network state which is %sconsistent (%s)",
                 consistent ? "" : "in",
                 is_local ? "local" : ne ? "remote" : "unknown remote");
+        /* Remember what the peer has, so that node data it lists can
+         * also be fetched from others with the same state. */
+        if (ne && !multicast)
+          {
+            network_hash = (dncp_hash)nethash;
+            memcpy(&ne->network_hash, nethash, DNCP_HASH_LEN(o));
+            ne->network_hash_set = true;
+          }
 
         if (consistent)
           {
@@ -481,7 +631,7 @@ handle_message(dncp_ep_i l,
         bool interesting = !n
           || (dncp_update_number_gt(n->update_number, new_update_number)
               || (new_update_number == n->update_number
-                  && memcmp(&n->node_data_hash, h, hlen) != 0));
+                  && memcmp(dncp_node_hash(n), h, hlen) != 0));
         L_DEBUG("saw %s %s for %s/%p (update number %d)",
                 interesting ? "new" : "old",
                 nd_len ? "state" : "state+data",
@@ -525,13 +675,9 @@ handle_message(dncp_ep_i l,
             memset(&tb, 0, sizeof(tb));
             tlv_buf_init(&tb, 0); /* not passed anywhere */
             if (tlv_put_raw(&tb, nd_data, nd_len))
-              {
-                dncp_node_set(n, new_update_number,
-                              dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
-                              tb.head);
-                memcpy(&n->node_data_hash, h, hlen);
-                n->node_data_hash_dirty = false;
-              }
+              _node_data_received(o, ne, n, new_update_number,
+                                  be32_to_cpu(ns->ms_since_origination),
+                                  h, tb.head);
             else
               {
                 L_DEBUG("tlv_put_raw failed");
@@ -544,7 +690,59 @@ handle_message(dncp_ep_i l,
             L_DEBUG("node data %s for %s",
                     multicast ? "not acceptable/supplied" : "missing",
                     DNCP_NI_REPR(l->dncp, ni));
-            (void)_push_req_node_data_tlv(&reply.buf, l->dncp, ns);
+            /* From known peers, the fetching is scheduled across all
+             * of them; otherwise, just ask the sender. */
+            if (ne && !multicast)
+              dncp_fetch_want(o, ne, ni, new_update_number, network_hash);
+            else
+              (void)_push_req_node_tlv(&reply.buf, l->dncp, ne, ni);
+          }
+        updated_or_requested_state = true;
+        break;
+
+      case DNCP_T_NODE_DELTA:
+        /* Only ever sent over unicast, in reply to our request */
+        if (multicast || !o->node_data_deltas)
+          break;
+        ns_len = nilen + sizeof(dncp_t_node_delta_s) + hlen;
+        if ((int)tlv_len(a) < ns_len)
+          {
+            L_INFO("invalid length node delta TLV received - ignoring");
+            break;
+          }
+        ni = tlv_data(a);
+        dncp_t_node_delta nd = tlv_data(a) + nilen;
+        h = tlv_data(a) + nilen + sizeof(*nd);
+        n = dncp_find_node_by_node_id(o, ni, false);
+        new_update_number = be32_to_cpu(nd->ns.update_number);
+        if (!n || n == o->own_node
+            || !dncp_update_number_gt(n->update_number, new_update_number))
+          break;
+        struct tlv_attr *nd_new = NULL;
+        if (n->tlv_container
+            && n->update_number == be32_to_cpu(nd->base_update_number))
+          nd_new = dncp_delta_apply(n->tlv_container, tlv_data(a) + ns_len,
+                                    tlv_len(a) - ns_len);
+        if (nd_new)
+          {
+            dncp_hash_s nd_hash;
+
+            o->ext->cb.hash(tlv_data(nd_new), tlv_len(nd_new), &nd_hash);
+            if (memcmp(&nd_hash, h, hlen))
+              {
+                tlv_free(nd_new);
+                nd_new = NULL;
+              }
+          }
+        if (nd_new)
+          _node_data_received(o, ne, n, new_update_number,
+                              be32_to_cpu(nd->ns.ms_since_origination),
+                              h, nd_new);
+        else
+          {
+            L_INFO("unusable node delta for %s - requesting node state",
+                   DNCP_NI_REPR(o, ni));
+            (void)_push_req_node_data_tlv(&reply.buf, o, ni);
           }
         updated_or_requested_state = true;
         break;
@@ -556,6 +754,11 @@ handle_message(dncp_ep_i l,
 
   }
 
+  /* The capability is (re)announced in every unicast message that has
+   * an endpoint identifier. */
+  if (ne && !multicast && seen_lid)
+    ne->delta_capable = delta_capable;
+
   /* Now, we can handle whether or not to send a network state request
    * based on the flags we know. */
   if (should_request_network_state && !updated_or_requested_state && !is_local)
@@ -565,6 +768,9 @@ handle_message(dncp_ep_i l,
       l->last_req_network_state = dncp_time(o);
     }
 
+  /* Fetch (more) node data, if there is some we want. */
+  dncp_fetch_run(o);
+
   /* If we haven't pushed anything, ignore the reply. */
   if (!reply.buf.head)
     return;
@@ -31,7 +31,13 @@ enum {
   /* was: DNCP_T_FRAGMENT_COUNT = 7 */
   DNCP_T_PEER = 8,
   DNCP_T_KEEPALIVE_INTERVAL = 9,
-  DNCP_T_TRUST_VERDICT = 10
+  DNCP_T_TRUST_VERDICT = 10,
+
+  /* Experimental node data delta extension (see dncp_delta.c); from
+   * the 'private use' range (768 - 1023) */
+  DNCP_T_DELTA_CAPABLE = 960, /* empty */
+  DNCP_T_REQ_NODE_DELTA = 961,
+  DNCP_T_NODE_DELTA = 962
 };
 
 #define TLV_SIZE sizeof(struct tlv_attr)
@@ -64,6 +70,30 @@ typedef struct __packed {
   /* + hash + + optional node data after this */
 } dncp_t_node_state_s, *dncp_t_node_state;
 
+/* DNCP_T_REQ_NODE_DELTA */
+typedef struct __packed {
+  /* dncp_node_id_s node_id; variable length, encoded here */
+  uint32_t base_update_number;
+} dncp_t_req_node_delta_s, *dncp_t_req_node_delta;
+
+/* DNCP_T_NODE_DELTA */
+typedef struct __packed {
+  /* dncp_node_id_s node_id; variable length, encoded here */
+  uint32_t base_update_number;
+  dncp_t_node_state_s ns;
+  /* + hash + delta records after this */
+} dncp_t_node_delta_s, *dncp_t_node_delta;
+
+/* Node delta record: keep the next 'keep' TLVs of the base node data,
+ * skip 'drop' TLVs, and insert the insert_len bytes of TLVs that
+ * follow the record. Whatever is left of the base after the last
+ * record is kept. */
+typedef struct __packed {
+  uint16_t keep;
+  uint16_t drop;
+  uint32_t insert_len;
+} dncp_t_node_delta_op_s, *dncp_t_node_delta_op;
+
 /* DNCP_T_CUSTOM custom data, with H-64 of URI at start to identify type TBD */
 
 /* DNCP_T_PEER */
@@ -0,0 +1,306 @@
+/*
+ * $Id: dncp_snapshot.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * Warm restart support: the node database is periodically written to
+ * a file, and preloaded from it on startup. The preloaded nodes are
+ * not reachable until the network confirms them (or they are pruned
+ * after the grace interval), but as their update numbers and hashes
+ * are known, only nodes that changed in the meanwhile have to be
+ * fetched.
+ *
+ * The file consists of a header followed by node state TLVs in the
+ * same format as on the wire (node identifier, update number, ms since
+ * origination, hash, node data). The own node is stored without data;
+ * only its update number is of interest.
+ */
+
+#include "dncp_i.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define SNAPSHOT_VERSION 1
+
+typedef struct __packed {
+  uint8_t version;
+  uint8_t node_id_length;
+  uint8_t hash_length;
+  uint8_t reserved;
+  /* Wall clock time (in ms) at save; used to age the origination times */
+  uint64_t saved_at;
+} dncp_snapshot_header_s;
+
+static uint64_t _wall_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool _snapshot_write(int fd, const void *buf, size_t len)
+{
+  ssize_t r = write(fd, buf, len);
+
+  if (r < 0 || (size_t)r != len)
+    {
+      L_ERR("snapshot save - error writing: %s",
+            r < 0 ? strerror(errno) : "short write");
+      return false;
+    }
+  if (fsync(fd) < 0)
+    {
+      L_ERR("snapshot save - fsync failed: %s", strerror(errno));
+      return false;
+    }
+  return true;
+}
+
+/* Make a rename within the directory of filename durable */
+static void _snapshot_sync_dir(const char *filename)
+{
+  char path[strlen(filename) + 1];
+  int fd;
+
+  strcpy(path, filename);
+  fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) < 0)
+    L_ERR("snapshot save - directory fsync failed: %s", strerror(errno));
+  if (fd >= 0)
+    close(fd);
+}
+
+static int _node_state_len(dncp_node n)
+{
+  int l = n == n->dncp->own_node || !n->tlv_container ?
+    0 : tlv_len(n->tlv_container);
+
+  return DNCP_NI_LEN(n->dncp) + sizeof(dncp_t_node_state_s)
+    + DNCP_HASH_LEN(n->dncp) + l;
+}
+
+bool dncp_save_snapshot(dncp o)
+{
+  int nilen = DNCP_NI_LEN(o), hlen = DNCP_HASH_LEN(o);
+  char tmpname[strlen(o->snapshot_file ? o->snapshot_file : "") + 5];
+  dncp_snapshot_header_s *h;
+  hnetd_time_t now = dncp_time(o);
+  size_t len = sizeof(*h);
+  dncp_node n;
+  void *buf, *p;
+  bool ok = false;
+  int fd, c = 0;
+
+  if (!o->snapshot_file)
+    return false;
+  dncp_for_each_node(o, n)
+    len += TLV_ATTR_ALIGN * ((sizeof(struct tlv_attr) + _node_state_len(n)
+                              + TLV_ATTR_ALIGN - 1) / TLV_ATTR_ALIGN);
+  if (!(buf = malloc(len)))
+    {
+      L_ERR("snapshot save - eom");
+      return false;
+    }
+  h = buf;
+  memset(h, 0, sizeof(*h));
+  h->version = SNAPSHOT_VERSION;
+  h->node_id_length = nilen;
+  h->hash_length = hlen;
+  h->saved_at = cpu_to_be64(_wall_ms());
+  p = buf + sizeof(*h);
+  dncp_for_each_node(o, n)
+    {
+      struct tlv_attr *a = p;
+      int l = _node_state_len(n);
+      dncp_t_node_state ns;
+
+      dncp_calculate_node_data_hash(n);
+      tlv_init(a, DNCP_T_NODE_STATE, sizeof(*a) + l);
+      p = tlv_data(a);
+      memcpy(p, n->node_id, nilen);
+      p += nilen;
+      ns = p;
+      ns->update_number = cpu_to_be32(n->update_number);
+      ns->ms_since_origination =
+        cpu_to_be32(now - dncp_node_get_origination_time(n));
+      p += sizeof(*ns);
+      memcpy(p, dncp_node_hash(n), hlen);
+      p += hlen;
+      l -= nilen + sizeof(*ns) + hlen;
+      if (l)
+        memcpy(p, tlv_data(n->tlv_container), l);
+      tlv_fill_pad(a);
+      p = tlv_next(a);
+      c++;
+    }
+  sprintf(tmpname, "%s.tmp", o->snapshot_file);
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    {
+      L_ERR("snapshot save - error opening %s: %s", tmpname, strerror(errno));
+      goto done;
+    }
+  ok = _snapshot_write(fd, buf, len);
+  close(fd);
+  if (ok && rename(tmpname, o->snapshot_file) < 0)
+    {
+      L_ERR("snapshot save - rename to %s failed: %s",
+            o->snapshot_file, strerror(errno));
+      ok = false;
+    }
+  if (!ok)
+    {
+      unlink(tmpname);
+      goto done;
+    }
+  _snapshot_sync_dir(o->snapshot_file);
+  L_DEBUG("snapshot save - %d nodes (%d bytes) to %s",
+          c, (int)len, o->snapshot_file);
+  o->snapshot_hash = o->network_hash;
+ done:
+  free(buf);
+  return ok;
+}
+
+/* Preload one node from the snapshot. Returns true if it was added. */
+static bool _snapshot_load_node(dncp o, struct tlv_attr *a, uint64_t downtime)
+{
+  int nilen = DNCP_NI_LEN(o), hlen = DNCP_HASH_LEN(o);
+  int ns_len = nilen + sizeof(dncp_t_node_state_s) + hlen;
+  hnetd_time_t now = dncp_time(o);
+  dncp_t_node_state ns;
+  dncp_hash_s nd_hash;
+  struct tlv_buf tb;
+  uint32_t update_number;
+  void *ni, *h, *nd;
+  int nd_len;
+  dncp_node n;
+
+  if (tlv_id(a) != DNCP_T_NODE_STATE || (int)tlv_len(a) < ns_len)
+    {
+      L_INFO("snapshot load - invalid TLV %s", TLV_REPR(a));
+      return false;
+    }
+  ni = tlv_data(a);
+  ns = ni + nilen;
+  h = ni + nilen + sizeof(*ns);
+  nd = ni + ns_len;
+  nd_len = tlv_len(a) - ns_len;
+  update_number = be32_to_cpu(ns->update_number);
+  if (!memcmp(ni, o->own_node->node_id, nilen))
+    {
+      /* Continue where we left off, instead of colliding with our
+       * own stale data that is still out there. */
+      if (dncp_update_number_gt(o->own_node->update_number, update_number))
+        {
+          o->own_node->update_number = update_number;
+          o->republish_tlvs = true;
+          dncp_schedule(o);
+        }
+      return false;
+    }
+  if (dncp_find_node_by_node_id(o, ni, false))
+    return false;
+  o->ext->cb.hash(nd, nd_len, &nd_hash);
+  if (memcmp(&nd_hash, h, hlen))
+    {
+      L_INFO("snapshot load - broken hash for %s", DNCP_NI_REPR(o, ni));
+      return false;
+    }
+  if (!(n = dncp_find_node_by_node_id(o, ni, true)))
+    return false;
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0); /* not passed anywhere */
+  if (!tlv_put_raw(&tb, nd, nd_len))
+    {
+      tlv_buf_free(&tb);
+      vlist_delete(&o->nodes, &n->in_nodes);
+      return false;
+    }
+  dncp_node_set(n, update_number,
+                now - be32_to_cpu(ns->ms_since_origination)
+                - (hnetd_time_t)downtime,
+                tb.head);
+  memcpy(dncp_node_hash(n), h, hlen);
+  n->node_data_hash_dirty = false;
+
+  /* Pretend the node was reachable just now; that way it is kept
+   * (unreachable) for the grace interval, waiting for the network to
+   * confirm it. */
+  n->last_reachable_prune = now - 1;
+  if (n->last_reachable_prune == o->last_prune)
+    n->last_reachable_prune--;
+  return true;
+}
+
+static int _snapshot_load(dncp o)
+{
+  const dncp_snapshot_header_s *h;
+  uint64_t saved_at, wall = _wall_ms(), downtime = 0;
+  struct tlv_attr *a;
+  struct stat st;
+  void *buf;
+  int fd, c = 0;
+
+  fd = open(o->snapshot_file, O_RDONLY);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        return 0;
+      L_ERR("snapshot load - failed to open %s: %s",
+            o->snapshot_file, strerror(errno));
+      return -1;
+    }
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h))
+    {
+      L_INFO("snapshot load - %s too short", o->snapshot_file);
+      close(fd);
+      return 0;
+    }
+  buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    {
+      L_ERR("snapshot load - mmap failed: %s", strerror(errno));
+      return -1;
+    }
+  h = buf;
+  if (h->version != SNAPSHOT_VERSION
+      || h->node_id_length != DNCP_NI_LEN(o)
+      || h->hash_length != DNCP_HASH_LEN(o))
+    {
+      L_INFO("snapshot load - incompatible snapshot, ignoring");
+      goto done;
+    }
+  saved_at = be64_to_cpu(h->saved_at);
+  if (wall > saved_at)
+    downtime = wall - saved_at;
+  tlv_for_each_in_buf(a, buf + sizeof(*h), st.st_size - sizeof(*h))
+    if (_snapshot_load_node(o, a, downtime))
+      c++;
+  L_INFO("snapshot load - %d nodes from %s", c, o->snapshot_file);
+ done:
+  munmap(buf, st.st_size);
+  return c;
+}
+
+int dncp_set_snapshot_file(dncp o, const char *filename)
+{
+  free(o->snapshot_file);
+  o->snapshot_file = NULL;
+  if (!filename)
+    return 0;
+  if (!(o->snapshot_file = strdup(filename)))
+    return -1;
+  /* Give the network a chance to converge before the first save */
+  o->next_snapshot = dncp_time(o) + DNCP_SNAPSHOT_INTERVAL;
+  memset(&o->snapshot_hash, 0, sizeof(o->snapshot_hash));
+  return _snapshot_load(o);
+}
@@ -119,7 +119,7 @@ static void _prune_rec(dncp_node n)
   L_DEBUG("_prune_rec %s / %p", DNCP_NODE_REPR(n), n);
 
   /* Refresh the entry - we clearly did reach it. */
-  vlist_add(&n->dncp->nodes, &n->in_nodes, n);
+  vlist_add(&n->dncp->nodes, &n->in_nodes, n->node_id);
   _node_set_reachable(n, true);
 
   /* Look at it's neighbors. */
@@ -162,7 +162,7 @@ static void dncp_prune(dncp o)
         continue;
       next_time = TMIN(next_time,
                        n->last_reachable_prune + grace_interval + 1);
-      vlist_add(&o->nodes, &n->in_nodes, n);
+      vlist_add(&o->nodes, &n->in_nodes, n->node_id);
       _node_set_reachable(n, false);
     }
   o->next_prune = next_time;
@@ -267,6 +267,7 @@ void dncp_ext_timeout(dncp o)
 {
   hnetd_time_t next = 0;
   hnetd_time_t now = o->ext->cb.get_time(o->ext);
+  hnetd_time_t holddown_end;
   dncp_ep ep;
   dncp_tlv t, t2;
 
@@ -281,8 +282,8 @@ void dncp_ext_timeout(dncp o)
   /* Handle the own TLV roll-over first. */
   if (!o->tlvs_dirty && !o->republish_tlvs)
     {
-      hnetd_time_t next_time =
-        o->own_node->origination_time + (1LL << 32) - (1LL << 16);
+      hnetd_time_t next_time = dncp_node_get_origination_time(o->own_node)
+        + (1LL << 32) - (1LL << 16);
       if (next_time <= now)
         o->republish_tlvs = true;
       else
@@ -290,8 +291,22 @@ void dncp_ext_timeout(dncp o)
     }
 
   /* Refresh locally originated data; by doing this, we can avoid
-   * replicating code. */
-  dncp_self_flush(o->own_node);
+   * replicating code. Changes soon after the previous update wait for
+   * the hold-down, so that a burst of them results in one update. */
+  holddown_end = dncp_republish_holddown_end(o);
+  if (holddown_end > now)
+    {
+      L_DEBUG("local tlv changes held down");
+      if (!o->republish_held)
+        o->num_republish_deferred++;
+      o->republish_held = true;
+      SET_NEXT(holddown_end, "republish hold-down");
+    }
+  else
+    {
+      o->republish_held = false;
+      dncp_self_flush(o->own_node);
+    }
 
   if (!o->disable_prune)
     {
@@ -309,6 +324,9 @@ void dncp_ext_timeout(dncp o)
       SET_NEXT(o->next_prune, "next_prune");
     }
 
+  /* Retry node data requests that have not been answered. */
+  SET_NEXT(dncp_fetch_timeout(o), "fetch");
+
   /* Release the flag to allow more change-triggered zero timeouts to
    * be scheduled. (We don't want to do this before we're done with
    * our mutations of state that can be addressed by the ordering of
@@ -318,6 +336,18 @@ void dncp_ext_timeout(dncp o)
   /* Recalculate network hash if necessary. */
   dncp_calculate_network_hash(o);
 
+  /* Write the warm restart snapshot, if the network state changed. */
+  if (o->snapshot_file)
+    {
+      if (o->next_snapshot <= now)
+        {
+          if (memcmp(&o->snapshot_hash, &o->network_hash, DNCP_HASH_LEN(o)))
+            dncp_save_snapshot(o);
+          o->next_snapshot = now + DNCP_SNAPSHOT_INTERVAL;
+        }
+      SET_NEXT(o->next_snapshot, "snapshot");
+    }
+
   dncp_for_each_enabled_ep(o, ep)
     {
       /* Update the 'active' link's published keepalive interval, if need be */
@@ -346,7 +376,7 @@ void dncp_ext_timeout(dncp o)
   /* Look at neighbors we should be worried about.. */
   /* vlist_for_each_element(&l->neighbors, n, in_neighbors) */
   dncp_t_peer ne;
-  dncp_for_each_tlv_safe(o, t, t2)
+  dncp_for_each_tlv_with_type_safe(o, t, t2, DNCP_T_PEER)
     if ((ne = dncp_tlv_peer(o, &t->tlv)))
       {
         dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
@@ -397,8 +427,10 @@ void dncp_ext_timeout(dncp o)
       L_DEBUG("next scheduled in %d", (int)delta);
     }
 
-  /* Clear the cached time, it's most likely no longer valid. */
+  /* Clear the cached time, it's most likely no longer valid; so is
+   * the network state payload built with it. */
   o->now = 0;
+  dncp_ns_cache_drop(o);
 }
 
 void dncp_trickle_reset(dncp o)
@@ -409,25 +441,18 @@ void dncp_trickle_reset(dncp o)
    * per-link mode here; resetting the variables does nothing harmful
    * anyway. */
 
-  /* Per-link */
   dncp_for_each_ep(o, ep)
     {
       dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-      trickle_set_i(&l->trickle, l, ep->trickle_imin);
-    }
+      dncp_peer n;
 
-  /* Per-peer */
-  dncp_t_peer ne;
-  dncp_tlv t;
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+      /* Per-link */
+      trickle_set_i(&l->trickle, l, ep->trickle_imin);
 
+      /* Per-peer */
+      list_for_each_entry(n, &l->peers, in_ep_peers)
         trickle_set_i(&n->trickle, l, ep->trickle_imin);
-      }
+    }
 }
 
 void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
@@ -448,13 +473,10 @@ void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
   else
     {
       dncp o = l->dncp;
-      dncp_tlv t, t2;
-      dncp_t_peer ne;
+      dncp_peer n, n2;
 
-      dncp_for_each_tlv_safe(o, t, t2)
-        if ((ne = dncp_tlv_peer(o, &t->tlv)))
-          if (ne->ep_id == l->ep_id)
-            dncp_remove_tlv(o, t);
+      list_for_each_entry_safe(n, n2, &l->peers, in_ep_peers)
+        dncp_remove_tlv(o, n->tlv);
 
       /* kill TLV, if any */
       ep_i_set_keepalive_interval(l, DNCP_KEEPALIVE_INTERVAL(o));
@@ -25,6 +25,14 @@
  * and behind the scenes it also handles offline caching of the trust
  * (in a flat file).
  *
+ * The file is an append-only log of checksummed records; a later
+ * record for the same hash supersedes the earlier ones, and a neutral
+ * record is a tombstone. Changes are appended (and fsync'd) as they
+ * are saved, and once the log has grown enough compared to the live
+ * content, it is compacted by writing a new file and renaming it over
+ * the old one. A torn record at the end (e.g. due to power loss) is
+ * ignored on load, and dropped at the next compaction.
+ *
  * Trust itself is of 3 different degrees:
  *
  * - neutral (unknown)
@@ -40,10 +48,6 @@
  * presence of both negative and positive verdict of same degree,
  * negative wins.
  *
- * TBD: think if using temporary files actually is worth here (and in
- * pa_store) or not. This write is not atomic, nor does it handle
- * errors gracefully..
- *
  * TBD: hnetd.c argument to enable this + some command-line way to
  * manipulate configured trust
  *
@@ -52,12 +56,23 @@
  *
  * TBD: make sure 'neutral' remotely received state is purged
  * eventually.
+ *
+ * Effective verdicts are expensive to compute (every trust verdict TLV
+ * of every node has to be looked at), so the most recently looked up
+ * ones are cached. Any change to the local verdicts or to remote trust
+ * verdict TLVs flushes the cache.
  */
 
 #include "dncp_trust.h"
 #include "dncp_i.h"
 
 #include <libubox/md5.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <openssl/sha.h>
 #include <openssl/ssl.h>
 
@@ -67,10 +82,29 @@
 /* maximum # of neutral verdicts */
 #define NEUTRAL_MAXIMUM 10
 
-/* version schema; if content of dncp_trust_stored_s
- * (=dncp_t_trust_verdict_s + cname) changes, change this.
+/* version schema; if content of dncp_trust_record_s
+ * (=dncp_t_trust_verdict_s + cname + check) changes, change this.
+ * Version 1 files (no checksums, rewritten in place) are still read.
  */
-#define SAVE_VERSION 1
+#define SAVE_VERSION 2
+#define SAVE_VERSION_LEGACY 1
+
+/* the log is compacted when it has more than this many records, and
+ * more than COMPACT_RATIO times the live ones */
+#define COMPACT_MINIMUM 64
+#define COMPACT_RATIO 2
+
+/* how many effective verdicts we cache */
+#define VERDICT_CACHE_SIZE 32
+
+typedef struct {
+  struct avl_node in_cache;
+  struct list_head in_lru;
+
+  dncp_sha256_s hash;
+  int verdict;
+  char cname[DNCP_T_TRUST_VERDICT_CNAME_LEN];
+} dncp_trust_cached_s, *dncp_trust_cached;
 
 struct dncp_trust_struct {
   dncp dncp;
@@ -78,10 +112,29 @@ struct dncp_trust_struct {
   /* Store filename */
   char *filename;
 
-  /* Hash of the content already persisted. We guarantee not to
-   * rewrite unless something _does_ change. This is just plain md5
-   * hash.*/
-  dncp_hash_s file_hash;
+  /* Hash of the content already persisted, and of the current
+   * content. We guarantee not to rewrite unless something _does_
+   * change. The hash is XOR of md5 of the (non-neutral) records, so
+   * it can be updated record by record. */
+  unsigned char file_hash[16];
+  unsigned char content_hash[16];
+
+  /* Number of records in the file (including superseded ones) */
+  int file_records;
+
+  /* Set if the file has to be rewritten instead of appended to */
+  bool file_compact;
+
+  /* Nodes changed since the last save */
+  struct list_head dirty;
+
+  /* Hashes of removed nodes that still have a record in the file */
+  dncp_sha256_s *tombstones;
+  int num_tombstones;
+
+  /* Nodes loaded from the file live in one preallocated array */
+  struct dncp_trust_node_struct *loaded;
+  int num_loaded;
 
   /* Verdict store (both cached and configured ones) */
   struct vlist_tree tree;
@@ -98,10 +151,23 @@ struct dncp_trust_struct {
   /* Until what point in time default verdict is configured-positive. */
   hnetd_time_t trust_until;
 
+  /* Effective verdict cache; most recently used first in lru */
+  struct avl_tree cache;
+  struct list_head cache_lru;
+  int cache_used;
+  dncp_trust_cached_s cache_entries[VERDICT_CACHE_SIZE];
+
+  /* Verdict lookup statistics */
+  uint32_t lookups;
+  uint32_t cache_hits;
+  uint64_t lookup_ns_total;
+  uint64_t lookup_ns_max;
+
   /* RPC methods */
   struct platform_rpc_method rpc_trust_list;
   struct platform_rpc_method rpc_trust_set;
   struct platform_rpc_method rpc_trust_set_timer;
+  struct platform_rpc_method rpc_trust_stats;
 };
 
 typedef struct __packed {
@@ -110,10 +176,27 @@ typedef struct __packed {
 } dncp_trust_stored_s, *dncp_trust_stored;
 
 typedef struct __packed {
+  uint8_t version;
+  uint8_t reserved[3];
+} dncp_trust_header_s;
+
+typedef struct __packed {
+  dncp_trust_stored_s stored;
+
+  /* First bytes of md5 of the stored part */
+  uint32_t check;
+} dncp_trust_record_s, *dncp_trust_record;
+
+typedef struct dncp_trust_node_struct {
   struct vlist_node in_tree;
 
   dncp_trust_stored_s stored;
 
+  /* In dncp_trust.dirty if changed since last save */
+  struct list_head in_dirty;
+
+  /* Does the file have a (non-neutral) record of this node */
+  bool persisted;
 } dncp_trust_node_s, *dncp_trust_node;
 
 typedef struct {
@@ -123,108 +206,369 @@ typedef struct {
 
 static void _trust_publish_maybe(dncp_trust t, dncp_trust_node n);
 
-static void _trust_calculate_hash(dncp_trust t, dncp_hash rh)
+/* Add or remove (it is the same operation) the record to content hash */
+static void _trust_hash_toggle(dncp_trust t, dncp_trust_node tn)
 {
   md5_ctx_t ctx;
-  dncp_trust_node tn;
+  unsigned char buf[16];
+  int i;
 
+  if (tn->stored.tlv.verdict == DNCP_VERDICT_NEUTRAL)
+    return;
   md5_begin(&ctx);
-  vlist_for_each_element(&t->tree, tn, in_tree)
+  md5_hash(&tn->stored, sizeof(tn->stored), &ctx);
+  md5_end(buf, &ctx);
+  for (i = 0 ; i < 16 ; i++)
+    t->content_hash[i] ^= buf[i];
+}
+
+static void _trust_cache_flush(dncp_trust t)
+{
+  if (!t->cache_used)
+    return;
+  avl_init(&t->cache, t->cache.comp, false, NULL);
+  INIT_LIST_HEAD(&t->cache_lru);
+  t->cache_used = 0;
+}
+
+static dncp_trust_node _trust_node_find(dncp_trust t,
+                                        dncp_sha256 hash);
+
+static uint32_t _trust_record_check(const dncp_trust_stored_s *stored)
+{
+  md5_ctx_t ctx;
+  unsigned char buf[16];
+  uint32_t check;
+
+  md5_begin(&ctx);
+  md5_hash(stored, sizeof(*stored), &ctx);
+  md5_end(buf, &ctx);
+  memcpy(&check, buf, sizeof(check));
+  return check;
+}
+
+static void _trust_node_free(dncp_trust t, dncp_trust_node tn)
+{
+  if (tn >= t->loaded && tn < t->loaded + t->num_loaded)
+    return;
+  free(tn);
+}
+
+static void _trust_dirty(dncp_trust t, dncp_trust_node tn)
+{
+  if (list_empty(&tn->in_dirty))
+    list_add_tail(&tn->in_dirty, &t->dirty);
+}
+
+static void _trust_dirty_clear(dncp_trust t)
+{
+  dncp_trust_node tn, tn2;
+
+  list_for_each_entry_safe(tn, tn2, &t->dirty, in_dirty)
+    list_del_init(&tn->in_dirty);
+  free(t->tombstones);
+  t->tombstones = NULL;
+  t->num_tombstones = 0;
+}
+
+static void _trust_tombstone(dncp_trust t, dncp_trust_node tn)
+{
+  dncp_sha256_s *nt = realloc(t->tombstones,
+                              sizeof(*nt) * (t->num_tombstones + 1));
+
+  if (!nt)
     {
-      if (tn->stored.tlv.verdict == DNCP_VERDICT_NEUTRAL)
-        continue;
-      md5_hash(&tn->stored, sizeof(tn->stored), &ctx);
+      /* We cannot record the removal; rewrite the file instead */
+      t->file_compact = true;
+      return;
     }
-  char buf[16];
-  memset(rh, 0, sizeof(*rh));
-  md5_end(buf, &ctx);
-  memcpy(rh, buf, sizeof(*rh) < 16 ? sizeof(*rh) : 16);
+  t->tombstones = nt;
+  t->tombstones[t->num_tombstones++] = tn->stored.tlv.sha256_hash;
+}
+
+/* Apply one record read from the file */
+static bool _trust_load_record(dncp_trust t, const dncp_trust_stored_s *stored)
+{
+  dncp_trust_node tn = _trust_node_find(t, (dncp_sha256)&stored->tlv.sha256_hash);
+
+  if (stored->tlv.verdict == DNCP_VERDICT_NEUTRAL)
+    {
+      if (tn)
+        vlist_delete(&t->tree, &tn->in_tree);
+      return true;
+    }
+  if (tn)
+    {
+      _trust_hash_toggle(t, tn);
+      tn->stored = *stored;
+      _trust_hash_toggle(t, tn);
+      return true;
+    }
+  if (t->num_loaded == t->file_records)
+    return false;
+  tn = &t->loaded[t->num_loaded++];
+  tn->stored = *stored;
+  INIT_LIST_HEAD(&tn->in_dirty);
+  vlist_add(&t->tree, &tn->in_tree, tn);
+  return true;
 }
 
 static void _trust_load(dncp_trust t)
 {
   if (!t->filename)
     return;
-  FILE *f = fopen(t->filename, "rb");
-  if (!f)
+  /* Until we know better, the file is rewritten on first save */
+  t->file_compact = true;
+  int fd = open(t->filename, O_RDONLY);
+  if (fd < 0)
     {
       L_ERR("trust load failed to open %s", t->filename);
       return;
     }
-  char buf[sizeof(dncp_trust_stored_s)];
-  int r;
-
-  r = fread(buf, 1, 1, f);
-  if (r != 1)
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < 1)
     {
       L_ERR("trust load - immediate eof");
-      goto done;
+      close(fd);
+      return;
+    }
+  const unsigned char *buf = mmap(NULL, st.st_size, PROT_READ,
+                                  MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    {
+      L_ERR("trust load - mmap failed: %s", strerror(errno));
+      return;
+    }
+  size_t ofs, stride;
+  bool legacy = buf[0] == SAVE_VERSION_LEGACY;
+  if (legacy)
+    {
+      ofs = 1;
+      stride = sizeof(dncp_trust_stored_s);
+    }
+  else if (buf[0] == SAVE_VERSION
+           && (size_t)st.st_size >= sizeof(dncp_trust_header_s))
+    {
+      ofs = sizeof(dncp_trust_header_s);
+      stride = sizeof(dncp_trust_record_s);
     }
-  if (buf[0] != SAVE_VERSION)
+  else
     {
       L_INFO("wrong version # -> skipping");
       goto done;
     }
-  while ((r = fread(buf, 1, sizeof(buf), f)))
+  int n = (st.st_size - ofs) / stride;
+  if (n && !(t->loaded = calloc(n, sizeof(*t->loaded))))
     {
-      if (r != sizeof(buf))
-        {
-          L_ERR("trust load - partial read of record");
-          break;
-        }
-      dncp_trust_node tn = calloc(1, sizeof(*tn));
-      if (!tn)
+      L_ERR("trust load - eom");
+      goto done;
+    }
+  t->file_records = n;
+  int i;
+  for (i = 0 ; i < n ; i++, ofs += stride)
+    {
+      dncp_trust_record_s r;
+
+      /* The records are not aligned; copy them out first */
+      memcpy(&r, buf + ofs, stride);
+      if (!legacy && r.check != _trust_record_check(&r.stored))
         {
-          L_ERR("trust load - eom");
+          L_ERR("trust load - invalid record #%d, ignoring rest", i);
           break;
         }
-      memcpy(&tn->stored, buf, sizeof(buf));
-      vlist_add(&t->tree, &tn->in_tree, tn);
+      r.stored.cname[sizeof(r.stored.cname)-1] = 0;
+      if (!_trust_load_record(t, &r.stored))
+        break;
+    }
+  /* Anything unexpected (old format, torn or corrupt tail) means the
+   * file cannot be appended to as-is. */
+  t->file_compact = legacy || ofs != (size_t)st.st_size;
+  dncp_trust_node tn;
+  vlist_for_each_element(&t->tree, tn, in_tree)
+    {
+      tn->persisted = true;
       _trust_publish_maybe(t, tn);
     }
  done:
-  fclose(f);
+  munmap((void *)buf, st.st_size);
 }
 
-static void _trust_save(dncp_trust t)
+static void _trust_record_fill(dncp_trust_record r, dncp_trust_node tn)
 {
-  if (!t->filename)
+  r->stored = tn->stored;
+  r->check = _trust_record_check(&r->stored);
+}
+
+static bool _trust_write(int fd, const void *buf, size_t len)
+{
+  ssize_t r = write(fd, buf, len);
+
+  if (r < 0 || (size_t)r != len)
     {
-      L_DEBUG("trust save skipped, no filename");
-      return;
+      L_ERR("trust save - error writing: %s",
+            r < 0 ? strerror(errno) : "short write");
+      return false;
     }
-  dncp_hash_s oh = t->file_hash;
-  _trust_calculate_hash(t, &t->file_hash);
-  if (memcmp(&oh, &t->file_hash, sizeof(oh)) == 0)
+  if (fsync(fd) < 0)
     {
-      L_DEBUG("trust save skipped, hash identical");
-      return;
+      L_ERR("trust save - fsync failed: %s", strerror(errno));
+      return false;
     }
-  FILE *f = fopen(t->filename, "wb");
-  if (!f)
+  return true;
+}
+
+/* Make a rename within the directory of filename durable */
+static void _trust_sync_dir(const char *filename)
+{
+  char path[strlen(filename) + 1];
+  int fd;
+
+  strcpy(path, filename);
+  fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) < 0)
+    L_ERR("trust save - directory fsync failed: %s", strerror(errno));
+  if (fd >= 0)
+    close(fd);
+}
+
+/* Rewrite the whole file via a temporary file + rename */
+static bool _trust_compact(dncp_trust t, int live)
+{
+  char tmpname[strlen(t->filename) + 5];
+  dncp_trust_header_s hdr = { .version = SAVE_VERSION };
+  size_t len = sizeof(hdr) + live * sizeof(dncp_trust_record_s);
+  unsigned char *buf = malloc(len);
+  dncp_trust_record r;
+  dncp_trust_node tn;
+  bool ok = false;
+  int fd;
+
+  if (!buf)
     {
-      L_ERR("trust save - error opening %s", t->filename);
-      return;
+      L_ERR("trust save - eom");
+      return false;
     }
-  dncp_trust_node tn;
-  char version = SAVE_VERSION;
-  if (fwrite(&version, 1, 1, f) != 1)
+  memcpy(buf, &hdr, sizeof(hdr));
+  r = (dncp_trust_record)(buf + sizeof(hdr));
+  vlist_for_each_element(&t->tree, tn, in_tree)
+    if (tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL)
+      _trust_record_fill(r++, tn);
+  sprintf(tmpname, "%s.tmp", t->filename);
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
     {
-      L_ERR("trust save - error writing version");
+      L_ERR("trust save - error opening %s: %s", tmpname, strerror(errno));
       goto done;
     }
+  ok = _trust_write(fd, buf, len);
+  close(fd);
+  if (ok && rename(tmpname, t->filename) < 0)
+    {
+      L_ERR("trust save - rename to %s failed: %s",
+            t->filename, strerror(errno));
+      ok = false;
+    }
+  if (!ok)
+    {
+      unlink(tmpname);
+      goto done;
+    }
+  _trust_sync_dir(t->filename);
+  L_DEBUG("trust save - compacted %d records to %d", t->file_records, live);
+  t->file_records = live;
+  t->file_compact = false;
   vlist_for_each_element(&t->tree, tn, in_tree)
+    tn->persisted = tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL;
+ done:
+  free(buf);
+  return ok;
+}
+
+/* Append tombstones and changed records to the end of the file */
+static bool _trust_append(dncp_trust t, int pending)
+{
+  dncp_trust_record_s *buf;
+  dncp_trust_record r;
+  dncp_trust_node tn;
+  bool ok = false;
+  int i, fd;
+
+  if (!pending)
+    return true;
+  if (!(r = buf = calloc(pending, sizeof(*buf))))
     {
-      if (tn->stored.tlv.verdict == DNCP_VERDICT_NEUTRAL)
-        continue;
-      if (fwrite(&tn->stored, 1, sizeof(tn->stored), f) != sizeof(tn->stored))
-        {
-          L_ERR("trust save - error writing block");
-          goto done;
-        }
+      L_ERR("trust save - eom");
+      return false;
+    }
+  for (i = 0 ; i < t->num_tombstones ; i++, r++)
+    {
+      r->stored.tlv.sha256_hash = t->tombstones[i];
+      r->check = _trust_record_check(&r->stored);
     }
+  list_for_each_entry(tn, &t->dirty, in_dirty)
+    if (tn->persisted || tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL)
+      _trust_record_fill(r++, tn);
+  fd = open(t->filename, O_WRONLY | O_APPEND);
+  if (fd < 0)
+    {
+      L_ERR("trust save - error opening %s: %s", t->filename, strerror(errno));
+      goto done;
+    }
+  ok = _trust_write(fd, buf, pending * sizeof(*buf));
+  close(fd);
+  if (!ok)
+    goto done;
+  L_DEBUG("trust save - appended %d records", pending);
+  t->file_records += pending;
+  list_for_each_entry(tn, &t->dirty, in_dirty)
+    tn->persisted = tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL;
  done:
-  fclose(f);
+  free(buf);
+  return ok;
+}
+
+static void _trust_save(dncp_trust t)
+{
+  dncp_trust_node tn;
+  int live = 0, pending;
+  bool ok;
+
+  if (!t->filename)
+    {
+      L_DEBUG("trust save skipped, no filename");
+      return;
+    }
+  if (!t->file_compact
+      && memcmp(t->content_hash, t->file_hash, sizeof(t->file_hash)) == 0)
+    {
+      L_DEBUG("trust save skipped, hash identical");
+      list_for_each_entry(tn, &t->dirty, in_dirty)
+        tn->persisted = tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL;
+      _trust_dirty_clear(t);
+      return;
+    }
+  vlist_for_each_element(&t->tree, tn, in_tree)
+    if (tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL)
+      live++;
+  pending = t->num_tombstones;
+  list_for_each_entry(tn, &t->dirty, in_dirty)
+    if (tn->persisted || tn->stored.tlv.verdict != DNCP_VERDICT_NEUTRAL)
+      pending++;
+  if (t->file_compact
+      || (t->file_records + pending > COMPACT_MINIMUM
+          && t->file_records + pending > COMPACT_RATIO * live))
+    ok = _trust_compact(t, live);
+  else
+    ok = _trust_append(t, pending);
+  if (!ok)
+    {
+      /* Whatever made it to the file, start from scratch next time */
+      t->file_compact = true;
+      return;
+    }
+  memcpy(t->file_hash, t->content_hash, sizeof(t->file_hash));
+  _trust_dirty_clear(t);
 }
 
 static void _trust_write_cb(struct uloop_timeout *to)
@@ -257,6 +601,7 @@ static int _trust_get_remote_verdict(dncp_trust t, dncp_sha256 h,
 
   if (cname)
     *cname = 0;
+  /* Not the network TLV index; that covers only validated node data. */
   dncp_for_each_node(o, node)
     if (node != o->own_node)
       dncp_node_for_each_tlv_with_t_v(node, a, DNCP_T_TRUST_VERDICT, false)
@@ -287,16 +632,71 @@ static dncp_trust_node _trust_node_find(dncp_trust t,
   return vlist_find(&t->tree, cn, cn, in_tree);
 }
 
+static int
+_compare_sha256(const void *a, const void *b, void *ptr __unused)
+{
+  return memcmp(a, b, sizeof(dncp_sha256_s));
+}
+
+static dncp_trust_cached _trust_cache_add(dncp_trust t, const dncp_sha256 h)
+{
+  dncp_trust_cached c;
+
+  if (t->cache_used < VERDICT_CACHE_SIZE)
+    c = &t->cache_entries[t->cache_used++];
+  else
+    {
+      c = list_last_entry(&t->cache_lru, dncp_trust_cached_s, in_lru);
+      avl_delete(&t->cache, &c->in_cache);
+      list_del(&c->in_lru);
+    }
+  c->hash = *h;
+  c->in_cache.key = &c->hash;
+  avl_insert(&t->cache, &c->in_cache);
+  list_add(&c->in_lru, &t->cache_lru);
+  return c;
+}
+
+static uint64_t _trust_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int dncp_trust_get_verdict(dncp_trust t, const dncp_sha256 h, char *cname)
 {
-  dncp_trust_node tn = _trust_node_find(t, h);
-  int verdict2 = tn ? tn->stored.tlv.verdict : DNCP_VERDICT_NONE;
-  int verdict = _trust_get_remote_verdict(t, h, NULL, cname);
-  if (verdict > verdict2)
-    return verdict;
-  if (tn && cname)
-    strcpy(cname, tn->stored.tlv.cname);
-  return verdict2;
+  uint64_t start = _trust_ns(), took;
+  dncp_trust_cached c;
+
+  t->lookups++;
+  if ((c = avl_find_element(&t->cache, h, c, in_cache)))
+    {
+      t->cache_hits++;
+      list_move(&c->in_lru, &t->cache_lru);
+    }
+  else
+    {
+      dncp_trust_node tn = _trust_node_find(t, h);
+      int verdict2 = tn ? tn->stored.tlv.verdict : DNCP_VERDICT_NONE;
+
+      c = _trust_cache_add(t, h);
+      c->verdict = _trust_get_remote_verdict(t, h, NULL, c->cname);
+      if (c->verdict <= verdict2)
+        {
+          c->verdict = verdict2;
+          if (tn)
+            strcpy(c->cname, tn->stored.cname);
+        }
+    }
+  if (cname)
+    strcpy(cname, c->cname);
+  took = _trust_ns() - start;
+  t->lookup_ns_total += took;
+  if (took > t->lookup_ns_max)
+    t->lookup_ns_max = took;
+  return c->verdict;
 }
 
 static dncp_tlv _find_local_tlv(dncp d, dncp_sha256 hash)
@@ -304,7 +704,7 @@ static dncp_tlv _find_local_tlv(dncp d, dncp_sha256 hash)
   dncp_tlv tlv;
   dncp_t_trust_verdict tv;
 
-  dncp_for_each_tlv(d, tlv)
+  dncp_for_each_tlv_with_type(d, tlv, DNCP_T_TRUST_VERDICT)
     if ((tv = dncp_tlv_trust_verdict(&tlv->tlv)))
       {
         if (memcmp(hash, &tv->sha256_hash, sizeof(*hash)) == 0)
@@ -360,14 +760,22 @@ static void _update_trust_node(struct vlist_tree *tr,
 
   if (t_old == t_new)
     return;
+  _trust_cache_flush(t);
+  if (t_new && !t_old)
+    _trust_hash_toggle(t, t_new);
   if (t_old)
     {
+      _trust_hash_toggle(t, t_old);
+      if (!list_empty(&t_old->in_dirty))
+        list_del(&t_old->in_dirty);
+      if (t->filename && t_old->persisted)
+        _trust_tombstone(t, t_old);
       int len = sizeof(t_old->stored.tlv) + strlen(t_old->stored.cname) + 1;
       dncp_remove_tlv_matching(t->dncp,
                                DNCP_T_TRUST_VERDICT, &t_old->stored, len);
       if (t_old->stored.tlv.verdict == DNCP_VERDICT_NEUTRAL)
         t->num_neutral--;
-      free(t_old);
+      _trust_node_free(t, t_old);
     }
 }
 
@@ -388,6 +796,7 @@ static bool _trust_set(dncp_trust t, const dncp_sha256 h,
         return false;
       if (tn->stored.tlv.verdict == DNCP_VERDICT_NEUTRAL)
         t->num_neutral--;
+      _trust_hash_toggle(t, tn);
     }
   else
     {
@@ -398,6 +807,7 @@ static bool _trust_set(dncp_trust t, const dncp_sha256 h,
           return false;
         }
       tn->stored.tlv.sha256_hash = *h;
+      INIT_LIST_HEAD(&tn->in_dirty);
       vlist_add(&t->tree, &tn->in_tree, tn);
     }
   tn->stored.tlv.verdict = verdict;
@@ -405,6 +815,9 @@ static bool _trust_set(dncp_trust t, const dncp_sha256 h,
     t->num_neutral++;
   if (*cname)
     strcpy(tn->stored.cname, cname);
+  _trust_hash_toggle(t, tn);
+  _trust_dirty(t, tn);
+  _trust_cache_flush(t);
   uloop_timeout_set(&t->timeout, SAVE_INTERVAL);
   return true;
 }
@@ -422,6 +835,7 @@ static void _tlv_cb(dncp_subscriber s,
   /* Local changes are not interesting */
   if (n == t->dncp->own_node)
     return;
+  _trust_cache_flush(t);
   dncp_trust_node tn = _trust_node_find(t, &tv->sha256_hash);
   int local_verdict = DNCP_VERDICT_NEUTRAL;
   if (tv->verdict == DNCP_VERDICT_CONFIGURED_POSITIVE)
@@ -576,6 +990,19 @@ int _rpc_list(struct platform_rpc_method *m, __unused const struct blob_attr *in
   return 1;
 }
 
+int _rpc_stats(struct platform_rpc_method *m, __unused const struct blob_attr *in, struct blob_buf *b)
+{
+  dncp_trust t = container_of(m, dncp_trust_s, rpc_trust_stats);
+
+  T_A(!blobmsg_add_u32(b, "lookups", t->lookups));
+  T_A(!blobmsg_add_u32(b, "cache-hits", t->cache_hits));
+  T_A(!blobmsg_add_u32(b, "cache-size", t->cache_used));
+  T_A(!blobmsg_add_u64(b, "latency-avg-ns",
+                       t->lookups ? t->lookup_ns_total / t->lookups : 0));
+  T_A(!blobmsg_add_u64(b, "latency-max-ns", t->lookup_ns_max));
+  return 1;
+}
+
 int _rpc_set_timer(struct platform_rpc_method *m, const struct blob_attr *in, __unused struct blob_buf *out)
 {
   dncp_trust t = container_of(m, dncp_trust_s, rpc_trust_set_timer);
@@ -629,12 +1056,15 @@ dncp_trust dncp_trust_create(dncp o, const char *filename)
   t->dncp = o;
   vlist_init(&t->tree, _compare_trust_node, _update_trust_node);
   t->tree.keep_old = true;
+  avl_init(&t->cache, _compare_sha256, false, NULL);
+  INIT_LIST_HEAD(&t->cache_lru);
+  INIT_LIST_HEAD(&t->dirty);
   t->timeout.cb = _trust_write_cb;
   t->subscriber.tlv_change_cb = _tlv_cb;
   if (filename)
     t->filename = strdup(filename);
   _trust_load(t);
-  _trust_calculate_hash(t, &t->file_hash);
+  memcpy(t->file_hash, t->content_hash, sizeof(t->file_hash));
   dncp_subscribe(o, &t->subscriber);
 
   t->rpc_trust_set_timer.cb = _rpc_set_timer;
@@ -643,10 +1073,13 @@ dncp_trust dncp_trust_create(dncp o, const char *filename)
   t->rpc_trust_list.name = "trust-list";
   t->rpc_trust_set.cb = _rpc_set;
   t->rpc_trust_set.name = "trust-set";
+  t->rpc_trust_stats.cb = _rpc_stats;
+  t->rpc_trust_stats.name = "trust-stats";
 
   platform_rpc_register(&t->rpc_trust_set_timer);
   platform_rpc_register(&t->rpc_trust_list);
   platform_rpc_register(&t->rpc_trust_set);
+  platform_rpc_register(&t->rpc_trust_stats);
   return t;
 }
 
@@ -660,10 +1093,13 @@ void dncp_trust_destroy(dncp_trust t)
       if (t->timeout.pending)
         _trust_save(t);
       free(t->filename);
+      t->filename = NULL;
     }
   dncp_unsubscribe(o, &t->subscriber);
   vlist_flush_all(&t->tree);
   uloop_timeout_cancel(&t->timeout);
+  _trust_dirty_clear(t);
+  free(t->loaded);
   free(t);
 }
 
@@ -730,6 +1166,7 @@ static int _trust_help(const char *prog)
   fprintf(stderr, "usage:\n");
   fprintf(stderr, "\t%s\n", prog);
   fprintf(stderr, "\t\tlist\n");
+  fprintf(stderr, "\t\tstats\n");
   fprintf(stderr, "\t\tset <hash> <value>\n");
   fprintf(stderr, "\t\tset-trust-timer <value-in-seconds>\n");
   return 1;
@@ -742,6 +1179,8 @@ static int _trust_multicall(__unused struct platform_rpc_method *m, int argc, ch
   if (argc > 1) {
     if (strcmp(argv[1], "list") == 0) {
       return platform_rpc_cli("trust-list", NULL);
+    } else if (strcmp(argv[1], "stats") == 0) {
+      return platform_rpc_cli("trust-stats", NULL);
     } else if (strcmp(argv[1], "set") == 0) {
       if (argc != 4)
         return _trust_help(argv[0]);
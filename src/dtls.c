@@ -30,6 +30,12 @@
  * certificate code, on the other hand, may be painful to adapt to
  * non-OpenSSL.
  *
+ * - optionally, handshake steps (the expensive public key operations)
+ * are run in a pool of worker threads. A connection that has been
+ * handed to a worker is not touched by the event loop until the worker
+ * is done with it; input received meanwhile is queued, and certificate
+ * verdicts the worker needs are asked from the event loop.
+ *
  */
 
 
@@ -47,6 +53,13 @@
 /* In linux, fcntl.h includes something with __unused. Argh. So
  * include this before anything hnetd-specific.*/
 #include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
 
 #include "dtls.h"
 #if L_LEVEL >= LOG_DEBUG
@@ -82,6 +95,33 @@
  * ( does it matter? it seems one context is enough. ) */
 #define USE_ONE_CONTEXT
 
+/* Number of buckets in the connection hash table (power of two). */
+#define CONNECTION_HASH_SIZE 64
+
+/* How many distinct source addresses we keep input rate state for. When
+ * we run out, the least recently heard from one is recycled. */
+#define SOURCE_MAX 128
+
+/* Number of buckets in the source hash table (power of two). */
+#define SOURCE_HASH_SIZE 64
+
+/* How long (in seconds) established sessions may be resumed. */
+#define SESSION_LIFETIME (7 * 86400)
+
+/* How long (in milliseconds) we batch session cache changes before
+ * writing them to disk. */
+#define SESSION_SAVE_DELAY 2000
+
+/* Scheduling priority (nice) of handshake worker threads */
+#define WORKER_NICE 19
+
+/* Session cache file header; bump the version if the format changes. */
+#define SESSION_FILE_MAGIC "HNDTLSS3"
+
+/* Maximum size of the session ticket key material (name + HMAC + AES
+ * keys); 48 bytes before OpenSSL 1.1, 80 since. */
+#define TICKET_KEYS_MAX 80
+
 /* These lurk in queue, waiting for connection to finish (outbound). */
 typedef struct {
   struct list_head in_queued_buffers;
@@ -90,8 +130,12 @@ typedef struct {
 } *dtls_queued_buffer;
 
 typedef struct {
+  /* dtls->connections, most recently used first */
   struct list_head in_connections;
 
+  /* dtls->connection_hash bucket of (remote_addr, is_client) */
+  struct list_head in_hash;
+
   struct list_head queued_buffers;
 
   dtls d;
@@ -116,8 +160,60 @@ typedef struct {
   BIO *wbio;
 
   time_t last_use;
+
+  /* Handshake worker pool state; while job is JOB_BUSY, only the
+   * worker may touch ssl/rbio/wbio. */
+  enum {
+    JOB_NONE,
+    JOB_BUSY,
+    JOB_DONE
+  } job;
+  int job_rv;
+  int job_err;
+  struct list_head inbound;
+
+  /* Certificate verdict request from the worker to the event loop */
+  X509 *verify_cert;
+  bool verify_result;
 } dtls_connection_s, *dtls_connection;
 
+/* The connections are passed to the workers and back through pipes, so
+ * the event loop never has to wait for a lock a (lower priority) worker
+ * holds. The mutex is only for the rare certificate verdict requests. */
+typedef struct dtls_workers_struct {
+  int job_pipe[2];
+  int done_pipe[2];
+  struct uloop_fd ufd;
+
+  pthread_mutex_t lock;
+  pthread_cond_t verify_cond;
+  bool stopping;
+
+  dtls d;
+  int num_threads;
+  pthread_t threads[0];
+} *dtls_workers;
+
+/* Per-source input token bucket. Credit is kept in 1/1000 packet units
+ * so that refill can happen at millisecond granularity. */
+typedef struct {
+  struct list_head in_hash;
+  struct list_head in_lru;
+
+  struct in6_addr addr;
+  int64_t credit;
+  hnetd_time_t refilled;
+} dtls_source_s, *dtls_source;
+
+/* Client side session we last established with a remote; offered when
+ * connecting there again so that we get an abbreviated handshake. */
+typedef struct {
+  struct list_head in_sessions;
+
+  struct sockaddr_in6 remote_addr;
+  SSL_SESSION *session;
+} dtls_session_s, *dtls_session;
+
 typedef struct dtls_struct {
   /* Client provided - (optional) callback to call when something
    * readable available. */
@@ -137,6 +233,26 @@ typedef struct dtls_struct {
   udp46 u46_client;
 
   struct list_head connections;
+  struct list_head connection_hash[CONNECTION_HASH_SIZE];
+
+  dtls_source_s sources[SOURCE_MAX];
+  struct list_head source_hash[SOURCE_HASH_SIZE];
+  struct list_head source_lru;
+
+  /* Most recently established first */
+  struct list_head sessions;
+  int num_sessions;
+  char *session_file;
+  struct uloop_timeout session_save_timeout;
+  bool sessions_dirty;
+  unsigned char ticket_keys[TICKET_KEYS_MAX];
+  int ticket_keys_len;
+  time_t ticket_keys_created;
+  struct uloop_timeout ticket_keys_timeout;
+
+  dtls_stats_s stats;
+
+  dtls_workers workers;
 
 #ifdef DTLS_OPENSSL
   unsigned char cookie_secret[COOKIE_SECRET_LENGTH];
@@ -159,6 +275,7 @@ typedef struct dtls_struct {
 
 static dtls_limits_s _default_limits = {
   .input_pps = 100,
+  .input_pps_total = 1000,
   .connection_idle_limit_seconds = 1800,
   .num_non_data_connections = 10,
   .num_data_connections = 100,
@@ -168,6 +285,19 @@ static dtls_limits_s _default_limits = {
 
 static bool _ssl_initialized = false;
 
+/* FNV-1a; the inputs are bounded by the limits anyway, so this is only
+ * about spreading them evenly, not about resisting chosen collisions. */
+static uint32_t _hash_bytes(uint32_t h, const void *p, size_t len)
+{
+  const unsigned char *c = p;
+
+  while (len--)
+    h = (h ^ *c++) * 16777619;
+  return h;
+}
+
+#define HASH_INIT 2166136261u
+
 static bool _drain_errors()
 {
   if (!ERR_peek_error())
@@ -275,6 +405,254 @@ static int _cookie_verify_cb(SSL *ssl,
 
 #endif /* DTLS_OPENSSL */
 
+static void _session_free(dtls d, dtls_session s)
+{
+  list_del(&s->in_sessions);
+  SSL_SESSION_free(s->session);
+  d->num_sessions--;
+  free(s);
+}
+
+static dtls_session _session_find(dtls d, const struct sockaddr_in6 *addr)
+{
+  dtls_session s;
+
+  list_for_each_entry(s, &d->sessions, in_sessions)
+    if (memcmp(addr, &s->remote_addr, sizeof(*addr)) == 0)
+      return s;
+  return NULL;
+}
+
+static void _session_changed(dtls d)
+{
+  if (!d->session_file || d->sessions_dirty)
+    return;
+  d->sessions_dirty = true;
+  uloop_timeout_set(&d->session_save_timeout, SESSION_SAVE_DELAY);
+}
+
+/* Replace the ticket keys if they are as old as the sessions may be
+ * (or from the future), and schedule the next check. Tickets issued
+ * with the old keys do not decrypt anymore, so their peers fall back
+ * to a full handshake. */
+static bool _ticket_keys_rotate(dtls d)
+{
+  time_t now = time(NULL);
+  time_t age = now - d->ticket_keys_created;
+
+  if (age < 0 || age >= SESSION_LIFETIME)
+    {
+      if (RAND_bytes(d->ticket_keys, d->ticket_keys_len) != 1
+          || SSL_CTX_set_tlsext_ticket_keys(d->ssl_server_ctx,
+                                            d->ticket_keys,
+                                            d->ticket_keys_len) != 1)
+        {
+          _drain_errors();
+          L_ERR("unable to rotate session ticket keys");
+          return false;
+        }
+      L_DEBUG("rotated session ticket keys");
+      d->ticket_keys_created = now;
+      age = 0;
+      _session_changed(d);
+    }
+  uloop_timeout_set(&d->ticket_keys_timeout,
+                    (SESSION_LIFETIME - age) * 1000);
+  return true;
+}
+
+static void _ticket_keys_timeout_cb(struct uloop_timeout *t)
+{
+  dtls d = container_of(t, dtls_s, ticket_keys_timeout);
+
+  _ticket_keys_rotate(d);
+}
+
+/* Takes over the reference to session. */
+static void _session_store(dtls d, const struct sockaddr_in6 *addr,
+                           SSL_SESSION *session)
+{
+  dtls_session s = _session_find(d, addr);
+
+  if (!session)
+    return;
+  if (s)
+    {
+      if (s->session == session)
+        {
+          /* Resumed the one we had; nothing new to store. */
+          SSL_SESSION_free(session);
+          list_move(&s->in_sessions, &d->sessions);
+          return;
+        }
+      SSL_SESSION_free(s->session);
+      list_move(&s->in_sessions, &d->sessions);
+    }
+  else
+    {
+      if (!(s = calloc(1, sizeof(*s))))
+        {
+          SSL_SESSION_free(session);
+          return;
+        }
+      s->remote_addr = *addr;
+      list_add(&s->in_sessions, &d->sessions);
+      if (++d->num_sessions > DTLS_LIMIT(num_data_connections))
+        _session_free(d, list_last_entry(&d->sessions, dtls_session_s,
+                                         in_sessions));
+    }
+  s->session = session;
+  _session_changed(d);
+}
+
+static void _session_forget(dtls d, const struct sockaddr_in6 *addr)
+{
+  dtls_session s = _session_find(d, addr);
+
+  if (!s)
+    return;
+  L_DEBUG("forgetting session to %s", HEX_REPR(addr, sizeof(*addr)));
+  _session_free(d, s);
+  _session_changed(d);
+}
+
+static bool _sessions_save(dtls d)
+{
+  char tmp[PATH_MAX];
+  unsigned char buf[4096];
+  dtls_session s;
+  uint32_t keys_len32 = d->ticket_keys_len;
+  int64_t keys_created64 = d->ticket_keys_created;
+  FILE *f;
+  int fd;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", d->session_file) >= (int)sizeof(tmp))
+    return false;
+  /* Contains master secrets; keep it private. */
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+    {
+      L_ERR("unable to open %s: %s", tmp, strerror(errno));
+      return false;
+    }
+  if (!(f = fdopen(fd, "w")))
+    {
+      close(fd);
+      goto fail;
+    }
+  if (fwrite(SESSION_FILE_MAGIC, strlen(SESSION_FILE_MAGIC), 1, f) != 1
+      || fwrite(&keys_len32, sizeof(keys_len32), 1, f) != 1
+      || fwrite(d->ticket_keys, d->ticket_keys_len, 1, f) != 1
+      || fwrite(&keys_created64, sizeof(keys_created64), 1, f) != 1)
+    goto fail_close;
+  list_for_each_entry(s, &d->sessions, in_sessions)
+    {
+      int len = i2d_SSL_SESSION(s->session, NULL);
+      unsigned char *p = buf;
+      uint32_t len32;
+
+      if (len <= 0 || len > (int)sizeof(buf))
+        continue;
+      len32 = len;
+      i2d_SSL_SESSION(s->session, &p);
+      if (fwrite(&s->remote_addr, sizeof(s->remote_addr), 1, f) != 1
+          || fwrite(&len32, sizeof(len32), 1, f) != 1
+          || fwrite(buf, len, 1, f) != 1)
+        goto fail_close;
+    }
+  if (fclose(f))
+    goto fail;
+  if (rename(tmp, d->session_file) < 0)
+    goto fail;
+  L_DEBUG("saved %d sessions to %s", d->num_sessions, d->session_file);
+  return true;
+
+ fail_close:
+  fclose(f);
+ fail:
+  L_ERR("unable to save sessions to %s", d->session_file);
+  unlink(tmp);
+  return false;
+}
+
+static void _sessions_save_cb(struct uloop_timeout *t)
+{
+  dtls d = container_of(t, dtls_s, session_save_timeout);
+
+  d->sessions_dirty = false;
+  _sessions_save(d);
+}
+
+static bool _sessions_load(dtls d)
+{
+  unsigned char magic[sizeof(SESSION_FILE_MAGIC) - 1];
+  unsigned char keys[TICKET_KEYS_MAX];
+  uint32_t keys_len32;
+  int64_t keys_created64;
+  unsigned char buf[4096];
+  struct sockaddr_in6 addr;
+  uint32_t len32;
+  time_t now = time(NULL);
+  int loaded = 0;
+  FILE *f;
+
+  if (!(f = fopen(d->session_file, "r")))
+    {
+      if (errno != ENOENT)
+        L_ERR("unable to open %s: %s", d->session_file, strerror(errno));
+      return errno == ENOENT;
+    }
+  if (fread(magic, sizeof(magic), 1, f) != 1
+      || memcmp(magic, SESSION_FILE_MAGIC, sizeof(magic))
+      || fread(&keys_len32, sizeof(keys_len32), 1, f) != 1
+      || keys_len32 > sizeof(keys)
+      || fread(keys, keys_len32, 1, f) != 1
+      || fread(&keys_created64, sizeof(keys_created64), 1, f) != 1)
+    {
+      L_ERR("ignoring invalid session file %s", d->session_file);
+      fclose(f);
+      return false;
+    }
+  /* Different OpenSSL version; the tickets are useless anyway. */
+  if ((int)keys_len32 == d->ticket_keys_len)
+    {
+      memcpy(d->ticket_keys, keys, keys_len32);
+      d->ticket_keys_created = keys_created64;
+    }
+  /* Stored newest first, so append to keep the order. */
+  while (fread(&addr, sizeof(addr), 1, f) == 1
+         && fread(&len32, sizeof(len32), 1, f) == 1
+         && len32 <= sizeof(buf)
+         && fread(buf, len32, 1, f) == 1)
+    {
+      const unsigned char *p = buf;
+      SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, len32);
+      dtls_session s;
+
+      if (!session)
+        {
+          _drain_errors();
+          continue;
+        }
+      if ((SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session))
+          < now
+          || d->num_sessions >= DTLS_LIMIT(num_data_connections)
+          || _session_find(d, &addr)
+          || !(s = calloc(1, sizeof(*s))))
+        {
+          SSL_SESSION_free(session);
+          continue;
+        }
+      s->remote_addr = addr;
+      s->session = session;
+      list_add_tail(&s->in_sessions, &d->sessions);
+      d->num_sessions++;
+      loaded++;
+    }
+  fclose(f);
+  L_DEBUG("loaded %d sessions from %s", loaded, d->session_file);
+  return true;
+}
+
 static void _qb_free(dtls_queued_buffer qb)
 {
   list_del(&qb->in_queued_buffers);
@@ -295,7 +673,10 @@ static void _connection_free(dtls_connection dc)
     }
   list_for_each_entry_safe(qb, qb2, &dc->queued_buffers, in_queued_buffers)
     _qb_free(qb);
+  list_for_each_entry_safe(qb, qb2, &dc->inbound, in_queued_buffers)
+    _qb_free(qb);
   list_del(&dc->in_connections);
+  list_del(&dc->in_hash);
   SSL_free(dc->ssl);
   uloop_timeout_cancel(&dc->uto);
   free(dc);
@@ -303,6 +684,8 @@ static void _connection_free(dtls_connection dc)
 
 static bool _connection_poll_write(dtls_connection dc)
 {
+  if (dc->job != JOB_NONE)
+    return true;
   while (BIO_ctrl_pending(dc->wbio) > 0)
     {
       char buf[2048];
@@ -333,6 +716,9 @@ static bool _connection_shutdown(dtls_connection dc)
   else
     dc->d->num_non_data_connections--;
   dc->state = STATE_SHUTDOWN;
+  /* Worker has it; it is freed once the worker is done. */
+  if (dc->job != JOB_NONE)
+    return true;
   /* The SSL_shutdown needs to be called 2+ times; first time, it
    * does local bookkeeping, and second time confirms receipt of
    * ack from remote side (eventually). */
@@ -345,11 +731,16 @@ static bool _connection_shutdown(dtls_connection dc)
 
 static void _connection_drop(dtls d, bool is_data)
 {
-  dtls_connection dc, dc2, lru = NULL;
+  struct list_head *p, *p2;
+  dtls_connection dc, lru = NULL;
   int dropped = 0;
 
-  list_for_each_entry_safe(dc, dc2, &d->connections, in_connections)
+  /* The connection list is in most recently used first order, so the
+   * idle ones are all at the tail, and the first (non-idle) one of
+   * the desired class we encounter from there on is the LRU one. */
+  list_for_each_prev_safe(p, p2, &d->connections)
     {
+      dc = list_entry(p, dtls_connection_s, in_connections);
       if (dc->state == STATE_SHUTDOWN)
         continue;
       if ((d->t - dc->last_use) >= DTLS_LIMIT(connection_idle_limit_seconds))
@@ -361,19 +752,65 @@ static void _connection_drop(dtls d, bool is_data)
         }
       if ((dc->state == STATE_DATA) == !is_data)
         continue;
-      if (lru && lru->last_use <= dc->last_use)
-        continue;
       lru = dc;
+      break;
     }
   if (dropped || !lru)
     return;
   _connection_shutdown(lru);
 }
 
+/* One handshake step; may be run in a worker thread. */
+static int _connection_handshake(dtls_connection dc, int *err)
+{
+  /* Note: state may be changed to shutdown meanwhile by the event loop,
+   * but is_client is constant. */
+  int rv = dc->is_client ? SSL_connect(dc->ssl) : SSL_accept(dc->ssl);
+
+  if (rv > 0)
+    {
+      *err = SSL_ERROR_NONE;
+      return rv;
+    }
+  *err = SSL_get_error(dc->ssl, rv);
+  _drain_errors();
+  return rv;
+}
+
+static bool _workers_submit(dtls_connection dc);
+static bool _call_unknown_cb(dtls d, dtls_cert cert);
+
+/* A resumed session skips certificate verification; check that the
+ * peer (still) passes it, so that trust verdicts that have changed
+ * since the session was established also apply to it. */
+static bool _connection_verify_resumed(dtls_connection dc)
+{
+  X509 *cert = SSL_get_peer_certificate(dc->ssl);
+  X509_STORE *store = SSL_CTX_get_cert_store(SSL_get_SSL_CTX(dc->ssl));
+  X509_STORE_CTX *ctx;
+  bool ok = false;
+
+  /* No certificate with PSK */
+  if (!cert)
+    return true;
+  if ((ctx = X509_STORE_CTX_new()))
+    {
+      if (X509_STORE_CTX_init(ctx, store, cert,
+                              SSL_get_peer_cert_chain(dc->ssl)))
+        ok = X509_verify_cert(ctx) == 1;
+      X509_STORE_CTX_free(ctx);
+    }
+  _drain_errors();
+  if (!ok && dc->d->unknown_cb)
+    ok = _call_unknown_cb(dc->d, cert);
+  X509_free(cert);
+  return ok;
+}
+
 static bool _connection_poll_read(dtls_connection dc)
 {
   unsigned char buf[1];
-  int rv;
+  int rv, err = SSL_ERROR_NONE;
   dtls_queued_buffer qb, qb2;
   dtls d = dc->d;
 
@@ -382,25 +819,52 @@ static bool _connection_poll_read(dtls_connection dc)
   switch (dc->state)
     {
     case STATE_ACCEPT:
-      if ((rv = SSL_accept(dc->ssl)) > 0)
+    case STATE_CONNECT:
+      if (dc->job == JOB_BUSY)
+        return true;
+      if (dc->job == JOB_DONE)
+        {
+          dc->job = JOB_NONE;
+          rv = dc->job_rv;
+          err = dc->job_err;
+          /* More input arrived while the worker was at it */
+          if (rv <= 0 && err == SSL_ERROR_WANT_READ
+              && BIO_ctrl_pending(dc->rbio) > 0)
+            goto redo;
+        }
+      else if (_workers_submit(dc))
+        return true;
+      else
+        rv = _connection_handshake(dc, &err);
+      if (rv > 0)
         {
-          L_DEBUG("connection %p accept->data", dc);
-        to_data:
+          L_DEBUG("connection %p %s->data", dc,
+                  dc->is_client ? "connect" : "accept");
+          if (SSL_session_reused(dc->ssl) && !_connection_verify_resumed(dc))
+            {
+              L_INFO("peer of resumed session %p no longer trusted", dc);
+              d->stats.rejected_resumptions++;
+              if (dc->is_client)
+                _session_forget(d, &dc->remote_addr);
+              else
+                SSL_CTX_remove_session(SSL_get_SSL_CTX(dc->ssl),
+                                       SSL_get_session(dc->ssl));
+              return _connection_shutdown(dc);
+            }
           if (dc->d->num_data_connections == DTLS_LIMIT(num_data_connections))
             _connection_drop(d, true);
+          if (SSL_session_reused(dc->ssl))
+            d->stats.resumed_handshakes++;
+          else
+            d->stats.full_handshakes++;
+          if (dc->is_client)
+            _session_store(d, &dc->remote_addr, SSL_get1_session(dc->ssl));
           dc->d->num_non_data_connections--;
           dc->d->num_data_connections++;
           dc->state = STATE_DATA;
           goto redo;
         }
       break;
-    case STATE_CONNECT:
-      if ((rv = SSL_connect(dc->ssl)) > 0)
-        {
-          L_DEBUG("connection %p connect->data", dc);
-          goto to_data;
-        }
-      break;
     case STATE_DATA:
       /* Initially try to flush writes. Then try to flush reads. */
       list_for_each_entry_safe(qb, qb2, &dc->queued_buffers, in_queued_buffers)
@@ -455,15 +919,19 @@ static bool _connection_poll_read(dtls_connection dc)
   /* Shared handling of errors for accept/listen */
   if (rv == 0)
     {
+      if (dc->state == STATE_CONNECT)
+        _session_forget(d, &dc->remote_addr);
       L_DEBUG(" got 0 => terminating connection");
       _connection_free(dc);
       return false;
     }
   /* Non-0, but probably timeout */
-  int err = SSL_get_error(dc->ssl, rv);
-  _drain_errors();
   if (err != SSL_ERROR_WANT_READ)
     {
+      /* The session we offered may be what the other side did not
+       * like; next attempt should do a full handshake. */
+      if (dc->state == STATE_CONNECT)
+        _session_forget(d, &dc->remote_addr);
       if (dc->state != STATE_SHUTDOWN)
         {
           L_DEBUG("shutting down connection due to error");
@@ -510,6 +978,9 @@ static void _connection_uto_cb(struct uloop_timeout *t)
   dtls_connection dc = container_of(t, dtls_connection_s, uto);
 
   L_DEBUG("_connection_uto_cb %p", dc);
+  /* Re-armed once the worker is done */
+  if (dc->job != JOB_NONE)
+    return;
 #ifdef DTLS_OPENSSL
   DTLSv1_handle_timeout(dc->ssl);
 #endif /* DTLS_OPENSSL */
@@ -518,23 +989,55 @@ static void _connection_uto_cb(struct uloop_timeout *t)
   _connection_poll(dc);
 }
 
+static struct list_head *
+_connection_bucket(dtls d, bool is_client, const struct sockaddr_in6 *addr)
+{
+  uint32_t h = HASH_INIT;
+
+  h = _hash_bytes(h, &addr->sin6_addr, sizeof(addr->sin6_addr));
+  h = _hash_bytes(h, &addr->sin6_port, sizeof(addr->sin6_port));
+  h = _hash_bytes(h, &is_client, sizeof(is_client));
+  return &d->connection_hash[h & (CONNECTION_HASH_SIZE - 1)];
+}
+
 static dtls_connection
-_connection_find(dtls d, int is_client, const struct sockaddr_in6 *dst)
+_connection_find_role(dtls d, bool is_client, const struct sockaddr_in6 *dst)
 {
+  struct list_head *h = _connection_bucket(d, is_client, dst);
   dtls_connection dc;
 
-  L_DEBUG("_connection_find dst:%s", HEX_REPR(dst, sizeof(*dst)));
-  list_for_each_entry(dc, &d->connections, in_connections)
-    if (dc->state != STATE_SHUTDOWN
-        && (is_client < 0 || (!is_client == !dc->is_client)))
-      if (memcmp(dst, &dc->remote_addr, sizeof(*dst)) == 0)
-        {
-          dc->last_use = d->t;
-          return dc;
-        }
+  list_for_each_entry(dc, h, in_hash)
+    if (dc->state != STATE_SHUTDOWN && !is_client == !dc->is_client
+        && memcmp(dst, &dc->remote_addr, sizeof(*dst)) == 0)
+      return dc;
   return NULL;
 }
 
+static dtls_connection
+_connection_find(dtls d, int is_client, const struct sockaddr_in6 *dst)
+{
+  dtls_connection dc, dc2;
+
+  L_DEBUG("_connection_find dst:%s", HEX_REPR(dst, sizeof(*dst)));
+  if (is_client >= 0)
+    dc = _connection_find_role(d, is_client, dst);
+  else
+    {
+      /* Either role will do; prefer the one that can carry data now. */
+      dc = _connection_find_role(d, true, dst);
+      if ((!dc || dc->state != STATE_DATA)
+          && (dc2 = _connection_find_role(d, false, dst))
+          && (!dc || dc2->state == STATE_DATA))
+        dc = dc2;
+    }
+  if (dc)
+    {
+      dc->last_use = d->t;
+      list_move(&dc->in_connections, &d->connections);
+    }
+  return dc;
+}
+
 static void _dtls_update_t(dtls d)
 {
   time_t t = time(NULL);
@@ -557,6 +1060,7 @@ _connection_create(dtls d, bool is_client,
   if (d->num_non_data_connections == DTLS_LIMIT(num_non_data_connections))
     _connection_drop(d, false);
   INIT_LIST_HEAD(&dc->queued_buffers);
+  INIT_LIST_HEAD(&dc->inbound);
   dc->d = d;
   _dtls_update_t(d);
   dc->last_use = d->t;
@@ -584,7 +1088,15 @@ _connection_create(dtls d, bool is_client,
   BIO_set_mem_eof_return(dc->wbio, -1);
 
   SSL_set_bio(ssl, dc->rbio, dc->wbio);
+  if (is_client)
+    {
+      dtls_session s = _session_find(d, remote_addr);
+
+      if (s && SSL_set_session(ssl, s->session) != 1)
+        _drain_errors();
+    }
   list_add(&dc->in_connections, &d->connections);
+  list_add(&dc->in_hash, _connection_bucket(d, is_client, remote_addr));
 
   dc->ssl = ssl;
   L_DEBUG("Created new %s connection %p to %s",
@@ -593,6 +1105,55 @@ _connection_create(dtls d, bool is_client,
   return dc;
 }
 
+static bool _dtls_admit(dtls d, const struct sockaddr_in6 *src)
+{
+  int64_t rate = DTLS_LIMIT(input_pps);
+  int64_t burst = rate * HNETD_TIME_PER_SECOND;
+  hnetd_time_t now = hnetd_time();
+  struct list_head *h;
+  dtls_source ds;
+
+  if (d->pps++ >= DTLS_LIMIT(input_pps_total))
+    {
+      L_DEBUG("dropping packet due to too big total pps (%d > %d)",
+              d->pps, DTLS_LIMIT(input_pps_total));
+      return false;
+    }
+  h = &d->source_hash[_hash_bytes(HASH_INIT, &src->sin6_addr,
+                                  sizeof(src->sin6_addr))
+                      & (SOURCE_HASH_SIZE - 1)];
+  list_for_each_entry(ds, h, in_hash)
+    if (memcmp(&ds->addr, &src->sin6_addr, sizeof(ds->addr)) == 0)
+      goto found;
+
+  /* Recycle the least recently heard from source; new ones start
+   * with a full bucket. */
+  ds = list_last_entry(&d->source_lru, dtls_source_s, in_lru);
+  list_del_init(&ds->in_hash);
+  list_add(&ds->in_hash, h);
+  ds->addr = src->sin6_addr;
+  ds->credit = burst;
+  ds->refilled = now;
+
+ found:
+  list_move(&ds->in_lru, &d->source_lru);
+  if (now > ds->refilled)
+    {
+      ds->credit += (now - ds->refilled) * rate;
+      if (ds->credit > burst)
+        ds->credit = burst;
+    }
+  ds->refilled = now;
+  if (ds->credit < HNETD_TIME_PER_SECOND)
+    {
+      L_DEBUG("dropping packet due to too big pps from %s (> %d)",
+              HEX_REPR(&src->sin6_addr, sizeof(src->sin6_addr)), (int)rate);
+      return false;
+    }
+  ds->credit -= HNETD_TIME_PER_SECOND;
+  return true;
+}
+
 static void _dtls_poll(dtls d, bool is_client)
 {
   struct sockaddr_in6 remote_addr, local_addr;
@@ -607,12 +1168,8 @@ static void _dtls_poll(dtls d, bool is_client)
     }
 
   _dtls_update_t(d);
-  if (d->pps++ >= DTLS_LIMIT(input_pps))
-    {
-      L_DEBUG("dropping packet due to too big pps (%d > %d)",
-              d->pps, DTLS_LIMIT(input_pps));
-      return;
-    }
+  if (!_dtls_admit(d, &remote_addr))
+    return;
 
   dtls_connection dc = _connection_find(d, is_client, &remote_addr);
   if (!dc)
@@ -635,6 +1192,19 @@ static void _dtls_poll(dtls d, bool is_client)
   dc->has_local_addr = true;
   dc->local_addr = local_addr;
 
+  /* Worker has the BIOs; feed the data in once it is done. */
+  if (dc->job != JOB_NONE)
+    {
+      dtls_queued_buffer qb = malloc(sizeof(*qb) + rv);
+
+      if (!qb)
+        return;
+      memcpy(qb->buf, buf, rv);
+      qb->len = rv;
+      list_add_tail(&qb->in_queued_buffers, &dc->inbound);
+      return;
+    }
+
   /* Feed in the data to the BIO */
   L_DEBUG("adding %d bytes to rbio", rv);
   BIO_write(dc->rbio, buf, rv);
@@ -661,6 +1231,246 @@ _dtls_client_cb(udp46 s __unused, void *context)
   _dtls_poll(d, true);
 }
 
+/* Connection the current (worker) thread is running a handshake step of */
+static __thread dtls_connection _worker_dc;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *_ssl_locks;
+
+static void _ssl_locking_cb(int mode, int n,
+                            const char *file __unused, int line __unused)
+{
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&_ssl_locks[n]);
+  else
+    pthread_mutex_unlock(&_ssl_locks[n]);
+}
+
+static unsigned long _ssl_id_cb(void)
+{
+  return (unsigned long)pthread_self();
+}
+
+static bool _ssl_init_threads(void)
+{
+  int i;
+
+  if (CRYPTO_get_locking_callback())
+    return true;
+  if (!(_ssl_locks = calloc(CRYPTO_num_locks(), sizeof(*_ssl_locks))))
+    return false;
+  for (i = 0 ; i < CRYPTO_num_locks() ; i++)
+    pthread_mutex_init(&_ssl_locks[i], NULL);
+  CRYPTO_set_id_callback(_ssl_id_cb);
+  CRYPTO_set_locking_callback(_ssl_locking_cb);
+  return true;
+}
+#else
+static bool _ssl_init_threads(void)
+{
+  return true;
+}
+#endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+
+/* Pointer sized writes are atomic (< PIPE_BUF), and there is at most
+ * one job or verdict request per connection in flight, so the pipes
+ * never fill up. */
+static bool _workers_post(int fd, dtls_connection dc)
+{
+  if (write(fd, &dc, sizeof(dc)) == sizeof(dc))
+    return true;
+  L_ERR("unable to pass connection to/from worker: %s", strerror(errno));
+  return false;
+}
+
+static void *_worker_main(void *arg)
+{
+  dtls_workers w = arg;
+  dtls_connection dc;
+
+#ifdef __linux__
+  /* Handshakes are background work; the event loop should win any
+   * contention for the CPU (matters on single core routers). */
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), WORKER_NICE) < 0)
+    L_DEBUG("unable to lower handshake worker priority");
+#endif /* __linux__ */
+
+  /* NULL = time to stop */
+  while (read(w->job_pipe[0], &dc, sizeof(dc)) == sizeof(dc) && dc)
+    {
+      _worker_dc = dc;
+      dc->job_rv = _connection_handshake(dc, &dc->job_err);
+      _worker_dc = NULL;
+      _workers_post(w->done_pipe[1], dc);
+    }
+  return NULL;
+}
+
+static bool _workers_submit(dtls_connection dc)
+{
+  dtls_workers w = dc->d->workers;
+
+  if (!w)
+    return false;
+  dc->job = JOB_BUSY;
+  if (_workers_post(w->job_pipe[1], dc))
+    return true;
+  dc->job = JOB_NONE;
+  return false;
+}
+
+static void _workers_verify(dtls_workers w, dtls_connection dc)
+{
+  dtls d = w->d;
+  bool result = d->unknown_cb
+    && d->unknown_cb(d, dc->verify_cert, d->unknown_cb_context);
+
+  pthread_mutex_lock(&w->lock);
+  dc->verify_result = result;
+  dc->verify_cert = NULL;
+  pthread_cond_broadcast(&w->verify_cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void _workers_done(dtls_connection dc)
+{
+  dtls_queued_buffer qb, qb2;
+
+  if (dc->state == STATE_SHUTDOWN)
+    {
+      /* Shut down while the handshake was in progress */
+      dc->job = JOB_NONE;
+      _connection_free(dc);
+      return;
+    }
+  list_for_each_entry_safe(qb, qb2, &dc->inbound, in_queued_buffers)
+    {
+      BIO_write(dc->rbio, qb->buf, qb->len);
+      _qb_free(qb);
+    }
+  dc->job = JOB_DONE;
+  _connection_poll(dc);
+}
+
+static void _workers_cb(struct uloop_fd *u, unsigned int events __unused)
+{
+  dtls_workers w = container_of(u, struct dtls_workers_struct, ufd);
+  dtls_connection dcs[64];
+  ssize_t r;
+  int i;
+
+  /* Connections that have a job pending are never freed (handling one
+   * connection may shut down others, but not free them), so the
+   * pointers stay valid until handled here. The worker is blocked
+   * while waiting for the verdict, so verify_cert is stable. */
+  while ((r = read(u->fd, dcs, sizeof(dcs))) > 0)
+    for (i = 0 ; i < r / (ssize_t)sizeof(dcs[0]) ; i++)
+      {
+        if (dcs[i]->verify_cert)
+          _workers_verify(w, dcs[i]);
+        else
+          _workers_done(dcs[i]);
+      }
+}
+
+/* Ask for a verdict on cert; worker threads forward the question to
+ * the event loop and wait for the answer. */
+static bool _call_unknown_cb(dtls d, dtls_cert cert)
+{
+  dtls_connection dc = _worker_dc;
+  dtls_workers w = d->workers;
+  bool result;
+
+  if (!dc)
+    return d->unknown_cb(d, cert, d->unknown_cb_context);
+  dc->verify_cert = cert;
+  if (!_workers_post(w->done_pipe[1], dc))
+    {
+      dc->verify_cert = NULL;
+      return false;
+    }
+  pthread_mutex_lock(&w->lock);
+  while (dc->verify_cert && !w->stopping)
+    pthread_cond_wait(&w->verify_cond, &w->lock);
+  result = !dc->verify_cert && dc->verify_result;
+  pthread_mutex_unlock(&w->lock);
+  return result;
+}
+
+static void _workers_destroy(dtls d)
+{
+  dtls_workers w = d->workers;
+  dtls_connection stop = NULL;
+  int i;
+
+  if (!w)
+    return;
+  pthread_mutex_lock(&w->lock);
+  w->stopping = true;
+  pthread_cond_broadcast(&w->verify_cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0 ; i < w->num_threads ; i++)
+    _workers_post(w->job_pipe[1], stop);
+  for (i = 0 ; i < w->num_threads ; i++)
+    pthread_join(w->threads[i], NULL);
+  if (w->ufd.registered)
+    uloop_fd_delete(&w->ufd);
+  for (i = 0 ; i < 2 ; i++)
+    {
+      close(w->job_pipe[i]);
+      close(w->done_pipe[i]);
+    }
+  pthread_cond_destroy(&w->verify_cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+  d->workers = NULL;
+}
+
+bool dtls_set_handshake_workers(dtls d, int num_workers)
+{
+  dtls_workers w;
+
+  if (d->started)
+    return false;
+  _workers_destroy(d);
+  if (num_workers <= 0)
+    return true;
+  if (!_ssl_init_threads())
+    return false;
+  if (!(w = calloc(1, sizeof(*w) + num_workers * sizeof(w->threads[0]))))
+    return false;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->verify_cond, NULL);
+  w->job_pipe[0] = w->job_pipe[1] = w->done_pipe[0] = w->done_pipe[1] = -1;
+  w->d = d;
+  d->workers = w;
+  /* Workers block on reading jobs; nobody blocks on writes or on
+   * reading the results. */
+  if (pipe2(w->job_pipe, O_CLOEXEC) < 0
+      || pipe2(w->done_pipe, O_CLOEXEC | O_NONBLOCK) < 0
+      || fcntl(w->job_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+    {
+      L_ERR("unable to create worker pipes: %s", strerror(errno));
+      goto fail;
+    }
+  w->ufd.fd = w->done_pipe[0];
+  w->ufd.cb = _workers_cb;
+  if (uloop_fd_add(&w->ufd, ULOOP_READ) < 0)
+    goto fail;
+  for (w->num_threads = 0 ; w->num_threads < num_workers ; w->num_threads++)
+    if (pthread_create(&w->threads[w->num_threads], NULL, _worker_main, w))
+      {
+        L_ERR("unable to create handshake worker");
+        goto fail;
+      }
+  L_DEBUG("started %d handshake workers", num_workers);
+  return true;
+
+ fail:
+  _workers_destroy(d);
+  return false;
+}
+
 void dtls_set_readable_cb(dtls d,
                           dtls_readable_cb cb, void *cb_context)
 {
@@ -680,6 +1490,7 @@ void dtls_set_unknown_cert_cb(dtls d,
 dtls dtls_create(uint16_t port)
 {
   dtls d = calloc(1, sizeof(*d));
+  int i;
 
   if (!_ssl_initialized)
     {
@@ -692,6 +1503,19 @@ dtls dtls_create(uint16_t port)
   if (!(d->u46_server = udp46_create(port)))
     goto fail;
   INIT_LIST_HEAD(&d->connections);
+  for (i = 0 ; i < CONNECTION_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->connection_hash[i]);
+  INIT_LIST_HEAD(&d->source_lru);
+  INIT_LIST_HEAD(&d->sessions);
+  d->session_save_timeout.cb = _sessions_save_cb;
+  d->ticket_keys_timeout.cb = _ticket_keys_timeout_cb;
+  for (i = 0 ; i < SOURCE_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->source_hash[i]);
+  for (i = 0 ; i < SOURCE_MAX ; i++)
+    {
+      INIT_LIST_HEAD(&d->sources[i].in_hash);
+      list_add(&d->sources[i].in_lru, &d->source_lru);
+    }
 
   if (!(d->u46_client = udp46_create(0)))
     goto fail;
@@ -713,6 +1537,11 @@ dtls dtls_create(uint16_t port)
   SSL_CTX_set_cookie_verify_cb(ctx, _cookie_verify_cb);
   RAND_bytes(d->cookie_secret, COOKIE_SECRET_LENGTH);
 #endif /* DTLS_OPENSSL */
+  /* Server side session cache; client side one is in d->sessions as
+   * OpenSSL does not look up client sessions by itself. */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"hnetd", 5);
+  SSL_CTX_set_timeout(ctx, SESSION_LIFETIME);
   d->ssl_server_ctx = ctx;
 
 #ifndef USE_ONE_CONTEXT
@@ -743,6 +1572,45 @@ void dtls_set_limits(dtls d, dtls_limits limits)
   d->limits = *limits;
 }
 
+bool dtls_set_session_file(dtls d, const char *filename)
+{
+  if (d->session_file)
+    free(d->session_file);
+  if (!(d->session_file = strdup(filename)))
+    return false;
+  /* Start with the (random) keys OpenSSL generated, unless we have
+   * stored ones. */
+  d->ticket_keys_len = SSL_CTX_get_tlsext_ticket_keys(d->ssl_server_ctx,
+                                                      NULL, 0);
+  if (d->ticket_keys_len <= 0 || d->ticket_keys_len > TICKET_KEYS_MAX
+      || SSL_CTX_get_tlsext_ticket_keys(d->ssl_server_ctx, d->ticket_keys,
+                                        d->ticket_keys_len) != 1)
+    {
+      _drain_errors();
+      return false;
+    }
+  d->ticket_keys_created = time(NULL);
+  if (!_sessions_load(d))
+    return false;
+  if (SSL_CTX_set_tlsext_ticket_keys(d->ssl_server_ctx, d->ticket_keys,
+                                     d->ticket_keys_len) != 1)
+    {
+      _drain_errors();
+      return false;
+    }
+  if (!_ticket_keys_rotate(d))
+    return false;
+  /* Make sure the ticket keys hit the disk even if we never establish
+   * a session of our own as a client. */
+  _session_changed(d);
+  return true;
+}
+
+void dtls_get_stats(dtls d, dtls_stats stats)
+{
+  *stats = d->stats;
+}
+
 
 void dtls_start(dtls d)
 {
@@ -756,6 +1624,7 @@ void dtls_destroy(dtls d)
 {
   dtls_connection dc, dc2;
 
+  _workers_destroy(d);
   if (d->psk)
     free(d->psk);
   SSL_CTX_free(d->ssl_server_ctx);
@@ -764,6 +1633,19 @@ void dtls_destroy(dtls d)
 #endif /* USE_ONE_CONTEXT */
   list_for_each_entry_safe(dc, dc2, &d->connections, in_connections)
     _connection_free(dc);
+  uloop_timeout_cancel(&d->ticket_keys_timeout);
+  if (d->session_file)
+    {
+      if (d->sessions_dirty)
+        {
+          uloop_timeout_cancel(&d->session_save_timeout);
+          _sessions_save(d);
+        }
+      free(d->session_file);
+    }
+  while (!list_empty(&d->sessions))
+    _session_free(d, list_first_entry(&d->sessions, dtls_session_s,
+                                      in_sessions));
   udp46_destroy(d->u46_server);
   udp46_destroy(d->u46_client);
   free(d);
@@ -781,6 +1663,8 @@ ssize_t dtls_recv(dtls d,
   d->readable = false;
   list_for_each_entry(dc, &d->connections, in_connections)
     {
+      if (dc->job != JOB_NONE)
+        continue;
       ssize_t rv = SSL_read(dc->ssl, buf, len);
       if (rv > 0)
         {
@@ -882,7 +1766,7 @@ static int _verify_cert_cb(int ok, X509_STORE_CTX *ctx)
 
   if (d->unknown_cb && cert)
     {
-      if (d->unknown_cb(d, cert, d->unknown_cb_context))
+      if (_call_unknown_cb(d, cert))
         return 1;
     }
 #if L_LEVEL >= LOG_ERR
@@ -62,11 +62,18 @@ typedef struct {
    */
 
   /*
-   * Set the acceptable packets per second to process. Anything more
-   * than this will be silently dropped.
+   * Set the acceptable packets per second to process from a single
+   * source address (token bucket, with burst of one second's worth).
+   * Anything more than this will be silently dropped.
    */
   int input_pps;
 
+  /*
+   * Set the acceptable packets per second to process in total, across
+   * all sources. Anything more than this will be silently dropped.
+   */
+  int input_pps_total;
+
   /*
    * How many seconds a connection can be idle before it is eliminated.
    */
@@ -86,6 +93,30 @@ typedef struct {
 
 void dtls_set_limits(dtls d, dtls_limits limits);
 
+/* Keep (client side) sessions and the session ticket keys in the given
+ * file, so that reconnects - also across restarts - can resume the
+ * earlier session instead of doing a full handshake. The peer
+ * certificate of a resumed session is verified again (including the
+ * unknown certificate callback), so a changed trust verdict also ends
+ * its sessions. The ticket keys are replaced once they are as old as
+ * the session lifetime. */
+bool dtls_set_session_file(dtls d, const char *filename);
+
+typedef struct {
+  /* Handshakes completed with full exchange vs. by resuming a session */
+  unsigned int full_handshakes;
+  unsigned int resumed_handshakes;
+  /* Resumed sessions whose peer is no longer trusted */
+  unsigned int rejected_resumptions;
+} dtls_stats_s, *dtls_stats;
+
+void dtls_get_stats(dtls d, dtls_stats stats);
+
+/* Run handshakes in a pool of num_workers threads instead of the event
+ * loop (0 = in the event loop, the default). Must be called before
+ * dtls_start. */
+bool dtls_set_handshake_workers(dtls d, int num_workers);
+
 
 /* Callback to call when dtls has new data. */
 void dtls_set_readable_cb(dtls d, dtls_readable_cb cb, void *cb_context);
@@ -11,65 +11,149 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <spawn.h>
 
 #include "hnetd.h"
 
+extern char **environ;
+
 /* One eweq task in the queue */
 struct exeq_task {
 	struct list_head le;
+	struct uloop_process process;
+	struct exeq *e;
+	const char *key;
+	hnetd_time_t queued;
+	hnetd_time_t started;
 	char *args[];
 	/* Additional data first contains the array of pointers
 	 * provided to execv: {arg1_p, arg2_p, arg3_p, NULL}
 	 * Then, it contains all the strings that are used in the
 	 * previous array: arg1:arg2:arg3
+	 * followed by the key, if any.
 	 */
 };
 
-static void exeq_start_maybe(struct exeq *e)
+static bool exeq_key_running(struct exeq *e, const char *key)
 {
-	if(e->process.pending || list_empty(&e->tasks))
-		return;
+	struct exeq_task *t;
+	list_for_each_entry(t, &e->running, le)
+		if(t->key && !strcmp(t->key, key))
+			return true;
+	return false;
+}
+
+static bool exeq_barrier_running(struct exeq *e)
+{
+	struct exeq_task *t;
+	list_for_each_entry(t, &e->running, le)
+		if(!t->key)
+			return true;
+	return false;
+}
 
-	struct exeq_task *t = list_first_entry(&e->tasks, struct exeq_task, le);
-	pid_t pid = fork();
-	if (pid == 0) {
-		execv(t->args[0], t->args);
-		L_ERR("execv error: %s\n", strerror(errno));
-		_exit(128);
+static void _process_handler(struct uloop_process *c, int ret);
+
+static void exeq_spawn(struct exeq *e, struct exeq_task *t)
+{
+	hnetd_time_t now = hnetd_time();
+	pid_t pid;
+	int err;
+
+	list_del(&t->le);
+	e->stats.queued--;
+
+	if((err = posix_spawn(&pid, t->args[0], NULL, NULL, t->args, environ))) {
+		L_ERR("posix_spawn error: %s", strerror(err));
+		e->stats.failed++;
+		free(t);
+		return;
 	}
+
 	L_DEBUG("exeq_run %s", t->args[0]);
 	for (int i = 1 ; t->args[i] ; i++)
 		L_DEBUG(" %s", t->args[i]);
 
-	e->process.pid = pid;
-	if(uloop_process_add(&e->process))
+	e->stats.executed++;
+	e->stats.wait_total += now - t->queued;
+	if(now - t->queued > e->stats.wait_max)
+		e->stats.wait_max = now - t->queued;
+
+	t->started = now;
+	t->process.pid = pid;
+	t->process.cb = _process_handler;
+	if(uloop_process_add(&t->process))
 		L_ERR("Could not add process %d to uloop", pid);
-	list_del(&t->le);
-	free(t);
+	list_add_tail(&t->le, &e->running);
+	e->stats.running++;
+}
+
+static void exeq_start_maybe(struct exeq *e)
+{
+	struct exeq_task *t, *ts;
+
+	/* A running barrier still runs alone */
+	if(exeq_barrier_running(e))
+		return;
+
+	list_for_each_entry_safe(t, ts, &e->tasks, le) {
+		if(!t->key) {
+			/* Barrier: only runs alone, and nothing passes it */
+			if(list_empty(&e->running) && &t->le == e->tasks.next)
+				exeq_spawn(e, t);
+			return;
+		}
+
+		if(e->stats.running >= e->max_running)
+			return;
+
+		if(!exeq_key_running(e, t->key))
+			exeq_spawn(e, t);
+	}
 }
 
 static  void _process_handler(struct uloop_process *c, int ret)
 {
-	struct exeq *e = container_of(c, struct exeq, process);
-	if(ret)
+	struct exeq_task *t = container_of(c, struct exeq_task, process);
+	struct exeq *e = t->e;
+	hnetd_time_t run = hnetd_time() - t->started;
+
+	if(ret) {
 		L_WARN("Child process %d exited with status %d", c->pid, ret);
-	else
-		L_DEBUG("Child process %d terminated normally.", c->pid, ret);
+		e->stats.failed++;
+	} else {
+		L_DEBUG("Child process %d terminated normally.", c->pid);
+	}
+
+	e->stats.run_total += run;
+	if(run > e->stats.run_max)
+		e->stats.run_max = run;
+
+	list_del(&t->le);
+	e->stats.running--;
+	free(t);
+
 	exeq_start_maybe(e);
+	L_DEBUG("exeq: %u queued, %u running, %lu executed, %lu coalesced, "
+			"wait avg %"PRItime"ms max %"PRItime"ms",
+			e->stats.queued, e->stats.running, e->stats.executed,
+			e->stats.coalesced,
+			e->stats.wait_total / (hnetd_time_t)e->stats.executed,
+			e->stats.wait_max);
 }
 
 /* Add a task to the queue.
  * The arguments are copied and can therefore be freed after the call. */
-int exeq_add(struct exeq *e, char **args)
+int exeq_add_keyed(struct exeq *e, const char *key, char **args)
 {
-	size_t datalen = 0;
-	struct exeq_task *task;
+	size_t datalen = key ? strlen(key) + 1 : 0;
+	struct exeq_task *task, *t;
 	size_t arg_cnt;
 	char *str;
 	for(arg_cnt = 0; args[arg_cnt] ; arg_cnt++)
 		datalen += strlen(args[arg_cnt]) + 1;
 
-	if(!(task = malloc(sizeof(*task) + (arg_cnt + 1) * sizeof(char *) + datalen))) {
+	if(!(task = calloc(1, sizeof(*task) + (arg_cnt + 1) * sizeof(char *) + datalen))) {
 		L_ERR("exeq_add: malloc failed");
 		return -1;
 	}
@@ -81,17 +165,56 @@ int exeq_add(struct exeq *e, char **args)
 		str += strlen(args[arg_cnt]) + 1;
 	}
 	task->args[arg_cnt] = NULL;
+	task->e = e;
+	task->queued = hnetd_time();
+
+	if(key) {
+		strcpy(str, key);
+		task->key = str;
+
+		/* Supersede a queued task with the same key, unless a barrier
+		 * was queued after it. The new task takes over its position. */
+		list_for_each_entry_reverse(t, &e->tasks, le) {
+			if(!t->key)
+				break;
+
+			if(!strcmp(t->key, key)) {
+				L_DEBUG("exeq_add: %s supersedes queued task", key);
+				task->queued = t->queued;
+				list_add(&task->le, &t->le);
+				list_del(&t->le);
+				free(t);
+				e->stats.coalesced++;
+				exeq_start_maybe(e);
+				return 0;
+			}
+		}
+	}
 
 	list_add_tail(&task->le, &e->tasks);
+	if(++e->stats.queued > e->stats.max_queued)
+		e->stats.max_queued = e->stats.queued;
+
 	exeq_start_maybe(e);
 	return 0;
 }
 
+int exeq_add(struct exeq *e, char **args)
+{
+	return exeq_add_keyed(e, NULL, args);
+}
+
+bool exeq_busy(struct exeq *e)
+{
+	return !list_empty(&e->running) || !list_empty(&e->tasks);
+}
+
 void exeq_init(struct exeq *e)
 {
-	memset(&e->process, 0, sizeof(*e));
-	e->process.cb = _process_handler;
+	memset(e, 0, sizeof(*e));
+	e->max_running = 1;
 	INIT_LIST_HEAD(&e->tasks);
+	INIT_LIST_HEAD(&e->running);
 }
 
 void exeq_term(struct exeq *e)
@@ -100,6 +223,13 @@ void exeq_term(struct exeq *e)
 	list_for_each_entry_safe(t, ts, &e->tasks, le)
 		free(t);
 
-	uloop_process_delete(&e->process);
-}
+	list_for_each_entry_safe(t, ts, &e->running, le) {
+		uloop_process_delete(&t->process);
+		free(t);
+	}
 
+	INIT_LIST_HEAD(&e->tasks);
+	INIT_LIST_HEAD(&e->running);
+	e->stats.queued = 0;
+	e->stats.running = 0;
+}
@@ -4,8 +4,12 @@
  * Copyright (c) 2014-2015 Cisco Systems, Inc.
  *
  * This file provides a process execution fifo.
- * It uses execv and will not execute the next task before
- * the previous one has finished.
+ * It spawns queued tasks with posix_spawn. Tasks may be given a key:
+ * tasks with the same key never run concurrently, and a queued task is
+ * replaced by a later one with the same key (latest wins). Tasks with
+ * different keys may run in parallel, up to max_running processes.
+ * Tasks without a key act as barriers: they run alone, after all previous
+ * tasks have finished.
  */
 
 #ifndef EXEQ_H_
@@ -14,10 +18,28 @@
 #include <libubox/uloop.h>
 #include <libubox/list.h>
 
+#include "hnetd_time.h"
+
+/* Queue metrics */
+struct exeq_stats {
+	unsigned int queued;      /* Current queue depth */
+	unsigned int running;     /* Currently running processes */
+	unsigned int max_queued;  /* Highest queue depth seen */
+	unsigned long executed;   /* Spawned processes */
+	unsigned long coalesced;  /* Tasks superseded before they ran */
+	unsigned long failed;     /* Spawn failures and non-zero exits */
+	hnetd_time_t wait_total;  /* Time spent queued by spawned tasks */
+	hnetd_time_t wait_max;
+	hnetd_time_t run_total;   /* Time spent running by finished tasks */
+	hnetd_time_t run_max;
+};
+
 /* A single execution queue structure */
 struct exeq {
-	struct uloop_process process;
 	struct list_head tasks;
+	struct list_head running;
+	unsigned int max_running; /* Defaults to 1 (strictly sequential) */
+	struct exeq_stats stats;
 };
 
 /* Initializes a queue structure */
@@ -28,8 +50,15 @@ void exeq_init(struct exeq *);
  * Returns 0 on success. -errorcode on error. */
 int exeq_add(struct exeq *, char **args);
 
+/* Add a task identified by key (see above). A NULL key is equivalent
+ * to exeq_add. */
+int exeq_add_keyed(struct exeq *, const char *key, char **args);
+
+/* Whether tasks are queued or running */
+bool exeq_busy(struct exeq *e);
+
 /* Cancels the execution queue.
- * (Does not interrupt the current process if currently running) */
+ * (Does not interrupt the running processes) */
 void exeq_term(struct exeq *e);
 
 #endif /* EXEQ_H_ */
@@ -13,8 +13,12 @@
 
 #include "hncp_i.h"
 #include "hncp_io.h"
+#include "hncp_hash.h"
 
-#include <libubox/md5.h>
+#if (defined(DNCP_FIXED_NI_LEN) && DNCP_FIXED_NI_LEN != HNCP_NI_LEN)     \
+  || (defined(DNCP_FIXED_HASH_LEN) && DNCP_FIXED_HASH_LEN != HNCP_HASH_LEN)
+#error "DNCP built for other node identifier or hash lengths than HNCP's"
+#endif
 
 /* TBD - make these separate callbacks into utility library? */
 
@@ -33,15 +37,73 @@ static bool hncp_handle_collision_randomly(dncp_ext ext)
 }
 
 
-static void hncp_hash_md5(const void *buf, size_t len, void *dest)
+/* Node data schema; TLV types are unique also across nesting levels,
+ * so the same schema is used for the nested TLVs. */
+static struct tlv_schema hncp_schema;
+
+static bool _validate_nested(struct tlv_attr *a, unsigned int flen)
+{
+  flen = ROUND_BYTES_TO_4BYTES(flen);
+  if (tlv_len(a) <= flen)
+    return true;
+  return tlv_validate(&hncp_schema, tlv_data(a) + flen, tlv_len(a) - flen,
+                      NULL, NULL) == 0;
+}
+
+static bool _validate_container(const struct tlv_attr_info *info __unused,
+                                struct tlv_attr *a)
+{
+  return _validate_nested(a, 0);
+}
+
+static bool _validate_dp(const struct tlv_attr_info *info __unused,
+                         struct tlv_attr *a)
+{
+  return hncp_tlv_dp(a)
+    && _validate_nested(a, sizeof(hncp_t_delegated_prefix_header_s)
+                        + ROUND_BITS_TO_BYTES(hncp_tlv_dp(a)->prefix_length_bits));
+}
+
+static bool _validate_ap(const struct tlv_attr_info *info __unused,
+                         struct tlv_attr *a)
+{
+  return hncp_tlv_ap(a)
+    && _validate_nested(a, sizeof(hncp_t_assigned_prefix_header_s)
+                        + ROUND_BITS_TO_BYTES(hncp_tlv_ap(a)->prefix_length_bits));
+}
+
+static bool _validate_node_name(const struct tlv_attr_info *info __unused,
+                                struct tlv_attr *a)
 {
-  md5_ctx_t ctx;
+  hncp_t_node_name nn = tlv_data(a);
 
-  md5_begin(&ctx);
-  md5_hash(buf, len, &ctx);
-  md5_end(dest, &ctx);
+  return tlv_len(a) >= sizeof(*nn) + nn->name_length;
 }
 
+static bool _validate_trust_verdict(const struct tlv_attr_info *info __unused,
+                                    struct tlv_attr *a)
+{
+  return dncp_tlv_trust_verdict(a) != NULL;
+}
+
+#define FIXED(t, len) { t, len, len, NULL }
+
+static const struct tlv_attr_info hncp_node_data_info[] = {
+  FIXED(DNCP_T_PEER, HNCP_NI_LEN + sizeof(dncp_t_peer_s)),
+  FIXED(DNCP_T_KEEPALIVE_INTERVAL, sizeof(dncp_t_keepalive_interval_s)),
+  { DNCP_T_TRUST_VERDICT, 0, 0, _validate_trust_verdict },
+  { HNCP_T_VERSION, sizeof(hncp_t_version_s), 0, NULL },
+  { HNCP_T_EXTERNAL_CONNECTION, 0, 0, _validate_container },
+  { HNCP_T_DELEGATED_PREFIX, 0, 0, _validate_dp },
+  { HNCP_T_ASSIGNED_PREFIX, 0, 0, _validate_ap },
+  FIXED(HNCP_T_NODE_ADDRESS, sizeof(hncp_t_node_address_s)),
+  { HNCP_T_DNS_DELEGATED_ZONE, sizeof(hncp_t_dns_delegated_zone_s), 0, NULL },
+  { HNCP_T_NODE_NAME, sizeof(hncp_t_node_name_s), 0, _validate_node_name },
+  { HNCP_T_PREFIX_POLICY, sizeof(hncp_t_prefix_policy_s), 0, NULL },
+  FIXED(HNCP_T_PIM_RPA_CANDIDATE, sizeof(hncp_t_pim_rpa_candidate_s)),
+  FIXED(HNCP_T_PIM_BORDER_PROXY, sizeof(hncp_t_pim_border_proxy_s)),
+  FIXED(HNCP_T_SSID, sizeof(hncp_t_wifi_ssid_s)),
+};
 
 static struct tlv_attr *
 hncp_validate_node_data(dncp_node n, struct tlv_attr *a)
@@ -110,6 +172,20 @@ hncp hncp_create(void)
   return o;
 }
 
+bool hncp_set_hash_backend(hncp o, const char *name)
+{
+  hncp_hash_backend b = hncp_hash_find_backend(name);
+
+  if (!b)
+    {
+      L_ERR("hncp_set_hash_backend: unknown backend %s", name);
+      return false;
+    }
+  o->ext.cb.hash = b->hash;
+  o->ext.cb.hash_multi = b->hash_multi;
+  return true;
+}
+
 struct in6_addr *hncp_get_ipv6_address(hncp h, const char *prefer_ifname)
 {
   dncp o = h->dncp;
@@ -178,17 +254,24 @@ bool hncp_init(hncp o)
       .keepalive_multiplier_percent = HNCP_KEEPALIVE_MULTIPLIER * 100,
       .grace_interval = HNCP_PRUNE_GRACE_PERIOD,
       .minimum_prune_interval = HNCP_MINIMUM_PRUNE_INTERVAL,
+      .republish_holddown = HNCP_REPUBLISH_HOLDDOWN,
       .ext_node_data_size = sizeof(hncp_node_s),
       .ext_ep_data_size = sizeof(hncp_ep_s)
     },
     .cb = {
       /* Rest of callbacks are populated in the hncp_io_init */
-      .hash = hncp_hash_md5,
+      .hash = hncp_hash_backends[0].hash,
+      .hash_multi = hncp_hash_backends[0].hash_multi,
       .validate_node_data = hncp_validate_node_data,
       .handle_collision = hncp_handle_collision_randomly
     }
   };
   memset(o, 0, sizeof(*o));
+  if (!hncp_schema.num_types
+      && !tlv_schema_init(&hncp_schema, hncp_node_data_info,
+                          ARRAY_SIZE(hncp_node_data_info)))
+    return false;
+  ext_s.conf.node_data_schema = &hncp_schema;
   o->ext = ext_s;
   o->udp_port = HNCP_PORT;
   if (!hncp_io_init(o))
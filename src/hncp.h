@@ -57,6 +57,11 @@
  * self. */
 #define HNCP_MINIMUM_PRUNE_INTERVAL (HNETD_TIME_PER_SECOND / 50)
 
+/* How long to coalesce local TLV changes after publishing new node
+ * data; each update is flooded to every neighbor, so bursts of changes
+ * (e.g. prefix assignment settling) should not each cause one. */
+#define HNCP_REPUBLISH_HOLDDOWN (HNETD_TIME_PER_SECOND / 50)
+
 
 /****************************************** Other implementation definitions */
 
@@ -68,6 +73,16 @@
  * enough. */
 #define HNCP_REJOIN_INTERVAL (1 * HNETD_TIME_PER_SECOND)
 
+/* Stream (TCP) transport: largest message we send or accept (at most
+ * what dncp_ext_readable can receive), socket buffer sizes to ask
+ * for, how much unsent data we tolerate before giving up on a
+ * connection, and how often we retry connecting to configured
+ * peers. */
+#define HNCP_STREAM_MAXIMUM_SIZE 65536
+#define HNCP_STREAM_SOCKET_BUFFER (1 << 20)
+#define HNCP_STREAM_MAXIMUM_BUFFERED (4 << 20)
+#define HNCP_STREAM_RECONNECT_INTERVAL (5 * HNETD_TIME_PER_SECOND)
+
 /*********************************************************************** API */
 
 typedef struct hncp_struct hncp_s, *hncp;
@@ -109,6 +124,14 @@ pid_t hncp_run(char *argv[]);
  */
 hncp hncp_create(void);
 
+/**
+ * Select the hash backend by name (see hncp_hash.h); all of them
+ * produce the same hashes, so it can be changed at any time.
+ *
+ * @return true on success, false if there is no such backend.
+ */
+bool hncp_set_hash_backend(hncp o, const char *name);
+
 
 /**
  * Destroy HNCP instances
@@ -19,9 +19,38 @@
 static char __hexhash[HNCP_HASH_LEN*2 + 1];
 #define hd_hash_to_hex(hash) hexlify(__hexhash, (hash)->buf, HNCP_HASH_LEN)
 #define hd_ni_to_hex(hash) hexlify(__hexhash, (hash)->buf, HNCP_NI_LEN)
+#define hd_node_to_hex(n) hexlify(__hexhash, (n)->node_id, HNCP_NI_LEN)
 
 static hnetd_time_t hd_now; //time hncp_dump is called
 
+/* Server-side dump filters */
+enum {
+	HD_FILTER_NODE_ID,
+	HD_FILTER_TLV_TYPE,
+	HD_FILTER_UPDATES,
+	HD_FILTER_MAX
+};
+
+static const struct blobmsg_policy hd_filter_policy[HD_FILTER_MAX] = {
+	[HD_FILTER_NODE_ID] = { .name = "node-id", .type = BLOBMSG_TYPE_ARRAY },
+	[HD_FILTER_TLV_TYPE] = { .name = "tlv-type", .type = BLOBMSG_TYPE_ARRAY },
+	[HD_FILTER_UPDATES] = { .name = "updates", .type = BLOBMSG_TYPE_TABLE },
+};
+
+struct hd_filter_node {
+	dncp_node_id_s id;
+	uint32_t update;
+};
+
+struct hd_filter {
+	struct hd_filter_node *nodes; //Sorted, only dump these nodes
+	size_t nodes_cnt;
+	struct hd_filter_node *updates; //Sorted, skip nodes not updated since
+	size_t updates_cnt;
+	uint16_t *types; //Only dump these TLV types
+	size_t types_cnt;
+};
+
 #define hd_do_in_nested(buf, type, name, action, err) do { \
 		void *__k; \
 		if(!(__k =  blobmsg_open_ ## type (buf, name)) || (action)) { \
@@ -240,7 +269,118 @@ inv:
 }
 
 
-static int hd_node(dncp o, dncp_node n, struct blob_buf *b)
+static size_t hd_count(struct blob_attr *attr)
+{
+	struct blob_attr *a;
+	unsigned rem;
+	size_t cnt = 0;
+	blobmsg_for_each_attr(a, attr, rem)
+		cnt++;
+	return cnt;
+}
+
+static int hd_filter_node_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(dncp_node_id_s));
+}
+
+static int hd_filter_parse_nodes(dncp o, struct blob_attr *attr,
+		struct hd_filter_node **nodes, size_t *cnt, bool updates)
+{
+	struct blob_attr *a;
+	unsigned rem;
+
+	hd_a(*nodes = calloc(hd_count(attr) + 1, sizeof(**nodes)), return -ENOMEM);
+
+	blobmsg_for_each_attr(a, attr, rem) {
+		struct hd_filter_node *fn = &(*nodes)[*cnt];
+		const char *hex = updates ? blobmsg_name(a) : blobmsg_data(a);
+		if((!updates && blobmsg_type(a) != BLOBMSG_TYPE_STRING) ||
+				(updates && blobmsg_type(a) != BLOBMSG_TYPE_INT32) ||
+				strlen(hex) != 2 * (size_t)DNCP_NI_LEN(o) ||
+				unhexlify(fn->id.buf, DNCP_NI_LEN(o), hex) != DNCP_NI_LEN(o))
+			return -EINVAL;
+
+		if(updates)
+			fn->update = blobmsg_get_u32(a);
+		(*cnt)++;
+	}
+
+	qsort(*nodes, *cnt, sizeof(**nodes), hd_filter_node_cmp);
+	return 0;
+}
+
+static void hd_filter_free(struct hd_filter *f)
+{
+	free(f->nodes);
+	free(f->updates);
+	free(f->types);
+	memset(f, 0, sizeof(*f));
+}
+
+static int hd_filter_parse(dncp o, struct hd_filter *f, const struct blob_attr *in)
+{
+	struct blob_attr *tb[HD_FILTER_MAX], *a;
+	unsigned rem;
+	int ret = 0;
+
+	memset(f, 0, sizeof(*f));
+	if(!in)
+		return 0;
+
+	blobmsg_parse(hd_filter_policy, HD_FILTER_MAX, tb, blob_data(in), blob_len(in));
+
+	if(tb[HD_FILTER_NODE_ID] &&
+			(ret = hd_filter_parse_nodes(o, tb[HD_FILTER_NODE_ID], &f->nodes, &f->nodes_cnt, false)))
+		goto err;
+
+	if(tb[HD_FILTER_UPDATES] &&
+			(ret = hd_filter_parse_nodes(o, tb[HD_FILTER_UPDATES], &f->updates, &f->updates_cnt, true)))
+		goto err;
+
+	if(tb[HD_FILTER_TLV_TYPE]) {
+		hd_a(f->types = calloc(hd_count(tb[HD_FILTER_TLV_TYPE]) + 1,
+				sizeof(*f->types)), ret = -ENOMEM; goto err);
+		blobmsg_for_each_attr(a, tb[HD_FILTER_TLV_TYPE], rem) {
+			hd_a(blobmsg_type(a) == BLOBMSG_TYPE_INT32, ret = -EINVAL; goto err);
+			f->types[f->types_cnt++] = blobmsg_get_u32(a);
+		}
+	}
+	return 0;
+
+err:
+	hd_filter_free(f);
+	return ret;
+}
+
+static bool hd_filter_node(struct hd_filter *f, dncp_node n)
+{
+	struct hd_filter_node *fn;
+	if(f->nodes_cnt && !bsearch(n->node_id, f->nodes, f->nodes_cnt,
+			sizeof(*f->nodes), hd_filter_node_cmp))
+		return false;
+
+	//Node data unchanged since the update number the client already has
+	if(f->updates_cnt && (fn = bsearch(n->node_id, f->updates, f->updates_cnt,
+			sizeof(*f->updates), hd_filter_node_cmp)) &&
+			(int32_t)(n->update_number - fn->update) <= 0)
+		return false;
+
+	return true;
+}
+
+static bool hd_filter_tlv(struct hd_filter *f, struct tlv_attr *tlv)
+{
+	if(!f->types_cnt)
+		return true;
+
+	for(size_t i = 0; i < f->types_cnt; i++)
+		if(f->types[i] == tlv_id(tlv))
+			return true;
+	return false;
+}
+
+static int hd_node(dncp o, dncp_node n, struct blob_buf *b, struct hd_filter *f)
 {
 	struct tlv_attr *tlv;
 	hncp_t_version v;
@@ -255,7 +395,7 @@ static int hd_node(dncp o, dncp_node n, struct blob_buf *b)
 	int ret = -1;
 
 	hd_a(!blobmsg_add_u32(b, "update", n->update_number), return -1);
-	hd_a(!blobmsg_add_u64(b, "age", hd_now - n->origination_time), return -1);
+	hd_a(!blobmsg_add_u64(b, "age", hd_now - dncp_node_get_origination_time(n)), return -1);
 	if(n == o->own_node)
 			hd_a(!blobmsg_add_u8(b, "self", 1), return -1);
 
@@ -268,6 +408,9 @@ static int hd_node(dncp o, dncp_node n, struct blob_buf *b)
 	hd_a(!blob_buf_init(&hncp_wifi, BLOBMSG_TYPE_ARRAY), goto aw);
 
 	dncp_node_for_each_tlv(n, tlv) {
+		if(!hd_filter_tlv(f, tlv))
+			continue;
+
 		switch (tlv_id(tlv)) {
 			case HNCP_T_ASSIGNED_PREFIX:
 				hd_do_in_table(&prefixes, NULL, hd_node_prefix(tlv, &prefixes), goto err);
@@ -343,11 +486,18 @@ px:
 	return ret;
 }
 
-static int hd_nodes(dncp o, struct blob_buf *b)
+static int hd_nodes(dncp o, struct blob_buf *b, struct hd_filter *f)
 {
 	dncp_node node;
 	dncp_for_each_node(o, node)
-		hd_do_in_table(b, hd_ni_to_hex(&node->node_id), hd_node(o, node,b), return -1);
+		if(hd_filter_node(f, node))
+			hd_do_in_table(b, hd_node_to_hex(node), hd_node(o, node, b, f), return -1);
+	return 0;
+}
+
+static int hd_nodes_one(dncp o, dncp_node node, struct blob_buf *b, struct hd_filter *f)
+{
+	hd_do_in_table(b, hd_node_to_hex(node), hd_node(o, node, b, f), return -1);
 	return 0;
 }
 
@@ -359,39 +509,233 @@ static int hd_links(dncp o, struct blob_buf *b)
 	return 0;
 }
 
+static int hd_memory(dncp o, struct blob_buf *b)
+{
+	dncp_memory_stats_s st;
+	size_t total;
+
+	dncp_get_memory_stats(o, &st);
+	total = st.node_pool + st.node_data + st.node_index;
+	hd_a(!blobmsg_add_u32(b, "nodes", st.num_nodes), return -1);
+	hd_a(!blobmsg_add_u32(b, "node-size", st.node_size), return -1);
+	hd_a(!blobmsg_add_u64(b, "node-pool", st.node_pool), return -1);
+	hd_a(!blobmsg_add_u64(b, "node-data", st.node_data), return -1);
+	hd_a(!blobmsg_add_u64(b, "node-index", st.node_index), return -1);
+	hd_a(!blobmsg_add_u32(b, "per-node", st.num_nodes ? total / st.num_nodes : 0), return -1);
+	return 0;
+}
+
+static int hd_republish(dncp o, struct blob_buf *b)
+{
+	dncp_republish_stats_s st;
+
+	dncp_get_republish_stats(o, &st);
+	hd_a(!blobmsg_add_u32(b, "tlv-changes", st.num_local_tlv_changes), return -1);
+	hd_a(!blobmsg_add_u32(b, "republished", st.num_republished), return -1);
+	hd_a(!blobmsg_add_u32(b, "deferred", st.num_deferred), return -1);
+	return 0;
+}
+
 static int hd_info(dncp o, struct blob_buf *b)
 {
 	hd_a(!blobmsg_add_u64(b, "time", hd_now), return -1);
-	hd_a(!blobmsg_add_string(b, "node-id", hd_ni_to_hex(&o->own_node->node_id)), return -1);
+	hd_a(!blobmsg_add_string(b, "node-id", hd_node_to_hex(o->own_node)), return -1);
+	hd_do_in_table(b, "memory", hd_memory(o, b), return -1);
+	hd_do_in_table(b, "republish", hd_republish(o, b), return -1);
 	return 0;
 }
 
 platform_rpc_cb hd_cb;
 platform_rpc_main hd_main;
+platform_rpc_stream_cb hd_stream;
+platform_rpc_stream_done hd_stream_done;
 
 static struct hd_rpc_method {
 	struct platform_rpc_method m;
 	dncp dncp;
 } hncp_rpc_dump = {
-	{.name = "dump", .cb = hd_cb, .main = hd_main},
+	{.name = "dump", .cb = hd_cb, .main = hd_main,
+			.stream = hd_stream, .stream_done = hd_stream_done},
 	NULL,
 };
 
-int hd_main(struct platform_rpc_method *method, __unused int argc, __unused char* const argv[])
+/* Client side: merges streamed messages back into a single dump */
+struct hd_reply {
+	struct blob_buf b;
+	struct blob_buf nodes;
+};
+
+static int hd_reply_cb(struct blob_attr *msg, void *priv)
 {
-	return platform_rpc_cli(method->name, NULL);
+	struct hd_reply *r = priv;
+	struct blob_attr *a, *n;
+	unsigned rem, rem2;
+
+	blob_for_each_attr(a, msg, rem) {
+		if(!strcmp(blobmsg_name(a), "nodes")) {
+			blobmsg_for_each_attr(n, a, rem2)
+				blobmsg_add_blob(&r->nodes, n);
+		} else {
+			blobmsg_add_blob(&r->b, a);
+		}
+	}
+	return 0;
 }
 
-int hd_cb(struct platform_rpc_method *method, __unused const struct blob_attr *in, struct blob_buf *b)
+static void hd_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n <node-id>]... [-t <tlv-type>]... [-u <node-id>=<update>]...\n"
+			"	-n: Only dump the given nodes\n"
+			"	-t: Only dump TLVs of the given types\n"
+			"	-u: Skip the node unless updated since the given update number\n",
+			prog);
+}
+
+int hd_main(struct platform_rpc_method *method, int argc, char* const argv[])
+{
+	struct blob_buf in = {NULL, NULL, 0, NULL};
+	struct hd_reply r = {{NULL, NULL, 0, NULL}, {NULL, NULL, 0, NULL}};
+	int c, ret = 4;
+	void *k;
+
+	blob_buf_init(&in, 0);
+	for(const char *opts = "ntu"; *opts; opts++) {
+		if(*opts == 'u')
+			k = blobmsg_open_table(&in, "updates");
+		else
+			k = blobmsg_open_array(&in, (*opts == 'n') ? "node-id" : "tlv-type");
+
+		optind = 1;
+		while((c = getopt(argc, argv, "n:t:u:")) != -1) {
+			char *sep;
+			if(c == '?') {
+				hd_usage(argv[0]);
+				blob_buf_free(&in);
+				return 1;
+			} else if(c != *opts) {
+				continue;
+			} else if(c == 'n') {
+				blobmsg_add_string(&in, NULL, optarg);
+			} else if(c == 't') {
+				blobmsg_add_u32(&in, NULL, atoi(optarg));
+			} else if((sep = strchr(optarg, '='))) {
+				char *id = strndup(optarg, sep - optarg);
+				if(id)
+					blobmsg_add_u32(&in, id, strtoul(sep + 1, NULL, 10));
+				free(id);
+			}
+		}
+
+		if(*opts == 'u')
+			blobmsg_close_table(&in, k);
+		else
+			blobmsg_close_array(&in, k);
+	}
+
+	blob_buf_init(&r.b, 0);
+	blob_buf_init(&r.nodes, BLOBMSG_TYPE_TABLE);
+	if(!platform_rpc_cli_stream(method->name, in.head, hd_reply_cb, &r, 3000) &&
+			!blobmsg_add_named_blob(&r.b, "nodes", r.nodes.head)) {
+		char *json = blobmsg_format_json_indent(r.b.head, true, true);
+		if(json) {
+			puts(json);
+			free(json);
+			ret = 0;
+		}
+	}
+
+	blob_buf_free(&in);
+	blob_buf_free(&r.b);
+	blob_buf_free(&r.nodes);
+	return ret;
+}
+
+int hd_cb(struct platform_rpc_method *method, const struct blob_attr *in, struct blob_buf *b)
 {
 	struct hd_rpc_method *m = container_of(method, struct hd_rpc_method, m);
+	struct hd_filter f;
+	int ret;
+
+	if((ret = hd_filter_parse(m->dncp, &f, in)))
+		return ret;
+
+	hd_now = hnetd_time();
+	ret = 1;
+	hd_a(!hd_info(m->dncp, b), ret = -1; goto out);
+	hd_do_in_table(b, "links", hd_links(m->dncp, b), ret = -1; goto out);
+	hd_do_in_table(b, "nodes", hd_nodes(m->dncp, b, &f), ret = -1; goto out);
+
+out:
+	hd_filter_free(&f);
+	return ret;
+}
+
+/* Streaming dump: the first message holds the info and links, then each
+ * matching node is sent as a message of its own. The cursor is a node
+ * identifier, so nodes appearing or vanishing between messages are safe. */
+struct hd_stream {
+	struct hd_filter f;
+	dncp_node_id_s cursor;
+	bool started;
+};
+
+static dncp_node hd_stream_next_node(dncp o, struct hd_stream *st)
+{
+	dncp_node n;
+
+	if(!st->started) {
+		st->started = true;
+		n = dncp_get_first_node(o);
+	} else if(avl_is_empty(&o->nodes.avl) ||
+			!(n = avl_find_ge_element(&o->nodes.avl, st->cursor.buf, n, in_nodes.avl))) {
+		return NULL;
+	} else if(!memcmp(n->node_id, st->cursor.buf, DNCP_NI_LEN(o)) ||
+			n->last_reachable_prune != o->last_prune) {
+		n = dncp_node_get_next(n);
+	}
+
+	for(; n && !hd_filter_node(&st->f, n); n = dncp_node_get_next(n));
+	return n;
+}
+
+int hd_stream(struct platform_rpc_method *method, struct platform_rpc_stream *s, struct blob_buf *b)
+{
+	struct hd_rpc_method *m = container_of(method, struct hd_rpc_method, m);
+	struct hd_stream *st = s->priv;
+	dncp_node n;
+	int ret;
+
 	hd_now = hnetd_time();
-	hd_a(!hd_info(m->dncp, b), return -1);
-	hd_do_in_table(b, "links", hd_links(m->dncp, b), return -1);
-	hd_do_in_table(b, "nodes", hd_nodes(m->dncp, b), return -1);
+	if(!st) {
+		hd_a(st = calloc(1, sizeof(*st)), return -ENOMEM);
+		if((ret = hd_filter_parse(m->dncp, &st->f, s->in))) {
+			free(st);
+			return ret;
+		}
+		s->priv = st;
+
+		hd_a(!hd_info(m->dncp, b), return -1);
+		hd_do_in_table(b, "links", hd_links(m->dncp, b), return -1);
+		return 1;
+	}
+
+	if(!(n = hd_stream_next_node(m->dncp, st)))
+		return 0;
+
+	memcpy(st->cursor.buf, n->node_id, DNCP_NI_LEN(m->dncp));
+	hd_do_in_table(b, "nodes", hd_nodes_one(m->dncp, n, b, &st->f), return -1);
 	return 1;
 }
 
+void hd_stream_done(__unused struct platform_rpc_method *method, struct platform_rpc_stream *s)
+{
+	struct hd_stream *st = s->priv;
+	if(st) {
+		hd_filter_free(&st->f);
+		free(st);
+	}
+}
+
 void hd_register_rpc(void)
 {
 	platform_rpc_register(&hncp_rpc_dump.m);
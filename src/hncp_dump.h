@@ -94,6 +94,19 @@
  *   preference : Protocol preference (u8)
  * }
  *
+ *
+ * The request may contain the following filters, applied by hnetd:
+ * {
+ *   node-id : [ node-id (string) ... ]  Only dump these nodes
+ *   tlv-type : [ type (u32) ... ]  Only dump data from these TLV types
+ *   updates : {  Skip nodes whose update number did not change since
+ *     node-id : update-number (u32)
+ *     ...
+ *   }
+ * }
+ *
+ * When streamed, the first reply message contains the time, node-id and
+ * links, and each following message contains a single entry of nodes.
  */
 void hd_init(dncp o);
 void hd_register_rpc(void);
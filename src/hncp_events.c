@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ */
+
+#include "hncp_events.h"
+
+#include "dncp_i.h"
+#include "hncp_pa.h"
+#include "pa_core.h"
+#include "platform.h"
+
+#include <libubox/blobmsg_json.h>
+
+#define he_a(test, err) do{if(!(test)) {err;}}while(0)
+
+/* Maximum number of events queued per client */
+#define HE_QUEUE_MAX 256
+
+enum {
+	HE_CLASS_NODE = 0x1,
+	HE_CLASS_TLV = 0x2,
+	HE_CLASS_EP = 0x4,
+	HE_CLASS_PA = 0x8,
+	HE_CLASS_ALL = 0xf,
+};
+
+static const char *he_class_names[] = { "node", "tlv", "ep", "pa" };
+
+enum {
+	HE_FILTER_EVENTS,
+	HE_FILTER_TLV_TYPE,
+	HE_FILTER_MAX
+};
+
+static const struct blobmsg_policy he_filter_policy[HE_FILTER_MAX] = {
+	[HE_FILTER_EVENTS] = { .name = "events", .type = BLOBMSG_TYPE_ARRAY },
+	[HE_FILTER_TLV_TYPE] = { .name = "tlv-type", .type = BLOBMSG_TYPE_ARRAY },
+};
+
+struct he_msg {
+	struct list_head le;
+	struct blob_attr attr[];
+};
+
+struct he_client {
+	struct list_head le;
+	struct platform_rpc_stream *s;
+	struct list_head queue;
+	size_t queued;
+	size_t dropped;
+	unsigned int classes;
+	uint16_t *types;
+	size_t types_cnt;
+};
+
+platform_rpc_main he_main;
+platform_rpc_stream_cb he_stream;
+platform_rpc_stream_done he_stream_done;
+
+static struct he_rpc_method {
+	struct platform_rpc_method m;
+	dncp dncp;
+	hncp_pa hp;
+	dncp_subscriber_s subscriber;
+	struct pa_user pa_user;
+	struct pa_user aa_user;
+	struct list_head clients;
+	bool subscribed;
+	bool replaying;
+} hncp_rpc_events = {
+	.m = {.name = "events", .main = he_main,
+			.stream = he_stream, .stream_done = he_stream_done},
+	.clients = LIST_HEAD_INIT(hncp_rpc_events.clients),
+};
+
+static void he_push(struct he_client *c, struct blob_attr *attr)
+{
+	struct he_msg *msg;
+	size_t len = blob_raw_len(attr);
+
+	he_a(msg = malloc(sizeof(*msg) + len), c->dropped++; return);
+	memcpy(msg->attr, attr, len);
+	list_add_tail(&msg->le, &c->queue);
+
+	if(!c->queued++)
+		platform_rpc_stream_kick(c->s);
+}
+
+/* Queue an event for a client, or drop it if the client is too slow */
+static void he_queue(struct he_client *c, struct blob_attr *attr)
+{
+	if(c->queued + (c->dropped ? 2 : 1) > HE_QUEUE_MAX) {
+		c->dropped++;
+		return;
+	}
+
+	if(c->dropped) {
+		struct blob_buf b = {NULL, NULL, 0, NULL};
+		blob_buf_init(&b, 0);
+		blobmsg_add_string(&b, "event", "overflow");
+		blobmsg_add_u32(&b, "dropped", c->dropped);
+		L_INFO("events: dropped %zu events for slow client", c->dropped);
+		c->dropped = 0;
+		he_push(c, b.head);
+		blob_buf_free(&b);
+	}
+
+	he_push(c, attr);
+}
+
+static void he_dispatch(struct blob_buf *b, unsigned int class, int type)
+{
+	struct he_client *c;
+	list_for_each_entry(c, &hncp_rpc_events.clients, le) {
+		if(!(c->classes & class))
+			continue;
+
+		if(type >= 0 && c->types_cnt) {
+			size_t i;
+			for(i = 0; i < c->types_cnt && c->types[i] != type; i++);
+			if(i == c->types_cnt)
+				continue;
+		}
+
+		he_queue(c, b->head);
+	}
+	blob_buf_free(b);
+}
+
+static int he_event_init(struct blob_buf *b, const char *event)
+{
+	//Clients only get changes, not the state replayed on (un)subscribe
+	he_a(!hncp_rpc_events.replaying, return -1);
+	he_a(!blob_buf_init(b, 0), return -1);
+	he_a(!blobmsg_add_string(b, "event", event), return -1);
+	return 0;
+}
+
+static int he_add_node_id(struct blob_buf *b, dncp_node n)
+{
+	char buf[DNCP_NI_MAX_LEN * 2 + 1];
+	hexlify(buf, n->node_id, DNCP_NI_LEN(n->dncp));
+	return blobmsg_add_string(b, "node-id", buf);
+}
+
+static void he_node_cb(__unused dncp_subscriber s, dncp_node n, bool add)
+{
+	struct blob_buf b = {NULL, NULL, 0, NULL};
+	he_a(!he_event_init(&b, add ? "node-add" : "node-remove") &&
+			!he_add_node_id(&b, n), goto err);
+	he_dispatch(&b, HE_CLASS_NODE, -1);
+	return;
+err:
+	blob_buf_free(&b);
+}
+
+static void he_tlv_cb(__unused dncp_subscriber s, dncp_node n,
+		struct tlv_attr *tlv, bool add)
+{
+	struct blob_buf b = {NULL, NULL, 0, NULL};
+	char *hex;
+
+	he_a(!he_event_init(&b, add ? "tlv-add" : "tlv-remove") &&
+			!he_add_node_id(&b, n) &&
+			!blobmsg_add_u32(&b, "type", tlv_id(tlv)) &&
+			(hex = blobmsg_alloc_string_buffer(&b, "data", tlv_len(tlv) * 2 + 1)), goto err);
+	hexlify(hex, tlv_data(tlv), tlv_len(tlv));
+	blobmsg_add_string_buffer(&b);
+	he_dispatch(&b, HE_CLASS_TLV, tlv_id(tlv));
+	return;
+err:
+	blob_buf_free(&b);
+}
+
+static void he_ep_cb(__unused dncp_subscriber s, dncp_ep ep,
+		enum dncp_subscriber_event event)
+{
+	struct blob_buf b = {NULL, NULL, 0, NULL};
+	he_a(!he_event_init(&b, event == DNCP_EVENT_ADD ? "ep-add" :
+			event == DNCP_EVENT_REMOVE ? "ep-remove" : "ep-update") &&
+			!blobmsg_add_string(&b, "ifname", ep->ifname) &&
+			!blobmsg_add_u32(&b, "ep-id", dncp_ep_get_id(ep)), goto err);
+	he_dispatch(&b, HE_CLASS_EP, -1);
+	return;
+err:
+	blob_buf_free(&b);
+}
+
+static void he_pa_event(struct pa_user *u, struct pa_ldp *ldp, const char *event)
+{
+	struct blob_buf b = {NULL, NULL, 0, NULL};
+	struct prefix p = { .prefix = ldp->prefix, .plen = ldp->plen };
+	struct prefix dp = { .prefix = ldp->dp->prefix, .plen = ldp->dp->plen };
+
+	he_a(!he_event_init(&b, event) &&
+			!blobmsg_add_string(&b, "core",
+					(u == &hncp_rpc_events.pa_user) ? "prefix" : "address") &&
+			(!ldp->link->name || !blobmsg_add_string(&b, "link", ldp->link->name)) &&
+			!blobmsg_add_string(&b, "prefix", PREFIX_REPR(&p)) &&
+			!blobmsg_add_string(&b, "delegated", PREFIX_REPR(&dp)), goto err);
+	he_dispatch(&b, HE_CLASS_PA, -1);
+	return;
+err:
+	blob_buf_free(&b);
+}
+
+static void he_pa_assigned_cb(struct pa_user *u, struct pa_ldp *ldp)
+{
+	he_pa_event(u, ldp, ldp->assigned ? "pa-assign" : "pa-unassign");
+}
+
+static void he_pa_applied_cb(struct pa_user *u, struct pa_ldp *ldp)
+{
+	he_pa_event(u, ldp, ldp->applied ? "pa-apply" : "pa-unapply");
+}
+
+/* Callbacks are only registered while someone is listening */
+static void he_subscribe(struct he_rpc_method *m, bool subscribe)
+{
+	if(m->subscribed == subscribe || !m->dncp)
+		return;
+
+	m->replaying = true;
+	if(subscribe) {
+		dncp_subscribe(m->dncp, &m->subscriber);
+		if(m->hp) {
+			hncp_pa_user_register(m->hp, &m->pa_user, false);
+			hncp_pa_user_register(m->hp, &m->aa_user, true);
+		}
+	} else {
+		dncp_unsubscribe(m->dncp, &m->subscriber);
+		if(m->hp) {
+			pa_user_unregister(&m->pa_user);
+			pa_user_unregister(&m->aa_user);
+		}
+	}
+	m->replaying = false;
+	m->subscribed = subscribe;
+}
+
+static int he_client_parse(struct he_client *c, const struct blob_attr *in)
+{
+	struct blob_attr *tb[HE_FILTER_MAX], *a;
+	unsigned rem;
+	size_t i;
+
+	c->classes = HE_CLASS_ALL;
+	if(!in)
+		return 0;
+
+	blobmsg_parse(he_filter_policy, HE_FILTER_MAX, tb, blob_data(in), blob_len(in));
+
+	if(tb[HE_FILTER_EVENTS] && blobmsg_data_len(tb[HE_FILTER_EVENTS])) {
+		c->classes = 0;
+		blobmsg_for_each_attr(a, tb[HE_FILTER_EVENTS], rem) {
+			he_a(blobmsg_type(a) == BLOBMSG_TYPE_STRING, return -EINVAL);
+			for(i = 0; i < ARRAY_SIZE(he_class_names) &&
+					strcmp(he_class_names[i], blobmsg_get_string(a)); i++);
+			he_a(i < ARRAY_SIZE(he_class_names), return -EINVAL);
+			c->classes |= 1 << i;
+		}
+	}
+
+	if(tb[HE_FILTER_TLV_TYPE]) {
+		blobmsg_for_each_attr(a, tb[HE_FILTER_TLV_TYPE], rem)
+			c->types_cnt++;
+		he_a(c->types = calloc(c->types_cnt, sizeof(*c->types)), return -ENOMEM);
+		i = 0;
+		blobmsg_for_each_attr(a, tb[HE_FILTER_TLV_TYPE], rem) {
+			he_a(blobmsg_type(a) == BLOBMSG_TYPE_INT32, return -EINVAL);
+			c->types[i++] = blobmsg_get_u32(a);
+		}
+	}
+	return 0;
+}
+
+static void he_client_free(struct he_client *c)
+{
+	struct he_msg *msg, *ms;
+	list_for_each_entry_safe(msg, ms, &c->queue, le)
+		free(msg);
+	free(c->types);
+	free(c);
+}
+
+int he_stream(struct platform_rpc_method *method, struct platform_rpc_stream *s, struct blob_buf *b)
+{
+	struct he_rpc_method *m = container_of(method, struct he_rpc_method, m);
+	struct he_client *c = s->priv;
+	struct he_msg *msg;
+	struct blob_attr *a;
+	unsigned rem;
+	int ret;
+
+	if(!c) {
+		he_a(c = calloc(1, sizeof(*c)), return -ENOMEM);
+		INIT_LIST_HEAD(&c->queue);
+		if((ret = he_client_parse(c, s->in))) {
+			he_client_free(c);
+			return ret;
+		}
+
+		c->s = s;
+		s->priv = c;
+		list_add(&c->le, &m->clients);
+		he_subscribe(m, true);
+
+		he_a(!blobmsg_add_string(b, "event", "subscribed"), return -1);
+		return 1;
+	}
+
+	if(list_empty(&c->queue))
+		return -EAGAIN;
+
+	msg = list_first_entry(&c->queue, struct he_msg, le);
+	blob_for_each_attr(a, msg->attr, rem)
+		blobmsg_add_blob(b, a);
+
+	list_del(&msg->le);
+	c->queued--;
+	free(msg);
+	return 1;
+}
+
+void he_stream_done(struct platform_rpc_method *method, struct platform_rpc_stream *s)
+{
+	struct he_rpc_method *m = container_of(method, struct he_rpc_method, m);
+	struct he_client *c = s->priv;
+
+	if(c) {
+		list_del(&c->le);
+		he_client_free(c);
+	}
+
+	if(list_empty(&m->clients))
+		he_subscribe(m, false);
+}
+
+static int he_print_cb(struct blob_attr *msg, __unused void *priv)
+{
+	char *json = blobmsg_format_json(msg, true);
+	he_a(json, return 4);
+	puts(json);
+	fflush(stdout);
+	free(json);
+	return 0;
+}
+
+int he_main(struct platform_rpc_method *method, int argc, char* const argv[])
+{
+	struct blob_buf in = {NULL, NULL, 0, NULL};
+	int c, ret;
+	void *k;
+
+	blob_buf_init(&in, 0);
+	for(const char *opts = "et"; *opts; opts++) {
+		k = blobmsg_open_array(&in, (*opts == 'e') ? "events" : "tlv-type");
+		optind = 1;
+		while((c = getopt(argc, argv, "e:t:")) != -1) {
+			if(c == '?') {
+				fprintf(stderr, "Usage: %s [-e node|tlv|ep|pa]... [-t <tlv-type>]...\n", argv[0]);
+				blob_buf_free(&in);
+				return 1;
+			} else if(c == *opts && c == 'e') {
+				blobmsg_add_string(&in, NULL, optarg);
+			} else if(c == *opts) {
+				blobmsg_add_u32(&in, NULL, atoi(optarg));
+			}
+		}
+		blobmsg_close_array(&in, k);
+	}
+
+	ret = platform_rpc_cli_stream(method->name, in.head, he_print_cb, NULL, 0);
+	blob_buf_free(&in);
+	return ret;
+}
+
+void he_register_rpc(void)
+{
+	platform_rpc_register(&hncp_rpc_events.m);
+}
+
+void he_init(dncp dncp, hncp_pa hp)
+{
+	hncp_rpc_events.dncp = dncp;
+	hncp_rpc_events.hp = hp;
+	hncp_rpc_events.subscriber.node_change_cb = he_node_cb;
+	hncp_rpc_events.subscriber.tlv_change_cb = he_tlv_cb;
+	hncp_rpc_events.subscriber.ep_change_cb = he_ep_cb;
+	hncp_rpc_events.pa_user.assigned = he_pa_assigned_cb;
+	hncp_rpc_events.pa_user.applied = he_pa_applied_cb;
+	hncp_rpc_events.aa_user = hncp_rpc_events.pa_user;
+}
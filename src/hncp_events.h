@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ *
+ * HNCP change event stream.
+ *
+ * A client subscribes once by opening the "events" stream and then
+ * receives one message per change:
+ * {
+ *   event : node-add | node-remove (node-id)
+ *         | tlv-add | tlv-remove (node-id, type, data)
+ *         | ep-add | ep-remove | ep-update (ifname, ep-id)
+ *         | pa-assign | pa-unassign | pa-apply | pa-unapply
+ *           (core, link, prefix, delegated)
+ *         | overflow (dropped)
+ *   ...
+ * }
+ *
+ * The request may restrict what is sent:
+ * {
+ *   events : [ "node" | "tlv" | "ep" | "pa" ... ]  Event classes
+ *   tlv-type : [ type (u32) ... ]  TLV types for tlv events
+ * }
+ *
+ * Each client has a bounded queue. Events that do not fit are dropped
+ * and an overflow event tells the client to resynchronize (hnet-dump).
+ */
+
+#pragma once
+
+#include "dncp.h"
+#include "hncp_pa.h"
+
+void he_init(dncp o, hncp_pa hp);
+void he_register_rpc(void);
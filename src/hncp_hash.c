@@ -0,0 +1,303 @@
+/*
+ * $Id: hncp_hash.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * HNCP hash (MD5) backends. Single buffers are hashed with libubox's
+ * MD5 (or OpenSSL's, if built with it); several independent buffers
+ * (e.g. the dirty node data before a network hash calculation) can be
+ * hashed at once with a multi-buffer MD5, that runs MD5_LANES of them
+ * in lockstep in vector registers.
+ */
+
+#include "hncp_hash.h"
+#include "hnetd.h"
+
+#include <string.h>
+#include <libubox/md5.h>
+#include <libubox/utils.h>
+
+#ifdef DTLS_OPENSSL
+#include <openssl/evp.h>
+#endif /* DTLS_OPENSSL */
+
+static void _md5(const void *buf, size_t len, void *dst)
+{
+  md5_ctx_t ctx;
+
+  md5_begin(&ctx);
+  md5_hash(buf, len, &ctx);
+  md5_end(dst, &ctx);
+}
+
+/********************************************************* Multi-buffer MD5 */
+
+/* With GCC/clang vector extensions, this maps to 128-bit SIMD (SSE2,
+ * NEON) where available, and to plain scalar code elsewhere. */
+#define MD5_LANES 4
+
+typedef uint32_t md5_lanes __attribute__((vector_size(MD5_LANES * 4)));
+
+typedef struct {
+  const unsigned char *buf;
+  size_t full_blocks;
+  size_t blocks;
+  /* Last partial block and the padding */
+  unsigned char tail[128];
+} md5_lane_s;
+
+static const unsigned char md5_zero_block[64];
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s)                     \
+  do {                                                   \
+    (a) += f((b), (c), (d)) + (x) + (uint32_t)(t);       \
+    (a) = (((a) << (s)) | ((a) >> (32 - (s)))) + (b);    \
+  } while (0)
+
+static void _md5_lanes_block(md5_lanes st[4], const md5_lanes m[16])
+{
+  md5_lanes a = st[0], b = st[1], c = st[2], d = st[3];
+
+  STEP(F, a, b, c, d, m[0], 0xd76aa478, 7);
+  STEP(F, d, a, b, c, m[1], 0xe8c7b756, 12);
+  STEP(F, c, d, a, b, m[2], 0x242070db, 17);
+  STEP(F, b, c, d, a, m[3], 0xc1bdceee, 22);
+  STEP(F, a, b, c, d, m[4], 0xf57c0faf, 7);
+  STEP(F, d, a, b, c, m[5], 0x4787c62a, 12);
+  STEP(F, c, d, a, b, m[6], 0xa8304613, 17);
+  STEP(F, b, c, d, a, m[7], 0xfd469501, 22);
+  STEP(F, a, b, c, d, m[8], 0x698098d8, 7);
+  STEP(F, d, a, b, c, m[9], 0x8b44f7af, 12);
+  STEP(F, c, d, a, b, m[10], 0xffff5bb1, 17);
+  STEP(F, b, c, d, a, m[11], 0x895cd7be, 22);
+  STEP(F, a, b, c, d, m[12], 0x6b901122, 7);
+  STEP(F, d, a, b, c, m[13], 0xfd987193, 12);
+  STEP(F, c, d, a, b, m[14], 0xa679438e, 17);
+  STEP(F, b, c, d, a, m[15], 0x49b40821, 22);
+
+  STEP(G, a, b, c, d, m[1], 0xf61e2562, 5);
+  STEP(G, d, a, b, c, m[6], 0xc040b340, 9);
+  STEP(G, c, d, a, b, m[11], 0x265e5a51, 14);
+  STEP(G, b, c, d, a, m[0], 0xe9b6c7aa, 20);
+  STEP(G, a, b, c, d, m[5], 0xd62f105d, 5);
+  STEP(G, d, a, b, c, m[10], 0x02441453, 9);
+  STEP(G, c, d, a, b, m[15], 0xd8a1e681, 14);
+  STEP(G, b, c, d, a, m[4], 0xe7d3fbc8, 20);
+  STEP(G, a, b, c, d, m[9], 0x21e1cde6, 5);
+  STEP(G, d, a, b, c, m[14], 0xc33707d6, 9);
+  STEP(G, c, d, a, b, m[3], 0xf4d50d87, 14);
+  STEP(G, b, c, d, a, m[8], 0x455a14ed, 20);
+  STEP(G, a, b, c, d, m[13], 0xa9e3e905, 5);
+  STEP(G, d, a, b, c, m[2], 0xfcefa3f8, 9);
+  STEP(G, c, d, a, b, m[7], 0x676f02d9, 14);
+  STEP(G, b, c, d, a, m[12], 0x8d2a4c8a, 20);
+
+  STEP(H, a, b, c, d, m[5], 0xfffa3942, 4);
+  STEP(H, d, a, b, c, m[8], 0x8771f681, 11);
+  STEP(H, c, d, a, b, m[11], 0x6d9d6122, 16);
+  STEP(H, b, c, d, a, m[14], 0xfde5380c, 23);
+  STEP(H, a, b, c, d, m[1], 0xa4beea44, 4);
+  STEP(H, d, a, b, c, m[4], 0x4bdecfa9, 11);
+  STEP(H, c, d, a, b, m[7], 0xf6bb4b60, 16);
+  STEP(H, b, c, d, a, m[10], 0xbebfbc70, 23);
+  STEP(H, a, b, c, d, m[13], 0x289b7ec6, 4);
+  STEP(H, d, a, b, c, m[0], 0xeaa127fa, 11);
+  STEP(H, c, d, a, b, m[3], 0xd4ef3085, 16);
+  STEP(H, b, c, d, a, m[6], 0x04881d05, 23);
+  STEP(H, a, b, c, d, m[9], 0xd9d4d039, 4);
+  STEP(H, d, a, b, c, m[12], 0xe6db99e5, 11);
+  STEP(H, c, d, a, b, m[15], 0x1fa27cf8, 16);
+  STEP(H, b, c, d, a, m[2], 0xc4ac5665, 23);
+
+  STEP(I, a, b, c, d, m[0], 0xf4292244, 6);
+  STEP(I, d, a, b, c, m[7], 0x432aff97, 10);
+  STEP(I, c, d, a, b, m[14], 0xab9423a7, 15);
+  STEP(I, b, c, d, a, m[5], 0xfc93a039, 21);
+  STEP(I, a, b, c, d, m[12], 0x655b59c3, 6);
+  STEP(I, d, a, b, c, m[3], 0x8f0ccc92, 10);
+  STEP(I, c, d, a, b, m[10], 0xffeff47d, 15);
+  STEP(I, b, c, d, a, m[1], 0x85845dd1, 21);
+  STEP(I, a, b, c, d, m[8], 0x6fa87e4f, 6);
+  STEP(I, d, a, b, c, m[15], 0xfe2ce6e0, 10);
+  STEP(I, c, d, a, b, m[6], 0xa3014314, 15);
+  STEP(I, b, c, d, a, m[13], 0x4e0811a1, 21);
+  STEP(I, a, b, c, d, m[4], 0xf7537e82, 6);
+  STEP(I, d, a, b, c, m[11], 0xbd3af235, 10);
+  STEP(I, c, d, a, b, m[2], 0x2ad7d2bb, 15);
+  STEP(I, b, c, d, a, m[9], 0xeb86d391, 21);
+
+  st[0] += a;
+  st[1] += b;
+  st[2] += c;
+  st[3] += d;
+}
+
+static void _md5_lane_init(md5_lane_s *l, const void *buf, size_t len)
+{
+  size_t rem = len % 64;
+  uint64_t bits = (uint64_t)len * 8;
+  unsigned char *p;
+  int i;
+
+  l->buf = buf;
+  l->full_blocks = len / 64;
+  l->blocks = l->full_blocks + (rem < 56 ? 1 : 2);
+  memset(l->tail, 0, sizeof(l->tail));
+  if (rem)
+    memcpy(l->tail, l->buf + l->full_blocks * 64, rem);
+  l->tail[rem] = 0x80;
+  /* Little-endian bit count at the end of the last block */
+  p = l->tail + (l->blocks - l->full_blocks) * 64 - 8;
+  for (i = 0 ; i < 8 ; i++, bits >>= 8)
+    p[i] = bits & 0xff;
+}
+
+static const unsigned char *_md5_lane_block(md5_lane_s *l, size_t i)
+{
+  if (i < l->full_blocks)
+    return l->buf + i * 64;
+  if (i < l->blocks)
+    return l->tail + (i - l->full_blocks) * 64;
+  return md5_zero_block;
+}
+
+/* Hash count (<= MD5_LANES) buffers at once */
+static void _md5_lanes(int count, const void **bufs, const size_t *lens,
+                       void **dsts)
+{
+  md5_lane_s lanes[MD5_LANES];
+  md5_lanes st[4], old[4], m[16], active;
+  size_t i, blocks = 0;
+  int j, k;
+
+  for (k = 0 ; k < MD5_LANES ; k++)
+    {
+      _md5_lane_init(&lanes[k], k < count ? bufs[k] : NULL,
+                     k < count ? lens[k] : 0);
+      if (lanes[k].blocks > blocks)
+        blocks = lanes[k].blocks;
+    }
+  for (k = 0 ; k < MD5_LANES ; k++)
+    {
+      st[0][k] = 0x67452301;
+      st[1][k] = 0xefcdab89;
+      st[2][k] = 0x98badcfe;
+      st[3][k] = 0x10325476;
+    }
+  for (i = 0 ; i < blocks ; i++)
+    {
+      for (k = 0 ; k < MD5_LANES ; k++)
+        {
+          const unsigned char *p = _md5_lane_block(&lanes[k], i);
+          uint32_t v;
+
+          for (j = 0 ; j < 16 ; j++)
+            {
+              memcpy(&v, p + j * 4, 4);
+              m[j][k] = le32_to_cpu(v);
+            }
+          active[k] = i < lanes[k].blocks ? ~0U : 0;
+        }
+      memcpy(old, st, sizeof(st));
+      _md5_lanes_block(st, m);
+      /* Lanes that are done keep their state */
+      for (j = 0 ; j < 4 ; j++)
+        st[j] = (st[j] & active) | (old[j] & ~active);
+    }
+  for (k = 0 ; k < count ; k++)
+    {
+      uint32_t out[4];
+
+      for (j = 0 ; j < 4 ; j++)
+        out[j] = cpu_to_le32(st[j][k]);
+      memcpy(dsts[k], out, sizeof(out));
+    }
+}
+
+static void _md5_multi(int count, const void **bufs, const size_t *lens,
+                       void **dsts)
+{
+  const void *b[MD5_LANES];
+  size_t l[MD5_LANES];
+  void *d[MD5_LANES];
+  int idx[count];
+  int i, j, k, t;
+
+  /* Buffers of similar length go to the same batch, so that few lanes
+   * are idle. */
+  for (i = 0 ; i < count ; i++)
+    {
+      for (j = i ; j > 0 && lens[idx[j - 1]] > lens[i] ; j--)
+        idx[j] = idx[j - 1];
+      idx[j] = i;
+    }
+  for (i = 0 ; i < count ; i += MD5_LANES)
+    {
+      t = count - i < MD5_LANES ? count - i : MD5_LANES;
+      if (t == 1)
+        {
+          _md5(bufs[idx[i]], lens[idx[i]], dsts[idx[i]]);
+          break;
+        }
+      for (k = 0 ; k < t ; k++)
+        {
+          b[k] = bufs[idx[i + k]];
+          l[k] = lens[idx[i + k]];
+          d[k] = dsts[idx[i + k]];
+        }
+      _md5_lanes(t, b, l, d);
+    }
+}
+
+/******************************************************************** OpenSSL */
+
+#ifdef DTLS_OPENSSL
+
+static void _evp_md5(const void *buf, size_t len, void *dst)
+{
+  EVP_Digest(buf, len, dst, NULL, EVP_md5(), NULL);
+}
+
+static void _evp_md5_multi(int count, const void **bufs, const size_t *lens,
+                           void **dsts)
+{
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  int i;
+
+  for (i = 0 ; i < count ; i++)
+    {
+      if (!ctx || !EVP_DigestInit_ex(ctx, EVP_md5(), NULL)
+          || !EVP_DigestUpdate(ctx, bufs[i], lens[i])
+          || !EVP_DigestFinal_ex(ctx, dsts[i], NULL))
+        _md5(bufs[i], lens[i], dsts[i]);
+    }
+  if (ctx)
+    EVP_MD_CTX_destroy(ctx);
+}
+
+#endif /* DTLS_OPENSSL */
+
+const hncp_hash_backend_s hncp_hash_backends[] = {
+  /* The multi-buffer one pays off only when built with optimization */
+  { .name = "md5", .hash = _md5 },
+  { .name = "md5-multi", .hash = _md5, .hash_multi = _md5_multi },
+#ifdef DTLS_OPENSSL
+  { .name = "evp", .hash = _evp_md5, .hash_multi = _evp_md5_multi },
+#endif /* DTLS_OPENSSL */
+  { .name = NULL }
+};
+
+hncp_hash_backend hncp_hash_find_backend(const char *name)
+{
+  hncp_hash_backend b;
+
+  for (b = (hncp_hash_backend)hncp_hash_backends ; b->name ; b++)
+    if (!strcmp(b->name, name))
+      return b;
+  return NULL;
+}
@@ -0,0 +1,28 @@
+/*
+ * $Id: hncp_hash.h $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * HNCP hash (MD5) backends.
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct {
+  const char *name;
+
+  /* dncp_ext callbacks: one buffer, and several at once (optional) */
+  void (*hash)(const void *buf, size_t len, void *dst);
+  void (*hash_multi)(int count, const void **bufs, const size_t *lens,
+                     void **dsts);
+} hncp_hash_backend_s, *hncp_hash_backend;
+
+/* Available backends, terminated by one with NULL name; the first one
+ * is the default. */
+extern const hncp_hash_backend_s hncp_hash_backends[];
+
+/* NULL if there is no such backend (in this build) */
+hncp_hash_backend hncp_hash_find_backend(const char *name);
@@ -84,6 +84,12 @@ struct hncp_struct {
   /* Timeout for doing 'something' in dncp_io. */
   struct uloop_timeout timeout;
 
+  /* TCP listening socket (once some endpoint uses streams), and the
+   * stream connections: both accepted ones, and ones to configured
+   * peers. */
+  struct uloop_fd stream_listen;
+  struct list_head streams;
+
 #ifdef DTLS
   /* DTLS 'socket' abstraction, which actually hides two UDP sockets
    * (client and server) and N OpenSSL contexts tied to each of
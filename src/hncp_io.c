@@ -31,6 +31,7 @@
 #include <arpa/inet.h>
 #include <libubox/usock.h>
 #include <ifaddrs.h>
+#include <netinet/tcp.h>
 
 #ifdef __linux__
 #define AF_LINK AF_PACKET
@@ -82,7 +83,537 @@ _get_hwaddrs(dncp_ext ext __unused, unsigned char *buf, int buf_left)
 static void _timeout(struct uloop_timeout *t)
 {
   hncp h = container_of(t, hncp_s, timeout);
+
+  /* Trickle resets typically send the same payload on every endpoint
+   * (or to every peer); batch the whole pass into few system calls. */
+  udp46_batch_begin(h->u46_server);
   dncp_ext_timeout(h->dncp);
+  udp46_batch_flush(h->u46_server);
+}
+
+/******************************************************* TCP stream transport */
+
+/* On endpoints with unicast_is_reliable_stream, unicast traffic goes
+ * over TCP: each DNCP message is preceded by its length (32 bits,
+ * network byte order). Peers are configured at both ends; we connect
+ * to them (and keep reconnecting), and accept connections from their
+ * addresses only. One connection is used for everything sent to the
+ * peer while it lasts; if both ends connect at the same time, the end
+ * with the smaller (address, HNCP port) keeps the connection it
+ * initiated. dncp is told when peers come and go. */
+
+typedef struct hncp_stream_struct {
+  struct list_head lh;
+  hncp h;
+  dncp_ep ep;
+  struct uloop_fd ufd;
+  struct sockaddr_in6 local;
+  struct sockaddr_in6 remote;
+
+  /* Configured peer; (re)connected to whenever not connected */
+  bool configured;
+  struct uloop_timeout reconnect;
+
+  /* Connection is up, and dncp knows about it */
+  bool connected;
+
+  /* The connection was initiated by the peer */
+  bool accepted;
+
+  /* Received data; frames before ioff have been consumed already */
+  unsigned char *ibuf;
+  size_t ioff, ilen, isize;
+
+  /* Frames not yet written to the socket */
+  unsigned char *obuf;
+  size_t olen, osize;
+} hncp_stream_s, *hncp_stream;
+
+#define STREAM_FRAME_HEADER_LEN 4
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* !MSG_NOSIGNAL */
+
+static bool _stream_reserve(unsigned char **buf, size_t *size, size_t need)
+{
+  size_t new_size = *size ? *size : 4096;
+  unsigned char *nb;
+
+  if (need <= *size)
+    return true;
+  while (new_size < need)
+    new_size *= 2;
+  if (!(nb = realloc(*buf, new_size)))
+    return false;
+  *buf = nb;
+  *size = new_size;
+  return true;
+}
+
+static void _stream_setsockopts(int fd)
+{
+  int v = HNCP_STREAM_SOCKET_BUFFER, on = 1;
+
+  /* The kernel may cap these; best effort only */
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v)) < 0
+      || setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v)) < 0)
+    L_DEBUG("unable to set stream socket buffers: %s", strerror(errno));
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    L_DEBUG("unable to set TCP_NODELAY: %s", strerror(errno));
+}
+
+static bool _stream_same_remote(const struct sockaddr_in6 *a,
+                                const struct sockaddr_in6 *b)
+{
+  return a->sin6_port == b->sin6_port
+    && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+static hncp_stream _stream_find(hncp h, dncp_ep ep,
+                                const struct sockaddr_in6 *remote)
+{
+  hncp_stream st;
+
+  list_for_each_entry(st, &h->streams, lh)
+    if (st->ep == ep && _stream_same_remote(&st->remote, remote))
+      return st;
+  return NULL;
+}
+
+static void _stream_set_events(hncp_stream st)
+{
+  /* Until connected, writability means the connect finished */
+  unsigned int events = ULOOP_READ;
+
+  if (st->olen || !st->connected)
+    events |= ULOOP_WRITE;
+  uloop_fd_add(&st->ufd, events);
+}
+
+/* Close the connection (if any), but keep the peer */
+static void _stream_disconnect(hncp_stream st)
+{
+  if (st->ufd.fd >= 0)
+    {
+      uloop_fd_delete(&st->ufd);
+      close(st->ufd.fd);
+      st->ufd.fd = -1;
+    }
+  if (st->connected)
+    {
+      L_DEBUG("stream to " SA6_F " closed", SA6_D(&st->remote));
+      st->connected = false;
+      dncp_ext_ep_peer_state(st->ep, &st->local, &st->remote, false);
+    }
+  free(st->ibuf);
+  free(st->obuf);
+  st->ibuf = st->obuf = NULL;
+  st->ioff = st->ilen = st->isize = st->olen = st->osize = 0;
+  st->accepted = false;
+}
+
+static void _stream_close(hncp_stream st)
+{
+  _stream_disconnect(st);
+  if (st->configured)
+    {
+      uloop_timeout_set(&st->reconnect, HNCP_STREAM_RECONNECT_INTERVAL);
+      return;
+    }
+  uloop_timeout_cancel(&st->reconnect);
+  list_del(&st->lh);
+  free(st);
+}
+
+/* Write as much of the output as the socket takes. On failure, the
+ * connection is shut down; it is closed once the socket reports it
+ * (as we may be deep within dncp here). */
+static void _stream_flush(hncp_stream st)
+{
+  ssize_t r;
+
+  while (st->olen)
+    {
+      r = send(st->ufd.fd, st->obuf, st->olen, MSG_NOSIGNAL);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+              L_DEBUG("stream send to " SA6_F " failed: %s",
+                      SA6_D(&st->remote), strerror(errno));
+              shutdown(st->ufd.fd, SHUT_RDWR);
+            }
+          break;
+        }
+      memmove(st->obuf, st->obuf + r, st->olen - r);
+      st->olen -= r;
+    }
+  _stream_set_events(st);
+}
+
+static void _stream_send(hncp_stream st, void *buf, size_t len)
+{
+  uint32_t hdr = htonl(len);
+
+  if (len > HNCP_STREAM_MAXIMUM_SIZE)
+    {
+      L_ERR("too large message (%d bytes) for stream", (int)len);
+      return;
+    }
+  if (st->olen + sizeof(hdr) + len > HNCP_STREAM_MAXIMUM_BUFFERED)
+    {
+      L_INFO("stream to " SA6_F " stalled, dropping it", SA6_D(&st->remote));
+      shutdown(st->ufd.fd, SHUT_RDWR);
+      return;
+    }
+  if (!_stream_reserve(&st->obuf, &st->osize, st->olen + sizeof(hdr) + len))
+    {
+      L_ERR("unable to send on stream - eom");
+      return;
+    }
+  memcpy(st->obuf + st->olen, &hdr, sizeof(hdr));
+  memcpy(st->obuf + st->olen + sizeof(hdr), buf, len);
+  st->olen += sizeof(hdr) + len;
+  _stream_flush(st);
+}
+
+/* Length of the next complete frame (if any) */
+static ssize_t _stream_frame_len(hncp_stream st)
+{
+  uint32_t hdr;
+  size_t left = st->ilen - st->ioff;
+
+  if (left < sizeof(hdr))
+    return -1;
+  memcpy(&hdr, st->ibuf + st->ioff, sizeof(hdr));
+  hdr = ntohl(hdr);
+  if (left < sizeof(hdr) + hdr)
+    return -1;
+  return hdr;
+}
+
+static ssize_t _stream_recv(hncp h, dncp_ep *ep,
+                            struct sockaddr_in6 **src,
+                            struct sockaddr_in6 **dst,
+                            void *buf, size_t len)
+{
+  hncp_stream st;
+  ssize_t l;
+
+  list_for_each_entry(st, &h->streams, lh)
+    {
+      if (!st->connected || (l = _stream_frame_len(st)) < 0)
+        continue;
+      st->ioff += STREAM_FRAME_HEADER_LEN + l;
+      if ((size_t)l > len)
+        {
+          L_INFO("too large frame (%d bytes) from " SA6_F,
+                 (int)l, SA6_D(&st->remote));
+          continue;
+        }
+      memcpy(buf, st->ibuf + st->ioff - l, l);
+      *ep = st->ep;
+      *src = &st->remote;
+      *dst = &st->local;
+      return l;
+    }
+  return -1;
+}
+
+static bool _stream_read(hncp_stream st)
+{
+  uint32_t hdr;
+  ssize_t r;
+
+  if (st->ioff)
+    {
+      memmove(st->ibuf, st->ibuf + st->ioff, st->ilen - st->ioff);
+      st->ilen -= st->ioff;
+      st->ioff = 0;
+    }
+  if (!_stream_reserve(&st->ibuf, &st->isize,
+                       st->ilen + STREAM_FRAME_HEADER_LEN
+                       + HNCP_STREAM_MAXIMUM_SIZE))
+    {
+      L_ERR("unable to receive on stream - eom");
+      return false;
+    }
+  r = recv(st->ufd.fd, st->ibuf + st->ilen, st->isize - st->ilen, 0);
+  if (r < 0)
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+  if (!r)
+    return false;
+  st->ilen += r;
+  if (st->ilen < sizeof(hdr))
+    return true;
+  memcpy(&hdr, st->ibuf, sizeof(hdr));
+  if (ntohl(hdr) > HNCP_STREAM_MAXIMUM_SIZE)
+    {
+      L_INFO("invalid frame length %u from " SA6_F,
+             (unsigned)ntohl(hdr), SA6_D(&st->remote));
+      return false;
+    }
+  return true;
+}
+
+static bool _stream_connected(hncp_stream st)
+{
+  socklen_t len = sizeof(st->local);
+
+  if (getsockname(st->ufd.fd, (struct sockaddr *)&st->local, &len) < 0
+      || !dncp_ep_is_enabled(st->ep))
+    {
+      _stream_close(st);
+      return false;
+    }
+  L_DEBUG("stream " SA6_F " <> " SA6_F " on %s up",
+          SA6_D(&st->local), SA6_D(&st->remote), st->ep->ifname);
+  st->connected = true;
+  _stream_set_events(st);
+  dncp_ext_ep_peer_state(st->ep, &st->local, &st->remote, true);
+  return true;
+}
+
+static void _stream_cb(struct uloop_fd *u, unsigned int events)
+{
+  hncp_stream st = container_of(u, hncp_stream_s, ufd);
+  hncp h = st->h;
+
+  if (!st->connected)
+    {
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        {
+          L_DEBUG("stream connect to " SA6_F " failed: %s",
+                  SA6_D(&st->remote), strerror(err ? err : errno));
+          _stream_close(st);
+          return;
+        }
+      if (!_stream_connected(st))
+        return;
+    }
+  if (events & ULOOP_WRITE)
+    _stream_flush(st);
+  if (events & ULOOP_READ)
+    {
+      if (!_stream_read(st))
+        {
+          _stream_close(st);
+          return;
+        }
+      while (_stream_frame_len(st) >= 0)
+        dncp_ext_readable(h->dncp);
+    }
+}
+
+static void _stream_connect(hncp_stream st)
+{
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    {
+      L_ERR("unable to create stream socket: %s", strerror(errno));
+      _stream_close(st);
+      return;
+    }
+  (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+  _stream_setsockopts(fd);
+  st->ufd.fd = fd;
+  st->ufd.cb = _stream_cb;
+  if (connect(fd, (struct sockaddr *)&st->remote, sizeof(st->remote)) < 0
+      && errno != EINPROGRESS)
+    {
+      L_DEBUG("stream connect to " SA6_F " failed: %s",
+              SA6_D(&st->remote), strerror(errno));
+      _stream_close(st);
+      return;
+    }
+  _stream_set_events(st);
+}
+
+static void _stream_reconnect(struct uloop_timeout *t)
+{
+  hncp_stream st = container_of(t, hncp_stream_s, reconnect);
+
+  if (st->ufd.fd < 0 && dncp_ep_is_enabled(st->ep))
+    _stream_connect(st);
+}
+
+/* Which configured peer does an accepted connection come from? */
+static hncp_stream _stream_find_peer(hncp h, const struct sockaddr_in6 *remote)
+{
+  hncp_stream st;
+
+  list_for_each_entry(st, &h->streams, lh)
+    if (st->configured && dncp_ep_is_enabled(st->ep)
+        && !memcmp(&st->remote.sin6_addr, &remote->sin6_addr,
+                   sizeof(remote->sin6_addr))
+        && (!IN6_IS_ADDR_LINKLOCAL(&remote->sin6_addr)
+            || st->remote.sin6_scope_id == remote->sin6_scope_id))
+      return st;
+  return NULL;
+}
+
+/* Should the connection we initiate to the peer win over the one it
+ * initiates to us? Both ends have to come to the same conclusion. */
+static bool _stream_initiator(hncp_stream st, const struct sockaddr_in6 *local)
+{
+  int c = memcmp(&local->sin6_addr, &st->remote.sin6_addr,
+                 sizeof(local->sin6_addr));
+
+  return c < 0 || (!c && st->h->udp_port < ntohs(st->remote.sin6_port));
+}
+
+static void _stream_accept_cb(struct uloop_fd *u,
+                              unsigned int events __unused)
+{
+  hncp h = container_of(u, hncp_s, stream_listen);
+  struct sockaddr_in6 local, remote;
+  socklen_t len;
+  hncp_stream st;
+  int fd;
+
+  while (1)
+    {
+      len = sizeof(remote);
+      if ((fd = accept(u->fd, (struct sockaddr *)&remote, &len)) < 0)
+        break;
+      len = sizeof(local);
+      if (getsockname(fd, (struct sockaddr *)&local, &len) < 0
+          || !(st = _stream_find_peer(h, &remote)))
+        {
+          L_DEBUG("rejecting stream from " SA6_F, SA6_D(&remote));
+          close(fd);
+          continue;
+        }
+      if (st->ufd.fd >= 0 && !st->accepted && _stream_initiator(st, &local))
+        {
+          L_DEBUG("rejecting stream from " SA6_F " in favor of ours",
+                  SA6_D(&remote));
+          close(fd);
+          continue;
+        }
+      /* Replaces our connection (attempt), or the peer's earlier one */
+      _stream_disconnect(st);
+      uloop_timeout_cancel(&st->reconnect);
+      (void)fcntl(fd, F_SETFL, O_NONBLOCK);
+      st->ufd.fd = fd;
+      st->ufd.cb = _stream_cb;
+      st->accepted = true;
+      _stream_connected(st);
+    }
+}
+
+static bool _stream_listen(hncp h)
+{
+  struct sockaddr_in6 sa;
+  int fd, on = 1;
+
+  if (h->stream_listen.fd >= 0)
+    return true;
+  sockaddr_in6_set(&sa, NULL, h->udp_port);
+  if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+    goto fail;
+  /* Accepted connections inherit the socket buffer sizes */
+  _stream_setsockopts(fd);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+      || fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+      || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+      || listen(fd, SOMAXCONN) < 0)
+    goto fail;
+  h->stream_listen.fd = fd;
+  h->stream_listen.cb = _stream_accept_cb;
+  uloop_fd_add(&h->stream_listen, ULOOP_READ);
+  return true;
+ fail:
+  L_ERR("unable to listen for streams: %s", strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  return false;
+}
+
+/* Drop the peers (and streams) of the endpoint */
+static void _stream_drop_ep(hncp h, dncp_ep ep)
+{
+  hncp_stream st, st2;
+
+  list_for_each_entry_safe(st, st2, &h->streams, lh)
+    if (st->ep == ep)
+      {
+        st->configured = false;
+        _stream_close(st);
+      }
+}
+
+static void _stream_set_ep_enabled(hncp h, dncp_ep ep, bool enabled)
+{
+  hncp_stream st, st2;
+
+  list_for_each_entry_safe(st, st2, &h->streams, lh)
+    if (st->ep == ep)
+      {
+        if (!enabled)
+          _stream_close(st);
+        else if (st->ufd.fd < 0)
+          _stream_connect(st);
+      }
+}
+
+bool hncp_io_set_stream(hncp h, const char *ifname, bool enabled)
+{
+  dncp_ep ep = dncp_find_ep_by_name(h->dncp, ifname);
+
+  if (!ep)
+    return false;
+#ifdef DTLS
+  /* The streams are not protected; dncp would drop what they carry. */
+  if (enabled && h->d)
+    {
+      L_ERR("stream transport is not available with DTLS");
+      return false;
+    }
+#endif /* DTLS */
+  if (enabled && !_stream_listen(h))
+    return false;
+  if (!enabled)
+    _stream_drop_ep(h, ep);
+  /* Non-link-local peers still need accept_insecure_nonlocal_traffic */
+  ep->unicast_only = enabled;
+  ep->unicast_is_reliable_stream = enabled;
+  ep->maximum_unicast_size =
+    enabled ? HNCP_STREAM_MAXIMUM_SIZE : HNCP_MAXIMUM_UNICAST_SIZE;
+  return true;
+}
+
+bool hncp_io_add_stream_peer(hncp h, const char *ifname,
+                             const struct sockaddr_in6 *remote)
+{
+  dncp_ep ep = dncp_find_ep_by_name(h->dncp, ifname);
+  hncp_stream st;
+
+  if (!ep || !ep->unicast_is_reliable_stream)
+    return false;
+  if ((st = _stream_find(h, ep, remote)) && st->configured)
+    return true;
+  if (!(st = calloc(1, sizeof(*st))))
+    return false;
+  st->h = h;
+  st->ep = ep;
+  st->remote = *remote;
+  if (IN6_IS_ADDR_LINKLOCAL(&remote->sin6_addr) && !remote->sin6_scope_id)
+    st->remote.sin6_scope_id = if_nametoindex(ifname);
+  st->configured = true;
+  st->reconnect.cb = _stream_reconnect;
+  st->ufd.fd = -1;
+  list_add(&st->lh, &h->streams);
+  if (dncp_ep_is_enabled(ep))
+    _stream_connect(st);
+  return true;
 }
 
 bool
@@ -111,7 +642,9 @@ hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled)
       return false;
     }
   /* Yay. It succeeded(?). */
-  dncp_ext_ep_ready(dncp_find_ep_by_name(h->dncp, ifname), enabled);
+  dncp_ep ep = dncp_find_ep_by_name(h->dncp, ifname);
+  dncp_ext_ep_ready(ep, enabled);
+  _stream_set_ep_enabled(h, ep, enabled);
   return true;
 }
 
@@ -144,6 +677,8 @@ _recv(dncp_ext ext,
   while (1)
     {
       f = 0;
+      if ((r = _stream_recv(h, ep, &src, &dst, buf, len)) >= 0)
+        goto got_stream;
 #ifdef DTLS
       if (h->d)
         {
@@ -183,6 +718,7 @@ _recv(dncp_ext ext,
       if (!*ep)
         continue;
 
+    got_stream:
       if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
         f |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
 
@@ -216,8 +752,21 @@ _send(dncp_ext ext, dncp_ep ep,
 {
   hncp h = container_of(ext, hncp_s, ext);
   struct sockaddr_in6 rdst;
+  hncp_stream st;
   ssize_t r;
 
+  if (dst && ep->unicast_is_reliable_stream
+      && (st = _stream_find(h, ep, dst)))
+    {
+      /* dncp has been told the peer is gone; it resyncs once the
+       * connection is back, so anything queued now would be stale. */
+      if (st->connected)
+        _stream_send(st, buf, len);
+      else
+        L_DEBUG("stream to " SA6_F " not connected, dropping %d bytes",
+                SA6_D(dst), (int)len);
+      return;
+    }
   if (!dst)
     sockaddr_in6_set(&rdst, &h->multicast_address, HNCP_PORT);
   else
@@ -301,6 +850,8 @@ bool hncp_io_init(hncp h)
 {
   if (!(h->u46_server = udp46_create(h->udp_port)))
     return false;
+  h->stream_listen.fd = -1;
+  INIT_LIST_HEAD(&h->streams);
   h->timeout.cb = _timeout;
   h->ext.cb.recv = _recv;
   h->ext.cb.send = _send;
@@ -313,8 +864,26 @@ bool hncp_io_init(hncp h)
 
 void hncp_io_uninit(hncp h)
 {
+  hncp_stream st, st2;
+
   if (h->u46_server)
     udp46_destroy(h->u46_server);
+  if (h->streams.next)
+    {
+      list_for_each_entry_safe(st, st2, &h->streams, lh)
+        {
+          /* dncp is going away too; no point telling it */
+          st->configured = false;
+          st->connected = false;
+          _stream_close(st);
+        }
+      if (h->stream_listen.fd >= 0)
+        {
+          uloop_fd_delete(&h->stream_listen);
+          close(h->stream_listen.fd);
+          h->stream_listen.fd = -1;
+        }
+    }
   /* clear the timer from uloop. */
   uloop_timeout_cancel(&h->timeout);
 }
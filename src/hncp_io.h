@@ -20,3 +20,10 @@ bool hncp_io_init(hncp h);
 void hncp_io_uninit(hncp h);
 
 bool hncp_io_set_ifname_enabled(hncp h, const char *ifname, bool enabled);
+
+/* Carry unicast traffic of the endpoint over TCP (as a reliable
+ * stream, with no multicast). Not available with DTLS. Connections are
+ * made to, and accepted from, the added peers only. */
+bool hncp_io_set_stream(hncp h, const char *ifname, bool enabled);
+bool hncp_io_add_stream_peer(hncp h, const char *ifname,
+                             const struct sockaddr_in6 *remote);
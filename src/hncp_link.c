@@ -105,15 +105,15 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 
 				dncp_t_peer pn = dncp_tlv_peer(l->dncp, pc);
 				if (!pn || pn->ep_id != cn->peer_ep_id ||
-				    memcmp(dncp_tlv_get_node_id(l->dncp, pn), &dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp)))
+				    memcmp(dncp_tlv_get_node_id(l->dncp, pn), dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp)))
 					continue;
 
 				if (pn->peer_ep_id == dncp_ep_get_id(ep)) {
 					// Matching reverse neighbor entry
 					L_DEBUG("hncp_link_calculate: if %"PRIu32" -> neigh %s:%"PRIu32,
-							dncp_ep_get_id(ep), DNCP_STRUCT_REPR(peer->node_id), pn->ep_id);
+							dncp_ep_get_id(ep), DNCP_NODE_REPR(peer), pn->ep_id);
 					mutual = true;
-					memcpy(&peers[peerpos].node_id, &peer->node_id, HNCP_NI_LEN);
+					memcpy(&peers[peerpos].node_id, peer->node_id, HNCP_NI_LEN);
 					peers[peerpos].ep_id = pn->ep_id;
 					++peerpos;
 				} else if (pn->peer_ep_id < dncp_ep_get_id(ep)) {
@@ -147,7 +147,7 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 					elected &= ~HNCP_LINK_LEGACY;
 
 				if (ourcaps < peercaps || (ourcaps == peercaps &&
-						memcmp(&dncp_get_own_node(l->dncp)->node_id, &peer->node_id, DNCP_NI_LEN(l->dncp)) < 0)) {
+						memcmp(dncp_get_own_node(l->dncp)->node_id, peer->node_id, DNCP_NI_LEN(l->dncp)) < 0)) {
 					if (peervertlv->caps_mp >> 4 &&
 							ourvertlv->caps_mp >> 4 == peervertlv->caps_mp >> 4)
 						elected &= ~HNCP_LINK_MDNSPROXY;
@@ -166,7 +166,7 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 				}
 
 				L_DEBUG("hncp_link_calculate: %s peer: %x peer-caps: %x ourcaps: %x pre-elected(SMPHL): %x",
-						ep->ifname, *((uint32_t*)&peer->node_id), peercaps, ourcaps, elected);
+						ep->ifname, *((uint32_t*)peer->node_id), peercaps, ourcaps, elected);
 			}
 		}
 	}
@@ -200,7 +200,7 @@ static void cb_tlv(dncp_subscriber s, dncp_node n,
 		if (dncp_node_is_self(n)) {
 			L_DEBUG("hncp_link: local neighbor tlv changed");
 			ep = dncp_find_ep_by_id(l->dncp, ne->ep_id);
-		} else if (!memcmp(dncp_tlv_get_node_id(l->dncp, ne),  &dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp))) {
+		} else if (!memcmp(dncp_tlv_get_node_id(l->dncp, ne),  dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp))) {
 			L_DEBUG("hncp_link: other node neighbor tlv changed");
 			ep = dncp_find_ep_by_id(l->dncp, ne->peer_ep_id);
 		}
@@ -89,6 +89,8 @@ static void hm_proxy_set(hm m, hm_iface i, bool enable)
 		return;
 
 	L_DEBUG("hncp_multicast: %s proxy = %d", i->ifname, enable);
+	char key[IFNAMSIZ + 6];
+	snprintf(key, sizeof(key), "proxy %s", i->ifname);
 	if(enable) {
 		hm_iface i2;
 		i->proxy_port = PROXY_MIN_PORT;
@@ -107,7 +109,7 @@ find:
 		addr_ntop(addr, INET6_ADDRSTRLEN, &m->current_address);
 		char *argv[] = { (char *)m->p.multicast_script,
 				"proxy", i->ifname, "on", addr, port, NULL };
-		exeq_add(&m->exeq, argv);
+		exeq_add_keyed(&m->exeq, key, argv);
 		hncp_t_pim_border_proxy_s tlv = {
 				.addr = m->current_address,
 				.port = htons(i->proxy_port)
@@ -116,7 +118,7 @@ find:
 	} else {
 		char *argv[] = { (char *)m->p.multicast_script,
 				"proxy", i->ifname, "off", NULL };
-		exeq_add(&m->exeq, argv);
+		exeq_add_keyed(&m->exeq, key, argv);
 		dncp_remove_tlv(m->dncp, i->proxy_tlv);
 		i->proxy_tlv = NULL;
 	}
@@ -133,7 +135,9 @@ static void hm_pim_set(hm m, hm_iface i, bool enable)
 	L_DEBUG("hncp_multicast: %s pim = %d", i->ifname, enable);
 	char *argv[] = { (char *)m->p.multicast_script,
 					"pim", i->ifname, enable?"on":"off", NULL};
-	exeq_add(&m->exeq, argv);
+	char key[IFNAMSIZ + 4];
+	snprintf(key, sizeof(key), "pim %s", i->ifname);
+	exeq_add_keyed(&m->exeq, key, argv);
 }
 
 #define hm_pim_update(m, i) hm_pim_set(m, i, i->internal && !i->external)
@@ -180,11 +184,9 @@ static void hm_is_controller_set(hm m, bool enable)
 		return;
 
 	L_DEBUG("hncp_multicast: controller = %d", enable);
-	dncp_node n;
-	struct tlv_attr *tlv;
-	dncp_for_each_node(m->dncp, n)
-		dncp_node_for_each_tlv_with_type(n, tlv, HNCP_T_PIM_BORDER_PROXY)
-			hm_bp_notify(m, tlv, enable);
+	dncp_network_tlv t;
+	dncp_for_each_network_tlv(m->dncp, t, HNCP_T_PIM_BORDER_PROXY)
+		hm_bp_notify(m, dncp_network_tlv_get_attr(t), enable);
 	m->is_controller = enable;
 }
 
@@ -218,15 +220,17 @@ static void hm_rpa_update(hm m)
 	dncp_node n, found_node = NULL;
 	struct tlv_attr *a, *found = NULL;
 	dncp_node on = dncp_get_own_node(m->dncp);
-
-	dncp_for_each_node(m->dncp, n)
-		if(n != on)
-			dncp_node_for_each_tlv_with_type(n, a, HNCP_T_PIM_RPA_CANDIDATE)
-				if (tlv_len(a) == 16 &&
-					(!found || dncp_node_cmp(n, found_node) > 0)) {
-					found = a;
-					found_node = n;
-				}
+	dncp_network_tlv t;
+
+	dncp_for_each_network_tlv(m->dncp, t, HNCP_T_PIM_RPA_CANDIDATE) {
+		n = dncp_network_tlv_get_node(t);
+		a = dncp_network_tlv_get_attr(t);
+		if (n != on && tlv_len(a) == 16 &&
+				(!found || dncp_node_cmp(n, found_node) > 0)) {
+			found = a;
+			found_node = n;
+		}
+	}
 
 	if(m->rpa_tlv) {
 		if(!m->has_address) {
@@ -392,6 +396,11 @@ hncp_multicast hncp_multicast_create(hncp h, hncp_multicast_params p)
 		return NULL;
 
 	m->dncp = hncp_get_dncp(h);
+	if (!dncp_add_network_tlv_index(m->dncp, HNCP_T_PIM_RPA_CANDIDATE) ||
+			!dncp_add_network_tlv_index(m->dncp, HNCP_T_PIM_BORDER_PROXY)) {
+		free(m);
+		return NULL;
+	}
 	m->p = *p;
 	m->rp_timeout.cb = _rp_timeout;
 	m->addr_timeout.cb = _addr_timeout;
@@ -437,5 +446,5 @@ void hncp_multicast_destroy(hncp_multicast m)
 
 bool hncp_multicast_busy(hncp_multicast m)
 {
-	return m->rp_timeout.pending || m->addr_timeout.pending || m->exeq.process.pending;
+	return m->rp_timeout.pending || m->addr_timeout.pending || exeq_busy(&m->exeq);
 }
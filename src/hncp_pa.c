@@ -2099,6 +2099,11 @@ void hncp_pa_iface_user_register(hncp_pa hp, struct hncp_pa_iface_user *user)
 	hp->if_cbs = user;
 }
 
+void hncp_pa_user_register(hncp_pa hp, struct pa_user *user, bool address)
+{
+	pa_user_register(address ? &hp->aa : &hp->pa, user);
+}
+
 hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 {
 	L_INFO("Initializing HNCP Prefix Assignment");
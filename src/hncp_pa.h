@@ -59,6 +59,13 @@ struct hncp_pa_iface_user {
  */
 void hncp_pa_iface_user_register(hncp_pa hp, struct hncp_pa_iface_user *user);
 
+/**
+ * Subscription to the prefix (or, if address is set, the address)
+ * assignment core's changes; see struct pa_user in pa_core.h.
+ */
+struct pa_user;
+void hncp_pa_user_register(hncp_pa hp, struct pa_user *user, bool address);
+
 /********************************
  *       Configuration          *
  ********************************/
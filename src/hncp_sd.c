@@ -54,8 +54,9 @@
 #define UPDATE_FLAG_LOCAL_DDZ 0x10
 #define UPDATE_FLAG_DOMAIN    0x20
 #define UPDATE_FLAG_RNAME     0x40
+#define UPDATE_FLAG_LOCAL_AP  0x80
 
-#define UPDATE_FLAG_ALL     0x7F
+#define UPDATE_FLAG_ALL     0xFF
 
 /* How long a timeout we schedule for the actual update (that occurs
  * in a timeout). This effectively sets an upper bound on how
@@ -100,8 +101,44 @@ struct hncp_sd_struct
   /* Callbacks from other modules */
   struct iface_user iface;
   struct hncp_link_user link;
+
+  /* Per-endpoint DDZ state (hncp_sd_ddz) */
+  struct vlist_tree ddzs;
 };
 
+/* Per-endpoint delegated zone state. It is maintained based on local
+ * assigned prefix TLV changes, so that only the DDZ TLVs of the
+ * endpoint that changed have to be republished. */
+typedef struct hncp_sd_ddz_struct {
+  struct vlist_node in_ddzs;
+
+  /* Key: endpoint identifier */
+  ep_id_t ep_id;
+
+  /* Locally assigned prefixes on the endpoint (hncp_sd_ddz_ap) */
+  struct vlist_tree aps;
+
+  /* Currently published forward DDZ TLV (copy), if any */
+  struct tlv_attr *forward;
+
+  /* Should the published TLVs be recalculated */
+  bool dirty;
+} hncp_sd_ddz_s, *hncp_sd_ddz;
+
+typedef struct hncp_sd_ddz_ap_struct {
+  struct vlist_node in_aps;
+
+  /* Key: assigned prefix */
+  struct prefix prefix;
+
+  /* Number of local assigned prefix TLVs referring to this prefix;
+   * entry is removed at next _publish_ddzs if it drops to zero. */
+  int count;
+
+  /* Currently published reverse DDZ TLV (copy), if any */
+  struct tlv_attr *reverse;
+} hncp_sd_ddz_ap_s, *hncp_sd_ddz_ap;
+
 static void _should_update(hncp_sd sd, int v)
 {
   L_DEBUG("hncp_sd/should_update:%d", v);
@@ -212,105 +249,256 @@ void hncp_sd_dump_link_fqdn(hncp_sd sd, dncp_ep ep,
            ifname, sd->router_name, sd->hncp->domain);
 }
 
-static void _publish_ddz(hncp_sd sd, dncp_ep ep,
-                         int flags_forward,
-                         struct prefix *assigned_prefix)
+static int _compare_ddzs(const void *a, const void *b, void *ptr __unused)
 {
-  hncp_t_dns_delegated_zone dh;
-  unsigned char buf[sizeof(struct tlv_attr) +
-                    sizeof(*dh) +
-                    DNS_MAX_ESCAPED_LEN];
-  char tbuf[DNS_MAX_ESCAPED_LEN];
+  hncp_sd_ddz d1 = (hncp_sd_ddz) a, d2 = (hncp_sd_ddz) b;
 
-  /* Forward DDZ handling (note: duplication doesn't matter) */
-  dh = (void *)buf;
-  memset(dh, 0, sizeof(*dh));
-  struct in6_addr *a = hncp_get_ipv6_address(sd->hncp, ep->ifname);
-  if (!a)
+  return d1->ep_id < d2->ep_id ? -1 : d1->ep_id > d2->ep_id;
+}
+
+static void _update_ddz(struct vlist_tree *t __unused,
+                        struct vlist_node *node_new __unused,
+                        struct vlist_node *node_old)
+{
+  hncp_sd_ddz ddz = container_of(node_old, hncp_sd_ddz_s, in_ddzs);
+
+  if (!node_old)
     return;
-  *((struct in6_addr *)dh->address) = *a;
-  hncp_sd_dump_link_fqdn(sd, ep, ep->ifname, tbuf, sizeof(tbuf));
-  int r = escaped2ll(tbuf, dh->ll, DNS_MAX_ESCAPED_LEN);
-  if (r < 0)
+  vlist_flush_all(&ddz->aps);
+  tlv_free(ddz->forward);
+  free(ddz);
+}
+
+static int _compare_ddz_aps(const void *a, const void *b, void *ptr __unused)
+{
+  hncp_sd_ddz_ap a1 = (hncp_sd_ddz_ap) a, a2 = (hncp_sd_ddz_ap) b;
+
+  return prefix_cmp(&a1->prefix, &a2->prefix);
+}
+
+static void _update_ddz_ap(struct vlist_tree *t __unused,
+                           struct vlist_node *node_new __unused,
+                           struct vlist_node *node_old)
+{
+  hncp_sd_ddz_ap ap = container_of(node_old, hncp_sd_ddz_ap_s, in_aps);
+
+  if (!node_old)
     return;
-  int flen = sizeof(*dh) + r;
-  dh->flags = flags_forward;
-  dncp_add_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, flen, 0);
+  tlv_free(ap->reverse);
+  free(ap);
+}
+
+/* Produce DDZ TLV for the endpoint to the buffer. Forward DDZ is
+ * produced if assigned_prefix is NULL, and reverse one otherwise. */
+static struct tlv_attr *_produce_ddz(hncp_sd sd, dncp_ep ep,
+                                     int flags_forward,
+                                     struct prefix *assigned_prefix,
+                                     void *buf)
+{
+  struct tlv_attr *a = buf;
+  hncp_t_dns_delegated_zone dh = tlv_data(a);
+  char tbuf[DNS_MAX_ESCAPED_LEN];
+  int r;
 
-  /* Reverse DDZ handling */
-  /* (.ip6.arpa. or .in-addr.arpa.). */
+  memset(dh, 0, sizeof(*dh));
+  struct in6_addr *addr = hncp_get_ipv6_address(sd->hncp, ep->ifname);
+  if (!addr)
+    return NULL;
+  *((struct in6_addr *)dh->address) = *addr;
   if (assigned_prefix)
     {
+      /* Reverse DDZ handling */
+      /* (.ip6.arpa. or .in-addr.arpa.). */
       r = _push_reverse_ll(assigned_prefix, dh->ll, DNS_MAX_ESCAPED_LEN);
-      if (r < 0)
-        return;
-      flen = sizeof(*dh) + r;
       dh->flags = 0;
-      dncp_add_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, flen, 0);
     }
+  else
+    {
+      /* Forward DDZ handling */
+      hncp_sd_dump_link_fqdn(sd, ep, ep->ifname, tbuf, sizeof(tbuf));
+      r = escaped2ll(tbuf, dh->ll, DNS_MAX_ESCAPED_LEN);
+      dh->flags = flags_forward;
+    }
+  if (r < 0)
+    return NULL;
+  tlv_init(a, HNCP_T_DNS_DELEGATED_ZONE, TLV_SIZE + sizeof(*dh) + r);
+  tlv_fill_pad(a);
+  return a;
 }
 
-static void _publish_ddzs(hncp_sd sd)
+/* Make sure the published DDZ TLV matches what we want. */
+static void _set_ddz(hncp_sd sd, struct tlv_attr **published,
+                     struct tlv_attr *a)
 {
-  dncp_tlv t;
-  hncp_t_assigned_prefix_header ah;
-  dncp_ep ep;
-
-  if (!(sd->should_update & UPDATE_FLAG_LOCAL_DDZ))
+  if (*published)
+    {
+      if (a && tlv_attr_equal(*published, a))
+        return;
+      dncp_remove_tlv_matching(sd->dncp, tlv_id(*published),
+                               tlv_data(*published), tlv_len(*published));
+      tlv_free(*published);
+      *published = NULL;
+    }
+  if (!a)
     return;
-  sd->should_update &= ~UPDATE_FLAG_LOCAL_DDZ;
-  L_DEBUG("_publish_ddzs");
-  (void)dncp_remove_tlvs_by_type(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE);
-  dncp_for_each_tlv(sd->dncp, t)
-    if ((ah = hncp_tlv_ap(dncp_tlv_get_attr(t))))
-      {
-        ep = dncp_find_ep_by_id(sd->dncp, ah->ep_id);
-
-        /* May be just race condition or whatever, silently ignore */
-        if (!ep)
-          continue;
+  if (!dncp_add_tlv_attr(sd->dncp, a, 0))
+    return;
+  *published = tlv_memdup(a);
+}
 
-        struct prefix p;
-        p.plen = ah->prefix_length_bits;
-        memcpy(&p.prefix, ah->prefix_data, ROUND_BITS_TO_BYTES(p.plen));
+#define DDZ_BUF_SIZE (TLV_SIZE + sizeof(hncp_t_dns_delegated_zone_s) + \
+                      DNS_MAX_ESCAPED_LEN + TLV_ATTR_ALIGN)
+
+static void _publish_ddz(hncp_sd sd, hncp_sd_ddz ddz)
+{
+  dncp_ep ep = dncp_find_ep_by_id(sd->dncp, ddz->ep_id);
+  unsigned char buf[DDZ_BUF_SIZE];
+  hncp_sd_ddz_ap ap, ap2;
+  bool has_ap = false;
 
-        _publish_ddz(sd, ep, HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE
-                     | HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE, &p);
-      }
+  ddz->dirty = false;
+  vlist_for_each_element_safe(&ddz->aps, ap, in_aps, ap2)
+    {
+      if (!ap->count)
+        {
+          _set_ddz(sd, &ap->reverse, NULL);
+          vlist_delete(&ddz->aps, &ap->in_aps);
+          continue;
+        }
+      has_ap = true;
+      /* May be just race condition or whatever, silently ignore */
+      _set_ddz(sd, &ap->reverse,
+               ep ? _produce_ddz(sd, ep, 0, &ap->prefix, buf) : NULL);
+    }
 
   /*
-   * Second stage: publish DDZs ALSO for any other interface, but if
-   * and only if there is no corresponding DDZ already (which has
-   * browse flag set -> duplicate detection would not work).
+   * Forward DDZ is published with browse flags on endpoints that have
+   * assigned prefix. Otherwise, it is published without the flags
+   * (duplicate detection would not work otherwise) if and only if the
+   * endpoint is enabled.
    *
    * This applies to cases where someone else publishes AP, but we
    * want old names to work (or 'all' names to work, depending on your
    * point of view).
    */
-  dncp_for_each_enabled_ep(sd->dncp, ep)
-    {
-      bool found = false;
-
-      dncp_for_each_tlv(sd->dncp, t)
-        if ((ah = hncp_tlv_ap(dncp_tlv_get_attr(t))))
-          {
-            if (ah->ep_id == dncp_ep_get_id(ep))
-              {
-                found = true;
-                break;
-              }
-          }
-      if (found)
-        continue;
-      /* Not found -> produce forward DDZ only. */
-      _publish_ddz(sd, ep, 0, NULL);
+  if (ep && (has_ap || dncp_ep_is_enabled(ep)))
+    _set_ddz(sd, &ddz->forward,
+             _produce_ddz(sd, ep,
+                          has_ap ? (HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE
+                                    | HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
+                          : 0, NULL, buf));
+  else
+    _set_ddz(sd, &ddz->forward, NULL);
+
+  if (!has_ap && !ddz->forward)
+    vlist_delete(&sd->ddzs, &ddz->in_ddzs);
+}
+
+static hncp_sd_ddz _find_ddz(hncp_sd sd, ep_id_t ep_id, bool create)
+{
+  hncp_sd_ddz_s fake = { .ep_id = ep_id };
+  hncp_sd_ddz ddz = vlist_find(&sd->ddzs, &fake, &fake, in_ddzs);
+
+  if (ddz || !create)
+    return ddz;
+  if (!(ddz = calloc(1, sizeof(*ddz))))
+    return NULL;
+  ddz->ep_id = ep_id;
+  vlist_init(&ddz->aps, _compare_ddz_aps, _update_ddz_ap);
+  vlist_add(&sd->ddzs, &ddz->in_ddzs, ddz);
+  return ddz;
+}
+
+static void _publish_ddzs(hncp_sd sd)
+{
+  hncp_sd_ddz ddz, ddz2;
+  dncp_ep ep;
+
+  if (!(sd->should_update & (UPDATE_FLAG_LOCAL_DDZ | UPDATE_FLAG_LOCAL_AP)))
+    return;
+  L_DEBUG("_publish_ddzs%s",
+          sd->should_update & UPDATE_FLAG_LOCAL_DDZ ? " (all)" : "");
+  if (sd->should_update & UPDATE_FLAG_LOCAL_DDZ)
+    {
+      /* Something that affects every endpoint changed (e.g. names,
+       * addresses or set of endpoints) -> recalculate everything. */
+      vlist_for_each_element(&sd->ddzs, ddz, in_ddzs)
+        ddz->dirty = true;
+      dncp_for_each_enabled_ep(sd->dncp, ep)
+        if ((ddz = _find_ddz(sd, dncp_ep_get_id(ep), true)))
+          ddz->dirty = true;
+    }
+  sd->should_update &= ~(UPDATE_FLAG_LOCAL_DDZ | UPDATE_FLAG_LOCAL_AP);
+  vlist_for_each_element_safe(&sd->ddzs, ddz, in_ddzs, ddz2)
+    if (ddz->dirty)
+      _publish_ddz(sd, ddz);
+}
+
+static void _write_node_name(hncp_sd sd, FILE *f, md5_ctx_t *ctx,
+                             struct tlv_attr *a)
+{
+  hncp_t_node_name rname = tlv_data(a);
+  int namelen = tlv_len(a) - sizeof(hncp_t_node_name_s);
+
+  if (namelen > 0 && namelen >= rname->name_length
+      && rname->name_length && rname->name_length <= DNS_MAX_L_LEN)
+    {
+      md5_hash(rname, tlv_len(a), ctx);
+      fprintf(f, "host-record=%.*s.%s,%s\n",
+              rname->name_length, rname->name, sd->hncp->domain,
+              ADDR_REPR(&rname->address));
     }
 }
 
+static void _write_ddz(hncp_sd sd, FILE *f, md5_ctx_t *ctx,
+                       dncp_node n, struct tlv_attr *a)
+{
+  /* Decode the labels */
+  char buf[DNS_MAX_ESCAPED_LEN];
+  char buf2[256];
+  char *server;
+  int port;
+  hncp_t_dns_delegated_zone dh;
+
+  if (tlv_len(a) < (sizeof(*dh)+1))
+    return;
+
+  dh = tlv_data(a);
+  if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
+                 buf, sizeof(buf)) < 0)
+    return;
+
+  md5_hash(a, tlv_raw_len(a), ctx);
+
+  if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE)
+    fprintf(f, "ptr-record=b._dns-sd._udp.%s,%s\n",
+            sd->hncp->domain, buf);
+  if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
+    fprintf(f, "ptr-record=lb._dns-sd._udp.%s,%s\n",
+            sd->hncp->domain, buf);
+  if (dncp_node_is_self(n))
+    {
+      server = LOCAL_OHP_ADDRESS;
+      port = LOCAL_OHP_PORT;
+    }
+  else
+    {
+      server = buf2;
+      port = DNS_PORT;
+      if (!inet_ntop(AF_INET6, dh->address,
+                     buf2, sizeof(buf2)))
+        {
+          L_ERR("inet_ntop failed in hncp_sd_write_dnsmasq_conf");
+          return;
+        }
+    }
+  fprintf(f, "server=/%s/%s#%d\n", buf, server, port);
+}
+
 bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
 {
+  dncp_network_tlv tn, tz;
   dncp_node n;
-  struct tlv_attr *a;
   FILE *f = fopen(filename, "w");
   md5_ctx_t ctx;
 
@@ -320,8 +508,8 @@ bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
       L_ERR("unable to open %s for writing dnsmasq conf", filename);
       return false;
     }
-  /* Basic idea: Traverse through the hncp node+tlv graph _once_,
-   * producing appropriate configuration file.
+  /* Basic idea: Traverse through the relevant TLVs of the whole
+   * network _once_, producing appropriate configuration file.
    *
    * What do we need to take care of?
    * - <routername>.<domain>
@@ -332,66 +520,27 @@ bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
    *
    * <subdomain>'s ~NS (remote, real IP)
    * <subdomain>'s ~NS (local, LOCAL_OHP_ADDRESS)
+   *
+   * Both TLV types are indexed in node order; merge them so that the
+   * output goes node by node, names first, like a scan of the nodes.
    */
-  dncp_for_each_node(sd->dncp, n)
+  tn = dncp_get_first_network_tlv(sd->dncp, HNCP_T_NODE_NAME);
+  tz = dncp_get_first_network_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE);
+  while (tn || tz)
     {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_NODE_NAME) {
-        hncp_t_node_name rname = tlv_data(a);
-        int namelen = tlv_len(a) - sizeof(hncp_t_node_name_s);
-        if (namelen > 0 && namelen >= rname->name_length
-            && rname->name_length && rname->name_length <= DNS_MAX_L_LEN)
-          {
-            md5_hash(rname, tlv_len(a), &ctx);
-            fprintf(f, "host-record=%.*s.%s,%s\n",
-                    rname->name_length, rname->name, sd->hncp->domain,
-                    ADDR_REPR(&rname->address));
-          }
-      }
-
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_DNS_DELEGATED_ZONE)
-        {
-          /* Decode the labels */
-          char buf[DNS_MAX_ESCAPED_LEN];
-          char buf2[256];
-          char *server;
-          int port;
-          hncp_t_dns_delegated_zone dh;
-
-          if (tlv_len(a) < (sizeof(*dh)+1))
-            continue;
-
-          dh = tlv_data(a);
-          if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
-                         buf, sizeof(buf)) < 0)
-            continue;
-
-          md5_hash(a, tlv_raw_len(a), &ctx);
-
-          if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE)
-            fprintf(f, "ptr-record=b._dns-sd._udp.%s,%s\n",
-                    sd->hncp->domain, buf);
-          if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
-            fprintf(f, "ptr-record=lb._dns-sd._udp.%s,%s\n",
-                    sd->hncp->domain, buf);
-          if (dncp_node_is_self(n))
-            {
-              server = LOCAL_OHP_ADDRESS;
-              port = LOCAL_OHP_PORT;
-            }
-          else
-            {
-              server = buf2;
-              port = DNS_PORT;
-              if (!inet_ntop(AF_INET6, dh->address,
-                             buf2, sizeof(buf2)))
-                {
-                  L_ERR("inet_ntop failed in hncp_sd_write_dnsmasq_conf");
-                  continue;
-                }
-            }
-          fprintf(f, "server=/%s/%s#%d\n", buf, server, port);
-        }
+      if (tn && (!tz || dncp_node_cmp(dncp_network_tlv_get_node(tn),
+                                      dncp_network_tlv_get_node(tz)) <= 0))
+        n = dncp_network_tlv_get_node(tn);
+      else
+        n = dncp_network_tlv_get_node(tz);
+      for (; tn && dncp_network_tlv_get_node(tn) == n ;
+           tn = dncp_network_tlv_get_next(tn))
+        _write_node_name(sd, f, &ctx, dncp_network_tlv_get_attr(tn));
+      for (; tz && dncp_network_tlv_get_node(tz) == n ;
+           tz = dncp_network_tlv_get_next(tz))
+        _write_ddz(sd, f, &ctx, n, dncp_network_tlv_get_attr(tz));
     }
+
   /* Default is 150. Given 0.5 second lifetime on service queries,
    * that's not much. */
   fprintf(f, "dns-forward-max=12345\n");
@@ -430,7 +579,7 @@ bool hncp_sd_restart_dnsmasq(hncp_sd sd)
 
 bool hncp_sd_reconfigure_ddz(hncp_sd sd)
 {
-  dncp_node n;
+  dncp_network_tlv t;
   struct tlv_attr *a;
   char buf[ARGS_MAX_LEN];
   char *c = buf;
@@ -441,26 +590,24 @@ bool hncp_sd_reconfigure_ddz(hncp_sd sd)
   PUSH_ARG(sd->p.ddz_script);
   PUSH_ARG(sd->hncp->domain);
   md5_begin(&ctx);
-  dncp_for_each_node(sd->dncp, n)
+  dncp_for_each_network_tlv(sd->dncp, t, HNCP_T_DNS_DELEGATED_ZONE)
     {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_DNS_DELEGATED_ZONE)
-        {
-          /* Decode the labels */
-          char buf[DNS_MAX_ESCAPED_LEN];
-          hncp_t_dns_delegated_zone dh = tlv_data(a);
-
-          if (tlv_len(a) < (sizeof(*dh)+1))
-            continue;
-          if (!(dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE))
-            continue;
-          dh = tlv_data(a);
-          if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
-                         buf, sizeof(buf)) < 0)
-            continue;
-
-          md5_hash(buf, strlen(buf), &ctx);
-          PUSH_ARG(buf);
-        }
+      /* Decode the labels */
+      char buf[DNS_MAX_ESCAPED_LEN];
+      hncp_t_dns_delegated_zone dh;
+
+      a = dncp_network_tlv_get_attr(t);
+      dh = tlv_data(a);
+      if (tlv_len(a) < (sizeof(*dh)+1))
+        continue;
+      if (!(dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE))
+        continue;
+      if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
+                     buf, sizeof(buf)) < 0)
+        continue;
+
+      md5_hash(buf, strlen(buf), &ctx);
+      PUSH_ARG(buf);
     }
   if (_sh_changed(&ctx, &sd->ddz_state))
     {
@@ -695,17 +842,11 @@ _tlv_ddz_matches(hncp_sd sd, struct tlv_attr *a)
 static dncp_node
 _find_router_name(hncp_sd sd)
 {
-  dncp_node n;
-  struct tlv_attr *a;
+  dncp_network_tlv t;
 
-  dncp_for_each_node(sd->dncp, n)
-    {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_NODE_NAME)
-        {
-          if (_tlv_router_name_matches(sd, a))
-            return n;
-        }
-    }
+  dncp_for_each_network_tlv(sd->dncp, t, HNCP_T_NODE_NAME)
+    if (_tlv_router_name_matches(sd, dncp_network_tlv_get_attr(t)))
+      return dncp_network_tlv_get_node(t);
   return NULL;
 }
 
@@ -728,29 +869,50 @@ _change_router_name(hncp_sd sd)
 }
 
 static void _local_tlv_cb(dncp_subscriber s,
-                          struct tlv_attr *tlv, bool add __unused)
+                          struct tlv_attr *tlv, bool add)
 {
   hncp_sd sd = container_of(s, hncp_sd_s, subscriber);
+  hncp_t_assigned_prefix_header ah;
 
   /* Note also assigned prefix changes here; they mean our published
    * zone information is no longer valid and should be republished at
-   * some point. OHP configuration may also change at this point. */
-  if (tlv_id(tlv) == HNCP_T_ASSIGNED_PREFIX)
+   * some point. OHP configuration may also change at this point.
+   *
+   * As this is called from within dncp local TLV handling, the DDZ
+   * TLVs themselves are updated later on in _publish_ddzs. */
+  if ((ah = hncp_tlv_ap(tlv)))
     {
-      _should_update(sd, UPDATE_FLAG_LOCAL_DDZ);
+      hncp_sd_ddz ddz = _find_ddz(sd, ah->ep_id, add);
+      hncp_sd_ddz_ap_s fake;
+      hncp_sd_ddz_ap ap;
+
+      if (!ddz)
+        return;
+      memset(&fake, 0, sizeof(fake));
+      fake.prefix.plen = ah->prefix_length_bits;
+      memcpy(&fake.prefix.prefix, ah->prefix_data,
+             ROUND_BITS_TO_BYTES(fake.prefix.plen));
+      ap = vlist_find(&ddz->aps, &fake, &fake, in_aps);
+      if (!ap)
+        {
+          if (!add || !(ap = calloc(1, sizeof(*ap))))
+            return;
+          ap->prefix = fake.prefix;
+          vlist_add(&ddz->aps, &ap->in_aps, ap);
+        }
+      ap->count += add ? 1 : -1;
+      ddz->dirty = true;
+      _should_update(sd, UPDATE_FLAG_LOCAL_AP);
     }
 }
 
 static struct tlv_attr *_get_dns_domain_tlv(hncp_sd sd)
 {
-  dncp_node n;
-  struct tlv_attr *a, *best = NULL;
+  dncp_network_tlv t;
+  struct tlv_attr *best = NULL;
 
-  dncp_for_each_node(sd->dncp, n)
-    {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_DOMAIN_NAME)
-        best = a;
-    }
+  dncp_for_each_network_tlv(sd->dncp, t, HNCP_T_DOMAIN_NAME)
+    best = dncp_network_tlv_get_attr(t);
   return best;
 }
 
@@ -947,6 +1109,13 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   sd->p = *p;
   if (!sd)
     return NULL;
+  if (!dncp_add_network_tlv_index(o, HNCP_T_NODE_NAME)
+      || !dncp_add_network_tlv_index(o, HNCP_T_DNS_DELEGATED_ZONE)
+      || !dncp_add_network_tlv_index(o, HNCP_T_DOMAIN_NAME))
+    {
+      free(sd);
+      return NULL;
+    }
 
   sd->iface.cb_intaddr = _intaddr_cb;
   sd->link.cb_elected = _election_cb;
@@ -986,6 +1155,7 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   sd->subscriber.tlv_change_cb = _tlv_cb;
   sd->subscriber.republish_cb = _republish_cb;
   sd->subscriber.ep_change_cb = _force_republish_cb;
+  vlist_init(&sd->ddzs, _compare_ddzs, _update_ddz);
   dncp_subscribe(o, &sd->subscriber);
 
   return sd;
@@ -996,6 +1166,7 @@ void hncp_sd_destroy(hncp_sd sd)
   iface_unregister_user(&sd->iface);
   dncp_unsubscribe(sd->dncp, &sd->subscriber);
   uloop_timeout_cancel(&sd->timeout);
+  vlist_flush_all(&sd->ddzs);
   free(sd);
 }
 
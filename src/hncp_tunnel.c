@@ -178,7 +178,7 @@ static void hncp_tunnel_discover(struct uloop_timeout *timer)
 	struct hncp_tunnel *t = container_of(timer, struct hncp_tunnel, discover);
 	struct ifaddrs *ifaddrs;
 	struct sockaddr_in6 dest = {.sin6_family = AF_INET6, .sin6_port = cpu_to_be16(HNCP_PORT)};
-	hncp_node_id node_id = (hncp_node_id)&t->dncp->own_node->node_id;
+	hncp_node_id node_id = (hncp_node_id)t->dncp->own_node->node_id;
 
 	struct {
 		uint16_t container_type;
@@ -44,36 +44,35 @@ static void wifi_ssid_update(struct uloop_timeout *to)
 	}
 
 	//Find those that are still valid
-	dncp_node n;
+	dncp_network_tlv t;
 	struct tlv_attr *tlv;
-	dncp_for_each_node(wifi->dncp, n) {
-		dncp_node_for_each_tlv_with_type(n, tlv, HNCP_T_SSID) {
-			if(tlv_len(tlv) != sizeof(hncp_t_wifi_ssid_s))
-				continue;
-
-			hncp_t_wifi_ssid tlv_ssid = (hncp_t_wifi_ssid) tlv->data;
-			if(tlv_ssid->password[HNCP_WIFI_PASSWORD_LEN] != 0 ||
-					tlv_ssid->ssid[HNCP_WIFI_SSID_LEN] != 0)
-				continue;
-
-			//Find this one
-			bool found = false;
-			for(i=0; i<HNCP_SSIDS; i++) {
-				if(wifi->ssids[i].to_delete &&
-						!strcmp(wifi->ssids[i].ssid, (char *)tlv_ssid->ssid) &&
-						!strcmp(wifi->ssids[i].password, (char *)tlv_ssid->password)) {
-					//Found, mark it as valid and go to next tlv
-					found = true;
-					wifi->ssids[i].to_delete = 0;
-					break;
-				}
+	dncp_for_each_network_tlv(wifi->dncp, t, HNCP_T_SSID) {
+		tlv = dncp_network_tlv_get_attr(t);
+		if(tlv_len(tlv) != sizeof(hncp_t_wifi_ssid_s))
+			continue;
+
+		hncp_t_wifi_ssid tlv_ssid = (hncp_t_wifi_ssid) tlv->data;
+		if(tlv_ssid->password[HNCP_WIFI_PASSWORD_LEN] != 0 ||
+				tlv_ssid->ssid[HNCP_WIFI_SSID_LEN] != 0)
+			continue;
+
+		//Find this one
+		bool found = false;
+		for(i=0; i<HNCP_SSIDS; i++) {
+			if(wifi->ssids[i].to_delete &&
+					!strcmp(wifi->ssids[i].ssid, (char *)tlv_ssid->ssid) &&
+					!strcmp(wifi->ssids[i].password, (char *)tlv_ssid->password)) {
+				//Found, mark it as valid and go to next tlv
+				found = true;
+				wifi->ssids[i].to_delete = 0;
+				break;
 			}
+		}
 
-			//Remember this one is new
-			if(!found && new_ctr != HNCP_SSIDS) {
-				new_tlvs[new_ctr] = tlv_ssid;
-				new_ctr++;
-			}
+		//Remember this one is new
+		if(!found && new_ctr != HNCP_SSIDS) {
+			new_tlvs[new_ctr] = tlv_ssid;
+			new_ctr++;
 		}
 	}
 
@@ -165,6 +164,10 @@ hncp_wifi hncp_wifi_init(hncp hncp, char *scriptpath)
 	wifi->to.cb = wifi_ssid_update;
 	wifi->script = scriptpath;
 	wifi->dncp = hncp->dncp;
+	if(!dncp_add_network_tlv_index(wifi->dncp, HNCP_T_SSID)) {
+		free(wifi);
+		return NULL;
+	}
 	wifi->subscriber.tlv_change_cb = wifi_tlv_cb;
 	exeq_init(&wifi->exeq);
 	dncp_subscribe(wifi->dncp, &wifi->subscriber);
@@ -29,6 +29,7 @@
 #include "hncp_proto.h"
 #include "hncp_link.h"
 #include "hncp_dump.h"
+#include "hncp_events.h"
 #include "platform.h"
 #include "pd.h"
 #include "dncp_trust.h"
@@ -96,6 +97,11 @@ int usage() {
 	 "\t--trust <(DTLS) path to trust consensus store file>\n"
 	 "\t--verify-path <(DTLS) path to trusted cert file>\n"
 	 "\t--verify-dir <(DTLS) path to trusted cert directory>\n"
+	 "\t--session-cache <(DTLS) path to session resumption cache file>\n"
+	 "\t--handshake-workers <(DTLS) number of handshake worker threads>\n"
+	 "\t--snapshot <path to node database snapshot file (warm restart)>\n"
+	 "\t--node-data-deltas (experimental: exchange node data changes as deltas)\n"
+	 "\t--hash-backend [md5,md5-multi,evp] (evp only with DTLS)\n"
 	 "\t-M multicast_script (enables draft-pfister-homenet-multicast support)\n"
 	 "\t-w wifi_script,[ssid1:pass2,[ssid2:pass2,...]]\n"
 	 );
@@ -129,6 +135,7 @@ int main(__unused int argc, char *argv[])
 
 	// Register multicalls
 	hd_register_rpc();
+	he_register_rpc();
 #ifdef DTLS
 	dncp_trust_register_multicall();
 #endif
@@ -161,7 +168,14 @@ int main(__unused int argc, char *argv[])
 #endif
 	const char *dtls_path = NULL;
 	const char *dtls_dir = NULL;
+#ifdef DTLS
+	const char *dtls_sessions = NULL;
+	int dtls_workers = 0;
+#endif
 	const char *pidfile = NULL;
+	const char *snapshot_file = NULL;
+	bool node_data_deltas = false;
+	const char *hash_backend = NULL;
 	const char *wifi = NULL;
 	bool strict = false;
 
@@ -177,6 +191,11 @@ int main(__unused int argc, char *argv[])
 		GOL_TRUST, /* DTLS trust cache filename */
 		GOL_DIR, /* DTLS trusted cert dir */
 		GOL_PATH, /* DTLS trusted cert file path */
+		GOL_SESSIONS, /* DTLS session cache filename */
+		GOL_WORKERS, /* DTLS handshake worker threads */
+		GOL_SNAPSHOT, /* Node database snapshot filename */
+		GOL_DELTAS, /* Node data deltas */
+		GOL_HASH, /* Hash backend */
 	};
 
 	struct option longopts[] = {
@@ -192,6 +211,11 @@ int main(__unused int argc, char *argv[])
 			{ "privatekey",    required_argument,      NULL,           GOL_KEY },
 			{ "verifydir",    required_argument,      NULL,           GOL_DIR },
 			{ "verifypath",    required_argument,      NULL,           GOL_PATH },
+			{ "session-cache",    required_argument,      NULL,           GOL_SESSIONS },
+			{ "handshake-workers",    required_argument,      NULL,           GOL_WORKERS },
+			{ "snapshot",    required_argument,      NULL,           GOL_SNAPSHOT },
+			{ "node-data-deltas",    no_argument,      NULL,           GOL_DELTAS },
+			{ "hash-backend",    required_argument,      NULL,           GOL_HASH },
 			{ "help",	 no_argument,		 NULL,           '?' },
 			{ NULL,          0,                      NULL,           0 }
 	};
@@ -270,6 +294,25 @@ int main(__unused int argc, char *argv[])
 		case GOL_PATH:
 			dtls_path = optarg;
 			break;
+		case GOL_SESSIONS:
+#ifdef DTLS
+			dtls_sessions = optarg;
+#endif
+			break;
+		case GOL_WORKERS:
+#ifdef DTLS
+			dtls_workers = atoi(optarg);
+#endif
+			break;
+		case GOL_SNAPSHOT:
+			snapshot_file = optarg;
+			break;
+		case GOL_DELTAS:
+			node_data_deltas = true;
+			break;
+		case GOL_HASH:
+			hash_backend = optarg;
+			break;
 		case GOL_KEY:
 #ifdef DTLS
 			dtls_key = optarg;
@@ -295,8 +338,18 @@ int main(__unused int argc, char *argv[])
 		return 42;
 	}
 
+	if (hash_backend && !hncp_set_hash_backend(h, hash_backend))
+		return 3;
+
 	hd_init(hncp_get_dncp(h));
 
+	if (node_data_deltas)
+		dncp_set_node_data_deltas(hncp_get_dncp(h), true);
+
+	if (snapshot_file &&
+	    dncp_set_snapshot_file(hncp_get_dncp(h), snapshot_file) < 0)
+		L_ERR("Unable to load node snapshot %s", snapshot_file);
+
 	if (sd_params.dnsmasq_script && sd_params.dnsmasq_bonus_file && sd_params.ohp_script)
 		link_config.cap_mdnsproxy = 4;
 
@@ -322,6 +375,14 @@ int main(__unused int argc, char *argv[])
 						return 13;
 				}
 		}
+		if (dtls_sessions) {
+				if (!dtls_set_session_file(d, dtls_sessions))
+						L_ERR("Unable to use session cache %s", dtls_sessions);
+		}
+		if (dtls_workers) {
+				if (!dtls_set_handshake_workers(d, dtls_workers))
+						L_ERR("Unable to start handshake workers");
+		}
 		hncp_set_dtls(h, d);
 		if (dtls_password) {
 				if (!(dtls_set_psk(d,
@@ -396,6 +457,8 @@ int main(__unused int argc, char *argv[])
 		return 17;
 	}
 
+	he_init(hncp_get_dncp(h), hncp_pa);
+
 	//PA configuration
 
 	if(pa_store_file && hncp_pa_storage_set(hncp_pa, pa_store_file)) {
@@ -489,6 +552,9 @@ int main(__unused int argc, char *argv[])
 
 	uloop_run();
 
+	if (snapshot_file)
+		dncp_save_snapshot(hncp_get_dncp(h));
+
 	if (pidfile)
 		unlink(pidfile);
 	return 0;
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <resolv.h>
@@ -30,15 +31,24 @@
 #include "hncp_dump.h"
 #include "dncp_trust.h"
 #include "hncp_pa.h"
+#include "hncp_io.h"
+#include "dncp_util.h"
+#include "backend_batch.h"
 
 static char backend[] = CMAKE_INSTALL_PREFIX "/sbin/hnetd-backend";
+static struct backend_batch backend_co = { .fd = { .fd = -1 } };
 static const char *hnetd_pd_socket = NULL;
 static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events);
 static int ipc_ifupdown(const char *method, int argc, char* const argv[]);
 static pid_t platform_run(char *argv[]);
+static void ipc_stream_accept(struct uloop_fd *fd, __unused unsigned int events);
 static struct uloop_fd ipcsock = { .cb = ipc_handle };
+static struct uloop_fd ipcstreamsock = { .cb = ipc_stream_accept };
 static const char *ipcpath = "/var/run/hnetd.sock";
+static const char *ipcpath_stream = "/var/run/hnetd-stream.sock";
+#define IPC_STREAM_MAX_MSG (1024*1024)
 static const char *ipcpath_client = "/var/run/hnetd-client%d.sock";
+static hncp hncp_p = NULL;
 static dncp dncp_p = NULL;
 static hncp_pa hncp_pa_p = NULL;
 static struct platform_rpc_method *hnet_rpc_methods[PLATFORM_RPC_MAX];
@@ -51,6 +61,7 @@ struct platform_iface {
 
 int platform_init(hncp hncp_in, hncp_pa pa, const char *pd_socket)
 {
+	hncp_p = hncp_in;
 	dncp_p = hncp_get_dncp(hncp_in);
 	hncp_pa_p = pa;
 	hnetd_pd_socket = pd_socket;
@@ -63,8 +74,17 @@ int platform_init(hncp hncp_in, hncp_pa pa, const char *pd_socket)
 	}
 	uloop_fd_add(&ipcsock, ULOOP_EDGE_TRIGGER | ULOOP_READ);
 
+	unlink(ipcpath_stream);
+	ipcstreamsock.fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, ipcpath_stream, NULL);
+	if (ipcstreamsock.fd < 0)
+		L_WARN("Unable to create streaming IPC socket");
+	else
+		uloop_fd_add(&ipcstreamsock, ULOOP_EDGE_TRIGGER | ULOOP_READ);
+
 	char *argv[] = {backend, "setbfs", NULL};
 	platform_run(argv);
+
+	backend_batch_init(&backend_co, backend);
 	return 0;
 }
 
@@ -140,6 +160,79 @@ int platform_rpc_cli(const char *method, struct blob_attr *in)
 	return ret;
 }
 
+// Read exactly len bytes from a blocking stream socket
+static int ipc_stream_recv(int sock, void *buf, size_t len)
+{
+	size_t rcvd = 0;
+	while (rcvd < len) {
+		ssize_t l = recv(sock, (uint8_t*)buf + rcvd, len - rcvd, 0);
+		if (l < 0 && errno == EINTR)
+			continue;
+		else if (l <= 0)
+			return (rcvd || l < 0) ? -1 : 0;
+		rcvd += l;
+	}
+	return 1;
+}
+
+int platform_rpc_cli_stream(const char *method, struct blob_attr *in,
+		platform_rpc_reply_cb *cb, void *priv, int timeout)
+{
+	int sock = usock(USOCK_UNIX, ipcpath_stream, NULL);
+	if (sock < 0) {
+		perror("Failed to connect to hnetd");
+		return 2;
+	}
+
+	struct blob_buf b = {NULL, NULL, 0, NULL};
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "command", method);
+
+	struct blob_attr *a;
+	unsigned rem;
+	blobmsg_for_each_attr(a, in, rem)
+		blobmsg_add_blob(&b, a);
+
+	// Unlike the datagram socket, requests are sent including their header
+	// and replies are a sequence of blobs terminated by closing the stream
+	int ret = 3, r = 0;
+	if (send(sock, b.head, blob_raw_len(b.head), MSG_NOSIGNAL) == (ssize_t)blob_raw_len(b.head)) {
+		struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		struct blob_attr hdr, *msg;
+		ret = 0;
+		while (!ret && (r = ipc_stream_recv(sock, &hdr, sizeof(hdr))) > 0) {
+			size_t len = blob_raw_len(&hdr);
+			if (len < sizeof(hdr) || len > IPC_STREAM_MAX_MSG || !(msg = malloc(len))) {
+				r = -1;
+				break;
+			}
+
+			memcpy(msg, &hdr, sizeof(hdr));
+			if ((r = ipc_stream_recv(sock, &msg[1], len - sizeof(hdr))) > 0)
+				ret = cb(msg, priv);
+			free(msg);
+
+			if (r <= 0) {
+				r = -1;
+				break;
+			}
+		}
+
+		if (r < 0) {
+			perror("Failed to retrieve from hnetd");
+			ret = 4;
+		}
+	} else {
+		perror("Failed to send to hnetd");
+	}
+
+	blob_buf_free(&b);
+	close(sock);
+	return ret;
+}
+
 int platform_rpc_multicall(int argc, char *const argv[])
 {
 	char *method = strstr(argv[0], "hnet-");
@@ -185,9 +278,11 @@ int platform_rpc_multicall(int argc, char *const argv[])
 	return -1;
 }
 
-// Run platform script
+// Run platform script (e.g. a DHCP client), after the queued commands
 static pid_t platform_run(char *argv[])
 {
+	backend_batch_sync(&backend_co);
+
 	pid_t pid = fork();
 	if (pid == 0) {
 		execv(argv[0], argv);
@@ -196,11 +291,15 @@ static pid_t platform_run(char *argv[])
 	return pid;
 }
 
-//
+// Run a backend command, through the co-process if available
+static void platform_call_env(char *argv[], char *envp[])
+{
+	backend_batch_call(&backend_co, argv, envp);
+}
+
 static void platform_call(char *argv[])
 {
-	pid_t pid = platform_run(argv);
-	waitpid(pid, NULL, 0);
+	platform_call_env(argv, NULL);
 }
 
 // Constructor for openwrt-specific interface part
@@ -413,53 +512,47 @@ void platform_set_dhcpv6_send(struct iface *c, const void *dhcpv6_data, size_t l
 		}
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		char *argv[] = {backend, "setdhcpv6", c->ifname, NULL};
+	char *argv[] = {backend, "setdhcpv6", c->ifname, NULL};
 
-		char *dnsbuf = malloc((dns_cnt + dns4_cnt) * INET6_ADDRSTRLEN + 5);
-		strcpy(dnsbuf, "DNS=");
-		size_t dnsbuflen = strlen(dnsbuf);
+	char *dnsbuf = malloc((dns_cnt + dns4_cnt) * INET6_ADDRSTRLEN + 5);
+	strcpy(dnsbuf, "DNS=");
+	size_t dnsbuflen = strlen(dnsbuf);
 
-		char *rawbuf = malloc(c->dhcpv6_len_out * 2 + 10);
-		strncpy(rawbuf, "PASSTHRU=", 10);
+	char *rawbuf = malloc(c->dhcpv6_len_out * 2 + 10);
+	strncpy(rawbuf, "PASSTHRU=", 10);
 
-		dhcpv6_for_each_option(c->dhcpv6_data_out, ((uint8_t*)c->dhcpv6_data_out) + c->dhcpv6_len_out, otype, olen, odata)
-			if (otype != DHCPV6_OPT_DNS_SERVERS && otype != DHCPV6_OPT_DNS_DOMAIN)
-				hexlify(rawbuf + strlen(rawbuf), &odata[-4], olen + 4);
+	dhcpv6_for_each_option(c->dhcpv6_data_out, ((uint8_t*)c->dhcpv6_data_out) + c->dhcpv6_len_out, otype, olen, odata)
+		if (otype != DHCPV6_OPT_DNS_SERVERS && otype != DHCPV6_OPT_DNS_DOMAIN)
+			hexlify(rawbuf + strlen(rawbuf), &odata[-4], olen + 4);
 
-		char *radefaultbuf = malloc(16);
-		snprintf(radefaultbuf, 16, "RA_DEFAULT=%d", (c->flags & IFACE_FLAG_ULA_DEFAULT) ? 1 : 0);
+	char radefaultbuf[16];
+	snprintf(radefaultbuf, sizeof(radefaultbuf), "RA_DEFAULT=%d", (c->flags & IFACE_FLAG_ULA_DEFAULT) ? 1 : 0);
 
-		for (size_t i = 0; i < dns_cnt; ++i) {
-			inet_ntop(AF_INET6, &dns[i], &dnsbuf[dnsbuflen], INET6_ADDRSTRLEN);
-			dnsbuflen = strlen(dnsbuf);
-			dnsbuf[dnsbuflen++] = ' ';
-		}
+	for (size_t i = 0; i < dns_cnt; ++i) {
+		inet_ntop(AF_INET6, &dns[i], &dnsbuf[dnsbuflen], INET6_ADDRSTRLEN);
+		dnsbuflen = strlen(dnsbuf);
+		dnsbuf[dnsbuflen++] = ' ';
+	}
 
-		for (size_t i = 0; i < dns4_cnt; ++i) {
-			inet_ntop(AF_INET, &dns4[i], &dnsbuf[dnsbuflen], INET_ADDRSTRLEN);
-			dnsbuflen = strlen(dnsbuf);
-			dnsbuf[dnsbuflen++] = ' ';
-		}
+	for (size_t i = 0; i < dns4_cnt; ++i) {
+		inet_ntop(AF_INET, &dns4[i], &dnsbuf[dnsbuflen], INET_ADDRSTRLEN);
+		dnsbuflen = strlen(dnsbuf);
+		dnsbuf[dnsbuflen++] = ' ';
+	}
 
-		if (dns_cnt || dns4_cnt)
-			dnsbuf[dnsbuflen - 1] = 0;
+	if (dns_cnt || dns4_cnt)
+		dnsbuf[dnsbuflen - 1] = 0;
 
-		char guestbuf[10];
-		sprintf(guestbuf, "GUEST=%s",
-			(c->flags & IFACE_FLAG_GUEST) == IFACE_FLAG_GUEST ?
-			"1": "");
-		putenv(guestbuf);
-		putenv(dnsbuf);
-		putenv(domainbuf);
-		putenv(rawbuf);
-		putenv(radefaultbuf);
+	char guestbuf[10];
+	sprintf(guestbuf, "GUEST=%s",
+		(c->flags & IFACE_FLAG_GUEST) == IFACE_FLAG_GUEST ?
+		"1": "");
 
-		execv(argv[0], argv);
-		_exit(128);
-	}
-	waitpid(pid, NULL, 0);
+	char *envp[] = {guestbuf, dnsbuf, domainbuf, rawbuf, radefaultbuf, NULL};
+	platform_call_env(argv, envp);
+
+	free(dnsbuf);
+	free(rawbuf);
 }
 
 void platform_set_iface(const char *name, bool enable)
@@ -491,6 +584,9 @@ enum ipc_option {
 	OPT_KEEPALIVE_INTERVAL,
 	OPT_TRICKLE_K,
 	OPT_DNSNAME,
+	OPT_STREAM,
+	OPT_STREAM_PEERS,
+	OPT_ACCEPT_INSECURE_NONLOCAL,
 	OPT_MAX
 };
 
@@ -514,6 +610,9 @@ struct blobmsg_policy ipc_policy[] = {
 	[OPT_KEEPALIVE_INTERVAL] = { .name = "keepalive_interval", .type = BLOBMSG_TYPE_INT32 },
 	[OPT_TRICKLE_K] = { .name = "trickle_k", .type = BLOBMSG_TYPE_INT32 },
 	[OPT_DNSNAME] = { .name = "dnsname", .type = BLOBMSG_TYPE_STRING},
+	[OPT_STREAM] = { .name = "stream", .type = BLOBMSG_TYPE_BOOL},
+	[OPT_STREAM_PEERS] = { .name = "stream_peers", .type = BLOBMSG_TYPE_ARRAY},
+	[OPT_ACCEPT_INSECURE_NONLOCAL] = { .name = "accept_insecure_nonlocal", .type = BLOBMSG_TYPE_BOOL},
 };
 
 enum ipc_prefix_option {
@@ -550,7 +649,7 @@ int ipc_ifupdown(const char *method, int argc, char *const argv[])
 	char *entry;
 
 	int c, i;
-	while ((c = getopt(argc, argv, "c:dp:l:i:m:n:uk:P:4:6:D:L")) > 0) {
+	while ((c = getopt(argc, argv, "c:dp:l:i:m:n:uk:P:4:6:D:LSC:N")) > 0) {
 		switch(c) {
 		case 'c':
 			blobmsg_add_string(&b, "mode", optarg);
@@ -620,6 +719,23 @@ int ipc_ifupdown(const char *method, int argc, char *const argv[])
 		case 'L':
 			blobmsg_add_u8(&b, "ip4uplinklimit", 1);
 			break;
+
+		case 'S':
+			blobmsg_add_u8(&b, "stream", 1);
+			break;
+
+		case 'C':
+			buf = strdup(optarg);
+			p = blobmsg_open_array(&b, "stream_peers");
+			for (entry = strtok(buf, ","); entry; entry = strtok(NULL, ","))
+				blobmsg_add_string(&b, NULL, entry);
+			blobmsg_close_array(&b, p);
+			free(buf);
+			break;
+
+		case 'N':
+			blobmsg_add_u8(&b, "accept_insecure_nonlocal", 1);
+			break;
 		}
 	}
 
@@ -739,6 +855,32 @@ static void ipc_handle_v4uplink(struct iface *c, struct blob_attr *tb[])
 	iface_commit_ipv4_uplink(c);
 }
 
+// Switch the interface to TCP streams, and add its stream peers
+static void ipc_handle_stream(struct iface *c, struct blob_attr *tb[])
+{
+	bool enabled = !tb[OPT_STREAM] || blobmsg_get_bool(tb[OPT_STREAM]);
+	struct sockaddr_in6 sa;
+	struct in6_addr addr;
+	struct blob_attr *k;
+	unsigned rem;
+
+	if (!hncp_io_set_stream(hncp_p, c->ifname, enabled)) {
+		L_ERR("unable to set stream mode on %s", c->ifname);
+		return;
+	}
+	if (!enabled || !tb[OPT_STREAM_PEERS])
+		return;
+	blobmsg_for_each_attr(k, tb[OPT_STREAM_PEERS], rem) {
+		if (blobmsg_type(k) != BLOBMSG_TYPE_STRING ||
+				inet_pton(AF_INET6, blobmsg_get_string(k), &addr) < 1) {
+			L_ERR("invalid stream peer on %s", c->ifname);
+			continue;
+		}
+		sockaddr_in6_set(&sa, &addr, HNCP_PORT);
+		hncp_io_add_stream_peer(hncp_p, c->ifname, &sa);
+	}
+}
+
 // Handle internal IPC message
 static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events)
 {
@@ -894,6 +1036,12 @@ static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events)
 			if(iface && tb[OPT_DNSNAME] && (conf = dncp_find_ep_by_name(dncp_p, iface->ifname)))
 				strncpy(conf->dnsname, blobmsg_get_string(tb[OPT_DNSNAME]), sizeof(conf->dnsname));
 
+			if(iface && tb[OPT_ACCEPT_INSECURE_NONLOCAL] && (conf = dncp_find_ep_by_name(dncp_p, iface->ifname)))
+				conf->accept_insecure_nonlocal_traffic = blobmsg_get_bool(tb[OPT_ACCEPT_INSECURE_NONLOCAL]);
+
+			if(iface && (tb[OPT_STREAM] || tb[OPT_STREAM_PEERS]))
+				ipc_handle_stream(iface, tb);
+
 			if (tb[OPT_IPV4SOURCE])
 				ipc_handle_v4uplink(c, tb);
 
@@ -905,6 +1053,7 @@ static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events)
 		} else if (!strcmp(cmd, "ifdown")) {
 			hncp_pa_conf_iface_update(hncp_pa_p, c->ifname); //Remove hncp_pa conf
 			hncp_pa_conf_iface_flush(hncp_pa_p, c->ifname);
+			hncp_io_set_stream(hncp_p, c->ifname, false);
 			iface_remove(c);
 		} else if (!strcmp(cmd, "enable_ipv4_uplink")) {
 			ipc_handle_v4uplink(c, tb);
@@ -922,3 +1071,186 @@ static void ipc_handle(struct uloop_fd *fd, __unused unsigned int events)
 		sendto(fd->fd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&sender, sender_len);
 	}
 }
+
+// Streaming IPC client: reads one request, then writes reply messages
+// as the socket becomes writable so large replies are never built at once
+struct ipc_stream {
+	struct uloop_fd fd;
+	struct uloop_timeout kick;
+	struct platform_rpc_method *method;
+	struct platform_rpc_stream s;
+	struct blob_attr hdr;     // Request header, until req is allocated
+	struct blob_attr *req;
+	size_t req_len;
+	struct blob_buf out;
+	size_t out_off;
+	bool started;
+	bool done;
+};
+
+static void ipc_stream_free(struct ipc_stream *st)
+{
+	if (st->started && st->method->stream && st->method->stream_done)
+		st->method->stream_done(st->method, &st->s);
+
+	uloop_timeout_cancel(&st->kick);
+	uloop_fd_delete(&st->fd);
+	close(st->fd.fd);
+	blob_buf_free(&st->out);
+	free(st->req);
+	free(st);
+}
+
+// Produce the next reply message: returns 1 if there is one, 0 if the
+// method has nothing to send right now and -1 when the reply is complete
+static int ipc_stream_next(struct ipc_stream *st)
+{
+	if (st->done)
+		return -1;
+
+	int ret;
+	blob_buf_init(&st->out, 0);
+	st->out_off = 0;
+
+	if (!st->method) {
+		ret = -ENOENT;
+	} else if (st->method->stream) {
+		st->started = true;
+		ret = st->method->stream(st->method, &st->s, &st->out);
+	} else if (st->method->cb) {
+		ret = st->method->cb(st->method, st->req, &st->out);
+		st->done = true;
+	} else {
+		ret = -ENOTSUP;
+	}
+
+	if (ret == -EAGAIN) {
+		st->out_off = blob_raw_len(st->out.head);
+		return 0;
+	} else if (ret < 0) {
+		blob_buf_init(&st->out, 0);
+		blobmsg_add_u32(&st->out, "error", -ret);
+		st->done = true;
+	} else if (ret == 0) {
+		st->done = true;
+		return -1;
+	}
+
+	return 1;
+}
+
+static void ipc_stream_write(struct ipc_stream *st)
+{
+	while (true) {
+		if (!st->out.head || st->out_off >= blob_raw_len(st->out.head)) {
+			int ret = ipc_stream_next(st);
+			if (ret == 0)
+				return;
+			else if (ret < 0)
+				break;
+		}
+
+		ssize_t l = send(st->fd.fd, (uint8_t*)st->out.head + st->out_off,
+				blob_raw_len(st->out.head) - st->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (l < 0 && errno == EINTR)
+			continue;
+		else if (l < 0 && errno == EAGAIN)
+			return;
+		else if (l < 0)
+			break;
+		st->out_off += l;
+	}
+
+	ipc_stream_free(st);
+}
+
+static void ipc_stream_kicked(struct uloop_timeout *t)
+{
+	ipc_stream_write(container_of(t, struct ipc_stream, kick));
+}
+
+// Resume an idle stream; deferred so methods may call this from any context
+void platform_rpc_stream_kick(struct platform_rpc_stream *s)
+{
+	struct ipc_stream *st = container_of(s, struct ipc_stream, s);
+	uloop_timeout_set(&st->kick, 0);
+}
+
+static void ipc_stream_handle(struct uloop_fd *fd, __unused unsigned int events)
+{
+	struct ipc_stream *st = container_of(fd, struct ipc_stream, fd);
+
+	if (st->s.in) {
+		// Anything the client sends after its request is discarded,
+		// but this is how we learn that an idle stream was closed
+		uint8_t buf[256];
+		ssize_t l;
+		while ((l = recv(fd->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+		if (l == 0 || (l < 0 && errno != EAGAIN && errno != EINTR))
+			ipc_stream_free(st);
+		else
+			ipc_stream_write(st);
+		return;
+	}
+
+	while (true) {
+		// The header may arrive in pieces too, so it is kept in st
+		size_t len = st->req ? blob_raw_len(st->req) : sizeof(st->hdr);
+		uint8_t *buf = st->req ? (uint8_t*)st->req : (uint8_t*)&st->hdr;
+
+		ssize_t l = recv(fd->fd, buf + st->req_len, len - st->req_len, MSG_DONTWAIT);
+		if (l < 0 && errno == EAGAIN)
+			return;
+		else if (l <= 0)
+			break;
+
+		st->req_len += l;
+		if (st->req_len < len)
+			continue;
+
+		if (!st->req) {
+			size_t req_len = blob_raw_len(&st->hdr);
+			if (req_len < sizeof(st->hdr) || req_len > IPC_STREAM_MAX_MSG ||
+					!(st->req = malloc(req_len)))
+				break;
+			memcpy(st->req, &st->hdr, sizeof(st->hdr));
+			if (req_len > sizeof(st->hdr))
+				continue;
+		}
+
+		// Request complete, look up the method and start replying
+		struct blob_attr *tb[OPT_MAX];
+		blobmsg_parse(ipc_policy, OPT_MAX, tb, blob_data(st->req), blob_len(st->req));
+
+		const char *cmd = tb[OPT_COMMAND] ? blobmsg_get_string(tb[OPT_COMMAND]) : "";
+		L_DEBUG("Handling streaming ipc command %s", cmd);
+
+		for (size_t i = 0; i < rpc_methods_cnt; ++i)
+			if (!strcmp(hnet_rpc_methods[i]->name, cmd))
+				st->method = hnet_rpc_methods[i];
+
+		st->s.in = st->req;
+		uloop_fd_add(&st->fd, ULOOP_EDGE_TRIGGER | ULOOP_READ | ULOOP_WRITE);
+		ipc_stream_write(st);
+		return;
+	}
+
+	ipc_stream_free(st);
+}
+
+static void ipc_stream_accept(struct uloop_fd *fd, __unused unsigned int events)
+{
+	int sock;
+	while ((sock = accept4(fd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct ipc_stream *st = calloc(1, sizeof(*st));
+		if (!st) {
+			close(sock);
+			continue;
+		}
+
+		st->fd.fd = sock;
+		st->fd.cb = ipc_stream_handle;
+		st->kick.cb = ipc_stream_kicked;
+		uloop_fd_add(&st->fd, ULOOP_EDGE_TRIGGER | ULOOP_READ);
+	}
+}
@@ -191,6 +191,42 @@ int platform_rpc_cli(const char *method, struct blob_attr *in)
 	return 4;
 }
 
+// ubus has no streaming replies, so the complete reply is a single message
+int platform_rpc_cli_stream(const char *method, struct blob_attr *in,
+		platform_rpc_reply_cb *cb, void *priv, int timeout)
+{
+	struct blob_attr *out = NULL;
+	struct ubus_context *ubus = ubus_connect(NULL);
+
+	if (!ubus) {
+		L_ERR("Failed to connect to ubus: %s", strerror(errno));
+		return 2;
+	}
+
+	uint32_t self;
+	if (ubus_lookup_id(ubus, main_object.name, &self)) {
+		L_ERR("Failed to lookup hnetd: is it running?");
+		return 3;
+	}
+
+	if (ubus_invoke(ubus, self, method, in, platform_rpc_call_cb, &out, timeout)) {
+		L_ERR("Failed to invoke hnetd method %s", method);
+		return 3;
+	}
+
+	if (!out)
+		return 4;
+
+	int ret = cb(out, priv);
+	free(out);
+	return ret;
+}
+
+// Streams are never started over ubus
+void platform_rpc_stream_kick(__unused struct platform_rpc_stream *s)
+{
+}
+
 static int platform_rpc_handle(struct ubus_context *ctx, __unused struct ubus_object *obj,
 		struct ubus_request_data *req, const char *method, struct blob_attr *msg)
 {
@@ -50,18 +50,40 @@ struct platform_rpc_method;
 typedef int(platform_rpc_cb)(struct platform_rpc_method *method, const struct blob_attr *in, struct blob_buf *out);
 typedef int(platform_rpc_main)(struct platform_rpc_method *method, int argc, char* const argv[]);
 
+// Streaming RPC: called repeatedly to produce one reply message at a time.
+// Returns 1 if a message was put into out, 0 when done, -EAGAIN if there is
+// nothing to send yet (see platform_rpc_stream_kick), other -errno on error.
+// priv is NULL on the first call and is handed to stream_done at the end.
+struct platform_rpc_stream {
+	const struct blob_attr *in;
+	void *priv;
+};
+typedef int(platform_rpc_stream_cb)(struct platform_rpc_method *method, struct platform_rpc_stream *s, struct blob_buf *out);
+typedef void(platform_rpc_stream_done)(struct platform_rpc_method *method, struct platform_rpc_stream *s);
+
+// Resume a stream whose method returned -EAGAIN
+void platform_rpc_stream_kick(struct platform_rpc_stream *s);
+
 struct platform_rpc_method {
 	const char *name;
 	platform_rpc_cb *cb;
 	platform_rpc_main *main;
 	struct blobmsg_policy *policy;
 	size_t policy_cnt;
+	platform_rpc_stream_cb *stream;
+	platform_rpc_stream_done *stream_done;
 };
 int platform_rpc_register(struct platform_rpc_method *method);
 
 // Call RPC function from your own program
 int platform_rpc_cli(const char *name, struct blob_attr *in);
 
+// Call RPC function and receive its reply messages one by one
+typedef int(platform_rpc_reply_cb)(struct blob_attr *msg, void *priv);
+// (timeout in ms between messages, 0 waits forever)
+int platform_rpc_cli_stream(const char *name, struct blob_attr *in,
+		platform_rpc_reply_cb *cb, void *priv, int timeout);
+
 // Multicall RPC dispatcher
 int platform_rpc_multicall(int argc, char *const argv[]);
 
@@ -18,15 +18,173 @@
 
 #include "tlv.h"
 
+/*
+ * Size-class allocator for TLV buffers and node data containers.
+ *
+ * Messages and node data are built into freshly allocated tlv_bufs
+ * and released soon after, so the same few sizes are requested over
+ * and over. Blocks are rounded up to a power of two class, and freed
+ * blocks are kept on per-class free lists (up to TLV_SLAB_CACHE bytes
+ * per class) for reuse. Growing a buffer within its class is free.
+ *
+ * Not thread safe; everything TLV-related runs in the main loop.
+ */
+
+#define TLV_SLAB_MIN_SHIFT 8	/* 256 bytes, same as tlv_buffer_grow step */
+#define TLV_SLAB_CLASSES 6	/* up to 8192 bytes */
+#define TLV_SLAB_CACHE 8192	/* max bytes kept per class */
+
+struct tlv_block {
+	union {
+		struct tlv_block *next;	/* when on free list */
+		size_t size;		/* when oversize and allocated */
+	};
+	size_t class;
+	char data[] __attribute__((aligned(sizeof(void *))));
+};
+
+static struct {
+	struct tlv_block *free[TLV_SLAB_CLASSES];
+	int num_free[TLV_SLAB_CLASSES];
+	struct tlv_alloc_stats stats;
+} tlv_slab;
+
+static inline size_t
+tlv_class_size(size_t class)
+{
+	return (size_t)1 << (TLV_SLAB_MIN_SHIFT + class);
+}
+
+static size_t
+tlv_size_class(size_t len)
+{
+	size_t class = 0;
+
+	while (class < TLV_SLAB_CLASSES && tlv_class_size(class) < len)
+		class++;
+	return class;
+}
+
+void *
+tlv_alloc(size_t len)
+{
+	size_t class = tlv_size_class(len);
+	size_t size = class < TLV_SLAB_CLASSES ? tlv_class_size(class) : len;
+	struct tlv_block *b;
+
+	if (class < TLV_SLAB_CLASSES && (b = tlv_slab.free[class])) {
+		tlv_slab.free[class] = b->next;
+		tlv_slab.num_free[class]--;
+		tlv_slab.stats.bytes_cached -= size;
+		tlv_slab.stats.reuses++;
+	} else {
+		if (!(b = malloc(sizeof(*b) + size)))
+			return NULL;
+		tlv_slab.stats.mallocs++;
+		b->size = size;
+	}
+	b->class = class;
+	tlv_slab.stats.allocs++;
+	tlv_slab.stats.in_use++;
+	tlv_slab.stats.bytes_in_use += size;
+	return b->data;
+}
+
+static inline struct tlv_block *
+tlv_block(void *ptr)
+{
+	return container_of(ptr, struct tlv_block, data);
+}
+
+static inline size_t
+tlv_block_size(struct tlv_block *b)
+{
+	return b->class < TLV_SLAB_CLASSES ? tlv_class_size(b->class) : b->size;
+}
+
+void
+tlv_free(void *ptr)
+{
+	struct tlv_block *b;
+	size_t size;
+
+	if (!ptr)
+		return;
+	b = tlv_block(ptr);
+	size = tlv_block_size(b);
+	tlv_slab.stats.frees++;
+	tlv_slab.stats.in_use--;
+	tlv_slab.stats.bytes_in_use -= size;
+	if (b->class < TLV_SLAB_CLASSES
+	    && (tlv_slab.num_free[b->class] + 1) * size <= TLV_SLAB_CACHE) {
+		b->next = tlv_slab.free[b->class];
+		tlv_slab.free[b->class] = b;
+		tlv_slab.num_free[b->class]++;
+		tlv_slab.stats.bytes_cached += size;
+		return;
+	}
+	free(b);
+}
+
+void *
+tlv_realloc(void *ptr, size_t len)
+{
+	void *n;
+	size_t size;
+
+	if (!ptr)
+		return tlv_alloc(len);
+	size = tlv_block_size(tlv_block(ptr));
+	if (len <= size && tlv_block(ptr)->class < TLV_SLAB_CLASSES)
+		return ptr;
+	if (!(n = tlv_alloc(len)))
+		return NULL;
+	memcpy(n, ptr, size < len ? size : len);
+	tlv_free(ptr);
+	return n;
+}
+
+void
+tlv_alloc_trim(void)
+{
+	struct tlv_block *b;
+	int i;
+
+	for (i = 0; i < TLV_SLAB_CLASSES; i++) {
+		while ((b = tlv_slab.free[i])) {
+			tlv_slab.free[i] = b->next;
+			free(b);
+		}
+		tlv_slab.num_free[i] = 0;
+	}
+	tlv_slab.stats.bytes_cached = 0;
+}
+
+/* Bytes actually reserved for a tlv_alloc result */
+size_t
+tlv_alloc_size(void *ptr)
+{
+	return ptr ? tlv_block_size(tlv_block(ptr)) : 0;
+}
+
+void
+tlv_alloc_get_stats(struct tlv_alloc_stats *stats)
+{
+	*stats = tlv_slab.stats;
+}
+
 static bool
 tlv_buffer_grow(struct tlv_buf *buf, int minlen)
 {
 	int delta = ((minlen / 256) + 1) * 256;
+	void *n = tlv_realloc(buf->buf, buf->buflen + delta);
+
+	if (!n)
+		return false;
+	buf->buf = n;
 	buf->buflen += delta;
-	buf->buf = realloc(buf->buf, buf->buflen);
-	if (buf->buf)
-		memset(buf->buf + buf->buflen - delta, 0, delta);
-	return !!buf->buf;
+	memset(buf->buf + buf->buflen - delta, 0, delta);
+	return true;
 }
 
 void
@@ -97,7 +255,7 @@ tlv_buf_init(struct tlv_buf *buf, int id)
 void
 tlv_buf_free(struct tlv_buf *buf)
 {
-	free(buf->buf);
+	tlv_free(buf->buf);
 	buf->buf = NULL;
 	buf->buflen = 0;
 }
@@ -183,16 +341,18 @@ tlv_nest_end(struct tlv_buf *buf, void *cookie)
 bool
 tlv_attr_equal(const struct tlv_attr *a1, const struct tlv_attr *a2)
 {
-	if (!a1 && !a2)
+	if (a1 == a2)
 		return true;
 
 	if (!a1 || !a2)
 		return false;
 
-	if (tlv_pad_len(a1) != tlv_pad_len(a2))
+	/* Same id and length, then the rest (libc memcmp is already
+	 * vectorized; a hand-written word loop was measurably slower) */
+	if (a1->id_len != a2->id_len)
 		return false;
 
-	return !memcmp(a1, a2, tlv_pad_len(a1));
+	return !memcmp(a1->data, a2->data, tlv_pad_len(a1) - sizeof(*a1));
 }
 
 /* Note: This is on-the-wire cmp operation. Therefore, the ids (where
@@ -201,8 +361,6 @@ tlv_attr_equal(const struct tlv_attr *a1, const struct tlv_attr *a2)
 int
 tlv_attr_cmp(const struct tlv_attr *a1, const struct tlv_attr *a2)
 {
-	int r;
-
 	if (!a1 && !a2)
 		return 0;
 	/* NULL attribute is always 'first', being empty. */
@@ -210,11 +368,11 @@ tlv_attr_cmp(const struct tlv_attr *a1, const struct tlv_attr *a2)
 		return -1;
 	if (!a2)
 		return 1;
-	r = memcmp(a1, a2, sizeof(*a1));
-	if (r)
-		return r;
+	/* Big-endian header compared as a number = memcmp of it */
+	if (a1->id_len != a2->id_len)
+		return be32_to_cpu(a1->id_len) < be32_to_cpu(a2->id_len) ? -1 : 1;
 	/* Padding we ignore */
-	return memcmp(a1, a2, tlv_raw_len(a1));
+	return memcmp(a1->data, a2->data, tlv_len(a1));
 }
 
 struct tlv_attr *
@@ -223,7 +381,7 @@ tlv_memdup(struct tlv_attr *attr)
 	struct tlv_attr *ret;
 	int size = tlv_pad_len(attr);
 
-	ret = malloc(size);
+	ret = tlv_alloc(size);
 	if (!ret)
 		return NULL;
 
@@ -231,39 +389,142 @@ tlv_memdup(struct tlv_attr *attr)
 	return ret;
 }
 
-static int
-_qsort_tlv_cmp(const void *t1, const void *t2)
+/* Merge sorted runs src[lo:mid] and src[mid:hi] to dst[lo:hi] */
+static void
+tlv_sort_merge(struct tlv_attr **src, struct tlv_attr **dst,
+	       int lo, int mid, int hi)
 {
-	const struct tlv_attr **aa1 = (void *)t1, **aa2 = (void *)t2;
-	return tlv_attr_cmp(*aa1, *aa2);
+	int i = lo, j = mid, k = lo;
+
+	while (i < mid && j < hi)
+		dst[k++] = tlv_attr_cmp(src[j], src[i]) < 0 ? src[j++] : src[i++];
+	while (i < mid)
+		dst[k++] = src[i++];
+	while (j < hi)
+		dst[k++] = src[j++];
 }
 
+/*
+ * Node data and messages are produced mostly in order, so this is a
+ * natural merge sort: the already ascending runs are found while
+ * walking the TLVs, and merged pairwise until one is left. Sorted
+ * input (the common case) is detected in the first walk, and left
+ * alone without any copying.
+ */
 bool tlv_sort(void *data, int len)
 {
-	void *tmp = alloca(len), *t = tmp;
-	struct tlv_attr *a, **al;
-	int c = 0, i;
-
-	if (!tmp)
-		return false;
-	tlv_for_each_in_buf(a, data, len)
+	struct tlv_attr *a, *prev = NULL, **al, **al2, **t;
+	int c = 0, nruns = 1, i, j, width, total = 0;
+	int *runs;
+
+	tlv_for_each_in_buf(a, data, len) {
+		if (prev && nruns == 1 && tlv_attr_cmp(prev, a) > 0)
+			nruns++;
+		total += tlv_pad_len(a);
+		prev = a;
 		c++;
+	}
 	if (c <= 1)
 		return true;
-	al = alloca(sizeof(struct tlv_attr *) * c);
-	if (!al)
+	if (total != len)
 		return false;
+	if (nruns == 1)
+		return true;
+
+	al = alloca(sizeof(struct tlv_attr *) * c * 2);
+	runs = alloca(sizeof(int) * (c + 1));
+	al2 = al + c;
 	c = 0;
-	tlv_for_each_in_buf(a, data, len)
+	nruns = 0;
+	prev = NULL;
+	tlv_for_each_in_buf(a, data, len) {
+		if (!prev || tlv_attr_cmp(prev, a) > 0)
+			runs[nruns++] = c;
 		al[c++] = a;
-	qsort(al, c, sizeof(struct tlv_attr *), _qsort_tlv_cmp);
-	for (i = 0 ; i < c ; i++) {
-		int l = tlv_pad_len(al[i]);
-		memcpy(t, al[i], l);
-		t += l;
+		prev = a;
+	}
+	runs[nruns] = c;
+
+	/* Merge adjacent runs until there is only one */
+	for (width = 1; width < nruns; width *= 2) {
+		for (i = 0; i < nruns; i += 2 * width) {
+			int mid = i + width < nruns ? runs[i + width] : c;
+			int hi = i + 2 * width < nruns ? runs[i + 2 * width] : c;
+			tlv_sort_merge(al, al2, runs[i], mid, hi);
+		}
+		t = al;
+		al = al2;
+		al2 = t;
+	}
+
+	void *tmp = alloca(len), *p = tmp;
+	for (j = 0; j < c; j++) {
+		int l = tlv_pad_len(al[j]);
+		memcpy(p, al[j], l);
+		p += l;
 	}
-	if (t != (tmp + len))
-		return false;
 	memcpy(data, tmp, len);
 	return true;
 }
+
+bool
+tlv_schema_init(struct tlv_schema *schema,
+		const struct tlv_attr_info *info, int info_len)
+{
+	unsigned int num_types = 0;
+	int i;
+
+	for (i = 0; i < info_len; i++)
+		if (info[i].type >= num_types)
+			num_types = info[i].type + 1;
+	schema->by_type = calloc(num_types, sizeof(schema->by_type[0]));
+	if (!schema->by_type) {
+		schema->num_types = 0;
+		return false;
+	}
+	schema->num_types = num_types;
+	for (i = 0; i < info_len; i++)
+		schema->by_type[info[i].type] = &info[i];
+	return true;
+}
+
+void
+tlv_schema_free(struct tlv_schema *schema)
+{
+	free(schema->by_type);
+	schema->by_type = NULL;
+	schema->num_types = 0;
+}
+
+int
+tlv_validate(const struct tlv_schema *schema, void *buf, int len,
+	     tlv_validate_cb cb, void *ctx)
+{
+	const struct tlv_attr_info *info;
+	struct tlv_attr *a = buf;
+	void *end = buf + len;
+	unsigned int alen, id;
+	int invalid = 0;
+	bool valid;
+
+	while ((void *)a < end) {
+		if ((void *)a + sizeof(*a) > end)
+			return -1;
+		alen = tlv_len(a);
+		if ((void *)tlv_data(a) + alen > end)
+			return -1;
+		valid = true;
+		id = tlv_id(a);
+		if (schema && id < schema->num_types
+		    && (info = schema->by_type[id]))
+			valid = alen >= info->minlen
+				&& (!info->maxlen || alen <= info->maxlen)
+				&& (!info->validate || info->validate(info, a));
+		if (!valid)
+			invalid++;
+		if (cb)
+			cb(ctx, a, valid);
+		a = tlv_next(a);
+	}
+	return invalid;
+}
@@ -42,10 +42,18 @@ struct tlv_attr {
 struct tlv_attr_info {
 	unsigned int type;
 	unsigned int minlen;
-	unsigned int maxlen;
+	unsigned int maxlen;	/* 0 = no maximum */
 	bool (*validate)(const struct tlv_attr_info *, struct tlv_attr *);
 };
 
+/* Type-indexed lookup table of tlv_attr_infos, for tlv_validate */
+struct tlv_schema {
+	const struct tlv_attr_info **by_type;
+	unsigned int num_types;
+};
+
+typedef void (*tlv_validate_cb)(void *ctx, struct tlv_attr *attr, bool valid);
+
 struct tlv_buf {
 	struct tlv_attr *head;
 	bool (*grow)(struct tlv_buf *buf, int minlen);
@@ -53,6 +61,16 @@ struct tlv_buf {
 	void *buf;
 };
 
+struct tlv_alloc_stats {
+	unsigned long allocs;		/* tlv_alloc calls */
+	unsigned long frees;		/* tlv_free calls */
+	unsigned long mallocs;		/* allocs that had to call malloc */
+	unsigned long reuses;		/* allocs served from a free list */
+	unsigned long in_use;		/* blocks currently allocated */
+	size_t bytes_in_use;		/* their (rounded up) size */
+	size_t bytes_cached;		/* bytes kept on free lists */
+};
+
 /*
  * tlv_data: returns the data pointer for an attribute
  */
@@ -120,9 +138,35 @@ extern void *tlv_nest_start(struct tlv_buf *buf, int id, int len);
 extern void tlv_nest_end(struct tlv_buf *buf, void *cookie);
 extern struct tlv_attr *tlv_put(struct tlv_buf *buf, int id, const void *ptr, int len);
 extern struct tlv_attr *tlv_memdup(struct tlv_attr *attr);
+
+/* Memory of tlv_bufs and tlv_memdup results comes from these, and must
+ * be released with tlv_free (also if it is kept past tlv_buf use). */
+extern void *tlv_alloc(size_t len);
+extern void *tlv_realloc(void *ptr, size_t len);
+extern void tlv_free(void *ptr);
+extern size_t tlv_alloc_size(void *ptr);
+extern void tlv_alloc_trim(void);
+extern void tlv_alloc_get_stats(struct tlv_alloc_stats *stats);
 extern struct tlv_attr *tlv_put_raw(struct tlv_buf *buf, const void *ptr, int len);
 extern bool tlv_sort(void *buf, int len);
 
+extern bool tlv_schema_init(struct tlv_schema *schema,
+			    const struct tlv_attr_info *info, int info_len);
+extern void tlv_schema_free(struct tlv_schema *schema);
+
+/*
+ * tlv_validate: check the TLVs in buf in one pass
+ *
+ * Every TLV has to fit within buf, and buf may not contain anything
+ * else (the last TLV may lack its padding). TLVs with an entry in the
+ * schema (which may be NULL) also have to satisfy its minlen, maxlen
+ * and validate callback; cb, if given, is called for every TLV with
+ * the result. Returns -1 if the framing is broken, and otherwise the
+ * number of TLVs that did not pass their schema entry.
+ */
+extern int tlv_validate(const struct tlv_schema *schema, void *buf, int len,
+			tlv_validate_cb cb, void *ctx);
+
 /* Paranoid version: Have faith only in the caller providing correct
  * buf + len; pos is used to maintain the current position within buf. */
 #define tlv_for_each_in_buf(pos, buf, len)                              \
@@ -28,6 +28,31 @@
 
 #define DEBUG(...) L_DEBUG(__VA_ARGS__)
 
+/* Room for the source address control message (either family) */
+#define UDP46_CONTROL_SIZE CMSG_SPACE(sizeof(struct in6_pktinfo))
+
+/* Maximum number of packets handed to one sendmmsg call */
+#define UDP46_BATCH_CHUNK 64
+
+typedef union {
+  struct cmsghdr h;
+  uint8_t buf[UDP46_CONTROL_SIZE];
+} udp46_control_u;
+
+typedef struct {
+  int sock;
+  union {
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+  } name;
+  socklen_t namelen;
+  udp46_control_u control;
+  size_t controllen;
+
+  /* Payload within udp46->payload */
+  size_t ofs, len;
+} udp46_queued_s, *udp46_queued;
+
 struct udp46_struct {
   int s4;
   int s6;
@@ -35,6 +60,15 @@ struct udp46_struct {
   struct uloop_fd ufds[2];
   udp46_readable_cb cb;
   void *cb_context;
+
+  /* Send batch (if batching) */
+  bool batching;
+  udp46_queued queue;
+  int queue_len, queue_size;
+  uint8_t *payload;
+  int payload_len, payload_size;
+
+  udp46_stats_s stats;
 };
 
 static int init_listening_socket(int pf, uint16_t port, uint16_t oport)
@@ -229,10 +263,12 @@ ssize_t udp46_recv(udp46 s,
   return -1;
 }
 
-int udp46_send_iovec(udp46 s,
-                     const struct sockaddr_in6 *src,
-                     const struct sockaddr_in6 *dst,
-                     struct iovec *iov, int iov_len)
+/* Fill in destination and source address of msg; returns the socket
+ * to send it on, or -1 if the addresses are not usable. */
+static int _prepare_msg(udp46 s,
+                        const struct sockaddr_in6 *src,
+                        const struct sockaddr_in6 *dst,
+                        struct msghdr *msg, struct sockaddr_in *sin)
 {
   if (src && src->sin6_family != AF_INET6)
     {
@@ -250,34 +286,25 @@ int udp46_send_iovec(udp46 s,
       DEBUG("IPv4 <> IPv6 traffic not allowed");
       return -1;
     }
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = iov_len,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
-  struct sockaddr_in sin;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
   int sock = -1;
 
   if (IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr))
     {
       /* Convert the destination address */
-      memset(&sin, 0, sizeof(sin));
-      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin.sin_addr);
-      sin.sin_family = AF_INET;
-      sin.sin_port = dst->sin6_port;
-      msg.msg_name = (void *)&sin;
-      msg.msg_namelen = sizeof(sin);
+      memset(sin, 0, sizeof(*sin));
+      MAPPED_IN6_ADDR_TO_IN_ADDR(&dst->sin6_addr, &sin->sin_addr);
+      sin->sin_family = AF_INET;
+      sin->sin_port = dst->sin6_port;
+      msg->msg_name = (void *)sin;
+      msg->msg_namelen = sizeof(*sin);
       sock = s->s4;
     }
   else
     {
       /* Use destination address as-is */
-      msg.msg_name = (void *)dst;
-      msg.msg_namelen = sizeof(*dst);
+      msg->msg_name = (void *)dst;
+      msg->msg_namelen = sizeof(*dst);
       sock = s->s6;
     }
   /* Deal with source address */
@@ -317,16 +344,177 @@ int udp46_send_iovec(udp46 s,
           cmsg->cmsg_len = CMSG_LEN(sizeof(*ipi6));
         }
     }
-  msg.msg_controllen = cmsg->cmsg_len;
-  return sendmsg(sock, &msg, 0);
+  msg->msg_controllen = cmsg->cmsg_len;
+  return sock;
+}
+
+static bool _grow(void **p, int *size, int need, size_t elem_size)
+{
+  int new_size;
+  void *np;
+
+  if (need <= *size)
+    return true;
+  new_size = *size ? *size * 2 : 8;
+  if (new_size < need)
+    new_size = need;
+  if (!(np = realloc(*p, new_size * elem_size)))
+    return false;
+  *p = np;
+  *size = new_size;
+  return true;
+}
+
+static ssize_t _queue_msg(udp46 s, int sock, struct msghdr *msg)
+{
+  udp46_queued q, prev;
+  size_t len = 0, i;
+  uint8_t *p;
+
+  for (i = 0 ; i < msg->msg_iovlen ; i++)
+    len += msg->msg_iov[i].iov_len;
+  if (!_grow((void **)&s->queue, &s->queue_size, s->queue_len + 1,
+             sizeof(*s->queue))
+      || !_grow((void **)&s->payload, &s->payload_size,
+                s->payload_len + len, 1))
+    {
+      DEBUG("unable to queue %d bytes - eom", (int)len);
+      return -1;
+    }
+  p = s->payload + s->payload_len;
+  for (i = 0 ; i < msg->msg_iovlen ; i++)
+    {
+      memcpy(p, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+      p += msg->msg_iov[i].iov_len;
+    }
+  q = &s->queue[s->queue_len];
+  prev = s->queue_len ? q - 1 : NULL;
+  /* Typically the same payload goes to many destinations in a row;
+   * store it only once. */
+  if (prev && prev->len == len
+      && !memcmp(s->payload + prev->ofs, s->payload + s->payload_len, len))
+    q->ofs = prev->ofs;
+  else
+    {
+      q->ofs = s->payload_len;
+      s->payload_len += len;
+    }
+  q->len = len;
+  q->sock = sock;
+  memcpy(&q->name, msg->msg_name, msg->msg_namelen);
+  q->namelen = msg->msg_namelen;
+  memcpy(&q->control, msg->msg_control, msg->msg_controllen);
+  q->controllen = msg->msg_controllen;
+  s->queue_len++;
+  return len;
 }
 
+int udp46_send_iovec(udp46 s,
+                     const struct sockaddr_in6 *src,
+                     const struct sockaddr_in6 *dst,
+                     struct iovec *iov, int iov_len)
+{
+  udp46_control_u c;
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = iov_len,
+    .msg_flags = 0,
+    .msg_control = &c,
+    .msg_controllen = sizeof(c)
+  };
+  struct sockaddr_in sin;
+  int sock = _prepare_msg(s, src, dst, &msg, &sin);
+  ssize_t r;
+
+  if (sock < 0)
+    return -1;
+  if (s->batching)
+    return _queue_msg(s, sock, &msg);
+  s->stats.syscalls++;
+  if ((r = sendmsg(sock, &msg, 0)) >= 0)
+    s->stats.packets++;
+  return r;
+}
+
+void udp46_batch_begin(udp46 s)
+{
+  s->batching = true;
+}
+
+static int _flush_sock(udp46 s, int sock)
+{
+  struct mmsghdr mv[UDP46_BATCH_CHUNK];
+  struct iovec iv[UDP46_BATCH_CHUNK];
+  int i = 0, j, n, r, sent = 0;
+  udp46_queued q;
+
+  while (i < s->queue_len)
+    {
+      for (n = 0 ; i < s->queue_len && n < UDP46_BATCH_CHUNK ; i++)
+        {
+          q = &s->queue[i];
+          if (q->sock != sock)
+            continue;
+          iv[n].iov_base = s->payload + q->ofs;
+          iv[n].iov_len = q->len;
+          memset(&mv[n], 0, sizeof(mv[n]));
+          mv[n].msg_hdr.msg_name = &q->name;
+          mv[n].msg_hdr.msg_namelen = q->namelen;
+          mv[n].msg_hdr.msg_iov = &iv[n];
+          mv[n].msg_hdr.msg_iovlen = 1;
+          mv[n].msg_hdr.msg_control = q->controllen ? &q->control : NULL;
+          mv[n].msg_hdr.msg_controllen = q->controllen;
+          n++;
+        }
+      for (j = 0 ; j < n ; )
+        {
+          s->stats.syscalls++;
+#ifdef __linux__
+          r = sendmmsg(sock, mv + j, n - j, 0);
+#else
+          r = sendmsg(sock, &mv[j].msg_hdr, 0) < 0 ? -1 : 1;
+#endif /* __linux__ */
+          if (r <= 0)
+            {
+              /* Drop the packet that failed, and go on with the rest */
+              DEBUG("udp46 batch send failed: %s", strerror(errno));
+              j++;
+              continue;
+            }
+          j += r;
+          sent += r;
+        }
+    }
+  return sent;
+}
+
+int udp46_batch_flush(udp46 s)
+{
+  int sent;
+
+  s->batching = false;
+  if (!s->queue_len)
+    return 0;
+  sent = _flush_sock(s, s->s4) + _flush_sock(s, s->s6);
+  DEBUG("udp46_batch_flush sent %d/%d", sent, s->queue_len);
+  s->stats.packets += sent;
+  s->queue_len = 0;
+  s->payload_len = 0;
+  return sent;
+}
+
+void udp46_get_stats(udp46 s, udp46_stats st)
+{
+  *st = s->stats;
+}
 
 void udp46_destroy(udp46 s)
 {
   udp46_set_readable_cb(s, NULL, NULL);
   close(s->s4);
   close(s->s6);
+  free(s->queue);
+  free(s->payload);
   free(s);
 }
 
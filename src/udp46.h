@@ -83,6 +83,28 @@ int udp46_send(udp46 s,
                const struct sockaddr_in6 *dst,
                void *buf, size_t buf_size);
 
+/**
+ * Batch sends.
+ *
+ * Between udp46_batch_begin and udp46_batch_flush, udp46_send* only
+ * queue the packets (copying them; identical consecutive payloads
+ * are stored once), and return the number of bytes queued. The flush
+ * hands the queue over to the kernel with as few (sendmmsg) system
+ * calls as possible, and returns the number of packets sent.
+ */
+void udp46_batch_begin(udp46 s);
+int udp46_batch_flush(udp46 s);
+
+typedef struct {
+  /* Packets sent (not just queued) */
+  uint32_t packets;
+
+  /* send* system calls made to send them */
+  uint32_t syscalls;
+} udp46_stats_s, *udp46_stats;
+
+void udp46_get_stats(udp46 s, udp46_stats st);
+
 /**
  * Destroy/close a socket.
  */
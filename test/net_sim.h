@@ -96,6 +96,12 @@ typedef struct {
 
   dncp_ep src;
   dncp_ep dst;
+
+  /* Node state requests sent over the link */
+  int sent_req_node_state;
+
+  /* Until when the link is busy sending (if link_bytes_per_ms is set) */
+  hnetd_time_t busy_until;
 } net_neigh_s, *net_neigh;
 
 typedef struct {
@@ -125,6 +131,10 @@ typedef struct {
   dncp_subscriber_s debug_subscriber;
 
   struct list_head iface_users;
+
+  /* Unicasts (and node state requests within them) sent by this node */
+  int sent_unicast;
+  int sent_req_node_state;
 } net_node_s, *net_node;
 
 typedef struct net_sim_t {
@@ -147,6 +157,10 @@ typedef struct net_sim_t {
   hnetd_time_t last_unicast_sent;
   int sent_multicast;
 
+  /* Bytes sent over unicast, and node deltas within them */
+  long sent_unicast_bytes;
+  int sent_node_delta;
+
   int converged_count;
   int not_converged_count;
 
@@ -158,6 +172,9 @@ typedef struct net_sim_t {
   bool fake_unicast;
   bool fake_unicast_is_reliable_stream;
 
+  /* If set, messages take len / link_bytes_per_ms ms to send, one at
+   * a time per link, on top of the propagation delay. */
+  int link_bytes_per_ms;
 } net_sim_s, *net_sim;
 
 static struct list_head net_sim_interfaces = LIST_HEAD_INIT(net_sim_interfaces);
@@ -231,29 +248,29 @@ bool net_sim_is_converged(net_sim s)
       list_for_each_entry(n2, &s->nodes, lh)
         {
           /* Make sure that the information about other node _is_ valid */
-          hn = dncp_find_node_by_node_id(n->d, &n2->d->own_node->node_id, false);
+          hn = dncp_find_node_by_node_id(n->d, n2->d->own_node->node_id, false);
           if (!hn)
             {
               L_DEBUG("unable to find other node hash - %s -> %s",
                       n->name, n2->name);
               return false;
             }
-          if (memcmp(&n2->d->own_node->node_data_hash,
-                     &hn->node_data_hash, HNCP_HASH_LEN))
+          if (memcmp(dncp_node_hash(n2->d->own_node),
+                     dncp_node_hash(hn), HNCP_HASH_LEN))
             {
               L_DEBUG("node data hash mismatch w/ network hash in sync %s @%s",
                       n2->name, n->name);
               return false;
             }
           if (!s->accept_time_errors
-              && llabs(n2->d->own_node->origination_time
-                       - hn->origination_time) > acceptable_offset)
+              && llabs(dncp_node_get_origination_time(n2->d->own_node)
+                       - dncp_node_get_origination_time(hn)) > acceptable_offset)
             {
               L_DEBUG("origination time mismatch at "
                       "%s: %lld !=~ %lld for %s [update number %d]",
                       n->name,
-                      (long long) hn->origination_time,
-                      (long long) n2->d->own_node->origination_time,
+                      (long long) dncp_node_get_origination_time(hn),
+                      (long long) dncp_node_get_origination_time(n2->d->own_node),
                       n2->name,
                       hn->update_number);
               s->not_converged_count++;
@@ -751,7 +768,7 @@ static void _message_deliver_cb(struct uloop_timeout *t)
 
 static void
 _send_one(net_sim s, void *buf, size_t len, dncp_ep sl, dncp_ep dl,
-          const struct sockaddr_in6 *dst)
+          const struct sockaddr_in6 *dst, hnetd_time_t delay)
 {
   if (MESSAGE_WAS_LOST)
     return;
@@ -771,7 +788,7 @@ _send_one(net_sim s, void *buf, size_t len, dncp_ep sl, dncp_ep dl,
   m->dst = *dst;
   list_add(&m->lh, &s->messages);
   m->deliver_to.cb = _message_deliver_cb;
-  uloop_timeout_set(&m->deliver_to, MESSAGE_PROPAGATION_DELAY);
+  uloop_timeout_set(&m->deliver_to, delay + MESSAGE_PROPAGATION_DELAY);
 
 #if L_LEVEL >= 7
   hncp h1 = container_of(dncp_ep_get_dncp(sl)->ext, hncp_s, ext);
@@ -820,6 +837,7 @@ _send(dncp_ext ext, dncp_ep ep,
   bool is_multicast = memcmp(&dst->sin6_addr, &h->multicast_address,
                              sizeof(h->multicast_address)) == 0;
   net_neigh n;
+  int reqs = 0;
 
   L_DEBUG("_io_send: %s -> " SA6_F,
           is_multicast ? "multicast" : "unicast", SA6_D(dst));
@@ -832,8 +850,18 @@ _send(dncp_ext ext, dncp_ep ep,
     }
   else
     {
+      struct tlv_attr *a;
+
       s->sent_unicast++;
+      s->sent_unicast_bytes += len;
+      node->sent_unicast++;
       s->last_unicast_sent = hnetd_time();
+      tlv_for_each_in_buf(a, buf, len)
+        if (tlv_id(a) == DNCP_T_REQ_NODE_STATE)
+          reqs++;
+        else if (tlv_id(a) == DNCP_T_NODE_DELTA)
+          s->sent_node_delta++;
+      node->sent_req_node_state += reqs;
     }
   int sent = 0;
   list_for_each_entry(n, &s->neighs, lh)
@@ -844,13 +872,25 @@ _send(dncp_ext ext, dncp_ep ep,
               || (memcmp(&dhl->ipv6_address, &dst->sin6_addr,
                          sizeof(dst->sin6_addr)) == 0)))
         {
-          _send_one(s, buf, len, n->src, n->dst, dst);
+          hnetd_time_t delay = 0;
+
+          if (s->link_bytes_per_ms)
+            {
+              hnetd_time_t now = hnetd_time();
+
+              if (n->busy_until < now)
+                n->busy_until = now;
+              n->busy_until += len / s->link_bytes_per_ms;
+              delay = n->busy_until - now;
+            }
+          _send_one(s, buf, len, n->src, n->dst, dst, delay);
+          n->sent_req_node_state += reqs;
           sent++;
         }
     }
   /* Loop at self too, just for fun. */
   if (is_multicast)
-    _send_one(s, buf, len, ep, ep, dst);
+    _send_one(s, buf, len, ep, ep, dst, 0);
   else
     sput_fail_unless(sent <= 1, "unicast must hit only one target");
 }
@@ -0,0 +1,156 @@
+#define NO_REDEFINE_ULOOP_TIMEOUT
+
+#include "backend_batch.c"
+
+#include <stdlib.h>
+#include <libubox/uloop.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "sput.h"
+
+int log_level = 9;
+void (*hnetd_log)(int priority, const char *format, ...) = syslog;
+
+/* Fake backend: logs the commands it runs, and how, to $LOG. The
+ * command "die" makes the co-process exit without acknowledging it. */
+static const char fake_backend[] =
+	"#!/bin/sh\n"
+	"if [ \"$1\" = batch ]; then\n"
+	"	while read -r argc envc; do\n"
+	"		if [ \"$argc\" = 0 ]; then\n"
+	"			echo end >> \"$LOG\"\n"
+	"			echo >&3\n"
+	"			continue\n"
+	"		fi\n"
+	"		set --\n"
+	"		i=0\n"
+	"		while [ $i -lt $((argc + envc)) ] && IFS= read -r field; do\n"
+	"			set -- \"$@\" \"$field\"\n"
+	"			i=$((i + 1))\n"
+	"		done\n"
+	"		while [ $envc -gt 0 ]; do\n"
+	"			export \"$1\"\n"
+	"			shift\n"
+	"			envc=$((envc - 1))\n"
+	"		done\n"
+	"		[ \"$1\" = die ] && exit 1\n"
+	"		echo \"batch $*${FOO:+ FOO=$FOO}\" >> \"$LOG\"\n"
+	"		unset FOO\n"
+	"		echo >&3\n"
+	"	done\n"
+	"else\n"
+	"	echo \"oneshot $*${FOO:+ FOO=$FOO}\" >> \"$LOG\"\n"
+	"fi\n";
+
+static char dir[] = "/tmp/test_backend_batch.XXXXXX";
+static char cmd[64], logfile[64];
+
+/* Check (and clear) what the backend has run so far */
+static bool _ran(const char *expected)
+{
+	char buf[1024];
+	size_t len = 0;
+	FILE *f = fopen(logfile, "r");
+
+	if (f) {
+		len = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+	}
+	buf[len] = 0;
+	truncate(logfile, 0);
+	if (strcmp(buf, expected))
+		L_ERR("backend ran '%s', expected '%s'", buf, expected);
+	return !strcmp(buf, expected);
+}
+
+void backend_batch_order(void)
+{
+	struct backend_batch b;
+	char *a1[] = { cmd, "a1", NULL };
+	char *a2[] = { cmd, "a2", "x y", "", NULL };
+	char *a3[] = { cmd, "a3", NULL };
+	char *nl[] = { cmd, "b\n2", NULL };
+	char *env[] = { "FOO=bar baz", NULL };
+
+	backend_batch_init(&b, cmd);
+	sput_fail_unless(b.fd.fd >= 0, "co-process started");
+
+	/* Queued until flushed at the end of the uloop iteration */
+	backend_batch_call(&b, a1, env);
+	backend_batch_call(&b, a2, NULL);
+	sput_fail_unless(b.queued == 2, "2 queued");
+	sput_fail_unless(_ran(""), "nothing run yet");
+
+	/* A one-shot command (e.g. a DHCP client) runs after the batch */
+	backend_batch_sync(&b);
+	sput_fail_unless(_ran("batch a1 FOO=bar baz\nbatch a2 x y \nend\n"),
+			 "batch framed and run in order");
+	sput_fail_unless(!b.len && !b.sent, "all acknowledged");
+	sput_fail_unless(b.acked == 3 && b.batches == 1, "acked batch");
+
+	/* Commands that cannot be framed run one-shot, but in order */
+	backend_batch_call(&b, a1, NULL);
+	backend_batch_call(&b, nl, NULL);
+	backend_batch_call(&b, a3, NULL);
+	backend_batch_sync(&b);
+	sput_fail_unless(_ran("batch a1\nend\noneshot b\n2\nbatch a3\nend\n"),
+			 "unframeable command in order");
+	backend_batch_term(&b);
+}
+
+void backend_batch_replay(void)
+{
+	struct backend_batch b;
+	char *c1[] = { cmd, "c1", NULL };
+	char *die[] = { cmd, "die", NULL };
+	char *c2[] = { cmd, "c2", NULL };
+	char *c3[] = { cmd, "c3", NULL };
+	char *env[] = { "FOO=1", NULL };
+
+	backend_batch_init(&b, cmd);
+	backend_batch_call(&b, c1, NULL);
+	backend_batch_call(&b, die, NULL);
+	backend_batch_call(&b, c2, env);
+	backend_batch_sync(&b);
+	/* Sent but never run: c2 must not get lost */
+	sput_fail_unless(b.fd.fd < 0, "one-shot mode");
+	sput_fail_unless(b.replayed == 2, "2 replayed");
+	sput_fail_unless(_ran("batch c1\noneshot die\noneshot c2 FOO=1\n"),
+			 "unacknowledged commands replayed in order");
+
+	backend_batch_call(&b, c3, NULL);
+	sput_fail_unless(_ran("oneshot c3\n"), "later commands one-shot");
+	backend_batch_term(&b);
+}
+
+int main(__unused int argc, __unused char **argv)
+{
+	FILE *f;
+
+	openlog("hnetd", LOG_PERROR | LOG_PID, LOG_DAEMON);
+	if (!mkdtemp(dir))
+		return 1;
+	snprintf(cmd, sizeof(cmd), "%s/backend", dir);
+	snprintf(logfile, sizeof(logfile), "%s/log", dir);
+	if (!(f = fopen(cmd, "w")))
+		return 1;
+	fputs(fake_backend, f);
+	fclose(f);
+	chmod(cmd, 0700);
+	setenv("LOG", logfile, 1);
+	signal(SIGPIPE, SIG_IGN);
+	uloop_init();
+
+	sput_start_testing();
+	sput_enter_suite("backend_batch");
+	sput_run_test(backend_batch_order);
+	sput_run_test(backend_batch_replay);
+	sput_leave_suite();
+	sput_finish_testing();
+
+	unlink(cmd);
+	unlink(logfile);
+	rmdir(dir);
+	return sput_get_return_value();
+}
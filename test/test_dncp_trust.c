@@ -15,6 +15,7 @@
 #include "dncp_trust.h"
 
 #include <unistd.h>
+#include <sys/stat.h>
 
 /************************************************************ NOP callbacks. */
 
@@ -40,6 +41,7 @@ void dncp_trust_base()
 
   net_sim_s s;
   net_sim_init(&s);
+  int i;
 
   /* 3 different cases (before sync)
   - nonexistent hash (ha[0])
@@ -60,11 +62,15 @@ void dncp_trust_base()
   dncp_trust_request_verdict(dt1, &ha[1], "bar");
   dncp_trust_set(dt1, &ha[2], DNCP_VERDICT_CONFIGURED_POSITIVE, "foo");
 
+  /* Cached verdicts must be invalidated once the TLVs arrive */
+  for (i = 0 ; i < 3 ; i++)
+    sput_fail_unless(dncp_trust_get_verdict(dt2, &ha[i], NULL)
+                     == DNCP_VERDICT_NONE, "verdict2 before sync");
+
   SIM_WHILE(&s, 100000, !net_sim_is_converged(&s));
 
   /* Verdict must be same for all hashes */
 
-  int i;
   for (i = 0 ; i < 3 ; i++)
     {
       int v1 = dncp_trust_get_verdict(dt1, &ha[i], NULL);
@@ -125,6 +131,100 @@ void dncp_trust_io()
   sput_fail_unless(dncp_trust_get_verdict(dt, &h, buf) == DNCP_VERDICT_CONFIGURED_POSITIVE,
                    "verdict none");
   sput_fail_unless(strcmp(buf, "foo")==0, "cname foo");
+
+  /* Changing the verdict back and forth must not rewrite the file */
+  struct stat st1, st2;
+  sput_fail_unless(stat(TESTFILENAME, &st1) == 0, "stat");
+  dncp_trust_set(dt, &h, DNCP_VERDICT_CONFIGURED_NEGATIVE, NULL);
+  sput_fail_unless(dncp_trust_get_verdict(dt, &h, NULL) == DNCP_VERDICT_CONFIGURED_NEGATIVE,
+                   "verdict negative");
+  dncp_trust_set(dt, &h, DNCP_VERDICT_CONFIGURED_POSITIVE, NULL);
+  sput_fail_unless(dncp_trust_get_verdict(dt, &h, NULL) == DNCP_VERDICT_CONFIGURED_POSITIVE,
+                   "verdict positive");
+  dncp_trust_destroy(dt);
+  sput_fail_unless(stat(TESTFILENAME, &st2) == 0, "stat 2");
+  sput_fail_unless(st1.st_mtim.tv_sec == st2.st_mtim.tv_sec
+                   && st1.st_mtim.tv_nsec == st2.st_mtim.tv_nsec,
+                   "file rewritten");
+
+  net_sim_uninit(&s);
+}
+
+/* header + records of (verdict TLV + cname + check) */
+#define LOG_SIZE(n) (4 + (n) * (sizeof(dncp_t_trust_verdict_s) + 64 + 4))
+
+static off_t _file_size(void)
+{
+  struct stat st;
+
+  if (stat(TESTFILENAME, &st) < 0)
+    return -1;
+  return st.st_size;
+}
+
+void dncp_trust_log()
+{
+  net_sim_s s;
+  dncp_sha256_s ha[3];
+  dncp_trust dt;
+  int i;
+
+  for (i = 0 ; i < 3 ; i++)
+    memset(&ha[i], 42 + i, sizeof(ha[i]));
+  net_sim_init(&s);
+  uloop_init();
+  unlink(TESTFILENAME);
+  dncp d = net_sim_find_dncp(&s, "x");
+
+  /* Initial save writes the whole file */
+  dt = dncp_trust_create(d, TESTFILENAME);
+  for (i = 0 ; i < 3 ; i++)
+    dncp_trust_set(dt, &ha[i], DNCP_VERDICT_CONFIGURED_POSITIVE, "foo");
+  dncp_trust_destroy(dt);
+  sput_fail_unless(_file_size() == (off_t)LOG_SIZE(3), "initial size");
+
+  /* Changes are appended */
+  dt = dncp_trust_create(d, TESTFILENAME);
+  dncp_trust_set(dt, &ha[0], DNCP_VERDICT_CONFIGURED_NEGATIVE, NULL);
+  dncp_trust_set(dt, &ha[2], DNCP_VERDICT_NEUTRAL, NULL);
+  dncp_trust_destroy(dt);
+  sput_fail_unless(_file_size() == (off_t)LOG_SIZE(5), "appended size");
+
+  /* Torn write at the end is ignored */
+  FILE *f = fopen(TESTFILENAME, "ab");
+  sput_fail_unless(f, "fopen");
+  fwrite(&ha[1], 1, sizeof(ha[1]), f);
+  fclose(f);
+  dt = dncp_trust_create(d, TESTFILENAME);
+  sput_fail_unless(dncp_trust_get_verdict(dt, &ha[0], NULL)
+                   == DNCP_VERDICT_CONFIGURED_NEGATIVE, "superseded");
+  sput_fail_unless(dncp_trust_get_verdict(dt, &ha[1], NULL)
+                   == DNCP_VERDICT_CONFIGURED_POSITIVE, "unchanged");
+  sput_fail_unless(dncp_trust_get_verdict(dt, &ha[2], NULL)
+                   == DNCP_VERDICT_NONE, "tombstone");
+
+  /* .. and the next save compacts the file */
+  dncp_trust_set(dt, &ha[1], DNCP_VERDICT_CONFIGURED_NEGATIVE, NULL);
+  dncp_trust_destroy(dt);
+  sput_fail_unless(_file_size() == (off_t)LOG_SIZE(2), "compacted size");
+  struct stat st;
+  sput_fail_unless(stat(TESTFILENAME, &st) == 0
+                   && (st.st_mode & 0777) == 0600, "compacted file private");
+
+  /* Log growth also triggers compaction eventually */
+  for (i = 0 ; i < 100 ; i++)
+    {
+      dt = dncp_trust_create(d, TESTFILENAME);
+      dncp_trust_set(dt, &ha[1], i % 2 ? DNCP_VERDICT_CONFIGURED_NEGATIVE
+                     : DNCP_VERDICT_CONFIGURED_POSITIVE, NULL);
+      dncp_trust_destroy(dt);
+      sput_fail_unless(_file_size() <= (off_t)LOG_SIZE(65), "bounded size");
+    }
+  dt = dncp_trust_create(d, TESTFILENAME);
+  sput_fail_unless(dncp_trust_get_verdict(dt, &ha[0], NULL)
+                   == DNCP_VERDICT_CONFIGURED_NEGATIVE, "ha0 after compaction");
+  sput_fail_unless(dncp_trust_get_verdict(dt, &ha[1], NULL)
+                   == DNCP_VERDICT_CONFIGURED_NEGATIVE, "ha1 after compaction");
   dncp_trust_destroy(dt);
 
   net_sim_uninit(&s);
@@ -145,6 +245,7 @@ int main(int argc, char **argv)
 
   maybe_run_test(dncp_trust_base);
   maybe_run_test(dncp_trust_io);
+  maybe_run_test(dncp_trust_log);
 
   sput_leave_suite(); /* optional */
   sput_finish_testing();
@@ -31,6 +31,17 @@
 /* in ms */
 #define SINGLE_TEST_ERROR_TIMEOUT 2000
 
+/* Handshake storm: how many peers connect at once, how often the
+ * 'keepalive' timer should fire (ms), and how late it may be (ms) with
+ * workers, unless it was as late without them. Workers still share the
+ * CPU with the loop on small machines, hence some intervals of slack. */
+#define STORM_PEERS 50
+#define STORM_KEEPALIVE_INTERVAL 10
+#define STORM_JITTER_LIMIT (5 * STORM_KEEPALIVE_INTERVAL)
+#define STORM_ERROR_TIMEOUT 20000
+
+#define SESSION_TEST_FILE "/tmp/test_dtls.sessions"
+
 #include "fake_log.h"
 
 dtls d1, d2;
@@ -225,6 +236,150 @@ static void _test_basic_i(int i)
   uloop_timeout_cancel(&t2);
 }
 
+bool resume_trusted;
+
+bool _verdict_cb(dtls d, dtls_cert cert, void *context)
+{
+  return resume_trusted;
+}
+
+void _rejected_timeout(struct uloop_timeout *t)
+{
+  uloop_timeout_set(t, 10);
+  if (d2->stats.rejected_resumptions)
+    uloop_end();
+}
+
+/* Send a packet d1 -> d2, and (if trusted) wait for it, then close
+ * the connection again. */
+static void _test_resume_send(struct sockaddr_in6 *src,
+                              struct sockaddr_in6 *dst)
+{
+  char *msg = "foo";
+  struct uloop_timeout t = { .cb = _timeout };
+  struct uloop_timeout t2 = { .cb = _no_connections_timeout };
+  struct uloop_timeout t3 = { .cb = _rejected_timeout };
+  dtls_connection dc;
+  int rv;
+
+  if (resume_trusted)
+    {
+      smock_push_int("dtls_recv", 3);
+      smock_push("dtls_recv_src_in6", &src->sin6_addr);
+      smock_push("dtls_recv_buf", msg);
+      pending_readable = 1;
+    }
+  else
+    uloop_timeout_set(&t3, 10);
+  rv = dtls_send(d1, NULL, dst, msg, strlen(msg));
+  sput_fail_unless(rv == 3, "sendto failed?");
+  uloop_timeout_set(&t, SINGLE_TEST_ERROR_TIMEOUT);
+  uloop_run();
+  sput_fail_unless(!pending_readable, "readable left");
+
+  if ((dc = _connection_find(d1, -1, dst)))
+    _connection_shutdown(dc);
+  uloop_timeout_set(&t2, 5);
+  uloop_run();
+  uloop_timeout_cancel(&t);
+  uloop_timeout_cancel(&t2);
+  uloop_timeout_cancel(&t3);
+}
+
+static void dtls_resume_untrusted()
+{
+  int pbase = 49050;
+  struct sockaddr_in6 src = {.sin6_family = AF_INET6
+#ifdef __APPLE__
+                             , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  struct sockaddr_in6 dst = src;
+  bool rb;
+
+  d1 = dtls_create(pbase);
+  dtls_set_unknown_cert_cb(d1, _verdict_cb, NULL);
+  d2 = dtls_create(pbase+1);
+  dtls_set_unknown_cert_cb(d2, _verdict_cb, NULL);
+  dtls_set_readable_cb(d2, _readable_cb, NULL);
+  rb = dtls_set_local_cert(d1, "test/cert1.pem", "test/key1.pem");
+  sput_fail_unless(rb, "dtls_set_local_cert 1");
+  rb = dtls_set_local_cert(d2, "test/cert2.pem", "test/key2.pem");
+  sput_fail_unless(rb, "dtls_set_local_cert 2");
+  dtls_start(d1);
+  dtls_start(d2);
+
+  (void)inet_pton(AF_INET6, "::1", &src.sin6_addr);
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  src.sin6_port = htons(pbase);
+  dst.sin6_port = htons(pbase+1);
+
+  resume_trusted = true;
+  _test_resume_send(&src, &dst);
+  sput_fail_unless(d2->stats.full_handshakes == 1, "full handshake");
+  _test_resume_send(&src, &dst);
+  sput_fail_unless(d2->stats.resumed_handshakes == 1, "resumed handshake");
+
+  /* Verdict changed; the session must not get it through anymore */
+  resume_trusted = false;
+  _test_resume_send(&src, &dst);
+  sput_fail_unless(d2->stats.resumed_handshakes == 1, "resumed untrusted");
+  sput_fail_unless(d2->stats.rejected_resumptions == 1, "not rejected");
+  sput_fail_unless(!_session_find(d1, &dst), "client kept session");
+
+  dtls_destroy(d1);
+  dtls_destroy(d2);
+}
+
+static dtls _test_session_file_i(int port)
+{
+  dtls d = dtls_create(port);
+
+  sput_fail_unless(d, "dtls_create");
+  sput_fail_unless(dtls_set_session_file(d, SESSION_TEST_FILE),
+                   "dtls_set_session_file");
+  return d;
+}
+
+static void dtls_ticket_rotation()
+{
+  unsigned char keys[TICKET_KEYS_MAX], ctx_keys[TICKET_KEYS_MAX];
+  int pbase = 49070;
+  dtls d;
+  int len;
+
+  unlink(SESSION_TEST_FILE);
+  d = _test_session_file_i(pbase);
+  len = d->ticket_keys_len;
+  memcpy(keys, d->ticket_keys, len);
+  sput_fail_unless(d->ticket_keys_timeout.pending, "rotation scheduled");
+  dtls_destroy(d);
+
+  /* Keys younger than the sessions are kept across restarts.. */
+  d = _test_session_file_i(pbase);
+  sput_fail_unless(!memcmp(keys, d->ticket_keys, len), "keys kept");
+
+  /* .. but not older ones */
+  d->ticket_keys_created -= SESSION_LIFETIME;
+  sput_fail_unless(_sessions_save(d), "_sessions_save");
+  dtls_destroy(d);
+  d = _test_session_file_i(pbase);
+  sput_fail_unless(memcmp(keys, d->ticket_keys, len), "old keys rotated");
+
+  /* Running instance rotates them when the timer fires */
+  memcpy(keys, d->ticket_keys, len);
+  d->ticket_keys_created -= SESSION_LIFETIME;
+  d->ticket_keys_timeout.cb(&d->ticket_keys_timeout);
+  sput_fail_unless(memcmp(keys, d->ticket_keys, len), "keys rotated");
+  sput_fail_unless(SSL_CTX_get_tlsext_ticket_keys(d->ssl_server_ctx,
+                                                  ctx_keys, len) == 1
+                   && !memcmp(ctx_keys, d->ticket_keys, len),
+                   "new keys in use");
+  sput_fail_unless(d->ticket_keys_timeout.pending, "next rotation scheduled");
+  dtls_destroy(d);
+  unlink(SESSION_TEST_FILE);
+}
+
 static void _test_unknown_i(int i)
 {
   char cert1[2048];
@@ -303,6 +458,117 @@ static void _test_unknown_i(int i)
   sput_fail_unless(!pending_unknown, "no unknown left");
 }
 
+int storm_received;
+hnetd_time_t storm_keepalive_next;
+hnetd_time_t storm_jitter;
+
+void _storm_readable_cb(dtls d, void *context)
+{
+  char buf[1024];
+  struct sockaddr_in6 *src, *dst;
+
+  while (dtls_recv(d, &src, &dst, buf, sizeof(buf)) > 0)
+    if (++storm_received == STORM_PEERS)
+      uloop_end();
+}
+
+void _storm_keepalive_cb(struct uloop_timeout *t)
+{
+  hnetd_time_t now = hnetd_time();
+
+  if (now - storm_keepalive_next > storm_jitter)
+    storm_jitter = now - storm_keepalive_next;
+  storm_keepalive_next = now + STORM_KEEPALIVE_INTERVAL;
+  uloop_timeout_set(t, STORM_KEEPALIVE_INTERVAL);
+}
+
+/* Returns the worst keepalive timer lateness seen during the storm. */
+static hnetd_time_t _test_storm_i(int pbase, int workers)
+{
+  dtls peers[STORM_PEERS];
+  dtls_limits_s limits = {
+    .input_pps = 100000,
+    .input_pps_total = 100000,
+    .num_non_data_connections = 2 * STORM_PEERS,
+  };
+  struct uloop_timeout t = { .cb = _timeout };
+  struct uloop_timeout ka = { .cb = _storm_keepalive_cb };
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6 };
+  dtls_stats_s stats;
+  char *msg = "storm";
+  bool rb;
+  int i, rv;
+
+#ifdef __APPLE__
+  dst.sin6_len = sizeof(dst);
+#endif /* __APPLE__ */
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  dst.sin6_port = htons(pbase);
+
+  d1 = dtls_create(pbase);
+  sput_fail_unless(d1, "dtls_create");
+  /* All peers share ::1, so per-source limits would throttle them. */
+  dtls_set_limits(d1, &limits);
+  dtls_set_readable_cb(d1, _storm_readable_cb, NULL);
+  rb = dtls_set_local_cert(d1, "test/cert1.pem", "test/key1.pem");
+  sput_fail_unless(rb, "dtls_set_local_cert 1");
+  rb = dtls_set_verify_locations(d1, "test/cert2.pem", NULL);
+  sput_fail_unless(rb, "dtls_set_verify_locations 1");
+  rb = dtls_set_handshake_workers(d1, workers);
+  sput_fail_unless(rb, "dtls_set_handshake_workers 1");
+  dtls_start(d1);
+
+  for (i = 0 ; i < STORM_PEERS ; i++)
+    {
+      peers[i] = dtls_create(pbase + 1 + i);
+      sput_fail_unless(peers[i], "dtls_create peer");
+      rb = dtls_set_local_cert(peers[i], "test/cert2.pem", "test/key2.pem");
+      sput_fail_unless(rb, "dtls_set_local_cert peer");
+      rb = dtls_set_verify_locations(peers[i], "test/cert1.pem", NULL);
+      sput_fail_unless(rb, "dtls_set_verify_locations peer");
+      rb = dtls_set_handshake_workers(peers[i], workers ? 1 : 0);
+      sput_fail_unless(rb, "dtls_set_handshake_workers peer");
+      dtls_start(peers[i]);
+    }
+
+  storm_received = 0;
+  storm_jitter = 0;
+  storm_keepalive_next = hnetd_time() + STORM_KEEPALIVE_INTERVAL;
+  uloop_timeout_set(&ka, STORM_KEEPALIVE_INTERVAL);
+  for (i = 0 ; i < STORM_PEERS ; i++)
+    {
+      rv = dtls_send(peers[i], NULL, &dst, msg, strlen(msg));
+      sput_fail_unless(rv == (int)strlen(msg), "sendto failed?");
+    }
+
+  uloop_timeout_set(&t, STORM_ERROR_TIMEOUT);
+  uloop_run();
+  sput_fail_unless(storm_received == STORM_PEERS, "not all peers got through");
+  dtls_get_stats(d1, &stats);
+  sput_fail_unless(stats.full_handshakes + stats.resumed_handshakes
+                   == STORM_PEERS, "not all handshakes completed");
+
+  uloop_timeout_cancel(&t);
+  uloop_timeout_cancel(&ka);
+  for (i = 0 ; i < STORM_PEERS ; i++)
+    dtls_destroy(peers[i]);
+  dtls_destroy(d1);
+  return storm_jitter;
+}
+
+static void dtls_storm()
+{
+  hnetd_time_t inline_jitter = _test_storm_i(49200, 0);
+  hnetd_time_t worker_jitter = _test_storm_i(49300, 4);
+
+  L_INFO("keepalive jitter with %d peer handshake storm: "
+         "%" PRItime " ms inline, %" PRItime " ms with workers",
+         STORM_PEERS, inline_jitter, worker_jitter);
+  sput_fail_unless(worker_jitter <= inline_jitter
+                   || worker_jitter < STORM_JITTER_LIMIT,
+                   "event loop blocked by handshakes");
+}
+
 static void dtls_basic_sc_cert()
 {
   _test_basic_i(0);
@@ -352,6 +618,9 @@ int main(int argc, char **argv)
   sput_maybe_run_test(dtls_basic_cc_psk, do {} while(0));
   sput_maybe_run_test(dtls_unknown_1, do {} while(0));
   sput_maybe_run_test(dtls_unknown_2, do {} while(0));
+  sput_maybe_run_test(dtls_resume_untrusted, do {} while(0));
+  sput_maybe_run_test(dtls_ticket_rotation, do {} while(0));
+  sput_maybe_run_test(dtls_storm, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -6,15 +6,39 @@
 #include <libubox/uloop.h>
 #include <syslog.h>
 
+#include "sput.h"
+
 struct uloop_timeout to, end;
-struct exeq exeq[2];
+struct exeq exeq[5];
 
 int log_level = 9;
 void (*hnetd_log)(int priority, const char *format, ...) = syslog;
 
 void _end_to(__unused struct uloop_timeout *t)
 {
-	exit(0);
+	sput_fail_unless(!exeq_busy(&exeq[0]) && !exeq_busy(&exeq[1]), "fifo done");
+	sput_fail_unless(exeq[0].stats.executed == 3, "3 executed");
+	sput_fail_unless(exeq[1].stats.executed == 3, "3 executed");
+
+	/* Barrier, then the surviving keyed task */
+	sput_fail_unless(!exeq_busy(&exeq[2]), "coalesced done");
+	sput_fail_unless(exeq[2].stats.executed == 2, "2 executed");
+	sput_fail_unless(exeq[2].stats.coalesced == 1, "1 coalesced");
+	sput_fail_unless(exeq[2].stats.max_queued == 1, "max depth 1");
+	sput_fail_unless(exeq[2].stats.wait_max >= 100, "waited for barrier");
+
+	sput_fail_unless(!exeq_busy(&exeq[3]), "parallel done");
+	sput_fail_unless(exeq[3].stats.executed == 3, "3 executed");
+	sput_fail_unless(exeq[3].stats.coalesced == 0, "none coalesced");
+	sput_fail_unless(exeq[3].stats.failed == 0, "none failed");
+
+	sput_fail_unless(!exeq_busy(&exeq[4]), "barrier done");
+	sput_fail_unless(exeq[4].stats.executed == 3, "3 executed");
+	sput_fail_unless(exeq[4].stats.wait_max >= 100, "waited for barrier");
+
+	for (size_t i = 0; i < 5; i++)
+		exeq_term(&exeq[i]);
+	uloop_end();
 }
 
 void _t2(__unused struct uloop_timeout *t)
@@ -39,11 +63,41 @@ void _t1(__unused struct uloop_timeout *t)
 	exeq_add(&exeq[1], argv3);
 	to.cb = _t2;
 	uloop_timeout_set(&to, 200);
+
+	/* Queued tasks with the same key are superseded */
+	exeq_init(&exeq[2]);
+	char *sleep[] = { "/bin/sleep", "0.1", NULL };
+	exeq_add(&exeq[2], sleep);
+	char *argv7[] = { "/bin/echo", "7", NULL };
+	exeq_add_keyed(&exeq[2], "k", argv7);
+	char *argv8[] = { "/bin/echo", "8", NULL };
+	exeq_add_keyed(&exeq[2], "k", argv8);
+	sput_fail_unless(exeq[2].stats.running == 1, "barrier running");
+	sput_fail_unless(exeq[2].stats.queued == 1, "1 queued");
+	sput_fail_unless(exeq[2].stats.coalesced == 1, "1 coalesced");
+
+	/* Distinct keys run in parallel, same key waits */
+	exeq_init(&exeq[3]);
+	exeq[3].max_running = 2;
+	exeq_add_keyed(&exeq[3], "a", sleep);
+	exeq_add_keyed(&exeq[3], "b", sleep);
+	char *argv9[] = { "/bin/echo", "9", NULL };
+	exeq_add_keyed(&exeq[3], "a", argv9);
+	sput_fail_unless(exeq[3].stats.running == 2, "2 running");
+	sput_fail_unless(exeq[3].stats.queued == 1, "1 queued");
+
+	/* A running barrier keeps later tasks waiting, even with room */
+	exeq_init(&exeq[4]);
+	exeq[4].max_running = 2;
+	exeq_add(&exeq[4], sleep);
+	exeq_add_keyed(&exeq[4], "a", argv7);
+	exeq_add_keyed(&exeq[4], "b", argv8);
+	sput_fail_unless(exeq[4].stats.running == 1, "barrier alone");
+	sput_fail_unless(exeq[4].stats.queued == 2, "2 queued");
 }
 
-int main()
+void test_exeq(void)
 {
-	openlog("hnetd", LOG_PERROR | LOG_PID, LOG_DAEMON);
 	uloop_init();
 	to.pending = 0;
 	to.cb = _t1;
@@ -52,5 +106,15 @@ int main()
 	end.cb = _end_to;
 	uloop_timeout_set(&end, 1000);
 	uloop_run();
-	return 0;
+}
+
+int main()
+{
+	openlog("hnetd", LOG_PERROR | LOG_PID, LOG_DAEMON);
+	sput_start_testing();
+	sput_enter_suite("exeq");
+	sput_run_test(test_exeq);
+	sput_leave_suite();
+	sput_finish_testing();
+	return sput_get_return_value();
 }
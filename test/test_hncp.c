@@ -13,6 +13,7 @@
 
 #include "hncp_i.h"
 #include "hncp_proto.h"
+#include "hncp_hash.h"
 #include "sput.h"
 #include "smock.h"
 #include "platform.h"
@@ -153,6 +154,9 @@ void hncp_int(void)
   /* Make sure network hash is dirty. */
   sput_fail_unless(o->network_hash_dirty, "network hash should be dirty");
 
+  /* Changes are published immediately until the hold-down part below */
+  o->ext->conf.republish_holddown = 0;
+
   /* Make sure we can add nodes if we feel like it. */
   dncp_node_id_s ni;
   memset(&ni, 0, sizeof(ni));
@@ -203,6 +207,178 @@ void hncp_int(void)
   dncp_ext_timeout(o);
   sput_fail_unless(o->own_node->update_number == 2, "update number ok");
 
+  /* Changes within the hold-down are coalesced into one update. */
+  dncp_republish_stats_s st, st2;
+  dncp_get_republish_stats(o, &st);
+  o->ext->conf.republish_holddown = HNETD_TIME_PER_SECOND;
+  dncp_add_tlv(o, 127, NULL, 0, 0);
+  dncp_ext_timeout(o);
+  dncp_add_tlv(o, 128, NULL, 0, 0);
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->own_node->update_number == 2, "update number ok");
+  o->last_republish -= HNETD_TIME_PER_SECOND;
+  dncp_ext_timeout(o);
+  sput_fail_unless(o->own_node->update_number == 3, "update number ok");
+  struct tlv_attr *a;
+  int c = 0;
+  dncp_node_for_each_tlv(o->own_node, a)
+    c += tlv_id(a) == 127 || tlv_id(a) == 128;
+  sput_fail_unless(c == 2, "both tlvs published");
+
+  dncp_get_republish_stats(o, &st2);
+  sput_fail_unless(st2.num_local_tlv_changes - st.num_local_tlv_changes == 2,
+                   "local tlv changes");
+  sput_fail_unless(st2.num_republished - st.num_republished == 1,
+                   "republished");
+  sput_fail_unless(st2.num_deferred - st.num_deferred == 1,
+                   "deferred once");
+
+  /* Local data is patched in place; the result should be the same as
+   * serializing all local TLVs from scratch. */
+  dncp_tlv lt[64];
+  int i;
+  o->ext->conf.republish_holddown = 0;
+  for (i = 0 ; i < 64 ; i++)
+    {
+      uint32_t v = (i * 37) % 64;
+      lt[i] = dncp_add_tlv(o, 200 + v % 3, &v, 1 + v % 4, 0);
+    }
+  for (i = 0 ; i < 64 ; i += 3)
+    dncp_remove_tlv(o, lt[i]);
+  dncp_ext_timeout(o);
+  struct tlv_buf tb;
+  dncp_tlv tt;
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  dncp_for_each_tlv(o, tt)
+    tlv_put_raw(&tb, dncp_tlv_get_attr(tt),
+                tlv_pad_len(dncp_tlv_get_attr(tt)));
+  sput_fail_unless(tlv_attr_equal(tb.head, dncp_node_get_tlvs(o->own_node)),
+                   "local data consistent");
+  tlv_buf_free(&tb);
+
+  /* Per-type iteration sees exactly the TLVs of the type. */
+  int c1 = 0, c2 = 0;
+  dncp_for_each_tlv(o, tt)
+    c1 += tlv_id(dncp_tlv_get_attr(tt)) == 201;
+  dncp_for_each_tlv_with_type(o, tt, 201)
+    {
+      sput_fail_unless(tlv_id(dncp_tlv_get_attr(tt)) == 201, "type ok");
+      c2++;
+    }
+  sput_fail_unless(c1 && c1 == c2, "all tlvs of type");
+  sput_fail_unless(!dncp_get_first_tlv_with_type(o, 199), "none of type");
+  sput_fail_unless(dncp_remove_tlvs_by_type(o, 201) == c1, "removed all");
+  sput_fail_unless(!dncp_get_first_tlv_with_type(o, 201), "none left");
+
+  hncp_uninit(&s);
+}
+
+/* Node data with a TLV of type tlvs[i][0] and content tlvs[i][1] for
+ * each i */
+static struct tlv_attr *_delta_data(int (*tlvs)[2], int count)
+{
+  struct tlv_buf tb;
+  int i;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (i = 0 ; i < count ; i++)
+    {
+      uint32_t v = cpu_to_be32(tlvs[i][1]);
+
+      tlv_put(&tb, tlvs[i][0], &v, sizeof(v));
+    }
+  return tb.head;
+}
+
+static bool _delta_roundtrip(struct tlv_attr *old, struct tlv_attr *new)
+{
+  int len = dncp_delta_encode(old, new, NULL);
+  void *buf = malloc(len + 1);
+  struct tlv_attr *r;
+  bool ok;
+
+  if (dncp_delta_encode(old, new, buf) != len)
+    {
+      free(buf);
+      return false;
+    }
+  r = dncp_delta_apply(old, buf, len);
+  ok = r && tlv_attr_equal(r, new);
+  tlv_free(r);
+  free(buf);
+  return ok;
+}
+
+void hncp_delta(void)
+{
+  static int a[][2] = {{1, 1}, {2, 1}, {2, 2}, {5, 1}, {7, 1}};
+  static int b[][2] = {{1, 1}, {2, 2}, {3, 1}, {5, 1}, {7, 2}, {8, 1}};
+  static int c[][2] = {{7, 1}, {1, 1}, {5, 1}};
+  struct tlv_attr *old = _delta_data(a, 5), *new = _delta_data(b, 6);
+  struct tlv_attr *unsorted = _delta_data(c, 3), *empty = _delta_data(c, 0);
+  int len = dncp_delta_encode(old, new, NULL);
+  void *buf = malloc(len);
+  int big[20][2], big2[20][2];
+  uint32_t update_number[DNCP_DELTA_HISTORY + 2];
+  hncp_s s;
+  dncp o;
+  int i;
+
+  sput_fail_unless(len > 0, "delta");
+  sput_fail_unless(_delta_roundtrip(old, new), "delta applies");
+  sput_fail_unless(_delta_roundtrip(new, old), "reverse delta applies");
+  sput_fail_unless(dncp_delta_encode(old, old, NULL) == 0, "no change");
+  sput_fail_unless(_delta_roundtrip(old, old), "empty delta applies");
+  sput_fail_unless(_delta_roundtrip(empty, new), "delta from nothing");
+  sput_fail_unless(_delta_roundtrip(new, empty), "delta to nothing");
+  sput_fail_unless(_delta_roundtrip(unsorted, new), "unsorted base");
+  sput_fail_unless(_delta_roundtrip(new, unsorted), "unsorted result");
+
+  /* Broken deltas and bases are noticed */
+  dncp_delta_encode(old, new, buf);
+  sput_fail_unless(!dncp_delta_apply(old, buf, len - 1), "truncated");
+  sput_fail_unless(!dncp_delta_apply(empty, buf, len), "base too short");
+  free(buf);
+  tlv_free(old);
+  tlv_free(new);
+  tlv_free(unsorted);
+  tlv_free(empty);
+
+  /* One TLV out of many changed: the delta is small */
+  for (i = 0 ; i < 20 ; i++)
+    {
+      big[i][0] = big2[i][0] = 10;
+      big[i][1] = big2[i][1] = i;
+    }
+  big2[19][1] = 100;
+  old = _delta_data(big, 20);
+  new = _delta_data(big2, 20);
+  len = dncp_delta_encode(old, new, NULL);
+  sput_fail_unless(len > 0 && len < (int)tlv_len(new) / 4, "delta small");
+  sput_fail_unless(_delta_roundtrip(old, new), "small delta applies");
+  tlv_free(old);
+  tlv_free(new);
+
+  /* The own node keeps the last DNCP_DELTA_HISTORY versions */
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  dncp_set_node_data_deltas(o, true);
+  for (i = 0 ; i < DNCP_DELTA_HISTORY + 2 ; i++)
+    {
+      update_number[i] = o->own_node->update_number;
+      dncp_add_tlv(o, 123, &i, sizeof(i), 0);
+      dncp_self_flush(o->own_node);
+    }
+  sput_fail_unless(!dncp_delta_base(o, update_number[1]), "oldest gone");
+  sput_fail_unless(dncp_delta_base(o, update_number[2]), "history kept");
+  sput_fail_unless(dncp_delta_base(o, update_number[i - 1]), "previous kept");
+  sput_fail_unless(!dncp_delta_base(o, o->own_node->update_number),
+                   "current not in history");
+  dncp_set_node_data_deltas(o, false);
+  sput_fail_unless(!dncp_delta_base(o, update_number[i - 1]),
+                   "history dropped");
   hncp_uninit(&s);
 }
 
@@ -230,6 +406,105 @@ void hncp_hash(void)
   hncp_uninit(&s);
 }
 
+/* Lengths around the MD5 padding boundaries (55/56/64 bytes) */
+#define HASH_TEST_MAX_LEN 300
+#define HASH_TEST_MAX_COUNT 9
+
+void hncp_hash_multi(void)
+{
+  unsigned char data[HASH_TEST_MAX_COUNT][HASH_TEST_MAX_LEN];
+  unsigned char got[HASH_TEST_MAX_COUNT][16], exp[16];
+  const void *bufs[HASH_TEST_MAX_COUNT];
+  size_t lens[HASH_TEST_MAX_COUNT];
+  void *dsts[HASH_TEST_MAX_COUNT];
+  hncp_hash_backend b, md5 = hncp_hash_find_backend("md5");
+  int i, j, count, bad;
+
+  for (i = 0 ; i < HASH_TEST_MAX_COUNT ; i++)
+    {
+      for (j = 0 ; j < HASH_TEST_MAX_LEN ; j++)
+        data[i][j] = random();
+      bufs[i] = data[i];
+      dsts[i] = got[i];
+    }
+  sput_fail_unless(md5 && md5 == hncp_hash_backends, "md5 is the default");
+  sput_fail_unless(!hncp_hash_find_backend("nonexistent"), "no such backend");
+  for (b = (hncp_hash_backend)hncp_hash_backends ; b->name ; b++)
+    {
+      bad = 0;
+      for (count = 1 ; count <= HASH_TEST_MAX_COUNT ; count++)
+        for (j = 0 ; j <= HASH_TEST_MAX_LEN ; j++)
+          {
+            /* Mix of lengths within a batch */
+            for (i = 0 ; i < count ; i++)
+              lens[i] = (j + i * 61) % (HASH_TEST_MAX_LEN + 1);
+            if (b->hash_multi)
+              b->hash_multi(count, bufs, lens, dsts);
+            else
+              for (i = 0 ; i < count ; i++)
+                b->hash(bufs[i], lens[i], dsts[i]);
+            for (i = 0 ; i < count ; i++)
+              {
+                md5->hash(bufs[i], lens[i], exp);
+                bad += !!memcmp(got[i], exp, sizeof(exp));
+              }
+          }
+      for (j = 0 ; j <= HASH_TEST_MAX_LEN ; j++)
+        {
+          b->hash(data[0], j, got[0]);
+          md5->hash(data[0], j, exp);
+          bad += !!memcmp(got[0], exp, sizeof(exp));
+        }
+      L_NOTICE("hash backend %s: %d mismatches", b->name, bad);
+      sput_fail_unless(!bad, "backend matches libubox md5");
+    }
+}
+
+#define HASH_BENCH_COUNT DNCP_HASH_BATCH
+#define HASH_BENCH_LEN 512
+#define HASH_BENCH_ROUNDS 2000
+
+void hncp_hash_bench(void)
+{
+  static unsigned char data[HASH_BENCH_COUNT][HASH_BENCH_LEN];
+  unsigned char out[HASH_BENCH_COUNT][16];
+  const void *bufs[HASH_BENCH_COUNT];
+  size_t lens[HASH_BENCH_COUNT];
+  void *dsts[HASH_BENCH_COUNT];
+  struct timespec ts0, ts;
+  hncp_hash_backend b;
+  int i, r;
+  long us;
+
+  for (i = 0 ; i < HASH_BENCH_COUNT ; i++)
+    {
+      memset(data[i], i, HASH_BENCH_LEN);
+      bufs[i] = data[i];
+      /* Node data of somewhat different sizes */
+      lens[i] = HASH_BENCH_LEN - (i % 4) * 64;
+      dsts[i] = out[i];
+    }
+  for (b = (hncp_hash_backend)hncp_hash_backends ; b->name ; b++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &ts0);
+      for (r = 0 ; r < HASH_BENCH_ROUNDS ; r++)
+        {
+          if (b->hash_multi)
+            b->hash_multi(HASH_BENCH_COUNT, bufs, lens, dsts);
+          else
+            for (i = 0 ; i < HASH_BENCH_COUNT ; i++)
+              b->hash(bufs[i], lens[i], dsts[i]);
+        }
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      us = (ts.tv_sec - ts0.tv_sec) * 1000000L
+        + (ts.tv_nsec - ts0.tv_nsec) / 1000;
+      L_NOTICE("hash backend %s: %d x %d buffers in %ld us (%ld MB/s)",
+               b->name, HASH_BENCH_ROUNDS, HASH_BENCH_COUNT, us,
+               us ? (long)HASH_BENCH_ROUNDS * HASH_BENCH_COUNT
+               * (HASH_BENCH_LEN - 96) / us : 0);
+    }
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -237,8 +512,11 @@ int main(int argc, char **argv)
   sput_start_testing();
   sput_enter_suite("hncp"); /* optional */
   sput_run_test(hncp_hash);
+  sput_run_test(hncp_hash_multi);
+  sput_run_test(hncp_hash_bench);
   sput_run_test(hncp_ext);
   sput_run_test(hncp_int);
+  sput_run_test(hncp_delta);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
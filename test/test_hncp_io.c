@@ -27,7 +27,7 @@
 dncp_ep_s static_ep = { .ifname = LOOPBACK_NAME,
                         .accept_insecure_nonlocal_traffic = true };
 
-#define dncp_find_ep_by_name(o, n) &static_ep
+#define dncp_find_ep_by_name(o, n) ((void)(o), (void)(n), &static_ep)
 #include "hncp_io.c"
 #include "sput.h"
 #include "smock.h"
@@ -43,16 +43,132 @@ void dncp_ext_ep_ready(dncp_ep ep, bool ready)
   smock_pull_bool_is("dncp_ready_value", ready);
 }
 
+/* Packets to send from within the timeout */
+static struct sockaddr_in6 *timeout_dst;
+static int timeout_sends;
+
 void dncp_ext_timeout(dncp o)
 {
+  char *msg = "bar";
+  int i;
+
   smock_pull("dncp_run");
+  for (i = 0 ; i < timeout_sends ; i++)
+    o->ext->cb.send(o->ext, &static_ep, NULL, timeout_dst, msg, strlen(msg));
+}
+
+bool dncp_ep_is_enabled(dncp_ep ep)
+{
+  return true;
 }
 
 int pending_packets = 0;
+int pending_peer_states = 0;
+
+/* Peer notifications (in any order, if set) */
+bool peer_states_unordered;
+int peer_ups, peer_downs;
+
+/* Remote end of the stream as seen by h1 (1) and h2 (2) */
+struct sockaddr_in6 stream_remote1, stream_remote2;
+uint16_t stream_server_port;
+
+/* Ends whose streams we wait to settle (if any) */
+static hncp settle_h1, settle_h2;
+
+static int _count_streams(hncp h, bool connected_only)
+{
+  hncp_stream st;
+  int c = 0;
+
+  list_for_each_entry(st, &h->streams, lh)
+    c += !connected_only || st->connected;
+  return c;
+}
+
+static hncp_stream _first_stream(hncp h)
+{
+  return list_first_entry(&h->streams, hncp_stream_s, lh);
+}
+
+static uint16_t _stream_port(hncp_stream st, bool peer)
+{
+  struct sockaddr_in6 sa;
+  socklen_t sl = sizeof(sa);
+
+  if ((peer ? getpeername : getsockname)(st->ufd.fd,
+                                         (struct sockaddr *)&sa, &sl) < 0)
+    return 0;
+  return sa.sin6_port;
+}
+
+/* Both ends are up, over the same connection */
+static bool _stream_settled(void)
+{
+  hncp_stream st1, st2;
+
+  if (_count_streams(settle_h1, true) != 1
+      || _count_streams(settle_h2, true) != 1)
+    return false;
+  st1 = _first_stream(settle_h1);
+  st2 = _first_stream(settle_h2);
+  return _stream_port(st1, false) == _stream_port(st2, true)
+    && _stream_port(st1, true) == _stream_port(st2, false);
+}
+
+static void _stream_settle_timeout(struct uloop_timeout *t)
+{
+  sput_fail_unless(false, "streams did not settle");
+  uloop_end();
+}
+
+/* Run the loop until the streams between h1 and h2 settle, when the
+ * order of events on the way is not fixed. It ends on the peer state
+ * change that settles them, so it does not depend on timing; the
+ * timeout only bounds a failure. */
+static void _stream_settle(hncp h1, hncp h2)
+{
+  struct uloop_timeout t = { .cb = _stream_settle_timeout };
+
+  settle_h1 = h1;
+  settle_h2 = h2;
+  uloop_timeout_set(&t, 5000);
+  if (!_stream_settled())
+    uloop_run();
+  uloop_timeout_cancel(&t);
+  settle_h1 = settle_h2 = NULL;
+}
+
+void dncp_ext_ep_peer_state(dncp_ep ep,
+                            struct sockaddr_in6 *local,
+                            struct sockaddr_in6 *remote,
+                            bool connected)
+{
+  if (connected)
+    peer_ups++;
+  else
+    peer_downs++;
+  if (peer_states_unordered)
+    {
+      if (settle_h1 && _stream_settled())
+        uloop_end();
+      return;
+    }
+  smock_pull_bool_is("dncp_peer_state", connected);
+  if (connected)
+    {
+      if (remote->sin6_port == htons(stream_server_port))
+        stream_remote1 = *remote;
+      else
+        stream_remote2 = *remote;
+    }
+  if (!--pending_peer_states && !pending_packets)
+    uloop_end();
+}
 
 void dncp_ext_readable(dncp o)
 {
-  char buf[1024];
+  static char buf[HNCP_STREAM_MAXIMUM_SIZE];
   size_t len = sizeof(buf);
   int r;
   struct sockaddr_in6 *src, *dst;
@@ -74,7 +190,7 @@ void dncp_ext_readable(dncp o)
       sput_fail_unless(memcmp(&dst->sin6_addr,
                               &edst->sin6_addr, sizeof(dst->sin6_addr))==0,
                        "dst mismatch");
-      if (!--pending_packets)
+      if (!--pending_packets && !pending_peer_states)
         uloop_end();
     }
 }
@@ -137,6 +253,228 @@ static void dncp_io_basic_2()
   hncp_io_uninit(&h2);
 }
 
+static void dncp_io_batch()
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  udp46_stats_s st;
+  char *ifname = LOOPBACK_NAME;
+  int i;
+
+  (void)uloop_init();
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62002;
+  h2.udp_port = 62003;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  struct sockaddr_in6 src = {
+    .sin6_family = AF_INET6,
+    .sin6_port = htons(h1.udp_port),
+    .sin6_addr = a
+#ifdef __APPLE__
+    , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  struct sockaddr_in6 dst = {
+    .sin6_family = AF_INET6,
+    .sin6_port = htons(h2.udp_port),
+    .sin6_addr = a
+#ifdef __APPLE__
+    , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+
+  /* Everything sent within one timeout should leave in one go */
+  timeout_dst = &dst;
+  timeout_sends = 10;
+  smock_push("dncp_run", NULL);
+  h1.timeout.cb(&h1.timeout);
+  smock_is_empty();
+  udp46_get_stats(h1.u46_server, &st);
+  sput_fail_unless(st.packets == 10, "10 packets sent");
+#ifdef __linux__
+  sput_fail_unless(st.syscalls == 1, "in 1 syscall");
+#endif /* __linux__ */
+
+  for (i = 0 ; i < timeout_sends ; i++)
+    {
+      smock_push_int("dncp_poll_io_recvfrom", 3);
+      smock_push_int("dncp_poll_io_recvfrom_src", &src);
+      smock_push_int("dncp_poll_io_recvfrom_dst", &dst);
+      smock_push_int("dncp_poll_io_recvfrom_buf", "bar");
+      smock_push_int("dncp_poll_io_recvfrom_ifname", ifname);
+      pending_packets++;
+    }
+  uloop_run();
+  smock_is_empty();
+
+  /* Outside timeout, sends are immediate */
+  smock_push_int("dncp_poll_io_recvfrom", 3);
+  smock_push_int("dncp_poll_io_recvfrom_src", &src);
+  smock_push_int("dncp_poll_io_recvfrom_dst", &dst);
+  smock_push_int("dncp_poll_io_recvfrom_buf", "foo");
+  smock_push_int("dncp_poll_io_recvfrom_ifname", ifname);
+  h1.ext.cb.send(&h1.ext, &static_ep, NULL, &dst, "foo", 3);
+  pending_packets++;
+  udp46_get_stats(h1.u46_server, &st);
+  sput_fail_unless(st.packets == 11, "11 packets sent");
+  uloop_run();
+
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+  timeout_sends = 0;
+}
+
+static void dncp_io_stream()
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  struct in6_addr a;
+  char *ifname = LOOPBACK_NAME;
+  int i, big_len = 60000;
+  char *big = malloc(big_len);
+
+  (void)uloop_init();
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62004;
+  h2.udp_port = 62005;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  sput_fail_unless(hncp_io_init(&h1), "dncp_io_init h1");
+  sput_fail_unless(hncp_io_init(&h2), "dncp_io_init h2");
+  static_ep.accept_insecure_nonlocal_traffic = false;
+  sput_fail_unless(hncp_io_set_stream(&h1, LOOPBACK_NAME, true),
+                   "set_stream h1");
+  sput_fail_unless(hncp_io_set_stream(&h2, LOOPBACK_NAME, true),
+                   "set_stream h2");
+  sput_fail_unless(static_ep.unicast_only
+                   && static_ep.unicast_is_reliable_stream
+                   && static_ep.maximum_unicast_size
+                   == HNCP_STREAM_MAXIMUM_SIZE, "stream ep conf");
+  sput_fail_unless(!static_ep.accept_insecure_nonlocal_traffic,
+                   "nonlocal traffic setting kept");
+  static_ep.accept_insecure_nonlocal_traffic = true;
+
+  /* h1 connects to h2, which does not know h1 and drops it */
+  (void)inet_pton(AF_INET6, "::1", &a);
+  struct sockaddr_in6 server, client;
+  sockaddr_in6_set(&server, &a, h2.udp_port);
+  sockaddr_in6_set(&client, &a, h1.udp_port);
+  stream_server_port = h2.udp_port;
+  smock_push_bool("dncp_peer_state", true);
+  smock_push_bool("dncp_peer_state", false);
+  pending_peer_states = 2;
+  sput_fail_unless(hncp_io_add_stream_peer(&h1, LOOPBACK_NAME, &server),
+                   "add_stream_peer");
+  sput_fail_unless(hncp_io_add_stream_peer(&h1, LOOPBACK_NAME, &server),
+                   "add_stream_peer again");
+  uloop_run();
+  smock_is_empty();
+  sput_fail_unless(_count_streams(&h1, true) == 0, "h1 rejected by h2");
+  sput_fail_unless(_count_streams(&h2, false) == 0, "no stream at h2");
+
+  /* Once h2 knows h1 too, it connects; both ends should tell dncp
+   * about the peer */
+  smock_push_bool("dncp_peer_state", true);
+  smock_push_bool("dncp_peer_state", true);
+  pending_peer_states = 2;
+  sput_fail_unless(hncp_io_add_stream_peer(&h2, LOOPBACK_NAME, &client),
+                   "add_stream_peer h2");
+  uloop_run();
+  smock_is_empty();
+  sput_fail_unless(_count_streams(&h1, true) == 1, "1 stream at h1");
+  sput_fail_unless(_count_streams(&h2, true) == 1, "1 stream at h2");
+  sput_fail_unless(_first_stream(&h1)->accepted, "h1 accepted");
+  sput_fail_unless(_stream_same_remote(&stream_remote1, &server),
+                   "h1 remote is h2");
+  sput_fail_unless(_stream_same_remote(&stream_remote2, &client),
+                   "h2 remote is h1");
+
+  /* Large message one way, then few small ones the other way; all
+   * over the same connection, with the message boundaries intact. */
+  for (i = 0 ; i < big_len ; i++)
+    big[i] = i % 251;
+  smock_push_int("dncp_poll_io_recvfrom", big_len);
+  smock_push_int("dncp_poll_io_recvfrom_src", &stream_remote2);
+  smock_push_int("dncp_poll_io_recvfrom_dst", &server);
+  smock_push_int("dncp_poll_io_recvfrom_buf", big);
+  smock_push_int("dncp_poll_io_recvfrom_ifname", ifname);
+  h1.ext.cb.send(&h1.ext, &static_ep, NULL, &stream_remote1, big, big_len);
+  pending_packets++;
+  uloop_run();
+  for (i = 0 ; i < 3 ; i++)
+    {
+      smock_push_int("dncp_poll_io_recvfrom", 3);
+      smock_push_int("dncp_poll_io_recvfrom_src", &stream_remote1);
+      smock_push_int("dncp_poll_io_recvfrom_dst", &stream_remote2);
+      smock_push_int("dncp_poll_io_recvfrom_buf", "baz");
+      smock_push_int("dncp_poll_io_recvfrom_ifname", ifname);
+      h2.ext.cb.send(&h2.ext, &static_ep, NULL, &stream_remote2, "baz", 3);
+      pending_packets++;
+    }
+  uloop_run();
+  smock_is_empty();
+  sput_fail_unless(_count_streams(&h1, false) == 1, "still 1 stream at h1");
+  sput_fail_unless(_count_streams(&h2, false) == 1, "still 1 stream at h2");
+
+  /* Both ends connect at once; h1 has the smaller address and port,
+   * so its connection is the one that is left. */
+  peer_states_unordered = true;
+  _stream_set_ep_enabled(&h1, &static_ep, false);
+  _stream_set_ep_enabled(&h2, &static_ep, false);
+  peer_ups = peer_downs = 0;
+  _stream_set_ep_enabled(&h1, &static_ep, true);
+  _stream_set_ep_enabled(&h2, &static_ep, true);
+  _stream_settle(&h1, &h2);
+  peer_states_unordered = false;
+  sput_fail_unless(_count_streams(&h1, true) == 1, "1 stream at h1");
+  sput_fail_unless(_count_streams(&h2, true) == 1, "1 stream at h2");
+  sput_fail_unless(peer_ups - peer_downs == 2, "peer up at both ends");
+  hncp_stream st1 = _first_stream(&h1), st2 = _first_stream(&h2);
+  struct sockaddr_in6 sa1, sa2;
+  socklen_t sl = sizeof(sa1);
+  sput_fail_unless(!st1->accepted && st2->accepted, "h1 connection kept");
+  getsockname(st1->ufd.fd, (struct sockaddr *)&sa1, &sl);
+  sl = sizeof(sa2);
+  getpeername(st2->ufd.fd, (struct sockaddr *)&sa2, &sl);
+  sput_fail_unless(sa1.sin6_port == sa2.sin6_port, "same connection");
+
+  /* Closing one end is noticed at the other one */
+  smock_push_bool("dncp_peer_state", false);
+  pending_peer_states = 1;
+  hncp_io_uninit(&h1);
+  uloop_run();
+  smock_is_empty();
+  sput_fail_unless(_count_streams(&h2, true) == 0, "no connection at h2");
+
+  /* Nothing is queued for the peer while it is not connected */
+  h2.ext.cb.send(&h2.ext, &static_ep, NULL, &client, "baz", 3);
+  sput_fail_unless(!_first_stream(&h2)->olen && _first_stream(&h2)->ufd.fd < 0,
+                   "not queued while disconnected");
+
+  sput_fail_unless(hncp_io_set_stream(&h2, LOOPBACK_NAME, false),
+                   "unset_stream h2");
+  sput_fail_unless(!static_ep.unicast_is_reliable_stream, "ep not stream");
+  sput_fail_unless(_count_streams(&h2, false) == 0, "no peers at h2");
+  hncp_io_uninit(&h2);
+  free(big);
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -147,6 +485,8 @@ int main(int argc, char **argv)
   argv += 1;
 
   sput_maybe_run_test(dncp_io_basic_2, do {} while(0));
+  sput_maybe_run_test(dncp_io_batch, do {} while(0));
+  sput_maybe_run_test(dncp_io_stream, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
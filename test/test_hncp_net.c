@@ -16,6 +16,9 @@
  */
 
 #include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/stat.h>
 
 /* Test utilities */
 #include "net_sim.h"
@@ -49,6 +52,65 @@ bool link_has_neighbors(dncp_ep l)
   return false;
 }
 
+/* Every local peer should be reachable via the per-endpoint and
+ * per-address indexes. */
+static void _check_peer_indexes(dncp o)
+{
+  dncp_tlv t;
+  dncp_peer n, n2;
+  dncp_ep ep;
+  int c = 0;
+
+  dncp_for_each_tlv_with_type(o, t, DNCP_T_PEER)
+    {
+      n = dncp_tlv_get_extra(t);
+      sput_fail_unless(n->tlv == t, "peer tlv backpointer");
+      sput_fail_unless(n->in_peers_by_sa6.key, "peer address known");
+      n2 = avl_find_element(&o->peers_by_sa6, &n->last_sa6, n2,
+                            in_peers_by_sa6);
+      sput_fail_unless(n2 && !memcmp(&n2->last_sa6, &n->last_sa6,
+                                     sizeof(n->last_sa6)),
+                       "peer found by address");
+      c++;
+    }
+  dncp_for_each_ep(o, ep)
+    {
+      dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+      list_for_each_entry(n, &l->peers, in_ep_peers)
+        {
+          sput_fail_unless(dncp_tlv_peer(o, &n->tlv->tlv)->ep_id == l->ep_id,
+                           "peer on right endpoint");
+          c--;
+        }
+    }
+  sput_fail_unless(!c, "all peers on endpoints");
+}
+
+/* The network TLV index should match what a scan of all nodes finds,
+ * in the same order. */
+static void _check_network_tlv_index(dncp o, uint16_t type)
+{
+  dncp_network_tlv t = dncp_get_first_network_tlv(o, type);
+  int c = 0;
+  dncp_node n;
+  struct tlv_attr *a;
+
+  dncp_for_each_node(o, n)
+    dncp_node_for_each_tlv_with_type(n, a, type)
+      {
+        sput_fail_unless(t && dncp_network_tlv_get_node(t) == n
+                         && !tlv_attr_cmp(dncp_network_tlv_get_attr(t), a),
+                         "network tlv matches");
+        if (t)
+          t = dncp_network_tlv_get_next(t);
+        c++;
+      }
+  sput_fail_unless(!t, "no extra network tlvs");
+  sput_fail_unless(dncp_get_network_tlv_count(o, type) == c,
+                   "network tlv count");
+}
+
 void hncp_two(void)
 {
   net_sim_s s;
@@ -65,6 +127,11 @@ void hncp_two(void)
   dncp_ep lc = dncp_find_ep_by_name(n1, "eth0");
   lc->keepalive_interval = 1000;
   n2 = net_sim_find_dncp(&s, "n2");
+  /* Index populated incrementally on n1, and all at once on n2 later */
+  sput_fail_unless(dncp_add_network_tlv_index(n1, HNCP_T_ASSIGNED_PREFIX),
+                   "add network tlv index");
+  sput_fail_unless(dncp_get_network_tlv_count(n2, HNCP_T_ASSIGNED_PREFIX) < 0,
+                   "not indexed");
   l1 = net_sim_dncp_find_ep_by_name(n1, "eth0");
   l2 = net_sim_dncp_find_ep_by_name(n2, "eth1");
   sput_fail_unless(!link_has_neighbors(l1), "no l1 neighbors");
@@ -77,6 +144,8 @@ void hncp_two(void)
 
   sput_fail_unless(n1->nodes.avl.count == 2, "n1 nodes == 2");
   sput_fail_unless(n2->nodes.avl.count == 2, "n2 nodes == 2");
+  _check_peer_indexes(n1);
+  _check_peer_indexes(n2);
 
 
   /* Play with the prefix API. Feed in stuff! */
@@ -112,6 +181,12 @@ void hncp_two(void)
     SIM_WHILE(&s, 10000,
               !net_sim_is_converged(&s) ||
               net_sim_dncp_tlv_type_count(n2, HNCP_T_ASSIGNED_PREFIX) != 2);
+  sput_fail_unless(dncp_add_network_tlv_index(n2, HNCP_T_ASSIGNED_PREFIX),
+                   "add network tlv index");
+  _check_network_tlv_index(n1, HNCP_T_ASSIGNED_PREFIX);
+  _check_network_tlv_index(n2, HNCP_T_ASSIGNED_PREFIX);
+  sput_fail_unless(dncp_get_network_tlv_count(n2, HNCP_T_ASSIGNED_PREFIX) == 2,
+                   "2 assigned prefixes indexed");
 
   sput_fail_unless(dncp_ifname_has_highest_id(n1, "eth0") !=
                    dncp_ifname_has_highest_id(n2, "eth1"),
@@ -139,6 +214,7 @@ void hncp_two(void)
    * of reachability (eventually; this may take some more time due to
    * grace period).. */
   SIM_WHILE(&s, 10000, n2->nodes.avl.count != 1);
+  _check_network_tlv_index(n2, HNCP_T_ASSIGNED_PREFIX);
 
   sput_fail_unless(dncp_ifname_has_highest_id(n1, "eth0") &&
                    dncp_ifname_has_highest_id(n2, "eth1"),
@@ -512,7 +588,7 @@ dncp_t_peer monkey_neighbor(dncp n1, dncp_ep l1,
         if (nh->peer_ep_id != dncp_ep_get_id(l2))
           continue;
         if (memcmp(dncp_tlv_get_node_id(n1, nh),
-                   &n2->own_node->node_id,
+                   n2->own_node->node_id,
                    HNCP_NI_LEN))
           continue;
         return nh;
@@ -757,7 +833,7 @@ void hncp_version(void)
 
   /* Make sure we can get neighbors for the other node from n1, using
    * the valid=false, but NOT with valid=true. */
-  dncp_node n = dncp_find_node_by_node_id(n1, &n2->own_node->node_id, false);
+  dncp_node n = dncp_find_node_by_node_id(n1, n2->own_node->node_id, false);
   sput_fail_unless(n, "dncp_node_find_by_id");
 
   struct tlv_attr *a = NULL;
@@ -779,6 +855,9 @@ void hncp_expiration(void)
   net_sim_init(&s);
   n1 = net_sim_find_dncp(&s, "n1");
   n2 = net_sim_find_dncp(&s, "n2");
+  /* Index on n1 should forget n2's TLVs once n2 expires */
+  sput_fail_unless(dncp_add_network_tlv_index(n1, HNCP_T_ASSIGNED_PREFIX),
+                   "add network tlv index");
   l1 = net_sim_dncp_find_ep_by_name(n1, "eth0");
   l2 = net_sim_dncp_find_ep_by_name(n2, "eth1");
 
@@ -786,23 +865,451 @@ void hncp_expiration(void)
   net_sim_set_connected(l1, l2, true);
   net_sim_set_connected(l2, l1, true);
   SIM_WHILE(&s, 1000, !net_sim_is_converged(&s));
+  _check_network_tlv_index(n1, HNCP_T_ASSIGNED_PREFIX);
 
   /* Make sure we can get neighbors for the other node from n1, using
    * the valid=false, but NOT with valid=true. */
-  dncp_node n = dncp_find_node_by_node_id(n1, &n2->own_node->node_id, false);
+  dncp_node n = dncp_find_node_by_node_id(n1, n2->own_node->node_id, false);
   sput_fail_unless(n, "dncp_node_find_by_id succeeded");
 
   /* Advance time _a lot_, run sim once */
   fu_set_hnetd_time(hnetd_time() + (1LL << 32) + 42);
   fu_poll();
 
-  n = dncp_find_node_by_node_id(n1, &n2->own_node->node_id, false);
+  n = dncp_find_node_by_node_id(n1, n2->own_node->node_id, false);
   sput_fail_unless(!n, "dncp_node_find_by_id failed");
+  _check_network_tlv_index(n1, HNCP_T_ASSIGNED_PREFIX);
+
+  net_sim_uninit(&s);
+}
+
+
+
+/* Warm restart: routers in a binary tree, one of which is restarted
+ * either cold (from scratch) or warm (from a snapshot of its node
+ * database). */
+#define SNAPSHOT_FILE "/tmp/test_hncp_net.snapshot"
+
+static dncp _tree_node(net_sim s, unsigned int i)
+{
+  char buf[32];
+
+  sprintf(buf, "node%u", i);
+  return net_sim_find_dncp(s, buf);
+}
+
+static void _tree_link(net_sim s, unsigned int parent, unsigned int child)
+{
+  char buf[32];
+
+  sprintf(buf, "down%u", (child - 1) % 2);
+  dncp_ep l1 = net_sim_dncp_find_ep_by_name(_tree_node(s, parent), buf);
+  dncp_ep l2 = net_sim_dncp_find_ep_by_name(_tree_node(s, child), "up");
+  net_sim_set_connected(l1, l2, true);
+  net_sim_set_connected(l2, l1, true);
+}
+
+/* Connect node i to its parent and children. */
+static void _tree_connect(net_sim s, unsigned int i, unsigned int num_nodes)
+{
+  unsigned int c;
+
+  if (i)
+    _tree_link(s, (i - 1) / 2, i);
+  for (c = 2 * i + 1 ; c <= 2 * i + 2 && c < num_nodes ; c++)
+    _tree_link(s, i, c);
+}
+
+static unsigned int _reachable_count(dncp o)
+{
+  unsigned int c = 0;
+  dncp_node n;
+
+  dncp_for_each_node(o, n)
+    c++;
+  return c;
+}
+
+static void _tree_restart(net_sim s, unsigned int i, unsigned int num_nodes,
+                          bool warm, hnetd_time_t elapsed[2], int *fetches)
+{
+  char buf[32];
+  dncp o = _tree_node(s, i);
+  hnetd_time_t start;
+  int j;
+
+  /* Some churn first, so that the network has a higher update
+   * number for the node than what it starts from. */
+  for (j = 0 ; j < 3 ; j++)
+    {
+      o->republish_tlvs = true;
+      dncp_self_flush(o->own_node);
+      SIM_WHILE(s, 1000000, !net_sim_is_converged(s));
+    }
+  sprintf(buf, "node%u", i);
+  unlink(SNAPSHOT_FILE);
+  if (warm)
+    {
+      sput_fail_unless(dncp_set_snapshot_file(o, SNAPSHOT_FILE) == 0,
+                       "no snapshot yet");
+      sput_fail_unless(dncp_save_snapshot(o), "snapshot saved");
+      struct stat st;
+      sput_fail_unless(stat(SNAPSHOT_FILE, &st) == 0
+                       && (st.st_mode & 0777) == 0600, "snapshot private");
+    }
+  uint32_t update_number = o->own_node->update_number;
+  net_sim_remove_node_by_name(s, buf);
+  o = _tree_node(s, i);
+  if (warm)
+    {
+      int loaded = dncp_set_snapshot_file(o, SNAPSHOT_FILE);
+
+      sput_fail_unless(loaded == (int)num_nodes - 1, "all nodes loaded");
+      sput_fail_unless(o->own_node->update_number == update_number,
+                       "own update number restored");
+      /* Nothing is visible until the network confirms it */
+      sput_fail_unless(dncp_get_first_node(o) == o->own_node
+                       && !dncp_node_get_next(o->own_node),
+                       "loaded nodes unreachable");
+    }
+  _tree_connect(s, i, num_nodes);
+  start = hnetd_time();
+  /* First until the restarted node sees everyone, then until the
+   * rest of the network has caught up with it. */
+  SIM_WHILE(s, 1000000, _reachable_count(o) < num_nodes);
+  elapsed[0] = hnetd_time() - start;
+  SIM_WHILE(s, 1000000, !net_sim_is_converged(s));
+  elapsed[1] = hnetd_time() - start;
+  *fetches = net_sim_node_from_dncp(o)->sent_req_node_state;
+  if (warm)
+    dncp_set_snapshot_file(o, NULL);
+  unlink(SNAPSHOT_FILE);
+}
+
+static void raw_hncp_snapshot(unsigned int num_nodes,
+                              hnetd_time_t elapsed[2][2], int *fetches)
+{
+  net_sim_s s;
+  unsigned int i;
+  hnetd_time_t start;
+
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_multicast = true;
+  s.disable_pa = true;
+  for (i = 0 ; i < num_nodes ; i++)
+    _tree_connect(&s, i, num_nodes);
+  SIM_WHILE(&s, 1000000, !net_sim_is_converged(&s));
+  start = hnetd_time();
+  L_NOTICE("%u node tree converged in %lld ms", num_nodes,
+           (long long)(start - s.start));
+
+  /* Restart a leaf; first cold, then warm. */
+  for (i = 0 ; i < 2 ; i++)
+    {
+      _tree_restart(&s, num_nodes - 1, num_nodes, i, elapsed[i],
+                    &fetches[i]);
+      L_NOTICE("%s restart in %u node tree: node converged in %lld ms, "
+               "network in %lld ms, %d node states requested",
+               i ? "warm" : "cold", num_nodes, (long long)elapsed[i][0],
+               (long long)elapsed[i][1], fetches[i]);
+    }
+  net_sim_uninit(&s);
+}
+
+static void _check_snapshot(unsigned int num_nodes)
+{
+  hnetd_time_t elapsed[2][2];
+  int fetches[2];
+
+  raw_hncp_snapshot(num_nodes, elapsed, fetches);
+  sput_fail_unless(elapsed[1][0] < elapsed[0][0], "warm restart faster");
+  sput_fail_unless(elapsed[1][1] <= elapsed[0][1],
+                   "warm restart converges no slower");
+  sput_fail_unless(fetches[1] < fetches[0], "warm restart fetches less");
+}
+
+void hncp_snapshot(void)
+{
+  _check_snapshot(31);
+}
+
+void hncp_snapshot_bench(void)
+{
+  _check_snapshot(500);
+}
+
+/* Bulk sync: a new router joins a converged network (a binary tree)
+ * over links to several of its routers at once. */
+#define JOIN_LINK_BYTES_PER_MS 100
+
+/* Extra node data per router, so that there is something to fetch */
+#define JOIN_FILLER_TLV 999
+#define JOIN_FILLER_SIZE 1000
 
+static void raw_hncp_join(unsigned int num_nodes, unsigned int num_links,
+                          hnetd_time_t elapsed[2], int *fetches,
+                          int *sources)
+{
+  net_sim_s s;
+  char buf[32];
+  unsigned int i;
+  hnetd_time_t start;
+  char filler[JOIN_FILLER_SIZE];
+  net_neigh n;
+  dncp o;
+
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_multicast = true;
+  s.disable_pa = true;
+  memset(filler, 42, sizeof(filler));
+  for (i = 0 ; i < num_nodes ; i++)
+    {
+      _tree_connect(&s, i, num_nodes);
+      dncp_add_tlv(_tree_node(&s, i), JOIN_FILLER_TLV,
+                   filler, sizeof(filler), 0);
+    }
+  SIM_WHILE(&s, 1000000, !net_sim_is_converged(&s));
+  /* Without a bandwidth limit, fetching from one peer would be just
+   * as fast as from many. */
+  s.link_bytes_per_ms = JOIN_LINK_BYTES_PER_MS;
+  o = net_sim_find_dncp(&s, "joiner");
+  for (i = 0 ; i < num_links ; i++)
+    {
+      dncp o2 = _tree_node(&s, i * num_nodes / num_links);
+
+      sprintf(buf, "join%u", i);
+      dncp_ep l1 = net_sim_dncp_find_ep_by_name(o, buf);
+      dncp_ep l2 = net_sim_dncp_find_ep_by_name(o2, "join");
+      net_sim_set_connected(l1, l2, true);
+      net_sim_set_connected(l2, l1, true);
+    }
+  start = hnetd_time();
+  SIM_WHILE(&s, 1000000, _reachable_count(o) <= num_nodes);
+  elapsed[0] = hnetd_time() - start;
+  SIM_WHILE(&s, 1000000, !net_sim_is_converged(&s));
+  elapsed[1] = hnetd_time() - start;
+  *fetches = net_sim_node_from_dncp(o)->sent_req_node_state;
+  *sources = 0;
+  list_for_each_entry(n, &s.neighs, lh)
+    if (dncp_ep_get_dncp(n->src) == o && n->sent_req_node_state)
+      (*sources)++;
+  L_NOTICE("join of %u node tree over %u links: node converged in %lld ms, "
+           "network in %lld ms, %d node states requested from %d peers",
+           num_nodes, num_links, (long long)elapsed[0],
+           (long long)elapsed[1], *fetches, *sources);
+  net_sim_uninit(&s);
+}
+
+static void _check_join(unsigned int num_nodes)
+{
+  hnetd_time_t elapsed[2];
+  int fetches, sources;
+
+  raw_hncp_join(num_nodes, 3, elapsed, &fetches, &sources);
+  sput_fail_unless(fetches <= (int)num_nodes + 5,
+                   "each node state requested about once");
+  sput_fail_unless(sources > 1, "node states requested from several peers");
+}
+
+void hncp_join(void)
+{
+  _check_join(63);
+}
+
+void hncp_join_bench(void)
+{
+  _check_join(255);
+}
+
+/* Node data deltas: a hub with a lot of node data changes a bit of it
+ * now and then, and the spokes have to catch up. */
+#define DELTA_SPOKES 8
+#define DELTA_TLV 998
+#define DELTA_TLV_COUNT 64
+#define DELTA_CHANGES 5
+
+static long raw_hncp_delta(bool deltas, int *num_deltas)
+{
+  net_sim_s s;
+  char buf[32];
+  uint32_t v[8];
+  unsigned int i;
+  long bytes;
+  dncp hub, o;
+
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_multicast = true;
+  s.disable_pa = true;
+  hub = net_sim_find_dncp(&s, "hub");
+  dncp_set_node_data_deltas(hub, deltas);
+  for (i = 0 ; i < DELTA_SPOKES ; i++)
+    {
+      sprintf(buf, "node%u", i);
+      o = net_sim_find_dncp(&s, buf);
+      dncp_set_node_data_deltas(o, deltas);
+      sprintf(buf, "spoke%u", i);
+      dncp_ep l1 = net_sim_dncp_find_ep_by_name(hub, buf);
+      dncp_ep l2 = net_sim_dncp_find_ep_by_name(o, "up");
+      net_sim_set_connected(l1, l2, true);
+      net_sim_set_connected(l2, l1, true);
+    }
+  for (i = 0 ; i < DELTA_TLV_COUNT ; i++)
+    {
+      memset(v, i, sizeof(v));
+      dncp_add_tlv(hub, DELTA_TLV, v, sizeof(v), 0);
+    }
+  SIM_WHILE(&s, 1000000, !net_sim_is_converged(&s));
+  bytes = s.sent_unicast_bytes;
+  for (i = 0 ; i < DELTA_CHANGES ; i++)
+    {
+      /* Refresh one of them (e.g. a new lifetime) */
+      memset(v, i * 7, sizeof(v));
+      dncp_remove_tlv_matching(hub, DELTA_TLV, v, sizeof(v));
+      v[0] = i + 1;
+      dncp_add_tlv(hub, DELTA_TLV, v, sizeof(v), 0);
+      dncp_self_flush(hub->own_node);
+      SIM_WHILE(&s, 1000000, !net_sim_is_converged(&s));
+    }
+  bytes = s.sent_unicast_bytes - bytes;
+  *num_deltas = s.sent_node_delta;
+  L_NOTICE("%d node data changes with%s deltas: %ld unicast bytes, "
+           "%d node deltas", DELTA_CHANGES, deltas ? "" : "out",
+           bytes, *num_deltas);
   net_sim_uninit(&s);
+  return bytes;
+}
+
+void hncp_delta(void)
+{
+  int deltas_off, deltas_on;
+  long bytes_off = raw_hncp_delta(false, &deltas_off);
+  long bytes_on = raw_hncp_delta(true, &deltas_on);
+
+  sput_fail_unless(!deltas_off, "no deltas unless enabled");
+  sput_fail_unless(deltas_on >= DELTA_CHANGES * DELTA_SPOKES,
+                   "changes sent as deltas");
+  sput_fail_unless(bytes_on < bytes_off, "fewer bytes with deltas");
+}
+
+/* Node database footprint: a single router with a large number of
+ * (synthetic) nodes in its database. */
+#define NODE_BENCH_COUNT 10000
+#define NODE_BENCH_ROUNDS 10
+
+static uint64_t _bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _bench_node_id(dncp o, unsigned int i, void *ni)
+{
+  uint32_t v = cpu_to_be32(i + 1);
+
+  memset(ni, 0, DNCP_NI_LEN(o));
+  memcpy(ni, &v, sizeof(v) < (size_t)DNCP_NI_LEN(o) ?
+         sizeof(v) : (size_t)DNCP_NI_LEN(o));
+}
+
+/* Node data of a node in a chain: peer TLVs for both neighbors. */
+static struct tlv_attr *_bench_node_data(dncp o, unsigned int i)
+{
+  int nilen = DNCP_NI_LEN(o);
+  struct tlv_buf tb;
+  unsigned int j;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (j = i ? i - 1 : i + 1 ; j <= i + 1 ; j += 2)
+    {
+      struct tlv_attr *a = tlv_new(&tb, DNCP_T_PEER,
+                                   nilen + sizeof(dncp_t_peer_s));
+      dncp_t_peer p = tlv_data(a) + nilen;
+
+      _bench_node_id(o, j, tlv_data(a));
+      p->peer_ep_id = cpu_to_be32(1);
+      p->ep_id = cpu_to_be32(2);
+    }
+  return tb.head;
 }
 
+void hncp_node_bench(void)
+{
+  net_sim_s s;
+  dncp_node_id_s ni;
+  dncp_memory_stats_s st;
+  struct mallinfo2 mi;
+  size_t heap;
+  uint64_t start, lookup, hash;
+  unsigned int i, r;
+  dncp_node n;
+  int found = 0;
 
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_multicast = true;
+  s.disable_pa = true;
+  dncp o = net_sim_find_dncp(&s, "node0");
+  /* The own node id is random; move it out of the way */
+  _bench_node_id(o, NODE_BENCH_COUNT + 1, &ni);
+  dncp_set_own_node_id(o, &ni);
+
+  mi = mallinfo2();
+  heap = mi.uordblks;
+  for (i = 0 ; i < NODE_BENCH_COUNT ; i++)
+    {
+      _bench_node_id(o, i, &ni);
+      n = dncp_find_node_by_node_id(o, &ni, true);
+      dncp_node_set(n, 1, hnetd_time(), _bench_node_data(o, i));
+      n->last_reachable_prune = o->last_prune;
+    }
+  mi = mallinfo2();
+  heap = mi.uordblks - heap;
+  sput_fail_unless(_reachable_count(o) == NODE_BENCH_COUNT + 1,
+                   "all nodes reachable");
+
+  dncp_get_memory_stats(o, &st);
+  sput_fail_unless(st.num_nodes == NODE_BENCH_COUNT + 1, "nodes counted");
+  sput_fail_unless(st.node_size % 64 == 0, "nodes cache line aligned");
+  sput_fail_unless(st.node_pool >= st.num_nodes * st.node_size
+                   && st.node_pool < 2 * st.num_nodes * st.node_size,
+                   "node pool size sane");
+  sput_fail_unless(st.node_data >= NODE_BENCH_COUNT * 2
+                   * (sizeof(struct tlv_attr) + HNCP_NI_LEN
+                      + sizeof(dncp_t_peer_s)), "node data size sane");
+
+  start = _bench_ns();
+  for (i = 0 ; i < NODE_BENCH_COUNT ; i++)
+    {
+      _bench_node_id(o, i, &ni);
+      if (dncp_find_node_by_node_id(o, &ni, false))
+        found++;
+    }
+  lookup = _bench_ns() - start;
+  sput_fail_unless(found == NODE_BENCH_COUNT, "all nodes found");
+
+  dncp_calculate_network_hash(o);
+  start = _bench_ns();
+  for (r = 0 ; r < NODE_BENCH_ROUNDS ; r++)
+    {
+      o->network_hash_dirty = true;
+      dncp_calculate_network_hash(o);
+    }
+  hash = _bench_ns() - start;
+
+  L_NOTICE("%d nodes: %zu bytes of heap per node (node %zu, data %zu), "
+           "%llu ns per lookup, %llu ns per node in network hash",
+           NODE_BENCH_COUNT, heap / NODE_BENCH_COUNT, st.node_size,
+           st.node_data / st.num_nodes,
+           (unsigned long long)(lookup / NODE_BENCH_COUNT),
+           (unsigned long long)(hash / NODE_BENCH_ROUNDS / NODE_BENCH_COUNT));
+  net_sim_uninit(&s);
+}
 
 #define test_setup() srandom(seed)
 #define maybe_run_test(fun) sput_maybe_run_test(fun, test_setup())
@@ -848,6 +1355,16 @@ int main(__unused int argc, __unused char **argv)
   maybe_run_test(hncp_tube_beyond_multicast_nc);
   maybe_run_test(hncp_tube_beyond_multicast_unique);
   maybe_run_test(hncp_random_monkey);
+  maybe_run_test(hncp_snapshot);
+  maybe_run_test(hncp_join);
+  maybe_run_test(hncp_delta);
+  maybe_run_test(hncp_node_bench);
+  /* Takes minutes; only run when explicitly asked for */
+  if (argc)
+    {
+      maybe_run_test(hncp_snapshot_bench);
+      maybe_run_test(hncp_join_bench);
+    }
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -86,6 +86,17 @@ do {                                                            \
   dncp_add_tlv(n, HNCP_T_NODE_ADDRESS, &h, sizeof(h), 0);     \
  } while(0)
 
+static int _count_local_ddzs(dncp o)
+{
+  dncp_tlv t;
+  int c = 0;
+
+  dncp_for_each_tlv(o, t)
+    if (tlv_id(dncp_tlv_get_attr(t)) == HNCP_T_DNS_DELEGATED_ZONE)
+      c++;
+  return c;
+}
+
 void test_hncp_sd(void)
 {
   net_sim_s s;
@@ -136,6 +147,26 @@ void test_hncp_sd(void)
                    "router names different");
   smock_is_empty();
 
+  /* Forward DDZ + reverse DDZ for both assigned prefixes */
+  sput_fail_unless(_count_local_ddzs(n1) == 3, "n1 ddz count");
+
+  /* Removal of the assigned prefix should withdraw just its reverse DDZ */
+  struct __packed {
+    hncp_t_assigned_prefix_header_s h;
+    struct in6_addr addr;
+  } ap = { .h = { .prefix_length_bits = p.plen,
+                  .ep_id = dncp_ep_get_id(l21) },
+           .addr = p.prefix };
+  dncp_remove_tlv_matching(n2, HNCP_T_ASSIGNED_PREFIX, &ap.h,
+                           sizeof(ap.h) + ROUND_BITS_TO_BYTES(p.plen));
+  SIM_WHILE(&s, 100, !net_sim_is_converged(&s)
+            || fu_timeouts()>2);
+  sput_fail_unless(_count_local_ddzs(n2) == 2, "n2 ddz count (no ap)");
+  tlv_ap_update(n2, p, l21, false, 0, true);
+  SIM_WHILE(&s, 100, !net_sim_is_converged(&s)
+            || fu_timeouts()>2);
+  sput_fail_unless(_count_local_ddzs(n2) == 3, "n2 ddz count");
+
   /* Play with dnsmasq utilities */
   memset(&node1->sd->dnsmasq_state, 0, HNCP_HASH_LEN);
   rv = hncp_sd_write_dnsmasq_conf(node1->sd, "/tmp/n1.conf");
@@ -217,6 +217,339 @@ void test_tlv_sort()
       c++;
     }
   sput_fail_unless(c == 4, "should be 4 attrs");
+  tlv_buf_free(&tb);
+}
+
+static int _qsort_cmp(const void *t1, const void *t2)
+{
+  const struct tlv_attr **aa1 = (void *)t1, **aa2 = (void *)t2;
+  return tlv_attr_cmp(*aa1, *aa2);
+}
+
+/* The straightforward way, to compare results (and speed) against */
+static void _reference_sort(void *data, int len)
+{
+  struct tlv_attr *a, *al[1000];
+  void *tmp = alloca(len), *t = tmp;
+  int c = 0, i;
+
+  tlv_for_each_in_buf(a, data, len)
+    al[c++] = a;
+  qsort(al, c, sizeof(al[0]), _qsort_cmp);
+  for (i = 0 ; i < c ; i++)
+    {
+      memcpy(t, al[i], tlv_pad_len(al[i]));
+      t += tlv_pad_len(al[i]);
+    }
+  memcpy(data, tmp, len);
+}
+
+/* n TLVs of few different types and lengths; swaps pairs of them if
+ * unsorted is set, and shuffles completely if it is negative. */
+static void _fill_sortable(struct tlv_buf *tb, int n, int unsorted)
+{
+  struct tlv_attr *a, *al[1000];
+  int c = 0, i, j, k;
+
+  memset(tb, 0, sizeof(*tb));
+  tlv_buf_init(tb, 0);
+  for (i = 0 ; i < n ; i++)
+    {
+      a = tlv_new(tb, 8 + i / 16, 4 + i % 3 * 4);
+      memset(tlv_data(a), i % 16, tlv_len(a));
+    }
+  tlv_sort(tlv_data(tb->head), tlv_len(tb->head));
+  tlv_for_each_attr(a, tb->head)
+    al[c++] = a;
+  /* Swap same-sized ones to keep it simple */
+  for (k = 0 ; k < (unsorted < 0 ? n : unsorted) ; k++)
+    {
+      i = random() % c;
+      j = random() % c;
+      if (tlv_pad_len(al[i]) != tlv_pad_len(al[j]))
+        continue;
+      void *tmp = alloca(tlv_pad_len(al[i]));
+      memcpy(tmp, al[i], tlv_pad_len(al[i]));
+      memcpy(al[i], al[j], tlv_pad_len(al[i]));
+      memcpy(al[j], tmp, tlv_pad_len(al[i]));
+    }
+}
+
+void tlv_sort_random()
+{
+  struct tlv_buf tb;
+  int i, len;
+
+  srandom(1);
+  for (i = 0 ; i < 200 ; i++)
+    {
+      _fill_sortable(&tb, 1 + random() % 100, i % 4 ? i % 4 : -1);
+      len = tlv_len(tb.head);
+      void *copy = malloc(len);
+      memcpy(copy, tlv_data(tb.head), len);
+      _reference_sort(copy, len);
+      sput_fail_unless(tlv_sort(tlv_data(tb.head), len), "tlv_sort");
+      sput_fail_unless(memcmp(copy, tlv_data(tb.head), len) == 0,
+                       "same as reference");
+      free(copy);
+      tlv_buf_free(&tb);
+    }
+  /* Trailing partial TLV is still refused */
+  _fill_sortable(&tb, 10, 1);
+  sput_fail_unless(!tlv_sort(tlv_data(tb.head), tlv_len(tb.head) + 2),
+                   "trailing garbage");
+  tlv_buf_free(&tb);
+}
+
+#define SORT_ROUNDS 5000
+
+static long _bench_sort(bool (*sortf)(void *, int), void (*reff)(void *, int),
+                        int unsorted)
+{
+  struct timespec ts0, ts;
+  struct tlv_buf tb;
+  long ns = 0;
+  int i;
+
+  srandom(2);
+  for (i = 0 ; i < SORT_ROUNDS ; i++)
+    {
+      _fill_sortable(&tb, 64, unsorted);
+      clock_gettime(CLOCK_MONOTONIC, &ts0);
+      if (sortf)
+        sortf(tlv_data(tb.head), tlv_len(tb.head));
+      else
+        reff(tlv_data(tb.head), tlv_len(tb.head));
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ns += (ts.tv_sec - ts0.tv_sec) * 1000000000L + ts.tv_nsec - ts0.tv_nsec;
+      tlv_buf_free(&tb);
+    }
+  return ns / SORT_ROUNDS;
+}
+
+void tlv_sort_bench()
+{
+  int cases[] = { 0, 1, 4, -1 };
+  const char *names[] = { "sorted", "1 swap", "4 swaps", "shuffled" };
+  unsigned int i;
+
+  for (i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++)
+    L_NOTICE("sort 64 TLVs, %s: %ld ns (qsort %ld ns)", names[i],
+             _bench_sort(tlv_sort, NULL, cases[i]),
+             _bench_sort(NULL, _reference_sort, cases[i]));
+}
+
+#define EQUAL_ROUNDS 200000
+
+void tlv_equal_bench()
+{
+  struct timespec ts0, ts;
+  struct tlv_buf tb1, tb2;
+  int i, r = 0;
+  long ns;
+
+  _fill_sortable(&tb1, 64, 0);
+  _fill_sortable(&tb2, 64, 0);
+  sput_fail_unless(tlv_attr_equal(tb1.head, tb2.head), "equal");
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+  for (i = 0 ; i < EQUAL_ROUNDS ; i++)
+    r += tlv_attr_equal(tb1.head, tb2.head);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (ts.tv_sec - ts0.tv_sec) * 1000000000L + ts.tv_nsec - ts0.tv_nsec;
+  L_NOTICE("tlv_attr_equal of %d bytes: %ld ns", tlv_pad_len(tb1.head),
+           ns / EQUAL_ROUNDS);
+  sput_fail_unless(r == EQUAL_ROUNDS, "all equal");
+  ((char *)tlv_data(tb2.head))[tlv_len(tb2.head) - 1] ^= 1;
+  sput_fail_unless(!tlv_attr_equal(tb1.head, tb2.head), "last byte differs");
+  tlv_buf_free(&tb1);
+  tlv_buf_free(&tb2);
+}
+
+#define CHURN_ROUNDS 100000
+#define CHURN_KEPT 16
+
+/* Emulate a router's steady state: short-lived outgoing messages,
+ * and node data containers that get replaced now and then. */
+void tlv_alloc_churn()
+{
+  struct tlv_attr *kept[CHURN_KEPT];
+  struct tlv_alloc_stats st0, st;
+  struct timespec ts0, ts;
+  struct tlv_buf tb;
+  int i, j, n, built = 0;
+
+  memset(kept, 0, sizeof(kept));
+  srandom(42);
+  tlv_alloc_get_stats(&st0);
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+  for (i = 0 ; i < CHURN_ROUNDS ; i++)
+    {
+      memset(&tb, 0, sizeof(tb));
+      tlv_buf_init(&tb, 0);
+      n = 1 + random() % 64;
+      for (j = 0 ; j < n ; j++)
+        tlv_new(&tb, j, random() % 60);
+      built++;
+      if (i % 8)
+        {
+          tlv_buf_free(&tb);
+          continue;
+        }
+      j = random() % CHURN_KEPT;
+      tlv_free(kept[j]);
+      kept[j] = tb.head;
+    }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  for (i = 0 ; i < CHURN_KEPT ; i++)
+    tlv_free(kept[i]);
+  tlv_alloc_get_stats(&st);
+  L_NOTICE("%d buffers in %ld us: %lu allocs, %lu mallocs, %lu reuses, "
+           "%lu bytes cached", built,
+           (long)((ts.tv_sec - ts0.tv_sec) * 1000000
+                  + (ts.tv_nsec - ts0.tv_nsec) / 1000),
+           st.allocs - st0.allocs, st.mallocs - st0.mallocs,
+           st.reuses - st0.reuses, (unsigned long)st.bytes_cached);
+  /* Plain realloc would be at least one malloc per buffer */
+  sput_fail_unless((st.mallocs - st0.mallocs) * 20 < (unsigned long)built,
+                   "mallocs amortized");
+  sput_fail_unless(st.in_use == st0.in_use, "nothing leaked");
+  sput_fail_unless(st.bytes_cached <= 6 * 8192, "cache bounded");
+  tlv_alloc_trim();
+  tlv_alloc_get_stats(&st);
+  sput_fail_unless(st.bytes_cached == 0, "trim");
+}
+
+static struct tlv_schema test_schema;
+
+static bool _validate_nested(const struct tlv_attr_info *info __unused,
+                             struct tlv_attr *a)
+{
+  /* 12 byte header, then nested TLVs */
+  return tlv_len(a) >= 12
+    && tlv_validate(&test_schema, tlv_data(a) + 12, tlv_len(a) - 12,
+                    NULL, NULL) == 0;
+}
+
+static const struct tlv_attr_info test_info[] = {
+  { 8, 12, 12, NULL },          /* peer-ish */
+  { 35, 0, 0, _validate_nested },
+  { 36, 20, 20, NULL },         /* node address-ish */
+  { 43, 1, 17, NULL },
+};
+
+static void _count_cb(void *ctx, struct tlv_attr *a __unused, bool valid)
+{
+  int *c = ctx;
+
+  c[valid ? 0 : 1]++;
+}
+
+/* Produce something that looks like node data of a router with
+ * n_peers neighbors and n_prefixes assigned prefixes. */
+static void _fill_node_data(struct tlv_buf *tb, int n_peers, int n_prefixes)
+{
+  struct tlv_attr *a;
+  void *cookie;
+  int i;
+
+  memset(tb, 0, sizeof(*tb));
+  tlv_buf_init(tb, 0);
+  for (i = 0 ; i < n_peers ; i++)
+    memset(tlv_data(tlv_new(tb, 8, 12)), i, 12);
+  for (i = 0 ; i < n_prefixes ; i++)
+    {
+      cookie = tlv_nest_start(tb, 35, 4 + 8);
+      memset(tlv_data(tb->head), i, 4 + 8);
+      a = tlv_new(tb, 43, 1);
+      *((uint8_t *)tlv_data(a)) = 0;
+      tlv_nest_end(tb, cookie);
+    }
+  for (i = 0 ; i < n_prefixes ; i++)
+    memset(tlv_data(tlv_new(tb, 36, 20)), i, 20);
+  tlv_new(tb, 99, 37);
+}
+
+void tlv_validate_schema()
+{
+  struct tlv_buf tb;
+  struct tlv_attr *a;
+  int c[2] = {0, 0};
+
+  sput_fail_unless(tlv_schema_init(&test_schema, test_info,
+                                   sizeof(test_info) / sizeof(test_info[0])),
+                   "tlv_schema_init");
+  _fill_node_data(&tb, 3, 2);
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head), _count_cb, c) == 0,
+                   "valid");
+  sput_fail_unless(c[0] == 3 + 2 + 2 + 1 && !c[1], "all visited");
+  sput_fail_unless(tlv_validate(NULL, tlv_data(tb.head), tlv_len(tb.head),
+                                NULL, NULL) == 0, "valid without schema");
+
+  /* The last TLV may lack padding, but not data */
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head) - 3, NULL, NULL) == 0,
+                   "unpadded");
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head) - 4, NULL, NULL) < 0,
+                   "truncated");
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head) + 2, NULL, NULL) < 0,
+                   "trailing garbage");
+
+  /* Wrong length for the type at top level */
+  tlv_for_each_attr(a, tb.head)
+    if (tlv_id(a) == 36)
+      {
+        tlv_init(a, 8, tlv_raw_len(a));
+        break;
+      }
+  c[0] = c[1] = 0;
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head), _count_cb, c) == 1,
+                   "one invalid");
+  sput_fail_unless(c[0] == 7 && c[1] == 1, "invalid visited");
+
+  /* .. and in a nested TLV */
+  tlv_for_each_attr(a, tb.head)
+    if (tlv_id(a) == 35)
+      {
+        struct tlv_attr *na = tlv_data(a) + 12;
+        tlv_init(na, 36, tlv_raw_len(na));
+        break;
+      }
+  sput_fail_unless(tlv_validate(&test_schema, tlv_data(tb.head),
+                                tlv_len(tb.head), NULL, NULL) == 2,
+                   "nested invalid");
+  tlv_buf_free(&tb);
+  tlv_schema_free(&test_schema);
+}
+
+#define VALIDATE_ROUNDS 20000
+
+void tlv_validate_bench()
+{
+  struct timespec ts0, ts;
+  struct tlv_buf tb;
+  int i, r = 0;
+  long us;
+
+  tlv_schema_init(&test_schema, test_info,
+                  sizeof(test_info) / sizeof(test_info[0]));
+  /* Fairly big home network router: 8 neighbors, 16 prefixes */
+  _fill_node_data(&tb, 8, 16);
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+  for (i = 0 ; i < VALIDATE_ROUNDS ; i++)
+    r |= tlv_validate(&test_schema, tlv_data(tb.head), tlv_len(tb.head),
+                      NULL, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  us = (ts.tv_sec - ts0.tv_sec) * 1000000 + (ts.tv_nsec - ts0.tv_nsec) / 1000;
+  L_NOTICE("validated %d x %d bytes in %ld us (%ld ns each)",
+           VALIDATE_ROUNDS, tlv_len(tb.head), us,
+           us * 1000 / VALIDATE_ROUNDS);
+  sput_fail_unless(r == 0, "valid");
+  tlv_buf_free(&tb);
+  tlv_schema_free(&test_schema);
 }
 
 int main(__unused int argc, __unused char **argv)
@@ -229,6 +562,12 @@ int main(__unused int argc, __unused char **argv)
   sput_run_test(tlv_cmp);
   sput_run_test(tlv_nest);
   sput_run_test(test_tlv_sort);
+  sput_run_test(tlv_sort_random);
+  sput_run_test(tlv_sort_bench);
+  sput_run_test(tlv_equal_bench);
+  sput_run_test(tlv_alloc_churn);
+  sput_run_test(tlv_validate_schema);
+  sput_run_test(tlv_validate_bench);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();